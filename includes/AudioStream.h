@@ -0,0 +1,62 @@
+// The audio stream as the client reads it: the capture format, then XRLE-compressed PCM packets.
+// Header only and free of Win32, so a recorded stream can be read without a sound device
+// (tests/ReplayBench.cpp). A C++ file that links a C build of xrle.c includes xrle.h inside
+// extern "C" before this header.
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include "xrle.h"
+#include "StreamInput.h"
+#include "PipelineTrace.h"
+
+// The server sends the WAVEFORMATEX of its capture first, 18 bytes packed, followed by the
+// cbSize bytes of the rest of a WAVEFORMATEXTENSIBLE when it is one
+const size_t AUDIO_FORMAT_BYTES = 18;
+const uint16_t AUDIO_FORMAT_TAG_EXTENSIBLE = 0xFFFE; // WAVE_FORMAT_EXTENSIBLE
+const uint16_t AUDIO_FORMAT_EXTENSIBLE_EXTRA = 22;   // cbSize of a WAVEFORMATEXTENSIBLE
+
+// Reads the format the audio server sends first. format receives all of it, so it can be used as
+// a WAVEFORMATEX.
+inline bool ReadAudioFormat(StreamInput& in, std::vector<uint8_t>& format) {
+	format.resize(AUDIO_FORMAT_BYTES);
+	if (!in.Read(format.data(), AUDIO_FORMAT_BYTES)) return false;
+	uint16_t tag, cbSize;
+	memcpy(&tag, format.data(), 2);         // wFormatTag
+	memcpy(&cbSize, format.data() + 16, 2); // cbSize
+	size_t extra = tag == AUDIO_FORMAT_TAG_EXTENSIBLE && cbSize >= AUDIO_FORMAT_EXTENSIBLE_EXTRA ? cbSize : 0;
+	format.resize(AUDIO_FORMAT_BYTES + extra);
+	return extra == 0 || in.Read(format.data() + AUDIO_FORMAT_BYTES, extra);
+}
+
+// Largest audio packet accepted. The server sends one per capture buffer of at most 100 ms;
+// a second of 8 channels of 32-bit samples at 192 kHz still fits.
+constexpr uint32_t AUDIO_PACKET_MAX_BYTES = 8 * 1024 * 1024;
+
+// Reads one XRLE-compressed packet and decompresses it into pcm. False at the end of the stream
+// or if the packet's lengths are implausible.
+inline bool ReadAudioPacket(StreamInput& in, std::vector<uint8_t>& pcm) {
+	uint32_t net_bytes_uncompressed, net_bytes_compressed;
+	TraceScope waitTrace("audio wait");
+	if (!in.Read(&net_bytes_uncompressed, 4)) return false;
+	waitTrace.End();
+	TRACE_SCOPE("audio packet");
+	if (!in.Read(&net_bytes_compressed, 4)) return false;
+	uint32_t bytes_uncompressed = ntohl(net_bytes_uncompressed);
+	uint32_t bytes_compressed = ntohl(net_bytes_compressed);
+	if (bytes_uncompressed > AUDIO_PACKET_MAX_BYTES || bytes_compressed > xrle_max_out(bytes_uncompressed)) return false;
+
+	// Decompressed straight out of the input's buffer; XRLE reads it a word at a time
+	const uint8_t* compressed = in.ReadSpan(bytes_compressed, 8);
+	if (!compressed) return false;
+	pcm.resize(bytes_uncompressed);
+	return xrle_decompress_bounded(pcm.data(), pcm.size(), compressed, bytes_compressed) == bytes_uncompressed;
+}
@@ -0,0 +1,74 @@
+// Client frame presentation: the surface the decoder applies frames to, and where they go after.
+// Header only and free of Win32, so the decode path can run without a window (tests/CorpusBench.cpp).
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "TripleFrameBuffer.h"
+
+// The decoder applies every frame in place to the presenter's BGRA surface: moves, XOR tiles
+// and the tile cache all read what is already there, so the surface persists between frames.
+// Once a frame is complete the presenter gets its damage and decides how it reaches the screen.
+enum PresentMode {
+	PRESENT_DIRECT = 0, // tiles decode into the window's DIB section, WM_PAINT blits the damage
+	PRESENT_COPY = 1    // frames go through g_frameBuffer into a separate paint DIB
+};
+
+class FramePresenter {
+public:
+	virtual ~FramePresenter() {}
+	// (Re)creates the surface at width x height; its contents are undefined until drawn
+	virtual bool Resize(int width, int height) = 0;
+	virtual uint8_t* Bits() = 0;
+	virtual int Pitch() = 0;
+	// Called by the decode thread once every tile of a frame is in the surface
+	virtual void Present(const std::vector<DamageRect>& damage) = 0;
+};
+
+// Keeps the surface in plain memory and collects the presented damage, for running the decode
+// path without a window.
+class MemoryPresenter : public FramePresenter {
+	std::vector<uint8_t> surface;
+	int width = 0, height = 0;
+public:
+	std::vector<DamageRect> presented; // damage of every frame presented so far
+	uint64_t frames = 0;
+	// With hashPresented the whole surface is folded into presentedHash at every Present, so two
+	// decodes of one stream can be compared frame by frame
+	bool hashPresented = false;
+	uint64_t presentedHash = 14695981039346656037ull;
+
+	bool Resize(int w, int h) override {
+		surface.assign((size_t)w * h * 4, 0);
+		width = w;
+		height = h;
+		return true;
+	}
+	uint8_t* Bits() override { return surface.data(); }
+	int Pitch() override { return width * 4; }
+	void Present(const std::vector<DamageRect>& damage) override {
+		presented.insert(presented.end(), damage.begin(), damage.end());
+		++frames;
+		if (!hashPresented) return;
+		for (size_t i = 0; i < surface.size(); i += 8) {
+			uint64_t word = 0;
+			memcpy(&word, surface.data() + i, std::min((size_t)8, surface.size() - i));
+			presentedHash = (presentedHash ^ word) * 1099511628211ull;
+		}
+	}
+};
+
+// What a stream is decoded into: the presenter owns the surface, and the window holds paintMutex
+// while it paints from it
+struct FrameSurface {
+	FramePresenter* presenter = nullptr;
+	int imgW = 0;      // current surface size, 0 until the first frame
+	int imgH = 0;
+	std::mutex paintMutex; // held while a frame is applied to the surface and while it is painted
+
+	~FrameSurface() { delete presenter; }
+};
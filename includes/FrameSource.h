@@ -0,0 +1,238 @@
+// Where the server's frames come from, and the capture context that double-buffers them.
+// Header only and free of Win32, so the screen pipeline can be fed on Linux (tests/CorpusBench.cpp).
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "qoi.h"
+#include "TileHash.h"
+#include "TileCodec.h"
+
+// A FrameSource produces 32bpp frames, RGBA or BGRA, into memory owned by the caller. The server keeps
+// one CaptureContext per ScreenBroadcaster: its two frame buffers alternate, so the previous frame is
+// still there after the next capture without a copy, and nothing is allocated unless the
+// frame size changes.
+class FrameSource {
+public:
+	virtual ~FrameSource() {}
+	// Size of the next frame
+	virtual bool QuerySize(int& width, int& height) = 0;
+	// Fills a width x height frame; pitch is the byte distance between rows of bits
+	virtual bool Capture(uint8_t* bits, int pitch, int width, int height, bool bgra) = 0;
+};
+
+// Deterministic content for running the server without a desktop (or off Windows): a static
+// toolbar and sidebar around a text-like page that scrolls a little every frame, and a block
+// sliding across it.
+class SyntheticFrameSource : public FrameSource {
+private:
+	int width, height;
+	uint64_t frame = 0;
+
+public:
+	SyntheticFrameSource(int w, int h) : width(w), height(h) {}
+
+	bool QuerySize(int& w, int& h) override {
+		w = width;
+		h = height;
+		return true;
+	}
+
+	bool Capture(uint8_t* bits, int pitch, int w, int h, bool bgra) override {
+		int scroll = (int)(frame * 3 % 4096);
+		int blockX = 160 + (int)(frame * 7 % (uint64_t)std::max(1, w - 160 - 64));
+		frame++;
+		for (int y = 0; y < h; ++y) {
+			uint32_t* row = reinterpret_cast<uint32_t*>(bits + (size_t)y * pitch);
+			for (int x = 0; x < w; ++x) {
+				uint32_t v;
+				if (y < 48) {
+					v = 0xFF404040u + ((x / 24) & 1) * 0x101010u;
+				} else if (x < 160) {
+					v = 0xFF302820u + (uint32_t)(y % 24 == 0) * 0x303030u;
+				} else if (y >= 200 && y < 264 && x >= blockX && x < blockX + 64) {
+					v = 0xFFFF8020u;
+				} else {
+					// Glyph-sized cells, every fourth line of them blank
+					int line = (y - 48 + scroll) / 4, cell = (x - 160) / 3;
+					uint64_t hash = TileHashMix((uint64_t)line, (uint64_t)cell);
+					v = ((line / 4) % 4 != 3 && (hash >> 61) == 0) ? 0xFF000000u : 0xFFFFFFFFu;
+				}
+				row[x] = bgra ? (v & 0xFF00FF00u) | ((v >> 16) & 0xFFu) | ((v & 0xFFu) << 16) : v;
+			}
+		}
+		return true;
+	}
+};
+
+// Whether path ends in ext, ignoring case
+inline bool HasExtension(const std::string& path, const char* ext) {
+	size_t n = strlen(ext);
+	if (path.size() < n) return false;
+	for (size_t i = 0; i < n; ++i)
+		if (tolower((unsigned char)path[path.size() - n + i]) != tolower((unsigned char)ext[i])) return false;
+	return true;
+}
+
+// Plays back frames loaded from .qoi or binary .ppm (P6, maxval 255) files, in order and then
+// from the start again. All frames are decoded up front, so capturing is a copy.
+class CorpusFrameSource : public FrameSource {
+private:
+	struct Frame {
+		int width, height;
+		std::vector<uint32_t> rgba;
+	};
+	std::vector<Frame> frames;
+	size_t next = 0;
+
+	static bool LoadPpm(const std::string& path, Frame& frame) {
+		std::ifstream f(path, std::ios::binary);
+		std::string magic;
+		int maxval = 0;
+		f >> magic;
+		// Header fields may be separated by comments
+		auto field = [&f](int& v) {
+			while (f >> std::ws && f.peek() == '#') f.ignore(1 << 20, '\n');
+			return (bool)(f >> v);
+		};
+		if (magic != "P6" || !field(frame.width) || !field(frame.height) || !field(maxval) || maxval != 255 ||
+			frame.width <= 0 || frame.height <= 0) return false;
+		f.get();
+		std::vector<uint8_t> rgb((size_t)frame.width * frame.height * 3);
+		if (!f.read((char*)rgb.data(), rgb.size())) return false;
+		frame.rgba.resize((size_t)frame.width * frame.height);
+		for (size_t i = 0; i < frame.rgba.size(); ++i)
+			frame.rgba[i] = 0xFF000000u | rgb[i * 3] | (rgb[i * 3 + 1] << 8) | (rgb[i * 3 + 2] << 16);
+		return true;
+	}
+
+public:
+	// Loads the files in the order given; false if any of them can't be read
+	bool Load(const std::vector<std::string>& paths) {
+		for (const std::string& path : paths) {
+			Frame frame;
+			if (HasExtension(path, ".qoi")) {
+				qoi_desc desc;
+				void* pixels = qoi_read(path.c_str(), &desc, 4);
+				if (!pixels) return false;
+				frame.width = desc.width;
+				frame.height = desc.height;
+				frame.rgba.assign((const uint32_t*)pixels, (const uint32_t*)pixels + (size_t)desc.width * desc.height);
+				free(pixels);
+			} else if (!LoadPpm(path, frame)) {
+				return false;
+			}
+			frames.push_back(std::move(frame));
+		}
+		return !frames.empty();
+	}
+
+	// Appends count frames captured from source, for content made on the spot
+	bool Record(FrameSource& source, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			Frame frame;
+			if (!source.QuerySize(frame.width, frame.height)) return false;
+			frame.rgba.resize((size_t)frame.width * frame.height);
+			if (!source.Capture((uint8_t*)frame.rgba.data(), frame.width * 4, frame.width, frame.height, false))
+				return false;
+			frames.push_back(std::move(frame));
+		}
+		return !frames.empty();
+	}
+
+	size_t FrameCount() const { return frames.size(); }
+
+	// The frame the next Capture returns, as RGBA
+	const uint32_t* Peek() const { return frames[next].rgba.data(); }
+
+	bool QuerySize(int& w, int& h) override {
+		if (frames.empty()) return false;
+		w = frames[next].width;
+		h = frames[next].height;
+		return true;
+	}
+
+	bool Capture(uint8_t* bits, int pitch, int w, int h, bool bgra) override {
+		const Frame& frame = frames[next];
+		next = (next + 1) % frames.size();
+		if (frame.width != w || frame.height != h) return false;
+		for (int y = 0; y < h; ++y) {
+			const uint32_t* src = frame.rgba.data() + (size_t)y * w;
+			uint32_t* row = reinterpret_cast<uint32_t*>(bits + (size_t)y * pitch);
+			if (!bgra) {
+				memcpy(row, src, (size_t)w * 4);
+				continue;
+			}
+			for (int x = 0; x < w; ++x) {
+				uint32_t v = src[x];
+				row[x] = (v & 0xFF00FF00u) | ((v >> 16) & 0xFFu) | ((v & 0xFFu) << 16);
+			}
+		}
+		return true;
+	}
+};
+
+// A captured 32bpp frame, rows back to back
+class CapturedFrame {
+	int width, height;
+	std::vector<uint32_t> pixels;
+public:
+	CapturedFrame(int w, int h) : width(w), height(h), pixels((size_t)w * h) {}
+	int Width() const { return width; }
+	int Height() const { return height; }
+	uint8_t* Bits() { return (uint8_t*)pixels.data(); }
+	const uint8_t* Bits() const { return (const uint8_t*)pixels.data(); }
+	int Pitch() const { return width * 4; }
+};
+
+class CaptureContext {
+private:
+	std::unique_ptr<FrameSource> source;
+	bool bgra;
+	std::unique_ptr<CapturedFrame> frames[2];
+	bool valid[2] = { false, false };
+	int current = 0;
+
+public:
+	CaptureContext(std::unique_ptr<FrameSource> frameSource, int pixelFormat)
+		: source(std::move(frameSource)), bgra(pixelFormat == PIXEL_FORMAT_BGRA) {}
+
+	// Captures the next frame. With keepPrevious the buffers alternate and Previous() is the frame
+	// captured before; without it a single buffer is reused and the other one released.
+	bool Capture(bool keepPrevious) {
+		int width, height;
+		if (!source->QuerySize(width, height)) return false;
+		int target = keepPrevious ? 1 - current : current;
+		std::unique_ptr<CapturedFrame>& frame = frames[target];
+		if (!frame || frame->Width() != width || frame->Height() != height)
+			frame.reset(new CapturedFrame(width, height));
+		valid[target] = source->Capture(frame->Bits(), frame->Pitch(), width, height, bgra);
+		if (!valid[target]) return false;
+		current = target;
+		if (!keepPrevious) {
+			frames[1 - current].reset();
+			valid[1 - current] = false;
+		}
+		return true;
+	}
+
+	CapturedFrame* Current() const { return frames[current].get(); }
+
+	// The frame captured before Current() if it is still held and the same size, else null.
+	// Its pixels may be modified; the buffer is overwritten by the capture after next.
+	CapturedFrame* Previous() const {
+		const CapturedFrame* curr = frames[current].get();
+		CapturedFrame* prev = frames[1 - current].get();
+		if (!curr || !prev || !valid[1 - current] ||
+			prev->Width() != curr->Width() || prev->Height() != curr->Height()) return nullptr;
+		return prev;
+	}
+};
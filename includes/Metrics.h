@@ -0,0 +1,366 @@
+// Frame stage timing, counters and latency histograms, and the per-frame latency timeline.
+// Header only and free of Win32, so the screen pipeline can be benchmarked on its own (tests/CorpusBench.cpp).
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// --- Frame stages ---
+// Every frame gets a sequence number on the server, which travels on the wire together with the
+// server's capture time. Both ends note when the frame completes each stage they handle.
+enum FrameStage {
+	STAGE_CAPTURE,   // server: capture finished (the time sent on the wire)
+	STAGE_DIFF,      // server: dirty tiles and copy rects known
+	STAGE_ENCODE,    // server: every dirty tile encoded
+	STAGE_SEND,      // server: last byte handed to the socket
+	STAGE_RECEIVED,  // client: frame header received
+	STAGE_DECODED,   // client: every tile in the framebuffer
+	STAGE_PUBLISHED, // client: handed to the presenter
+	STAGE_PAINTED,   // client: WM_PAINT done with the newest published frame
+	STAGE_COUNT
+};
+static const char* const FRAME_STAGE_NAMES[STAGE_COUNT] = {
+	"capture", "diff", "encode", "send", "received", "decoded", "published", "painted"
+};
+
+inline int64_t LatencyNowUs() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// --- Metrics ---
+// Counters and latency histograms live in per-thread shards. The owning thread bumps its own
+// words with plain relaxed stores; a reader adds up all shards with relaxed loads, so recording
+// never contends and reporting never blocks anyone. Shards are only ever pushed onto a lock-free
+// list: when a thread exits its shard is marked free and taken over, values and all, by the next
+// thread that records, so totals only grow.
+enum MetricCounter {
+	METRIC_SERVER_FRAMES,
+	METRIC_SERVER_CAPTURE_FAILURES,
+	METRIC_SERVER_TILES_RAW,        // one counter per TileCodec, in codec order
+	METRIC_SERVER_TILES_SOLID,
+	METRIC_SERVER_TILES_PALETTE,
+	METRIC_SERVER_TILES_QOI,
+	METRIC_SERVER_TILES_XOR,
+	METRIC_SERVER_TILES_CACHED,
+	METRIC_SERVER_BYTES,
+	METRIC_SERVER_PIXEL_BYTES,
+	METRIC_SERVER_KEYFRAMES,
+	METRIC_SERVER_VIEWER_DROPS,
+	METRIC_SERVER_RESYNC_FRAMES,
+	METRIC_CLIENT_FRAMES,
+	METRIC_CLIENT_TILES,
+	METRIC_CLIENT_BYTES,
+	METRIC_CLIENT_FRAMES_PUBLISHED,
+	METRIC_CLIENT_FRAMES_PAINTED,
+	METRIC_COUNTER_COUNT
+};
+
+struct MetricCounterInfo {
+	const char* name;
+	const char* labels;
+	const char* help;
+};
+static const MetricCounterInfo METRIC_COUNTERS[METRIC_COUNTER_COUNT] = {
+	{ "remote_server_frames_total", "", "Frames encoded by the server, once for all viewers" },
+	{ "remote_server_capture_failures_total", "", "Captures that failed, skipping a frame" },
+	{ "remote_server_tiles_total", "codec=\"raw\"", "Tiles sent by the server, by codec" },
+	{ "remote_server_tiles_total", "codec=\"solid\"", "" },
+	{ "remote_server_tiles_total", "codec=\"palette\"", "" },
+	{ "remote_server_tiles_total", "codec=\"qoi\"", "" },
+	{ "remote_server_tiles_total", "codec=\"xor\"", "" },
+	{ "remote_server_tiles_total", "codec=\"cached\"", "" },
+	{ "remote_server_bytes_total", "", "Tile record bytes sent by the server" },
+	{ "remote_server_pixel_bytes_total", "", "Bytes of the dirty tiles before encoding" },
+	{ "remote_server_keyframes_total", "", "Frames encoded as keyframes for viewers that joined or fell behind" },
+	{ "remote_server_viewer_dropped_frames_total", "", "Frames a viewer lost for falling behind" },
+	{ "remote_server_resync_frames_total", "", "Frames encoded a second time for viewers that fell behind" },
+	{ "remote_client_frames_total", "", "Frames received by the client" },
+	{ "remote_client_tiles_total", "", "Tiles received by the client" },
+	{ "remote_client_bytes_total", "", "Bytes received by the client" },
+	{ "remote_client_frames_published_total", "", "Frames handed to the presenter" },
+	{ "remote_client_frames_painted_total", "", "Published frames that reached WM_PAINT; the rest were overtaken" },
+};
+
+// Histograms of stage durations, indexed by the FrameStage that ends them, plus the totals
+enum {
+	METRIC_HIST_SERVER_TOTAL = STAGE_COUNT, // capture to send
+	METRIC_HIST_CLIENT_TOTAL,               // capture to paint, across clocks like "received"
+	METRIC_HIST_COUNT
+};
+
+// Log-linear buckets in microseconds in the manner of HdrHistogram: values below 16 get a bucket
+// each, every power of two above is split into 16, so any value is placed within about 6%.
+// The top bucket ends at 2^36 us (19 hours).
+struct LatencyHistogram {
+	static const int SUB_BITS = 4;
+	static const int MAX_BITS = 36;
+	static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+	static int BucketOf(uint64_t us) {
+		if (us >= (1ull << MAX_BITS)) us = (1ull << MAX_BITS) - 1;
+		if (us < (1u << SUB_BITS)) return (int)us;
+#ifdef _MSC_VER
+		unsigned long top;
+		_BitScanReverse64(&top, us);
+#else
+		int top = 63 - __builtin_clzll(us);
+#endif
+		return (int)((top - SUB_BITS + 1) << SUB_BITS) + (int)((us >> (top - SUB_BITS)) & ((1u << SUB_BITS) - 1));
+	}
+
+	// Largest value that falls into bucket
+	static uint64_t BucketUpper(int bucket) {
+		if (bucket < (1 << SUB_BITS)) return (uint64_t)bucket;
+		int shift = (bucket >> SUB_BITS) - 1;
+		uint64_t lower = (uint64_t)((1 << SUB_BITS) + (bucket & ((1 << SUB_BITS) - 1))) << shift;
+		return lower + (1ull << shift) - 1;
+	}
+};
+
+struct MetricsShard {
+	std::atomic<uint64_t> counters[METRIC_COUNTER_COUNT];
+	std::atomic<uint64_t> buckets[METRIC_HIST_COUNT][LatencyHistogram::BUCKETS];
+	std::atomic<uint64_t> sumsUs[METRIC_HIST_COUNT];
+	std::atomic<bool> inUse;
+	MetricsShard* next;
+};
+
+class Metrics {
+	std::atomic<MetricsShard*> shards{nullptr};
+
+	// Only the owner writes a shard, so a load and a store make the increment
+	static void Bump(std::atomic<uint64_t>& v, uint64_t n) {
+		v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	struct ShardLease {
+		MetricsShard* shard = nullptr;
+		~ShardLease() { if (shard) shard->inUse.store(false, std::memory_order_release); }
+	};
+
+	// The calling thread's shard. There is a single Metrics object (g_metrics), so one lease per thread.
+	MetricsShard* Local() {
+		thread_local ShardLease lease;
+		if (lease.shard) return lease.shard;
+		for (MetricsShard* s = shards.load(std::memory_order_acquire); s; s = s->next) {
+			bool free = false;
+			if (s->inUse.compare_exchange_strong(free, true, std::memory_order_acquire)) return lease.shard = s;
+		}
+		MetricsShard* s = new MetricsShard();
+		s->inUse.store(true, std::memory_order_relaxed);
+		s->next = shards.load(std::memory_order_relaxed);
+		while (!shards.compare_exchange_weak(s->next, s, std::memory_order_release, std::memory_order_relaxed)) {}
+		return lease.shard = s;
+	}
+
+public:
+	void Add(MetricCounter counter, uint64_t n = 1) {
+		Bump(Local()->counters[counter], n);
+	}
+
+	void Observe(int histogram, int64_t us) {
+		if (us < 0) return;
+		MetricsShard* s = Local();
+		Bump(s->buckets[histogram][LatencyHistogram::BucketOf((uint64_t)us)], 1);
+		Bump(s->sumsUs[histogram], (uint64_t)us);
+	}
+
+	// The calling thread's share of a counter; deltas of it are rates for just this thread
+	uint64_t Own(MetricCounter counter) {
+		return Local()->counters[counter].load(std::memory_order_relaxed);
+	}
+
+	uint64_t Counter(MetricCounter counter) const {
+		uint64_t total = 0;
+		for (MetricsShard* s = shards.load(std::memory_order_acquire); s; s = s->next)
+			total += s->counters[counter].load(std::memory_order_relaxed);
+		return total;
+	}
+
+	// Merges one histogram over all shards into buckets (LatencyHistogram::BUCKETS entries); returns the count
+	uint64_t Histogram(int histogram, uint64_t* buckets, uint64_t& sumUs) const {
+		uint64_t count = 0;
+		sumUs = 0;
+		std::fill(buckets, buckets + LatencyHistogram::BUCKETS, 0);
+		for (MetricsShard* s = shards.load(std::memory_order_acquire); s; s = s->next) {
+			for (int b = 0; b < LatencyHistogram::BUCKETS; ++b) {
+				uint64_t n = s->buckets[histogram][b].load(std::memory_order_relaxed);
+				buckets[b] += n;
+				count += n;
+			}
+			sumUs += s->sumsUs[histogram].load(std::memory_order_relaxed);
+		}
+		return count;
+	}
+
+	// Everything in the Prometheus text exposition format (version 0.0.4)
+	std::string Exposition() const {
+		std::string out;
+		char line[256];
+		const char* family = "";
+		for (int c = 0; c < METRIC_COUNTER_COUNT; ++c) {
+			const MetricCounterInfo& info = METRIC_COUNTERS[c];
+			if (strcmp(info.name, family) != 0) {
+				snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n", info.name, info.help, info.name);
+				out += line;
+				family = info.name;
+			}
+			snprintf(line, sizeof(line), *info.labels ? "%s{%s} %llu\n" : "%s%s %llu\n", info.name, info.labels,
+				(unsigned long long)Counter((MetricCounter)c));
+			out += line;
+		}
+		uint64_t wire = Counter(METRIC_SERVER_BYTES);
+		if (wire) {
+			snprintf(line, sizeof(line), "# HELP remote_server_compression_ratio Dirty tile bytes per byte sent\n"
+				"# TYPE remote_server_compression_ratio gauge\nremote_server_compression_ratio %.3f\n",
+				(double)Counter(METRIC_SERVER_PIXEL_BYTES) / wire);
+			out += line;
+		}
+
+		// Stage histograms on fixed boundaries (a bucket straddling one counts above it), and
+		// quantiles at the full resolution
+		static const uint64_t LE_US[] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000 };
+		static const double QUANTILES[] = { 0.5, 0.95, 0.99 };
+		std::vector<uint64_t> buckets(LatencyHistogram::BUCKETS);
+		std::string quantiles;
+		out += "# HELP remote_frame_stage_seconds Time from the previous stage of a frame to this one\n"
+			"# TYPE remote_frame_stage_seconds histogram\n";
+		for (int h = STAGE_CAPTURE + 1; h < METRIC_HIST_COUNT; ++h) {
+			uint64_t sumUs;
+			uint64_t count = Histogram(h, buckets.data(), sumUs);
+			if (!count) continue;
+			const char* stage = h == METRIC_HIST_SERVER_TOTAL ? "server_total" : h == METRIC_HIST_CLIENT_TOTAL ? "client_total" : FRAME_STAGE_NAMES[h];
+			uint64_t cumulative = 0;
+			int b = 0;
+			for (uint64_t le : LE_US) {
+				for (; b < LatencyHistogram::BUCKETS && LatencyHistogram::BucketUpper(b) <= le; ++b) cumulative += buckets[b];
+				snprintf(line, sizeof(line), "remote_frame_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", stage, le / 1e6, (unsigned long long)cumulative);
+				out += line;
+			}
+			snprintf(line, sizeof(line), "remote_frame_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+				"remote_frame_stage_seconds_sum{stage=\"%s\"} %.6f\nremote_frame_stage_seconds_count{stage=\"%s\"} %llu\n",
+				stage, (unsigned long long)count, stage, sumUs / 1e6, stage, (unsigned long long)count);
+			out += line;
+
+			for (double q : QUANTILES) {
+				uint64_t rank = (uint64_t)(q * (count - 1)) + 1, seen = 0;
+				int k = 0;
+				while (seen + buckets[k] < rank) seen += buckets[k++];
+				snprintf(line, sizeof(line), "remote_frame_stage_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.6f\n",
+					stage, q, LatencyHistogram::BucketUpper(k) / 1e6);
+				quantiles += line;
+			}
+		}
+		if (!quantiles.empty())
+			out += "# HELP remote_frame_stage_quantile_seconds Stage time quantiles since start, within 6%\n"
+				"# TYPE remote_frame_stage_quantile_seconds gauge\n" + quantiles;
+		return out;
+	}
+};
+
+static Metrics g_metrics;
+
+// --- Frame latency timeline ---
+// Both ends stamp every frame into a fixed ring indexed by sequence number, so recording never
+// allocates or locks. Stage costs are the gaps between consecutive stamps of one frame; each
+// stamp also feeds the frame stage histograms of g_metrics.
+class FrameLatencyRing {
+public:
+	static const size_t CAPACITY = 1024;
+
+	// Starts the record of frame seq (never 0); later stamps of older frames in the slot are dropped
+	void Begin(uint32_t seq, int64_t captureUs) {
+		Record& r = records[seq % CAPACITY];
+		r.seq.store(0, std::memory_order_relaxed);
+		for (std::atomic<int64_t>& us : r.us) us.store(0, std::memory_order_relaxed);
+		r.us[STAGE_CAPTURE].store(captureUs, std::memory_order_relaxed);
+		r.seq.store(seq, std::memory_order_release);
+	}
+
+	void Stamp(uint32_t seq, FrameStage stage) {
+		Record& r = records[seq % CAPACITY];
+		if (seq == 0 || r.seq.load(std::memory_order_acquire) != seq) return;
+		int64_t now = LatencyNowUs();
+		r.us[stage].store(now, std::memory_order_relaxed);
+		for (int s = stage - 1; s >= 0; --s) {
+			int64_t before = r.us[s].load(std::memory_order_relaxed);
+			if (!before) continue;
+			g_metrics.Observe(stage, now - before);
+			break;
+		}
+		if (stage == STAGE_SEND || stage == STAGE_PAINTED)
+			g_metrics.Observe(stage == STAGE_SEND ? METRIC_HIST_SERVER_TOTAL : METRIC_HIST_CLIENT_TOTAL,
+				now - r.us[STAGE_CAPTURE].load(std::memory_order_relaxed));
+	}
+
+	// p50/p95/p99 of every stage over the frames in the ring, one line per stage. A stage is timed
+	// from the stamp before it; on the client "received" is timed from the server's capture, which
+	// only means something where both ends share a clock (steady_clock is QPC on Windows, so the
+	// same machine). "total" runs from capture to the last stamp of each frame.
+	std::string Summary() const {
+		std::vector<int64_t> samples[STAGE_COUNT + 1];
+		for (const Record& r : records) {
+			if (!r.seq.load(std::memory_order_acquire)) continue;
+			int64_t us[STAGE_COUNT];
+			for (int s = 0; s < STAGE_COUNT; ++s) us[s] = r.us[s].load(std::memory_order_relaxed);
+			int last = 0;
+			for (int s = 1; s < STAGE_COUNT; ++s) {
+				if (!us[s]) continue;
+				if (us[last]) samples[s].push_back(us[s] - us[last]);
+				last = s;
+			}
+			if (last && us[STAGE_CAPTURE]) samples[STAGE_COUNT].push_back(us[last] - us[STAGE_CAPTURE]);
+		}
+		std::string out;
+		for (int s = 1; s <= STAGE_COUNT; ++s) {
+			std::vector<int64_t>& v = samples[s];
+			if (v.empty()) continue;
+			std::sort(v.begin(), v.end());
+			auto pct = [&](double q) { return v[(size_t)(q * (v.size() - 1))] / 1000.0; };
+			char line[160];
+			snprintf(line, sizeof(line), "  %-9s p50 %7.2f ms  p95 %7.2f ms  p99 %7.2f ms  (%zu frames)\n",
+				s == STAGE_COUNT ? "total" : FRAME_STAGE_NAMES[s], pct(0.50), pct(0.95), pct(0.99), v.size());
+			out += line;
+		}
+		return out;
+	}
+
+	// Writes the ring as CSV, one frame per line with its raw stamps in microseconds (0 = not reached)
+	bool Dump(const char* path) const {
+		std::ofstream f(path);
+		if (!f.is_open()) return false;
+		f << "seq";
+		for (const char* name : FRAME_STAGE_NAMES) f << ',' << name << "_us";
+		f << '\n';
+		for (const Record& r : records) {
+			uint32_t seq = r.seq.load(std::memory_order_acquire);
+			if (!seq) continue;
+			f << seq;
+			for (const std::atomic<int64_t>& us : r.us) f << ',' << us.load(std::memory_order_relaxed);
+			f << '\n';
+		}
+		return true;
+	}
+
+private:
+	struct Record {
+		std::atomic<uint32_t> seq{0};
+		std::atomic<int64_t> us[STAGE_COUNT] = {};
+	};
+	Record records[CAPACITY];
+};
+
+static FrameLatencyRing g_serverLatency;
+static FrameLatencyRing g_clientLatency;
+static std::atomic<uint32_t> g_nextFrameSeq(1); // shared by all server connections, skips 0
+static std::atomic<uint32_t> g_lastPresentedSeq(0); // newest frame handed to the presenter, stamped when painted
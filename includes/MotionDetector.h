@@ -0,0 +1,230 @@
+// Scroll and move detection for the screen stream, and the copy rects both ends apply.
+// Header only and free of Win32, so it can be benchmarked on its own (tests/CorpusBench.cpp).
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "TileHash.h"
+#include "WorkStealingPool.h"
+
+// --- Scroll / move detection ---
+// Each frame is summarized by row hashes of every TILE_W-wide vertical strip and column
+// hashes of every TILE_H-high horizontal band. Comparing them with the previous frame's finds
+// the dominant vertical (or, failing that, horizontal) shift and the regions it explains;
+// those go out as copy-rect commands ahead of the dirty tiles, and both ends apply them to
+// their copy of the previous frame with memmove, so only the residual tiles are resent.
+struct CopyRect {
+	int32_t sx, sy, dx, dy, w, h;
+};
+
+// Copies a rectangle within one 32bpp image; source and destination may overlap
+inline void ApplyCopyRect(uint8_t* bits, int pitch, const CopyRect& r) {
+	// Walk rows away from the destination so overlapping source rows are read before they are overwritten
+	bool bottomUp = r.dy > r.sy;
+	for (int i = 0; i < r.h; ++i) {
+		int row = bottomUp ? r.h - 1 - i : i;
+		memmove(bits + (size_t)(r.dy + row) * pitch + r.dx * 4,
+			bits + (size_t)(r.sy + row) * pitch + r.sx * 4, (size_t)r.w * 4);
+	}
+}
+
+class MotionDetector {
+private:
+	// Shortest run of shifted rows/columns (and narrowest region) worth a copy
+	static constexpr int MIN_RUN = 64;
+	static constexpr int MAX_SAMPLES = 256;
+
+	struct Span {
+		int laneBegin, laneEnd, posBegin, posEnd;
+	};
+
+	int width = 0, height = 0, strips = 0, bands = 0;
+	bool hasPrev = false;
+	// [strip * height + y] row hashes and [band * width + x] column hashes, current and previous frame
+	std::vector<uint64_t> rowHash, prevRowHash, colHash, prevColHash;
+	std::vector<int> votes;
+	std::vector<int> runBegin, runEnd;
+	std::vector<Span> spans;
+
+	void HashBand(const uint8_t* frame, int band) {
+		int y0 = band * TILE_H, y1 = std::min(height, y0 + TILE_H);
+		uint64_t* cols = colHash.data() + (size_t)band * width;
+		for (int x = 0; x < width; ++x) cols[x] = 0x27D4EB2F165667C5ull;
+
+		for (int y = y0; y < y1; ++y) {
+			const uint8_t* row = frame + (size_t)y * width * 4;
+			for (int s = 0; s < strips; ++s) {
+				int x0 = s * TILE_W, x1 = std::min(width, x0 + TILE_W);
+				uint64_t hash = 0x27D4EB2F165667C5ull;
+				int x = x0;
+				for (; x + 2 <= x1; x += 2) {
+					uint64_t v;
+					memcpy(&v, row + x * 4, 8);
+					hash = TileHashMix(hash, v);
+				}
+				if (x < x1) {
+					uint32_t v;
+					memcpy(&v, row + x * 4, 4);
+					hash = TileHashMix(hash, v);
+				}
+				rowHash[(size_t)s * height + y] = hash;
+			}
+			for (int x = 0; x < width; ++x) {
+				uint32_t px;
+				memcpy(&px, row + x * 4, 4);
+				cols[x] = (cols[x] ^ px) * 0x9E3779B97F4A7C15ull;
+			}
+		}
+	}
+
+	// Finds the dominant shift between curr and prev ([lane * positions + pos] hashes) and
+	// the regions, spanning whole lanes, that it explains. Returns 0 if there is none.
+	int FindShift(const uint64_t* curr, const uint64_t* prev, int lanes, int positions) {
+		spans.clear();
+
+		// Vote with a sample of changed, non-repetitive lines: where was that content last frame?
+		size_t changed = 0;
+		for (int l = 0; l < lanes; ++l) {
+			const uint64_t* c = curr + (size_t)l * positions;
+			const uint64_t* p = prev + (size_t)l * positions;
+			for (int i = 1; i < positions; ++i) changed += (c[i] != p[i] && c[i] != c[i - 1]);
+		}
+		if (changed < 8) return 0;
+
+		size_t step = std::max<size_t>(1, changed / MAX_SAMPLES), seen = 0;
+		int samples = 0;
+		votes.assign(2 * positions, 0);
+		for (int l = 0; l < lanes; ++l) {
+			const uint64_t* c = curr + (size_t)l * positions;
+			const uint64_t* p = prev + (size_t)l * positions;
+			for (int i = 1; i < positions; ++i) {
+				if (c[i] == p[i] || c[i] == c[i - 1] || seen++ % step) continue;
+				samples++;
+				// Both lines must start a run of identical lines, or repeated lines smear the vote
+				for (int j = 0; j < positions; ++j)
+					if (p[j] == c[i] && j != i && (j == 0 || p[j - 1] != p[j])) votes[i - j + positions]++;
+			}
+		}
+
+		int best = 0;
+		for (int d = 1; d < 2 * positions; ++d)
+			if (votes[d] > votes[best]) best = d;
+		int shift = best - positions;
+		if (shift == 0 || votes[best] < std::max(4, samples / 8)) return 0;
+
+		// Longest run per lane where the content matches prev shifted, provided enough of it moved
+		runBegin.assign(lanes, 0);
+		runEnd.assign(lanes, 0);
+		int from = std::max(0, shift), to = std::min(positions, positions + shift);
+		for (int l = 0; l < lanes; ++l) {
+			const uint64_t* c = curr + (size_t)l * positions;
+			const uint64_t* p = prev + (size_t)l * positions;
+			int start = from, moved = 0;
+			for (int i = from; i <= to; ++i) {
+				if (i < to && c[i] == p[i - shift]) {
+					moved += (c[i] != p[i]);
+					continue;
+				}
+				if (i - start > runEnd[l] - runBegin[l] && i - start >= MIN_RUN && moved * 4 >= i - start) {
+					runBegin[l] = start;
+					runEnd[l] = i;
+				}
+				start = i + 1;
+				moved = 0;
+			}
+		}
+
+		// Merge neighbouring lanes into regions while that keeps most of the region's extent
+		Span cur = { -1, -1, 0, 0 };
+		for (int l = 0; l <= lanes; ++l) {
+			bool valid = l < lanes && runEnd[l] > runBegin[l];
+			if (valid && cur.laneBegin >= 0) {
+				int b = std::max(cur.posBegin, runBegin[l]), e = std::min(cur.posEnd, runEnd[l]);
+				if (e - b >= MIN_RUN && (e - b) * 4 >= (cur.posEnd - cur.posBegin) * 3) {
+					cur.laneEnd = l + 1;
+					cur.posBegin = b;
+					cur.posEnd = e;
+					continue;
+				}
+			}
+			if (cur.laneBegin >= 0) spans.push_back(cur);
+			cur.laneBegin = -1;
+			if (valid) cur = { l, l + 1, runBegin[l], runEnd[l] };
+		}
+		return spans.empty() ? 0 : shift;
+	}
+
+public:
+	// Hashes a new frame; the previous frame's hashes are kept for Detect()
+	void Update(const uint8_t* frame, int w, int h, WorkStealingPool& pool) {
+		if (w != width || h != height) {
+			width = w;
+			height = h;
+			strips = (w + TILE_W - 1) / TILE_W;
+			bands = (h + TILE_H - 1) / TILE_H;
+			rowHash.assign((size_t)strips * h, 0);
+			colHash.assign((size_t)bands * w, 0);
+			prevRowHash = rowHash;
+			prevColHash = colHash;
+			hasPrev = false;
+		} else {
+			rowHash.swap(prevRowHash);
+			colHash.swap(prevColHash);
+			hasPrev = true;
+		}
+		pool.ParallelFor(bands, [&](size_t band, int) { HashBand(frame, (int)band); });
+	}
+
+	// Copy rects that turn the previous frame into (most of) the current one
+	void Detect(std::vector<CopyRect>& out) {
+		out.clear();
+		if (!hasPrev) return;
+
+		int dy = FindShift(rowHash.data(), prevRowHash.data(), strips, height);
+		for (const Span& s : spans) {
+			int x0 = s.laneBegin * TILE_W, x1 = std::min(width, s.laneEnd * TILE_W);
+			if (x1 - x0 >= MIN_RUN)
+				out.push_back({ x0, s.posBegin - dy, x0, s.posBegin, x1 - x0, s.posEnd - s.posBegin });
+		}
+		if (!out.empty()) return;
+
+		int dx = FindShift(colHash.data(), prevColHash.data(), bands, width);
+		for (const Span& s : spans) {
+			int y0 = s.laneBegin * TILE_H, y1 = std::min(height, s.laneEnd * TILE_H);
+			if (y1 - y0 >= MIN_RUN)
+				out.push_back({ s.posBegin - dx, y0, s.posBegin, y0, s.posEnd - s.posBegin, y1 - y0 });
+		}
+	}
+
+	// Whether tile (tx, ty) of the current frame matches the previous one with the copy rects
+	// from Detect() applied, judged by line hashes: rows for vertical moves and columns for
+	// horizontal ones. The rects span whole strips or bands, so a tile is in or out across them.
+	bool TileUnchanged(const std::vector<CopyRect>& moves, int tx, int ty) const {
+		if (!hasPrev) return false;
+		int x0 = tx * TILE_W, x1 = std::min(width, x0 + TILE_W);
+		int y0 = ty * TILE_H, y1 = std::min(height, y0 + TILE_H);
+		if (moves.empty() || moves[0].sx == moves[0].dx) {
+			const uint64_t* curr = rowHash.data() + (size_t)tx * height;
+			const uint64_t* prev = prevRowHash.data() + (size_t)tx * height;
+			for (int y = y0; y < y1; ++y) {
+				int from = y;
+				for (const CopyRect& m : moves)
+					if (x0 >= m.dx && x0 < m.dx + m.w && y >= m.dy && y < m.dy + m.h) from = y - m.dy + m.sy;
+				if (curr[y] != prev[from]) return false;
+			}
+		} else {
+			const uint64_t* curr = colHash.data() + (size_t)ty * width;
+			const uint64_t* prev = prevColHash.data() + (size_t)ty * width;
+			for (int x = x0; x < x1; ++x) {
+				int from = x;
+				for (const CopyRect& m : moves)
+					if (y0 >= m.dy && y0 < m.dy + m.h && x >= m.dx && x < m.dx + m.w) from = x - m.dx + m.sx;
+				if (curr[x] != prev[from]) return false;
+			}
+		}
+		return true;
+	}
+};
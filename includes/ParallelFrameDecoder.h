@@ -0,0 +1,539 @@
+// The client's half of the screen stream: parsing ScreenInfo and ScreenFrame messages, and the
+// parallel tile decoder that applies frames to a FrameSurface.
+// Header only and free of Win32, so it can be benchmarked on its own (tests/CorpusBench.cpp).
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include "TileCodec.h"
+#include "MotionDetector.h"
+#include "FramePresenter.h"
+#include "StreamInput.h"
+#include "Metrics.h"
+#include "PipelineTrace.h"
+#include "WorkStealingPool.h"
+
+// Uncomment this line for verbose debug output
+//#define SCREENRECV_DEBUG
+
+#ifdef SCREENRECV_DEBUG
+#define SRDPRINTF(...)        \
+    do {                      \
+        printf(__VA_ARGS__);  \
+        fflush(stdout);       \
+    } while (0)
+#else
+#define SRDPRINTF(...) do {} while (0)
+#endif
+
+// --- Client-side parallel tile decoder ---
+// The receive thread only reads the socket: it copies a frame's tile payloads into a
+// FramePayload and submits it. The decode thread spreads the tiles over a
+// WorkStealingPool, every worker decompressing and decoding straight into its own
+// region of the presenter's surface; once all tiles are done (the frame barrier) the
+// presenter is handed the frame's damage rects. Two payload buffers alternate,
+// so the next frame is drained from the socket while the previous one is decoded.
+// Tile cache references and insertions are replayed in tile order around the parallel
+// decode, mirroring the server's TileContentCache.
+struct TilePayload {
+	uint32_t x, y, w, h;
+	uint8_t type;                // TileCodec, possibly with TILE_XRLE
+	uint32_t payloadLen, param;
+	size_t offset;
+	uint32_t cacheSlot;          // slot referenced (TILE_CACHED) or filled by this tile
+	uint32_t decodedW, decodedH; // filled in by the decoder, 0 if the tile failed
+};
+
+struct FramePayload {
+	int width = 0, height = 0;
+	uint32_t seq = 0;            // server frame sequence number, for g_clientLatency
+	uint32_t flags = 0;          // FrameFlags
+	std::vector<CopyRect> moves; // applied before any tile
+	std::vector<uint8_t> data;
+	std::vector<TilePayload> tiles;
+
+	void Reset(int w, int h) {
+		width = w; height = h;
+		moves.clear();
+		data.clear();
+		tiles.clear();
+	}
+
+	// Reserves room for a tile payload and returns where to receive it (8-byte aligned for XRLE,
+	// and followed by the slack a bare QOI body is decoded with)
+	uint8_t* AddTile(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint8_t type, uint32_t payloadLen, uint32_t param) {
+		size_t offset = (data.size() + 7) & ~(size_t)7;
+		data.resize(offset + payloadLen + QOI_CHUNKS_TRAILER);
+		tiles.push_back({ x, y, w, h, type, payloadLen, param, offset, 0, 0, 0 });
+		return data.data() + offset;
+	}
+
+	void AddCachedTile(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t slot) {
+		tiles.push_back({ x, y, w, h, TILE_CACHED, 0, slot, 0, slot, 0, 0 });
+	}
+};
+
+class ParallelFrameDecoder {
+private:
+	FrameSurface* surface;
+	int pixelFormat;             // PixelFormat of the tile bodies
+	int recordFormat;            // TileRecordFormat of the tiles
+	WorkStealingPool pool;
+	std::vector<std::vector<uint8_t>> bodyScratch; // one per pool worker
+
+	// Client half of the tile cache: slot order plus TILE_W x TILE_H pixels per slot
+	TileCacheLru cacheLru;
+	std::vector<uint8_t> cachePixels;
+
+	FramePayload frames[2];
+	bool submitted[2] = { false, false };
+	int fillIndex = 0;
+	std::mutex frameMutex;
+	std::condition_variable frameCondition;
+	bool shouldExit = false;
+	std::thread decodeThread;
+
+	std::vector<DamageRect> damage; // regions the current frame changed, handed to the presenter
+	std::vector<uint8_t> dirtyBitmask; // ReadScreenFrame's, kept so that parsing a frame allocates nothing
+
+	void DecodeTile(FramePayload& frame, TilePayload& tile, uint8_t* bits, int pitch, int worker) {
+		if (tile.type == TILE_CACHED) return;
+		const uint8_t* body = frame.data.data() + tile.offset;
+		if (tile.type & TILE_XRLE) {
+			std::vector<uint8_t>& scratch = bodyScratch[worker];
+			if (scratch.size() < xrle_max_out(tile.param) + QOI_CHUNKS_TRAILER)
+				scratch.resize(xrle_max_out(tile.param) + QOI_CHUNKS_TRAILER);
+			if (xrle_decompress_bounded(scratch.data(), tile.param, body, tile.payloadLen) != tile.param) {
+				SRDPRINTF("ParallelFrameDecoder: decompress failed for tile at %u,%u\n", tile.x, tile.y);
+				return;
+			}
+			body = scratch.data();
+		}
+
+		if (tile.x + tile.w <= (uint32_t)frame.width && tile.y + tile.h <= (uint32_t)frame.height &&
+			DecodeTileBody(tile.type & TILE_CODEC_MASK, body, tile.param, bits + (size_t)tile.y * pitch + tile.x * 4,
+				pitch, tile.w, tile.h, pixelFormat, recordFormat)) {
+			tile.decodedW = tile.w;
+			tile.decodedH = tile.h;
+		} else {
+			SRDPRINTF("ParallelFrameDecoder: tile at %u,%u failed to decode, skipped\n", tile.x, tile.y);
+		}
+	}
+
+	void DecodeFrame(FramePayload& frame) {
+		// Only the decode thread writes the pixels; holding the lock for the whole frame keeps the
+		// window from painting a surface that is half applied or being reallocated
+		TRACE_SCOPE("apply frame");
+		FramePresenter* presenter = surface->presenter;
+		{
+			TRACE_SCOPE("wait paint lock");
+			surface->paintMutex.lock();
+		}
+		if (surface->imgW != frame.width || surface->imgH != frame.height) {
+			bool ok = presenter->Resize(frame.width, frame.height);
+			surface->imgW = ok ? frame.width : 0;
+			surface->imgH = ok ? frame.height : 0;
+			if (!ok) {
+				surface->paintMutex.unlock();
+				SRDPRINTF("ParallelFrameDecoder: no %dx%d surface, frame dropped\n", frame.width, frame.height);
+				return;
+			}
+		}
+
+		uint8_t* bits = presenter->Bits();
+		int pitch = presenter->Pitch();
+		for (const CopyRect& m : frame.moves)
+			ApplyCopyRect(bits, pitch, m);
+
+		// Replay the server's cache sequence to find the slot of every newly sent tile
+		uint32_t cacheSlots = cacheLru.Capacity();
+		if (frame.flags & FRAME_KEYFRAME) cacheLru.Clear();
+		for (TilePayload& tile : frame.tiles) {
+			if (tile.type == TILE_CACHED) {
+				if (tile.cacheSlot < cacheSlots) cacheLru.Touch(tile.cacheSlot);
+			} else if (cacheSlots) {
+				tile.cacheSlot = cacheLru.Insert();
+			}
+		}
+
+		pool.ParallelFor(frame.tiles.size(), "decode tiles", [&](size_t i, int worker) {
+			DecodeTile(frame, frame.tiles[i], bits, pitch, worker);
+		});
+
+		// Cache copies in tile order: a reference may name a slot filled earlier in this frame
+		if (cacheSlots) {
+			const size_t slotPitch = TILE_W * 4;
+			for (TilePayload& tile : frame.tiles) {
+				uint8_t* dst = bits + (size_t)tile.y * pitch + tile.x * 4;
+				uint8_t* slot = cachePixels.data() + tile.cacheSlot * TILE_CACHE_SLOT_BYTES;
+				if (tile.type == TILE_CACHED) {
+					if (tile.cacheSlot >= cacheSlots || tile.x + tile.w > (uint32_t)frame.width || tile.y + tile.h > (uint32_t)frame.height) {
+						SRDPRINTF("ParallelFrameDecoder: bad cache reference %u at %u,%u\n", tile.cacheSlot, tile.x, tile.y);
+						continue;
+					}
+					for (uint32_t row = 0; row < tile.h; ++row)
+						memcpy(dst + row * pitch, slot + row * slotPitch, tile.w * 4);
+					tile.decodedW = tile.w;
+					tile.decodedH = tile.h;
+				} else if (tile.decodedW && tile.decodedW <= TILE_W && tile.decodedH <= TILE_H) {
+					for (uint32_t row = 0; row < tile.decodedH; ++row)
+						memcpy(slot + row * slotPitch, dst + row * pitch, tile.decodedW * 4);
+				}
+			}
+		}
+
+		surface->paintMutex.unlock();
+		g_clientLatency.Stamp(frame.seq, STAGE_DECODED);
+
+		// Frame barrier passed: every tile is in the framebuffer
+		damage.clear();
+		for (const CopyRect& m : frame.moves)
+			damage.push_back({ m.dx, m.dy, m.w, m.h });
+		for (const TilePayload& tile : frame.tiles) {
+			if (tile.decodedW == 0) continue;
+			// Tiles arrive in row order, so a run of dirty tiles along a row merges into one rect
+			DamageRect d = { (int)tile.x, (int)tile.y, (int)tile.decodedW, (int)tile.decodedH };
+			if (damage.size() > frame.moves.size()) {
+				DamageRect& last = damage.back();
+				if (last.y == d.y && last.h == d.h && last.x + last.w == d.x) {
+					last.w += d.w;
+					continue;
+				}
+			}
+			damage.push_back(d);
+		}
+		if (damage.empty()) return;
+
+		{
+			TRACE_SCOPE("present");
+			presenter->Present(damage);
+		}
+		g_clientLatency.Stamp(frame.seq, STAGE_PUBLISHED);
+		g_metrics.Add(METRIC_CLIENT_FRAMES_PUBLISHED);
+		g_lastPresentedSeq.store(frame.seq);
+		SRDPRINTF("ParallelFrameDecoder: Batch processed %zu tiles\n", frame.tiles.size());
+	}
+
+	void DecodeLoop() {
+		g_trace.SetThreadName("decoder");
+		int decodeIndex = 0;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(frameMutex);
+				frameCondition.wait(lock, [&] { return shouldExit || submitted[decodeIndex]; });
+				if (shouldExit) return;
+			}
+			DecodeFrame(frames[decodeIndex]);
+			{
+				std::lock_guard<std::mutex> lock(frameMutex);
+				submitted[decodeIndex] = false;
+			}
+			frameCondition.notify_all();
+			decodeIndex ^= 1;
+		}
+	}
+
+public:
+	ParallelFrameDecoder(FrameSurface* surface, int threadCount, uint32_t cacheSlots, int pixelFormat,
+		int recordFormat)
+		: surface(surface), pixelFormat(pixelFormat), recordFormat(recordFormat), pool(threadCount), bodyScratch(pool.WorkerCount()),
+		cacheLru(cacheSlots), cachePixels((size_t)cacheSlots * TILE_CACHE_SLOT_BYTES) {
+		decodeThread = std::thread([this]() { DecodeLoop(); });
+	}
+
+	int WorkerCount() const { return pool.WorkerCount(); }
+	int RecordFormat() const { return recordFormat; }
+	// Scratch for the dirty bitmask of the frame being read; only the reading thread uses it
+	std::vector<uint8_t>& DirtyBitmask() { return dirtyBitmask; }
+
+	// Waits until every submitted frame has been decoded and presented
+	void Flush() {
+		std::unique_lock<std::mutex> lock(frameMutex);
+		frameCondition.wait(lock, [this] { return !submitted[0] && !submitted[1]; });
+	}
+
+	// Returns the buffer to receive the next frame into, waiting while it is still being decoded
+	FramePayload& BeginFrame() {
+		std::unique_lock<std::mutex> lock(frameMutex);
+		frameCondition.wait(lock, [this] { return !submitted[fillIndex]; });
+		return frames[fillIndex];
+	}
+
+	// Hands the frame filled since BeginFrame() to the decode thread
+	void Submit() {
+		{
+			std::lock_guard<std::mutex> lock(frameMutex);
+			submitted[fillIndex] = true;
+		}
+		frameCondition.notify_all();
+		fillIndex ^= 1;
+	}
+
+	~ParallelFrameDecoder() {
+		{
+			std::lock_guard<std::mutex> lock(frameMutex);
+			shouldExit = true;
+		}
+		frameCondition.notify_all();
+		decodeThread.join();
+	}
+};
+
+// --- Screen stream parsing ---
+// The client's half of the screen protocol, shared by ScreenRecvThread and --replay
+
+struct ScreenStreamInfo {
+	int width = 0, height = 0;
+	uint32_t cacheSlots = 0;
+	int pixelFormat = PIXEL_FORMAT_RGBA;
+	int recordFormat = TILE_RECORD_V1;
+};
+
+// Reads the payload of the ScreenInfo message the server answers the capabilities with: screen
+// size, tile cache slots, pixel format and tile record format. False if it is short or a value is
+// out of range.
+inline bool ReadScreenHandshake(StreamInput& in, ScreenStreamInfo& info) {
+	uint32_t fields[4];
+	if (!in.Read(fields, sizeof(fields))) {
+		SRDPRINTF("ReadScreenHandshake: read failed\n");
+		return false;
+	}
+	info.width = (int)ntohl(fields[0]);
+	info.height = (int)ntohl(fields[1]);
+	info.cacheSlots = ntohl(fields[2]);
+	info.pixelFormat = (int)ntohl(fields[3]);
+	uint32_t recordFormat;
+	info.recordFormat = in.Read(&recordFormat, 4) ? (int)ntohl(recordFormat) : TILE_RECORD_V1;
+	if (info.cacheSlots > MAX_TILE_CACHE_SLOTS || (uint32_t)info.pixelFormat > PIXEL_FORMAT_BGRA ||
+		(uint32_t)info.recordFormat > TILE_RECORD_V2) {
+		SRDPRINTF("ReadScreenHandshake: tile cache size, pixel or tile record format out of range\n");
+		return false;
+	}
+	SRDPRINTF("ReadScreenHandshake: screen size: %dx%d, %u tile cache slots, %s, v%d tile records\n", info.width,
+		info.height, info.cacheSlots, info.pixelFormat == PIXEL_FORMAT_BGRA ? "BGRA" : "RGBA", info.recordFormat + 1);
+	return true;
+}
+
+// Reads a varint of a compact tile record. Returns its length, or 0 at the end of the stream or if
+// it does not fit 32 bits.
+inline size_t ReadVarint(StreamInput& in, uint32_t& value) {
+	value = 0;
+	for (size_t n = 1, shift = 0; n <= 5; ++n, shift += 7) {
+		uint8_t b;
+		if (!in.Read(&b, 1)) return 0;
+		value |= (uint32_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) return n < 5 || b < 0x10 ? n : 0;
+	}
+	return 0;
+}
+
+// Reads the payload of one ScreenFrame message (header, copy rects, dirty bitmask and tiles) and
+// submits it to the decoder. pendingMoves is scratch kept across frames. False if the payload is
+// short or malformed; the decoder's state then no longer matches the server's.
+inline bool ReadScreenFrame(StreamInput& in, int width, int height, ParallelFrameDecoder& decoder,
+	std::vector<CopyRect>& pendingMoves) {
+	// --- Frame header: sequence number, the server's capture time and FrameFlags ---
+	TRACE_SCOPE("recv frame");
+	uint32_t frameHeader[4];
+	const uint8_t* span = in.ReadSpan(sizeof(frameHeader));
+	if (!span) {
+		SRDPRINTF("ReadScreenFrame: read for frame header failed\n");
+		return false;
+	}
+	memcpy(frameHeader, span, sizeof(frameHeader));
+	uint32_t frameSeq = ntohl(frameHeader[0]);
+	int64_t captureUs = (int64_t)(((uint64_t)ntohl(frameHeader[1]) << 32) | ntohl(frameHeader[2]));
+	g_clientLatency.Begin(frameSeq, in.CaptureTimeUs(captureUs));
+	g_clientLatency.Stamp(frameSeq, STAGE_RECEIVED);
+
+	// --- Copy-rect commands precede the dirty tiles ---
+	uint32_t nMovesNet = 0;
+	if (!in.Read(&nMovesNet, 4) || ntohl(nMovesNet) > 4096) {
+		SRDPRINTF("ReadScreenFrame: read for copy rect count failed\n");
+		return false;
+	}
+	pendingMoves.resize(ntohl(nMovesNet));
+	const uint8_t* moveRecords = in.ReadSpan(pendingMoves.size() * 24);
+	if (!moveRecords) {
+		SRDPRINTF("ReadScreenFrame: read for copy rects failed\n");
+		return false;
+	}
+	for (CopyRect& m : pendingMoves) {
+		uint32_t fields[6];
+		memcpy(fields, moveRecords, sizeof(fields));
+		moveRecords += sizeof(fields);
+		m = { (int32_t)ntohl(fields[0]), (int32_t)ntohl(fields[1]), (int32_t)ntohl(fields[2]),
+			(int32_t)ntohl(fields[3]), (int32_t)ntohl(fields[4]), (int32_t)ntohl(fields[5]) };
+	}
+
+	uint32_t xrleBitmaskLenNet = 0;
+	if (!in.Read(&xrleBitmaskLenNet, 4)) {
+		SRDPRINTF("ReadScreenFrame: read for bitmask length failed\n");
+		return false;
+	}
+	uint32_t xrleBitmaskLen = ntohl(xrleBitmaskLenNet);
+	SRDPRINTF("ReadScreenFrame: xrleBitmaskLen = %u\n", xrleBitmaskLen);
+
+	if (xrleBitmaskLen == 0 || xrleBitmaskLen > 1024 * 1024) {
+		SRDPRINTF("ReadScreenFrame: xrleBitmaskLen out of range\n");
+		return false;
+	}
+
+	SRDPRINTF("ReadScreenFrame: width=%d height=%d\n", width, height);
+	if (width <= 0 || height <= 0) {
+		SRDPRINTF("ReadScreenFrame: Invalid width/height\n");
+		return false;
+	}
+
+	size_t tiles_x = (width + TILE_W - 1) / TILE_W;
+	size_t tiles_y = (height + TILE_H - 1) / TILE_H;
+	size_t numTiles = tiles_x * tiles_y;
+	if (numTiles == 0 || numTiles > 100000) {
+		SRDPRINTF("ReadScreenFrame: numTiles out of range (%zu)\n", numTiles);
+		return false;
+	}
+
+	// Decompressed straight out of the input's buffer; XRLE reads it a word at a time
+	const uint8_t* xrleBitmask = in.ReadSpan(xrleBitmaskLen, 8);
+	if (!xrleBitmask) {
+		SRDPRINTF("ReadScreenFrame: read for xrleBitmask data failed\n");
+		return false;
+	}
+	std::vector<uint8_t>& dirtyBitmask = decoder.DirtyBitmask();
+	dirtyBitmask.resize((numTiles + 7) / 8);
+	size_t gotLen = xrle_decompress_bounded(dirtyBitmask.data(), dirtyBitmask.size(), xrleBitmask, xrleBitmaskLen);
+	SRDPRINTF("ReadScreenFrame: gotLen from xrle_decompress_bounded = %zu, expected = %zu\n", gotLen, dirtyBitmask.size());
+	if (gotLen != dirtyBitmask.size()) {
+		SRDPRINTF("ReadScreenFrame: xrle_decompress size mismatch\n");
+		return false;
+	}
+
+	size_t dirtyCount = 0;
+	SRDPRINTF("ReadScreenFrame: tiles_x=%zu tiles_y=%zu numTiles=%zu\n", tiles_x, tiles_y, numTiles);
+	SRDPRINTF("ReadScreenFrame: DirtyBitmask: ");
+	for (size_t b = 0; b < dirtyBitmask.size(); ++b) {
+		SRDPRINTF("%02X", dirtyBitmask[b]);
+		for (int bit = 0; bit < 8; ++bit)
+			if (dirtyBitmask[b] & (1 << bit))
+				dirtyCount++;
+	}
+	SRDPRINTF("\nReadScreenFrame: dirtyCount=%zu\n", dirtyCount);
+
+	uint32_t nTilesNet = 0;
+	if (!in.Read(&nTilesNet, 4)) {
+		SRDPRINTF("ReadScreenFrame: read for nTiles failed\n");
+		return false;
+	}
+	uint32_t nTiles = ntohl(nTilesNet);
+	SRDPRINTF("ReadScreenFrame: nTiles (server says) = %u\n", nTiles);
+
+	size_t bytesThisFrame = 4;
+	const int recordFormat = decoder.RecordFormat();
+
+	FramePayload* beginFrame;
+	{
+		TRACE_SCOPE("wait decoder");
+		beginFrame = &decoder.BeginFrame();
+	}
+	FramePayload& frame = *beginFrame;
+	frame.Reset(width, height);
+	frame.seq = frameSeq;
+	frame.flags = ntohl(frameHeader[3]);
+	for (const CopyRect& m : pendingMoves) {
+		if (m.w > 0 && m.h > 0 && m.sx >= 0 && m.sy >= 0 && m.dx >= 0 && m.dy >= 0 &&
+			m.sx <= width - m.w && m.dx <= width - m.w && m.sy <= height - m.h && m.dy <= height - m.h)
+			frame.moves.push_back(m);
+		else
+			SRDPRINTF("ReadScreenFrame: copy rect out of bounds, ignored\n");
+	}
+	size_t receivedDirty = 0;
+	for (size_t tileIdx = 0; tileIdx < numTiles; ++tileIdx) {
+		if (!(dirtyBitmask[tileIdx / 8] & (1 << (tileIdx % 8))))
+			continue;
+
+		uint32_t rx, ry, rw, rh, payloadLen, param;
+		uint8_t type;
+		if (recordFormat == TILE_RECORD_V1) {
+			const uint8_t* header = in.ReadSpan(TILE_HEADER_SIZE);
+			if (!header) {
+				SRDPRINTF("ReadScreenFrame: read header failed\n");
+				return false;
+			}
+			bytesThisFrame += TILE_HEADER_SIZE;
+			uint32_t rect[4], lens[2];
+			memcpy(rect, header, sizeof(rect));
+			memcpy(lens, header + 17, sizeof(lens));
+			rx = ntohl(rect[0]); ry = ntohl(rect[1]); rw = ntohl(rect[2]); rh = ntohl(rect[3]);
+			type = header[16];
+			payloadLen = ntohl(lens[0]); param = ntohl(lens[1]);
+		} else {
+			// Compact record: the rect is the tile's place in the grid
+			rx = (uint32_t)(tileIdx % tiles_x) * TILE_W;
+			ry = (uint32_t)(tileIdx / tiles_x) * TILE_H;
+			rw = std::min((uint32_t)TILE_W, (uint32_t)width - rx);
+			rh = std::min((uint32_t)TILE_H, (uint32_t)height - ry);
+			size_t lenBytes = 0, paramBytes = 0;
+			if (!in.Read(&type, 1) || (lenBytes = ReadVarint(in, payloadLen)) == 0) {
+				SRDPRINTF("ReadScreenFrame: read header failed\n");
+				return false;
+			}
+			param = payloadLen;
+			if (type == TILE_CACHED) payloadLen = 0;
+			else if ((type & TILE_XRLE) && (paramBytes = ReadVarint(in, param)) == 0) {
+				SRDPRINTF("ReadScreenFrame: read header failed\n");
+				return false;
+			}
+			bytesThisFrame += 1 + lenBytes + paramBytes;
+		}
+
+		if (rw == 0 || rh == 0 || rw > TILE_W || rh > TILE_H) {
+			SRDPRINTF("ReadScreenFrame: invalid tile size %ux%u\n", rw, rh);
+			return false;
+		}
+		if (type == TILE_CACHED) {
+			frame.AddCachedTile(rx, ry, rw, rh, param);
+			receivedDirty++;
+			continue;
+		}
+
+		uint8_t codec = type & TILE_CODEC_MASK;
+		bool validLen = (type & TILE_XRLE) ? param <= TILE_QOI_BOUND && payloadLen <= xrle_max_out(param)
+			: payloadLen == param && payloadLen <= TILE_QOI_BOUND;
+		if (codec > TILE_XOR || (codec == TILE_XOR && !(type & TILE_XRLE)) || payloadLen == 0 || !validLen) {
+			SRDPRINTF("ReadScreenFrame: invalid header\n");
+			return false;
+		}
+
+		uint8_t* payload = frame.AddTile(rx, ry, rw, rh, type, payloadLen, param);
+		if (!in.Read(payload, payloadLen)) {
+			SRDPRINTF("ReadScreenFrame: read data failed\n");
+			return false;
+		}
+		bytesThisFrame += payloadLen;
+		receivedDirty++;
+	}
+
+	// Decoding and presentation happen on the decoder while the next frame is received
+	if (!frame.tiles.empty() || !frame.moves.empty()) {
+		decoder.Submit();
+	}
+	SRDPRINTF("ReadScreenFrame: received %zu dirty tiles for %zu dirty bits\n", receivedDirty, dirtyCount);
+
+	g_metrics.Add(METRIC_CLIENT_FRAMES);
+	g_metrics.Add(METRIC_CLIENT_TILES, receivedDirty);
+	g_metrics.Add(METRIC_CLIENT_BYTES, bytesThisFrame);
+	return true;
+}
@@ -0,0 +1,181 @@
+// Scoped trace events for the streaming threads, written out as Chrome trace JSON.
+// Header only and free of Win32, so its overhead can be measured on its own (tests/TraceBench.cpp).
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define TRACE_HAVE_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_HAVE_TSC 1
+#else
+#define TRACE_HAVE_TSC 0
+#endif
+
+// --- Pipeline trace ---
+// Scoped events (TRACE_SCOPE) for the streaming threads, kept in a ring per thread and written out
+// as Chrome trace JSON, which chrome://tracing and ui.perfetto.dev open. Off by default: a disabled
+// scope costs one relaxed load. Recording takes two reads of the time stamp counter and three
+// relaxed stores into the thread's own ring; rings are leased like metrics shards, so it never
+// locks. Event names must be string literals, since only the pointer is kept.
+static std::atomic<bool> g_traceEnabled(false);
+static std::atomic<bool> g_traceDump(false); // --trace: on from the start, written out when a stream ends
+
+// Event clock: the time stamp counter where there is one, a few ns to read where steady_clock
+// can take 25 ns or more, which per tile was several percent of the work traced. Ticks become
+// microseconds only when the trace is written, against steady_clock over the whole run.
+inline int64_t TraceTicks() {
+#if TRACE_HAVE_TSC
+	return (int64_t)__rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+inline int64_t TraceNowUs() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class PipelineTrace {
+public:
+	static const uint64_t CAPACITY = 1 << 16; // events kept per thread
+
+	PipelineTrace() : epochTicks(TraceTicks()), epochUs(TraceNowUs()) {}
+
+	// start and end are TraceTicks() readings
+	void Record(const char* name, int64_t start, int64_t end) {
+		Ring* r = Local();
+		uint64_t head = r->head.load(std::memory_order_relaxed);
+		Event& e = r->events[head % CAPACITY];
+		e.name.store(name, std::memory_order_relaxed);
+		e.start.store(start, std::memory_order_relaxed);
+		e.duration.store(end - start, std::memory_order_relaxed);
+		r->head.store(head + 1, std::memory_order_release);
+	}
+
+	// Names the calling thread's track in the trace; cheap enough to call at every thread start
+	void SetThreadName(const char* name) {
+		ThreadState& t = Thread();
+		t.name = name;
+		if (t.ring) t.ring->threadName.store(name, std::memory_order_relaxed);
+	}
+
+	// Writes every ring as {"traceEvents": [...]}. Meant to run once tracing is off; events a
+	// thread overwrites while the dump reads them are dropped rather than torn.
+	bool Dump(const char* path) const {
+		std::ofstream f(path);
+		if (!f.is_open()) return false;
+		int64_t nowTicks = TraceTicks(), nowUs = TraceNowUs();
+		double ticksPerUs = nowUs > epochUs ? (double)(nowTicks - epochTicks) / (nowUs - epochUs) : 1.0;
+		if (ticksPerUs <= 0) ticksPerUs = 1.0;
+		f << "{\"traceEvents\":[\n";
+		bool first = true;
+		for (Ring* r = rings.load(std::memory_order_acquire); r; r = r->next) {
+			const char* threadName = r->threadName.load(std::memory_order_relaxed);
+			f << (first ? "" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << r->tid
+				<< ",\"args\":{\"name\":\"" << (threadName ? threadName : "thread") << "\"}}";
+			first = false;
+
+			uint64_t head = r->head.load(std::memory_order_acquire);
+			uint64_t begin = head > CAPACITY ? head - CAPACITY : 0;
+			std::vector<std::pair<const char*, std::pair<int64_t, int64_t>>> events;
+			events.reserve((size_t)(head - begin));
+			for (uint64_t i = begin; i < head; ++i) {
+				const Event& e = r->events[i % CAPACITY];
+				events.push_back({ e.name.load(std::memory_order_relaxed),
+					{ e.start.load(std::memory_order_relaxed), e.duration.load(std::memory_order_relaxed) } });
+			}
+			// Anything at or past the new head minus the capacity (plus the slot being written) may be mixed
+			uint64_t after = r->head.load(std::memory_order_acquire);
+			uint64_t valid = after + 1 > CAPACITY ? after + 1 - CAPACITY : 0;
+			for (uint64_t i = std::max(begin, valid); i < head; ++i) {
+				const auto& e = events[(size_t)(i - begin)];
+				if (!e.first) continue;
+				f << ",\n{\"ph\":\"X\",\"name\":\"" << e.first << "\",\"pid\":1,\"tid\":" << r->tid
+					<< ",\"ts\":" << epochUs + (int64_t)((e.second.first - epochTicks) / ticksPerUs)
+					<< ",\"dur\":" << e.second.second / ticksPerUs << "}";
+			}
+		}
+		f << "\n]}\n";
+		return true;
+	}
+
+private:
+	struct Event {
+		std::atomic<const char*> name{nullptr};
+		std::atomic<int64_t> start{0};    // ticks
+		std::atomic<int64_t> duration{0}; // ticks
+	};
+	struct Ring {
+		std::unique_ptr<Event[]> events{new Event[CAPACITY]};
+		std::atomic<uint64_t> head{0};
+		std::atomic<const char*> threadName{nullptr};
+		std::atomic<bool> inUse{true};
+		int tid = 0;
+		Ring* next = nullptr;
+	};
+	struct ThreadState {
+		Ring* ring = nullptr;
+		const char* name = nullptr;
+		~ThreadState() { if (ring) ring->inUse.store(false, std::memory_order_release); }
+	};
+	static ThreadState& Thread() {
+		thread_local ThreadState t;
+		return t;
+	}
+
+	std::atomic<Ring*> rings{nullptr};
+	std::atomic<int> ringCount{0};
+	const int64_t epochTicks, epochUs; // the clocks side by side when the trace was created
+
+	// The calling thread's ring, taken on its first event. A ring left by an exited thread is
+	// reused, old events included, so its track may show work of more than one thread in turn.
+	Ring* Local() {
+		ThreadState& t = Thread();
+		if (t.ring) return t.ring;
+		Ring* r = rings.load(std::memory_order_acquire);
+		for (; r; r = r->next) {
+			bool free = false;
+			if (r->inUse.compare_exchange_strong(free, true, std::memory_order_acquire)) break;
+		}
+		if (!r) {
+			r = new Ring();
+			r->tid = ringCount.fetch_add(1) + 1;
+			r->next = rings.load(std::memory_order_relaxed);
+			while (!rings.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed)) {}
+		}
+		r->threadName.store(t.name, std::memory_order_relaxed);
+		return t.ring = r;
+	}
+};
+
+static PipelineTrace g_trace;
+
+// Records the enclosing scope as one event while g_traceEnabled is set
+class TraceScope {
+	const char* name;
+	int64_t start;
+public:
+	explicit TraceScope(const char* name) : name(g_traceEnabled.load(std::memory_order_relaxed) ? name : nullptr),
+		start(this->name ? TraceTicks() : 0) {}
+	~TraceScope() { End(); }
+	// Ends the event before the scope does
+	void End() {
+		if (name) g_trace.Record(name, start, TraceTicks());
+		name = nullptr;
+	}
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+};
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
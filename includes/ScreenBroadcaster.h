@@ -0,0 +1,342 @@
+// The server's screen broadcast: one producer captures and encodes every frame once, and each viewer
+// is sent those frames from a queue of its own.
+// Header only and free of Win32, so the fan-out can be load-tested over loopback (tests/FanOutTest.cpp).
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "SendGather.h"
+#include "StreamInput.h"
+#include "FrameSource.h"
+#include "ScreenFrameEncoder.h"
+#include "Metrics.h"
+#include "PipelineTrace.h"
+
+// --- Screen broadcast ---
+// One producer per pixel format captures, diffs and encodes every frame once, into buffers that
+// hold the frame as it goes on the wire and are never written again once published. Every
+// viewer connection has a thread of its own that sends from a short queue of those buffers, so
+// the cost of a frame does not grow with the number of viewers. A viewer whose queue is full
+// loses what is queued rather than holding back the producer, and a viewer that has just joined
+// starts at a keyframe.
+// A viewer that fell behind is sent a keyframe of its own as soon as its sender is ready for the
+// next frame. It comes from a second encoder, the resync stream, which hashes tiles against what
+// it sent last and uses no tile cache (the shared stream's cache holds tiles this viewer never
+// got); its frames carry the same sequence numbers as the shared ones. The viewer stays on the
+// resync stream until the next shared keyframe.
+
+struct ScreenViewer {
+	std::condition_variable ready;
+	std::deque<EncodedFramePtr> queue;
+	bool joined = false;       // has been handed a frame
+	bool needsKeyframe = true; // until it is handed the next shared keyframe
+	bool onResync = false;     // has the resync stream's keyframe and is sent its frames
+	bool waiting = false;      // its sender waits in Next with nothing queued
+	bool closed = false;       // the producer stopped
+};
+
+// What a producer takes from the server it runs in: where the frames come from, the settings it
+// follows (read before every frame, so they can change while it runs) and where its statistics go.
+// Called on the producer's thread.
+class ScreenBroadcastHost {
+public:
+	virtual ~ScreenBroadcastHost() {}
+	virtual std::unique_ptr<FrameSource> NewFrameSource() = 0;
+	virtual int EncodeThreads() = 0;
+	virtual uint32_t TileCacheSlots() = 0;
+	// False stops the producer
+	virtual bool StreamActive() = 0;
+	virtual int Fps() = 0;
+	virtual bool HashDetect() = 0;
+	// About once a second: the frames published and their bytes since the last report
+	virtual void Report(int frames, size_t bytes, int width, int height, ScreenFrameEncoder& encoder, bool hashDetect) {}
+};
+
+class ScreenBroadcaster {
+public:
+	static const size_t VIEWER_QUEUE_FRAMES = 3;
+	// A viewer that fell behind waits at least this many frames since the last keyframe for the next
+	// shared one, so that one slow link cannot turn every frame into a keyframe for everybody. It
+	// is not left without frames meanwhile: up to 40 frames (2 s at the default 20 fps) come from
+	// the resync stream, which costs the producer a second encode of each of those frames.
+	static const int RESYNC_KEYFRAME_GAP = 40;
+
+	ScreenBroadcaster(int pixelFormat, int recordFormat, ScreenBroadcastHost& host)
+		: pixelFormat(pixelFormat), recordFormat(recordFormat), host(host) {}
+
+	// Adds a viewer, starting the producer if it is not running
+	void Add(const std::shared_ptr<ScreenViewer>& viewer) {
+		std::lock_guard<std::mutex> lock(viewersMutex);
+		viewers.push_back(viewer);
+		if (!running) {
+			running = true;
+			std::thread([this]() { Run(); }).detach();
+		}
+	}
+
+	void Remove(const std::shared_ptr<ScreenViewer>& viewer) {
+		std::lock_guard<std::mutex> lock(viewersMutex);
+		viewers.erase(std::remove(viewers.begin(), viewers.end(), viewer), viewers.end());
+	}
+
+	// Waits for the viewer's next frame; false once the producer has stopped
+	bool Next(ScreenViewer& viewer, EncodedFramePtr& frame) {
+		std::unique_lock<std::mutex> lock(viewersMutex);
+		viewer.waiting = true;
+		viewer.ready.wait(lock, [&] { return viewer.closed || !viewer.queue.empty(); });
+		viewer.waiting = false;
+		if (viewer.queue.empty()) return false;
+		frame = std::move(viewer.queue.front());
+		viewer.queue.pop_front();
+		return true;
+	}
+
+	// Whether the producer is running; it stops once the last viewer is removed
+	bool Running() {
+		std::lock_guard<std::mutex> lock(viewersMutex);
+		return running;
+	}
+
+private:
+	const int pixelFormat;
+	const int recordFormat;  // TileRecordFormat
+	ScreenBroadcastHost& host;
+	std::mutex viewersMutex; // guards viewers, running and every field of every viewer
+	std::vector<std::shared_ptr<ScreenViewer>> viewers;
+	bool running = false;
+	// Frame buffers; one only this list still refers to is free to be encoded into again
+	std::vector<std::shared_ptr<EncodedFrame>> framePool;
+
+	std::shared_ptr<EncodedFrame> FreeFrame() {
+		for (const std::shared_ptr<EncodedFrame>& frame : framePool) {
+			if (frame.use_count() == 1) {
+				// Pairs with the release of the last sender dropping its reference
+				std::atomic_thread_fence(std::memory_order_acquire);
+				return frame;
+			}
+		}
+		framePool.push_back(std::make_shared<EncodedFrame>());
+		return framePool.back();
+	}
+
+	// Whether the next frame has to be a keyframe, and whether the resync stream is needed and has
+	// to start with one; false also when there is nobody left to send to
+	bool WantsKeyframe(int framesSinceKeyframe, bool& stop, bool& resync, bool& resyncKeyframe) {
+		std::lock_guard<std::mutex> lock(viewersMutex);
+		stop = viewers.empty() || !host.StreamActive();
+		resync = resyncKeyframe = false;
+		if (stop) {
+			for (const std::shared_ptr<ScreenViewer>& viewer : viewers) {
+				viewer->closed = true;
+				viewer->ready.notify_all();
+			}
+			running = false;
+			return false;
+		}
+		bool keyframe = false;
+		for (const std::shared_ptr<ScreenViewer>& viewer : viewers) {
+			if (!viewer->needsKeyframe) continue;
+			// One whose sender is still busy with an old frame is left alone until it is ready
+			bool ready = viewer->onResync || viewer->waiting;
+			keyframe |= !viewer->joined || (ready && framesSinceKeyframe >= RESYNC_KEYFRAME_GAP);
+			if (viewer->joined && ready) {
+				resync = true;
+				resyncKeyframe |= !viewer->onResync;
+			}
+		}
+		if (keyframe) resync = resyncKeyframe = false;
+		return keyframe;
+	}
+
+	// Queues frame for a viewer that is up to date with its stream; one that is too far behind
+	// loses what is queued, as the queued deltas are useless without this one
+	bool Enqueue(ScreenViewer& viewer, const EncodedFramePtr& frame) {
+		if (viewer.queue.size() >= VIEWER_QUEUE_FRAMES) {
+			g_metrics.Add(METRIC_SERVER_VIEWER_DROPS, viewer.queue.size() + 1);
+			viewer.queue.clear();
+			viewer.needsKeyframe = true;
+			viewer.onResync = false;
+			return false;
+		}
+		viewer.queue.push_back(frame);
+		viewer.ready.notify_all();
+		return true;
+	}
+
+	// Hands the shared frame to the viewers on the shared stream and the resync frame, if one was
+	// encoded, to those on the resync stream or waiting to join it
+	void Publish(const std::shared_ptr<EncodedFrame>& frame, const std::shared_ptr<EncodedFrame>& resyncFrame) {
+		EncodedFramePtr published = frame, resyncPublished = resyncFrame;
+		bool keyframe = (frame->flags & FRAME_KEYFRAME) != 0;
+		bool resyncKeyframe = resyncFrame && (resyncFrame->flags & FRAME_KEYFRAME) != 0;
+		std::lock_guard<std::mutex> lock(viewersMutex);
+		for (const std::shared_ptr<ScreenViewer>& viewer : viewers) {
+			if (keyframe) {
+				viewer->needsKeyframe = false;
+				viewer->onResync = false;
+				viewer->joined = true;
+				viewer->queue.push_back(published);
+				viewer->ready.notify_all();
+			} else if (!viewer->needsKeyframe) {
+				Enqueue(*viewer, published);
+			} else if (resyncPublished && viewer->joined && (viewer->onResync || resyncKeyframe)) {
+				if (Enqueue(*viewer, resyncPublished)) viewer->onResync = true;
+			}
+		}
+	}
+
+	void Run() {
+		using namespace std::chrono;
+		g_trace.SetThreadName("screen producer");
+
+		CaptureContext capture(host.NewFrameSource(), pixelFormat);
+		int framesSinceKeyframe = 0;
+
+		auto lastReport = steady_clock::now();
+		int frames = 0;
+		size_t bytes = 0;
+
+		ScreenFrameEncoder encoder(recordFormat, host.TileCacheSlots(), host.EncodeThreads());
+		SSDPRINTF("ScreenBroadcaster: tile cache has %u slots, %s tiles\n", encoder.CacheSlots(),
+			pixelFormat == PIXEL_FORMAT_BGRA ? "BGRA" : "RGBA");
+		SSDPRINTF("ScreenBroadcaster: encoding with %d worker(s)\n", encoder.WorkerCount());
+		// Made when a viewer first falls behind
+		std::unique_ptr<ScreenFrameEncoder> resyncEncoder;
+
+		for (;;) {
+			bool stop, resync, resyncKeyframe;
+			bool keyframe = WantsKeyframe(framesSinceKeyframe, stop, resync, resyncKeyframe);
+			if (stop) break;
+
+			int fps = host.Fps();
+			int frameInterval = 1000 / fps;
+			auto start = steady_clock::now();
+
+			// Exact change detection diffs against the previous frame, which the capture context keeps
+			bool hashDetect = host.HashDetect();
+			bool captured;
+			{
+				TRACE_SCOPE("capture");
+				captured = capture.Capture(!hashDetect);
+			}
+			if (!captured) {
+				g_metrics.Add(METRIC_SERVER_CAPTURE_FAILURES);
+				continue;
+			}
+			uint32_t frameSeq = g_nextFrameSeq.fetch_add(1);
+			if (frameSeq == 0) frameSeq = g_nextFrameSeq.fetch_add(1);
+			int64_t captureUs = LatencyNowUs();
+			g_serverLatency.Begin(frameSeq, captureUs);
+
+			if (keyframe) {
+				framesSinceKeyframe = 0;
+				g_metrics.Add(METRIC_SERVER_KEYFRAMES);
+			}
+			framesSinceKeyframe++;
+
+			// Adaptive compression: skip XRLE for high FPS to reduce CPU overhead
+			bool useDoubleCompression = (fps <= 30);
+
+			std::shared_ptr<EncodedFrame> frame = FreeFrame();
+			size_t frameBytes;
+			// The tile cache already counts this frame's misses as sent; start every viewer over
+			if (!encoder.Encode(*frame, capture.Current(), capture.Previous(), frameSeq, captureUs, keyframe, hashDetect,
+				useDoubleCompression, frameBytes)) {
+				SSDPRINTF("ScreenBroadcaster: a tile failed to encode, frame dropped\n");
+				std::lock_guard<std::mutex> lock(viewersMutex);
+				for (const std::shared_ptr<ScreenViewer>& viewer : viewers) {
+					viewer->queue.clear();
+					viewer->needsKeyframe = true;
+					viewer->onResync = false;
+					viewer->joined = false;
+				}
+				continue;
+			}
+
+			// The same capture for the viewers that fell behind, from the resync stream's own history
+			std::shared_ptr<EncodedFrame> resyncFrame;
+			if (resync) {
+				if (!resyncEncoder) resyncEncoder.reset(new ScreenFrameEncoder(recordFormat, 0, host.EncodeThreads()));
+				resyncFrame = FreeFrame();
+				size_t resyncBytes;
+				if (resyncEncoder->Encode(*resyncFrame, capture.Current(), nullptr, frameSeq, captureUs, resyncKeyframe, true,
+					useDoubleCompression, resyncBytes)) {
+					g_metrics.Add(METRIC_SERVER_RESYNC_FRAMES);
+					g_metrics.Add(METRIC_SERVER_BYTES, resyncBytes);
+					if (resyncKeyframe) g_metrics.Add(METRIC_SERVER_KEYFRAMES);
+				} else {
+					SSDPRINTF("ScreenBroadcaster: a tile failed to encode, resync frame dropped\n");
+					resyncFrame.reset();
+					std::lock_guard<std::mutex> lock(viewersMutex);
+					for (const std::shared_ptr<ScreenViewer>& viewer : viewers) {
+						if (!viewer->onResync) continue;
+						viewer->queue.clear();
+						viewer->onResync = false;
+					}
+				}
+			}
+			Publish(frame, resyncFrame);
+
+			frames++;
+			bytes += frameBytes;
+			g_metrics.Add(METRIC_SERVER_FRAMES);
+			g_metrics.Add(METRIC_SERVER_BYTES, frameBytes);
+			auto now = steady_clock::now();
+			if (duration_cast<seconds>(now - lastReport).count() >= 1) {
+				host.Report(frames, bytes, frame->width, frame->height, encoder, hashDetect);
+				frames = 0;
+				bytes = 0;
+				lastReport = now;
+			}
+			auto elapsed = duration_cast<milliseconds>(steady_clock::now() - start).count();
+			// Use high-resolution timing instead of Sleep for better performance
+			if (elapsed < frameInterval) {
+				TRACE_SCOPE("frame pacing");
+				auto targetTime = start + milliseconds(frameInterval);
+				std::this_thread::sleep_until(targetTime);
+			}
+		}
+		SSDPRINTF("ScreenBroadcaster: no viewers left, producer exiting\n");
+	}
+};
+
+// Sends a viewer the frames of broadcaster until the producer stops or send fails. The first frame
+// is a keyframe; the stream's size, tile cache and formats go out as ScreenInfo ahead of it.
+// send(slices) puts slices on the wire and returns false if it could not.
+template <typename Send>
+inline void SendScreenFrames(ScreenBroadcaster& broadcaster, ScreenViewer& viewer, int pixelFormat, int recordFormat, Send send) {
+	std::vector<WireSlice> slices;
+	bool handshakeSent = false;
+	EncodedFramePtr frame;
+	while (broadcaster.Next(viewer, frame)) {
+		if (!handshakeSent) {
+			uint32_t info[5] = { htonl((uint32_t)frame->width), htonl((uint32_t)frame->height),
+				htonl(frame->cacheSlots), htonl((uint32_t)pixelFormat), htonl((uint32_t)recordFormat) };
+			MsgHeader infoHeader = MakeMsgHeader(MsgType::ScreenInfo, sizeof(info));
+			slices.assign({ { &infoHeader, sizeof(infoHeader) }, { info, sizeof(info) } });
+			if (!send(slices)) break;
+			SSDPRINTF("ScreenStreamServerThread: sent screen size %dx%d, %u tile cache slots, %s tiles, v%d records\n",
+				frame->width, frame->height, frame->cacheSlots, pixelFormat == PIXEL_FORMAT_BGRA ? "BGRA" : "RGBA",
+				recordFormat + 1);
+			handshakeSent = true;
+		}
+
+		TraceScope sendTrace("send frame");
+		MsgHeader frameHeader = MakeMsgHeader(MsgType::ScreenFrame, (uint32_t)frame->size);
+		slices.assign(1, { &frameHeader, sizeof(frameHeader) });
+		frame->AppendSlices(slices);
+		if (!send(slices)) break;
+		sendTrace.End();
+		g_serverLatency.Stamp(frame->seq, STAGE_SEND);
+		frame.reset(); // back to the producer's pool once every viewer is done with it
+	}
+}
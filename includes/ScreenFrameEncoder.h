@@ -0,0 +1,410 @@
+// The server's frame encoder: change detection, copy rects, the dirty bitmask, the tile cache and
+// the parallel tile encode of one frame into the buffers the senders gather onto the wire.
+// Header only and free of Win32, so it can be benchmarked on its own (tests/CorpusBench.cpp).
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "SendGather.h"
+#include "TileHash.h"
+#include "TileCodec.h"
+#include "MotionDetector.h"
+#include "FrameSource.h"
+#include "Metrics.h"
+#include "PipelineTrace.h"
+#include "WorkStealingPool.h"
+
+// Uncomment this line for verbose debug output on the server
+//#define SCREENSTREAMSERVER_DEBUG
+
+#ifdef SCREENSTREAMSERVER_DEBUG
+#define SSDPRINTF(...)        \
+    do {                      \
+        printf(__VA_ARGS__);  \
+        fflush(stdout);       \
+    } while (0)
+#else
+#define SSDPRINTF(...) do {} while (0)
+#endif
+
+// A frame as it goes on the wire, encoded once for every viewer
+struct EncodedFrame {
+	uint32_t seq = 0;
+	uint32_t flags = 0;        // FrameFlags
+	int width = 0, height = 0; // with cacheSlots, what a viewer that starts here is told
+	uint32_t cacheSlots = 0;
+
+	// The ScreenFrame payload is never assembled in one buffer: parts lists its runs in wire order,
+	// each either in head (header, copy rects, bitmask, tile count and cached-tile records) or in
+	// records, where the workers put the tile records they encode, and the sender gathers them.
+	static const int HEAD = 0, RECORDS = 1;
+	struct Part {
+		int buffer; // HEAD or RECORDS
+		size_t offset, len;
+	};
+	std::vector<uint8_t> head;
+	std::vector<uint8_t> records; // its size is the room for records, kept from frame to frame
+	std::vector<Part> parts;
+	size_t size = 0;
+
+	void Clear() {
+		head.clear();
+		parts.clear();
+		size = 0;
+	}
+
+	// Appends a run, merging it into the last one when it directly follows it in the same buffer
+	void AddPart(int buffer, size_t offset, size_t len) {
+		if (!parts.empty() && parts.back().buffer == buffer && parts.back().offset + parts.back().len == offset)
+			parts.back().len += len;
+		else
+			parts.push_back({ buffer, offset, len });
+		size += len;
+	}
+
+	void AppendSlices(std::vector<WireSlice>& slices) const {
+		for (const Part& part : parts) {
+			const std::vector<uint8_t>& buffer = part.buffer == HEAD ? head : records;
+			slices.push_back({ buffer.data() + part.offset, part.len });
+		}
+	}
+};
+typedef std::shared_ptr<const EncodedFrame> EncodedFramePtr;
+
+// --- Frame encoder ---
+// What the producer does between capturing a frame and publishing it: change detection (exact
+// against the previous frame with copy rects, or tile hashes), the dirty bitmask, tile cache
+// lookups and the parallel tile encode into an EncodedFrame. ScreenBroadcaster::Run feeds it from
+// the capture loop and tests/CorpusBench.cpp from recorded frames.
+
+class ScreenFrameEncoder {
+public:
+	ScreenFrameEncoder(int recordFormat, uint32_t cacheSlots, int encodeThreads)
+		: recordFormat(recordFormat), cacheSlots(cacheSlots), encodePool(encodeThreads),
+		encodeArenas(encodePool.WorkerCount()) {
+		if (cacheSlots > 0) tileCache.reset(new TileContentCache(cacheSlots));
+	}
+
+	uint32_t CacheSlots() const { return cacheSlots; }
+	int WorkerCount() const { return encodePool.WorkerCount(); }
+	TileContentCache* Cache() const { return tileCache.get(); }
+	// Dirty tiles of the last frame encoded, cached ones included
+	size_t DirtyTiles() const { return dirtyTiles.size(); }
+	// Copy rects the last frame encoded was sent with
+	size_t CopyRects() const { return moves.size(); }
+	// Off, scrolled and moved content is sent as tiles like any other change; for measuring what
+	// the copy rects save. Turned back on, the search starts over from the next frame.
+	void SetMotionDetect(bool on) {
+		if (on && !motionDetect) motion = MotionDetector();
+		motionDetect = on;
+	}
+	// Off, every tile is QOI-encoded (then XRLE) whatever its content, as before the codec was
+	// picked per tile; for measuring what the choice saves
+	void SetCodecChoice(bool on) { codecChoice = on; }
+
+	// Time spent in change detection and the tiles it looked at since the last call
+	void TakeDetectStats(uint64_t& ns, uint64_t& tiles) {
+		ns = detectNs;
+		tiles = detectTiles;
+		detectNs = detectTiles = 0;
+	}
+
+	// Encodes the frame in curr as a ScreenFrame payload into frame. prev is the frame captured
+	// before, or null; exact change detection diffs against it and applies the copy rects it finds
+	// to it. A keyframe sends every tile and clears the tile cache. tileBytes gets the size of the
+	// tile records. False if a tile failed to encode, after which the tile cache no longer matches
+	// what any viewer has.
+	bool Encode(EncodedFrame& frame, const CapturedFrame* curr, CapturedFrame* prev, uint32_t frameSeq, int64_t captureUs,
+		bool keyframe, bool hashDetect, bool useXrle, size_t& tileBytes);
+
+private:
+	// Dirty tiles are sharded across the pool; each worker encodes a record into its own arena and
+	// claims room for it in the frame's records, and the frame lists the records in the original
+	// tile order for the senders to gather. The room a frame needs is the size of its records
+	// whichever worker encoded them, so pooled frames stop allocating once they have held the
+	// largest frame, however the tiles were shared out.
+	struct TileEncodeArena {
+		std::vector<uint8_t> scratch = std::vector<uint8_t>(TILE_ENCODE_SCRATCH);
+		std::vector<uint8_t> record = std::vector<uint8_t>(TILE_RECORD_BOUND);
+	};
+	static const size_t NOT_PLACED = SIZE_MAX;
+	struct EncodedTile {
+		bool cached;   // sent as a reference to cacheSlot instead of a payload
+		uint32_t cacheSlot;
+		size_t offset; // in the frame's records, NOT_PLACED until there was room for it
+		size_t size;
+	};
+
+	const int recordFormat; // TileRecordFormat
+	const uint32_t cacheSlots;
+	std::unique_ptr<TileContentCache> tileCache;
+	WorkStealingPool encodePool;
+	std::vector<TileEncodeArena> encodeArenas;
+	std::vector<EncodedTile> encodedTiles;
+	std::vector<uint64_t> tileKeys;
+	std::vector<size_t> encodeList;
+	// Hash change detection: per-tile hashes of this and the previous frame
+	std::vector<uint64_t> tileHashes, prevTileHashes;
+	std::vector<uint8_t> tileDirty; // exact change detection, one flag per tile
+	int hashedWidth = 0, hashedHeight = 0;
+	uint64_t detectNs = 0, detectTiles = 0;
+	int frameCounter = 0;
+
+	MotionDetector motion;
+	bool motionDetect = true;
+	bool codecChoice = true;
+	std::vector<CopyRect> moves;
+	std::vector<uint8_t> dirtyBitmask;
+	std::vector<std::pair<int, int>> dirtyTiles;
+	std::vector<uint8_t> xrleBitmask;
+};
+
+inline bool ScreenFrameEncoder::Encode(EncodedFrame& frame, const CapturedFrame* currFrame, CapturedFrame* prevFrame, uint32_t frameSeq,
+	int64_t captureUs, bool keyframe, bool hashDetect, bool useXrle, size_t& tileBytes) {
+	using namespace std::chrono;
+	int width = currFrame->Width();
+	int height = currFrame->Height();
+	const uint8_t* curr_rgba = currFrame->Bits();
+
+	size_t tiles_x = (width + TILE_W - 1) / TILE_W;
+	size_t tiles_y = (height + TILE_H - 1) / TILE_H;
+	size_t numTiles = tiles_x * tiles_y;
+
+	dirtyBitmask.assign((numTiles + 7) / 8, 0);
+	dirtyTiles.clear();
+	if (motionDetect) {
+		TRACE_SCOPE("motion search");
+		motion.Update(curr_rgba, width, height, encodePool);
+	}
+	moves.clear();
+	const uint8_t* deltaBase = nullptr; // previous frame as the client has it, for TILE_XOR
+
+	auto mark_dirty = [&](size_t tx, size_t ty) {
+		size_t tidx = ty * tiles_x + tx;
+		dirtyBitmask[tidx / 8] |= 1 << (tidx % 8);
+		dirtyTiles.push_back({ (int)tx, (int)ty });
+	};
+
+	TraceScope scanTrace("dirty scan");
+	auto detectStart = steady_clock::now();
+	bool hashesValid = false;
+	if (hashDetect) {
+		hashesValid = hashedWidth == width && hashedHeight == height;
+		tileHashes.resize(numTiles);
+		encodePool.ParallelFor(tiles_y, [&](size_t ty, int) {
+			int y = (int)(ty * TILE_H), h = std::min(TILE_H, height - y);
+			for (size_t tx = 0; tx < tiles_x; ++tx) {
+				int x = (int)(tx * TILE_W), w = std::min(TILE_W, width - x);
+				tileHashes[ty * tiles_x + tx] = TileHash64(curr_rgba + ((size_t)y * width + x) * 4, width * 4, w, h);
+			}
+		});
+		hashedWidth = width;
+		hashedHeight = height;
+	}
+
+	frameCounter++;
+	if (keyframe || frameCounter % 60 == 0) {
+		for (size_t ty = 0; ty < tiles_y; ++ty)
+			for (size_t tx = 0; tx < tiles_x; ++tx)
+				mark_dirty(tx, ty);
+	}
+	else if (hashDetect) {
+		if (hashesValid) {
+			// Tiles under a copy rect are checked against the moved content by line hashes
+			if (motionDetect) motion.Detect(moves);
+			for (size_t ty = 0; ty < tiles_y; ++ty) {
+				for (size_t tx = 0; tx < tiles_x; ++tx) {
+					int tileLeft = (int)(tx * TILE_W), tileTop = (int)(ty * TILE_H);
+					bool moved = false;
+					for (const CopyRect& m : moves)
+						moved |= tileLeft < m.dx + m.w && m.dx < tileLeft + TILE_W && tileTop < m.dy + m.h && m.dy < tileTop + TILE_H;
+					size_t tidx = ty * tiles_x + tx;
+					if (moved ? !motion.TileUnchanged(moves, (int)tx, (int)ty) : tileHashes[tidx] != prevTileHashes[tidx])
+						mark_dirty(tx, ty);
+				}
+			}
+		}
+		else {
+			for (size_t ty = 0; ty < tiles_y; ++ty)
+				for (size_t tx = 0; tx < tiles_x; ++tx)
+					mark_dirty(tx, ty);
+		}
+	}
+	else {
+		if (prevFrame) {
+			// Scrolled/moved regions are copied on both ends first; only what still differs is resent
+			if (motionDetect) motion.Detect(moves);
+			for (const CopyRect& m : moves)
+				ApplyCopyRect(prevFrame->Bits(), prevFrame->Pitch(), m);
+
+			const uint8_t* prev = prevFrame->Bits();
+			deltaBase = prev;
+			tileDirty.assign(numTiles, 0);
+			encodePool.ParallelFor(tiles_y, [&](size_t ty, int) {
+				size_t offset = ty * TILE_H * (size_t)width * 4;
+				CompareTileBand(prev + offset, curr_rgba + offset, (size_t)width * 4, width,
+					std::min(TILE_H, height - (int)(ty * TILE_H)), tileDirty.data() + ty * tiles_x);
+			});
+			for (size_t ty = 0; ty < tiles_y; ++ty)
+				for (size_t tx = 0; tx < tiles_x; ++tx)
+					if (tileDirty[ty * tiles_x + tx]) mark_dirty(tx, ty);
+		}
+		else {
+			for (size_t ty = 0; ty < tiles_y; ++ty)
+				for (size_t tx = 0; tx < tiles_x; ++tx)
+					mark_dirty(tx, ty);
+		}
+	}
+	detectNs += duration_cast<nanoseconds>(steady_clock::now() - detectStart).count();
+	detectTiles += numTiles;
+	scanTrace.End();
+	g_serverLatency.Stamp(frameSeq, STAGE_DIFF);
+
+	// A keyframe must not lean on anything a viewer starting there lacks
+	if (keyframe && tileCache) tileCache->Clear();
+
+	frame.seq = frameSeq;
+	frame.flags = keyframe ? FRAME_KEYFRAME : 0;
+	frame.width = width;
+	frame.height = height;
+	frame.cacheSlots = cacheSlots;
+	frame.Clear();
+	std::vector<uint8_t>& head = frame.head;
+	auto put_u32 = [&](uint32_t value) {
+		uint32_t net = htonl(value);
+		head.insert(head.end(), (const uint8_t*)&net, (const uint8_t*)&net + 4);
+	};
+
+	// --- Frame header: [u32 seq][u64 capture time, us, high word first][u32 flags] ---
+	// --- Copy-rect commands: [u32 count] then count x [sx sy dx dy w h] ---
+	put_u32(frameSeq);
+	put_u32((uint32_t)((uint64_t)captureUs >> 32));
+	put_u32((uint32_t)captureUs);
+	put_u32(frame.flags);
+	put_u32((uint32_t)moves.size());
+	for (const CopyRect& m : moves) {
+		const int32_t fields[6] = { m.sx, m.sy, m.dx, m.dy, m.w, m.h };
+		for (int32_t f : fields) put_u32((uint32_t)f);
+	}
+	if (!moves.empty())
+		SSDPRINTF("ScreenFrameEncoder: %zu copy rect(s), first %dx%d by (%d,%d)\n", moves.size(),
+			moves[0].w, moves[0].h, moves[0].dx - moves[0].sx, moves[0].dy - moves[0].sy);
+
+	xrleBitmask.resize(xrle_max_out(dirtyBitmask.size()));
+	size_t xrleBitmaskLen = xrle_compress(xrleBitmask.data(), dirtyBitmask.data(), dirtyBitmask.size());
+	put_u32((uint32_t)xrleBitmaskLen);
+	head.insert(head.end(), xrleBitmask.data(), xrleBitmask.data() + xrleBitmaskLen);
+	put_u32((uint32_t)dirtyTiles.size());
+	frame.AddPart(EncodedFrame::HEAD, 0, head.size());
+
+	auto tile_rect = [&](size_t i, int& x, int& y, int& w, int& h) {
+		x = dirtyTiles[i].first * TILE_W;
+		y = dirtyTiles[i].second * TILE_H;
+		w = std::min(TILE_W, width - x);
+		h = std::min(TILE_H, height - y);
+	};
+
+	// Resolve cache hits in tile order (the client replays the same sequence), then encode the misses
+	size_t nDirty = dirtyTiles.size();
+	encodedTiles.resize(nDirty);
+	encodeList.clear();
+	if (tileCache) {
+		tileKeys.resize(nDirty);
+		if (hashDetect) {
+			for (size_t i = 0; i < nDirty; ++i)
+				tileKeys[i] = tileHashes[dirtyTiles[i].second * tiles_x + dirtyTiles[i].first];
+		} else {
+			encodePool.ParallelFor(nDirty, [&](size_t i, int) {
+				int x, y, w, h;
+				tile_rect(i, x, y, w, h);
+				tileKeys[i] = TileHash64(curr_rgba + ((size_t)y * width + x) * 4, width * 4, w, h);
+			});
+		}
+		for (size_t i = 0; i < nDirty; ++i) {
+			uint32_t slot;
+			encodedTiles[i].cached = tileCache->Lookup(tileKeys[i], slot);
+			if (encodedTiles[i].cached) {
+				encodedTiles[i].cacheSlot = slot;
+			} else {
+				tileCache->Insert(tileKeys[i]);
+				encodeList.push_back(i);
+			}
+		}
+	} else {
+		for (size_t i = 0; i < nDirty; ++i) {
+			encodedTiles[i].cached = false;
+			encodeList.push_back(i);
+		}
+	}
+
+	for (size_t i : encodeList) encodedTiles[i].offset = NOT_PLACED;
+	size_t capacity = frame.records.size();
+	std::atomic<size_t> recordsUsed(0), recordsMissing(0);
+	auto encode_tile = [&](size_t j, int worker) {
+		size_t i = encodeList[j];
+		if (encodedTiles[i].offset != NOT_PLACED) return;
+		TileEncodeArena& arena = encodeArenas[worker];
+		int x, y, w, h;
+		tile_rect(i, x, y, w, h);
+		size_t size = codecChoice ? EncodeTileRecord(arena.record.data(), arena.scratch.data(), curr_rgba, deltaBase,
+			width, x, y, w, h, useXrle, recordFormat) :
+			EncodeTileRecordQoi(arena.record.data(), arena.scratch.data(), curr_rgba, width, x, y, w, h, useXrle, recordFormat);
+		encodedTiles[i].size = size;
+		size_t offset = recordsUsed.load(std::memory_order_relaxed);
+		while (offset + size <= capacity &&
+			!recordsUsed.compare_exchange_weak(offset, offset + size, std::memory_order_relaxed)) {
+		}
+		if (offset + size > capacity) {
+			recordsMissing.fetch_add(size, std::memory_order_relaxed);
+			return;
+		}
+		memcpy(frame.records.data() + offset, arena.record.data(), size);
+		encodedTiles[i].offset = offset;
+	};
+	encodePool.ParallelFor(encodeList.size(), "encode tiles", encode_tile);
+	// Larger than any frame before: the records grow to hold them all and the tiles that did not
+	// fit are encoded again (encoding a tile always gives the same record)
+	if (recordsMissing.load() > 0) {
+		capacity = std::max(capacity * 2, recordsUsed.load() + recordsMissing.load());
+		frame.records.resize(capacity);
+		encodePool.ParallelFor(encodeList.size(), "encode tiles", encode_tile);
+	}
+	g_serverLatency.Stamp(frameSeq, STAGE_ENCODE);
+
+	// How many parts the records merge into depends on the order the workers placed them in, so
+	// room is made for one per tile: the vector then only grows with the dirty count
+	frame.parts.reserve(frame.parts.size() + nDirty);
+	tileBytes = 0;
+	for (size_t i = 0; i < nDirty; ++i) {
+		const EncodedTile& tile = encodedTiles[i];
+		int x, y, w, h;
+		tile_rect(i, x, y, w, h);
+		g_metrics.Add(METRIC_SERVER_PIXEL_BYTES, (uint64_t)w * h * 4);
+		if (tile.cached) {
+			size_t at = head.size();
+			head.resize(at + TILE_HEADER_SIZE);
+			size_t size = FinishTileRecord(head.data() + at, recordFormat, x, y, w, h, TILE_CACHED, 0, tile.cacheSlot);
+			head.resize(at + size);
+			frame.AddPart(EncodedFrame::HEAD, at, size);
+			tileBytes += size;
+			g_metrics.Add(METRIC_SERVER_TILES_CACHED);
+		} else {
+			if (tile.size == 0) return false;
+			const uint8_t* record = frame.records.data() + tile.offset;
+			frame.AddPart(EncodedFrame::RECORDS, tile.offset, tile.size);
+			g_metrics.Add((MetricCounter)(METRIC_SERVER_TILES_RAW + (TileRecordType(record, recordFormat) & TILE_CODEC_MASK)));
+			tileBytes += tile.size;
+		}
+	}
+	if (hashDetect)
+		tileHashes.swap(prevTileHashes);
+	return true;
+}
@@ -0,0 +1,75 @@
+// Scatter-gather send for stream sockets: WSASend on Windows, sendmsg elsewhere.
+// Header only and free of the rest of Remote, so it can be tested on its own (tests/SendGatherTest.cpp).
+#pragma once
+
+#include <cstddef>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+typedef int SOCKET;
+#endif
+
+// A run of bytes handed to SendGather
+struct WireSlice {
+	const void* data;
+	size_t len;
+};
+
+// Sends slices back to back as one stream, handing the kernel up to 256 of them per call instead
+// of copying them together first; a partial write resumes mid-slice. slices is left as it was.
+inline bool SendGather(SOCKET s, const WireSlice* slices, size_t count) {
+	const size_t BATCH = 256;
+#ifdef _WIN32
+	WSABUF bufs[BATCH];
+#else
+	iovec bufs[BATCH];
+#endif
+	size_t first = 0, done = 0; // slices[first] has had done bytes sent
+	for (;;) {
+		while (first < count && done == slices[first].len) {
+			first++;
+			done = 0;
+		}
+		if (first == count) return true;
+
+		size_t n = 0;
+		for (size_t i = first; i < count && n < BATCH; ++i) {
+			const char* data = (const char*)slices[i].data + (i == first ? done : 0);
+			size_t len = slices[i].len - (i == first ? done : 0);
+			if (len == 0) continue;
+#ifdef _WIN32
+			bufs[n].buf = (char*)data;
+			bufs[n].len = (ULONG)len;
+#else
+			bufs[n].iov_base = (void*)data;
+			bufs[n].iov_len = len;
+#endif
+			n++;
+		}
+
+#ifdef _WIN32
+		DWORD sent = 0;
+		if (WSASend(s, bufs, (DWORD)n, &sent, 0, NULL, NULL) == SOCKET_ERROR || sent == 0) return false;
+#else
+		msghdr msg = {};
+		msg.msg_iov = bufs;
+		msg.msg_iovlen = n;
+		ssize_t sent = sendmsg(s, &msg, MSG_NOSIGNAL);
+		if (sent <= 0) return false;
+#endif
+		for (size_t left = (size_t)sent; left > 0; ) {
+			size_t rest = slices[first].len - done;
+			if (left < rest) {
+				done += left;
+				break;
+			}
+			left -= rest;
+			first++;
+			done = 0;
+		}
+	}
+}
@@ -0,0 +1,233 @@
+// Message framing on the sockets, and the inputs the client reads streams from: the socket
+// directly, through a ring buffer, or anything else that delivers the same bytes.
+// Header only and free of Win32, so the client's parsers can be driven on their own (tests/CorpusBench.cpp).
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+typedef int SOCKET;
+#endif
+
+// --- Stream inputs ---
+// Where the client's screen and audio parsers read from: the socket, or a recording being
+// replayed (--replay).
+class StreamInput {
+public:
+	virtual ~StreamInput() {}
+	// Reads exactly len bytes; false at the end of the stream or on an error
+	virtual bool Read(void* dst, size_t len) = 0;
+	// Reads exactly len bytes and returns where they are, valid until the next read, or null at
+	// the end of the stream or on an error. align (a power of two) is the alignment the bytes need.
+	// Inputs with a buffer of their own point into it; this fallback copies.
+	virtual const uint8_t* ReadSpan(size_t len, size_t align = 1) {
+		(void)align; // the vector's storage is aligned for anything
+		if (spanScratch.size() <= len) spanScratch.resize(len + 1); // never empty, so never null
+		return Read(spanScratch.data(), len) ? spanScratch.data() : nullptr;
+	}
+	// Local time for a capture time sent by the server; a replay substitutes when the bytes arrived
+	virtual int64_t CaptureTimeUs(int64_t serverUs) { return serverUs; }
+private:
+	std::vector<uint8_t> spanScratch;
+};
+
+// Reads straight from the socket, one recv() per field at least; see BufferedSocketInput
+class SocketInput : public StreamInput {
+	SOCKET skt;
+	uint64_t recvCalls = 0;
+public:
+	explicit SocketInput(SOCKET s) : skt(s) {}
+	bool Read(void* dst, size_t len) override {
+		for (size_t got = 0; got < len; ) {
+			int ret = recv(skt, (char*)dst + got, (int)(len - got), 0);
+			recvCalls++;
+			if (ret <= 0) return false;
+			got += ret;
+		}
+		return true;
+	}
+	uint64_t RecvCalls() const { return recvCalls; }
+};
+
+// === MESSAGE FRAMING ===
+// Everything on the input and screen sockets is a message: a MsgHeader, then length bytes of
+// payload. A reader dispatches on the type and skips what it does not handle, so there is never
+// a need to peek at the socket to find out what comes next.
+enum class MsgType : uint8_t {
+	Input = 0,       // one INPUT, client -> server
+	RemoteCtrl = 1,  // RemoteCtrlMsg, client -> server
+	Clipboard = 2,   // UTF-8 text, either way
+	ScreenCaps = 3,  // client -> server: [u32 ScreenCaps]
+	ScreenInfo = 4,  // server -> client: [u32 width][u32 height][u32 tile cache slots][u32 PixelFormat]
+	ScreenFrame = 5, // server -> client: one frame, see FrameFlags
+};
+constexpr uint8_t MSG_VERSION = 1;
+constexpr uint32_t MSG_MAX_LENGTH = 64u << 20;
+
+#pragma pack(push, 1)
+struct MsgHeader {
+	uint8_t version; // MSG_VERSION; a peer speaking another version is disconnected
+	MsgType type;
+	uint16_t flags;  // none defined yet, sent as 0
+	uint32_t length; // of the payload; flags and length are in network byte order on the wire
+};
+#pragma pack(pop)
+
+inline MsgHeader MakeMsgHeader(MsgType type, uint32_t length) {
+	MsgHeader header = { MSG_VERSION, type, 0, htonl(length) };
+	return header;
+}
+
+inline bool SendAll(SOCKET s, const void* data, size_t len) {
+	const char* p = (const char*)data;
+	while (len > 0) {
+		int sent = send(s, p, (int)std::min(len, (size_t)1 << 30), 0);
+		if (sent <= 0) return false;
+		p += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+// Sends one message. Small ones go out in a single send(), so messages from different threads
+// sharing a socket do not interleave.
+inline bool SendMsg(SOCKET s, MsgType type, const void* payload, uint32_t length) {
+	MsgHeader header = MakeMsgHeader(type, length);
+	char small[256];
+	if (sizeof(header) + length <= sizeof(small)) {
+		memcpy(small, &header, sizeof(header));
+		if (length) memcpy(small + sizeof(header), payload, length);
+		return SendAll(s, small, sizeof(header) + length);
+	}
+	return SendAll(s, &header, sizeof(header)) && SendAll(s, payload, length);
+}
+
+// Reads a socket through a ring buffer, 256 KB by default: every recv() takes as much as has
+// arrived, so a frame of small tile records costs a few calls instead of several per tile, and
+// ReadSpan hands out views of the buffer without copying. Unread bytes stay in place until a
+// span would run past the end; then they move back to the front, which is the only copy.
+class BufferedSocketInput : public StreamInput {
+	SOCKET skt;
+	std::vector<uint8_t> buffer;
+	size_t head = 0, tail = 0; // unread bytes are buffer[head, tail)
+	uint64_t recvCalls = 0;
+
+	// Makes len bytes available from head, starting on an align boundary
+	bool Fill(size_t len, size_t align) {
+		uint8_t* base = buffer.data();
+		if (head == tail) head = tail = 0;
+		if (head + len > buffer.size() || ((uintptr_t)(base + head) & (align - 1))) {
+			size_t front = (size_t)(0 - (uintptr_t)base) & (align - 1);
+			memmove(base + front, base + head, tail - head);
+			tail = front + (tail - head);
+			head = front;
+		}
+		while (tail - head < len) {
+			int got = recv(skt, (char*)base + tail, (int)(buffer.size() - tail), 0);
+			recvCalls++;
+			if (got <= 0) return false;
+			tail += (size_t)got;
+		}
+		return true;
+	}
+
+public:
+	explicit BufferedSocketInput(SOCKET s, size_t capacity = 256 * 1024) : skt(s), buffer(capacity) {}
+
+	bool Read(void* dst, size_t len) override {
+		uint8_t* out = (uint8_t*)dst;
+		size_t buffered = std::min(len, tail - head);
+		memcpy(out, buffer.data() + head, buffered);
+		head += buffered;
+		out += buffered;
+		len -= buffered;
+		if (len == 0) return true;
+		// A read larger than half the buffer goes straight to the destination
+		if (len > buffer.size() / 2) {
+			for (size_t got = 0; got < len; ) {
+				int ret = recv(skt, (char*)out + got, (int)(len - got), 0);
+				recvCalls++;
+				if (ret <= 0) return false;
+				got += ret;
+			}
+			return true;
+		}
+		if (!Fill(len, 1)) return false;
+		memcpy(out, buffer.data() + head, len);
+		head += len;
+		return true;
+	}
+
+	const uint8_t* ReadSpan(size_t len, size_t align = 1) override {
+		if (len + align > buffer.size()) return StreamInput::ReadSpan(len, align);
+		if (!Fill(len, align)) return nullptr;
+		const uint8_t* span = buffer.data() + head;
+		head += len;
+		return span;
+	}
+
+	uint64_t RecvCalls() const { return recvCalls; }
+};
+
+// Splits a stream into messages. The payload of the current message is read through Payload(),
+// which fails rather than read into the next message; whatever is left unread is skipped by Next().
+class MessageReader {
+	class PayloadInput : public StreamInput {
+		MessageReader& reader;
+	public:
+		explicit PayloadInput(MessageReader& r) : reader(r) {}
+		bool Read(void* dst, size_t len) override {
+			if (len > reader.remaining || !reader.in.Read(dst, len)) return false;
+			reader.remaining -= (uint32_t)len;
+			return true;
+		}
+		const uint8_t* ReadSpan(size_t len, size_t align) override {
+			if (len > reader.remaining) return nullptr;
+			const uint8_t* span = reader.in.ReadSpan(len, align);
+			if (span) reader.remaining -= (uint32_t)len;
+			return span;
+		}
+		int64_t CaptureTimeUs(int64_t serverUs) override { return reader.in.CaptureTimeUs(serverUs); }
+	};
+
+	StreamInput& in;
+	PayloadInput payload;
+	uint32_t remaining = 0; // unread bytes of the current payload
+public:
+	explicit MessageReader(StreamInput& input) : in(input), payload(*this) {}
+
+	// Moves to the next message and returns its header in host byte order. False at the end of
+	// the stream, or on a header of another version or with an implausible length.
+	bool Next(MsgHeader& header) {
+		char skip[4096];
+		while (remaining > 0) {
+			uint32_t n = std::min(remaining, (uint32_t)sizeof(skip));
+			if (!in.Read(skip, n)) return false;
+			remaining -= n;
+		}
+		if (!in.Read(&header, sizeof(header))) return false;
+		header.flags = ntohs(header.flags);
+		header.length = ntohl(header.length);
+		if (header.version != MSG_VERSION || header.length > MSG_MAX_LENGTH) return false;
+		remaining = header.length;
+		return true;
+	}
+
+	StreamInput& Payload() { return payload; }
+	uint32_t Remaining() const { return remaining; }
+
+	// The rest of the current payload as a string
+	bool ReadPayload(std::string& out) {
+		out.resize(remaining);
+		return remaining == 0 || payload.Read(&out[0], out.size());
+	}
+};
@@ -0,0 +1,467 @@
+// The screen stream's tile records and handshake values, the tile codecs on both ends, and the tile
+// content cache both ends keep in step. Header only and free of Win32, so the codecs can be
+// benchmarked on their own (tests/CorpusBench.cpp); see TileCompare.h for how xrle.h is included.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include "qoi.h"
+#include "xrle.h"
+#include "TileCompare.h"
+#include "Metrics.h"
+
+// --- Tile records ---
+// [u32 x][u32 y][u32 w][u32 h][u8 type][u32 payloadLen][u32 param] + payload. The low bits of
+// type pick the codec; with TILE_XRLE set the payload is XRLE of the codec body and param is the
+// body length, otherwise param equals payloadLen. Cache references carry their slot in param.
+// Pixel values are in the negotiated PixelFormat byte order in every codec.
+// The compact records of TILE_RECORD_V2 leave out what the client already knows: the position
+// follows from the tile's bit in the dirty bitmask and the size from the tile grid, and the lengths
+// are varints (7 bits per byte, low group first, high bit set on all but the last). They are
+// [u8 type][varint payloadLen][varint param, only with TILE_XRLE] + payload, and
+// [u8 TILE_CACHED][varint slot] for cache references. A TILE_QOI body there is bare QOI chunks
+// (qoi_decode_chunks_into), without the header and end marker.
+enum TileCodec : uint8_t {
+	TILE_RAW = 0,     // w*h pixels
+	TILE_SOLID = 1,   // a single pixel value
+	TILE_PALETTE = 2, // [u8 n][n pixels] + 1/2/4-bit indices, MSB first, rows back to back
+	TILE_QOI = 3,     // QOI image
+	TILE_XOR = 4,     // w*h pixels XORed with the ones already at x,y; always XRLE
+	TILE_CACHED = 5,  // tile cache slot param, no payload
+	TILE_CODEC_MASK = 0x7f,
+	TILE_XRLE = 0x80,
+};
+constexpr size_t TILE_HEADER_SIZE = 25;
+constexpr size_t TILE_HEADER_V2_BOUND = 1 + 5 + 5;
+static_assert(TILE_HEADER_V2_BOUND <= TILE_HEADER_SIZE, "compact headers are written over the room of a full one");
+enum TileRecordFormat { TILE_RECORD_V1 = 0, TILE_RECORD_V2 = 1 };
+static_assert(METRIC_SERVER_TILES_CACHED - METRIC_SERVER_TILES_RAW == TILE_CACHED - TILE_RAW, "one tile counter per codec");
+
+// Screen stream handshake: the client sends its ScreenCaps bits in a ScreenCaps message, and the
+// server answers with a ScreenInfo message: width, height, tile cache slots, the PixelFormat of
+// everything it sends and its TileRecordFormat. BGRA is the native order on both ends, so neither
+// has to swizzle; RGBA stays for clients without it, as do full tile records (servers from before
+// the tile format field send only the first four).
+enum ScreenCaps : uint32_t { SCREEN_CAP_BGRA = 1, SCREEN_CAP_TILE_V2 = 2 };
+enum PixelFormat { PIXEL_FORMAT_RGBA = 0, PIXEL_FORMAT_BGRA = 1 };
+// Every ScreenFrame payload then starts with [u32 seq][u64 capture time, us, high word first][u32 FrameFlags].
+// A keyframe depends on nothing sent before it: all of its tiles are sent, with no copy rects, XOR
+// deltas or cache references, and both ends empty the tile cache before its first tile.
+enum FrameFlags : uint32_t { FRAME_KEYFRAME = 1 };
+
+// Worst-case QOI size of one tile, and the room its wire record needs while it is encoded (the
+// payload is staged 8-byte aligned, for XRLE). No codec body is larger than the QOI bound.
+constexpr size_t TILE_QOI_BOUND = QOI_ENCODE_BOUND(TILE_W, TILE_H, 4);
+constexpr size_t TILE_RECORD_BOUND = TILE_HEADER_SIZE + 7 + xrle_max_out(TILE_QOI_BOUND);
+// Encoder scratch: two 8-byte aligned candidate bodies
+constexpr size_t TILE_SCRATCH_HALF = (TILE_QOI_BOUND + 7) & ~(size_t)7;
+constexpr size_t TILE_ENCODE_SCRATCH = 2 * TILE_SCRATCH_HALF;
+
+// --- Tile content cache ---
+// The server remembers the content hashes of recently sent tiles; a dirty tile whose content
+// is still cached goes out as a TILE_CACHED record naming its slot instead of a payload. The
+// client keeps the pixels of every slot. Slots are recycled in LRU order, and both ends replay
+// the same Touch/Insert sequence in tile order, so they always agree on the slot a newly sent
+// tile lands in without it ever being sent.
+constexpr size_t TILE_CACHE_SLOT_BYTES = TILE_W * TILE_H * 4;
+constexpr uint32_t MAX_TILE_CACHE_SLOTS = 1024 * 1024 * 1024 / TILE_CACHE_SLOT_BYTES; // 1 GB
+
+// Slot recency order, identical on both ends of the connection
+class TileCacheLru {
+private:
+	std::vector<uint32_t> prev, next;
+	uint32_t head = 0, tail = 0; // most / least recently used
+
+	void Unlink(uint32_t slot) {
+		if (slot == head) head = next[slot]; else next[prev[slot]] = next[slot];
+		if (slot == tail) tail = prev[slot]; else prev[next[slot]] = prev[slot];
+	}
+
+	void PushFront(uint32_t slot) {
+		prev[slot] = slot;
+		next[slot] = head;
+		prev[head] = slot;
+		head = slot;
+	}
+
+public:
+	explicit TileCacheLru(uint32_t slots) : prev(slots), next(slots) { Clear(); }
+
+	// Unused slots are the least recent ones, in ascending order
+	void Clear() {
+		uint32_t slots = Capacity();
+		for (uint32_t i = 0; i < slots; ++i) {
+			prev[i] = i ? i - 1 : 0;
+			next[i] = i + 1 < slots ? i + 1 : i;
+		}
+		head = 0;
+		tail = slots ? slots - 1 : 0;
+	}
+
+	uint32_t Capacity() const { return (uint32_t)prev.size(); }
+
+	void Touch(uint32_t slot) {
+		if (slot == head) return;
+		Unlink(slot);
+		PushFront(slot);
+	}
+
+	// Recycles the least recently used slot as the most recent one
+	uint32_t Insert() {
+		uint32_t slot = tail;
+		Touch(slot);
+		return slot;
+	}
+};
+
+// Server side: content hash -> slot, open addressing with backward-shift deletion
+class TileContentCache {
+private:
+	TileCacheLru lru;
+	std::vector<uint64_t> slotKey;
+	std::vector<uint8_t> slotUsed;
+	std::vector<uint64_t> tableKey;
+	std::vector<uint32_t> tableSlot; // slot + 1, 0 = empty
+	size_t mask;
+
+	size_t Home(uint64_t key) const { return (size_t)(key ^ (key >> 29)) & mask; }
+
+	size_t Find(uint64_t key) const {
+		for (size_t i = Home(key);; i = (i + 1) & mask) {
+			if (!tableSlot[i] || tableKey[i] == key) return i;
+		}
+	}
+
+	void Erase(uint64_t key) {
+		size_t i = Find(key);
+		if (!tableSlot[i]) return;
+		for (size_t j = (i + 1) & mask; tableSlot[j]; j = (j + 1) & mask) {
+			size_t home = Home(tableKey[j]);
+			// Move j back into the hole unless its home lies cyclically in (i, j]
+			bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+			if (!stays) {
+				tableKey[i] = tableKey[j];
+				tableSlot[i] = tableSlot[j];
+				i = j;
+			}
+		}
+		tableSlot[i] = 0;
+	}
+
+public:
+	uint64_t lookups = 0, hits = 0;
+
+	explicit TileContentCache(uint32_t slots) : lru(slots), slotKey(slots), slotUsed(slots) {
+		size_t tableSize = 16;
+		while (tableSize < (size_t)slots * 2) tableSize *= 2;
+		tableKey.resize(tableSize);
+		tableSlot.resize(tableSize);
+		mask = tableSize - 1;
+	}
+
+	uint32_t Capacity() const { return lru.Capacity(); }
+
+	// Forgets every tile, as at a keyframe
+	void Clear() {
+		lru.Clear();
+		std::fill(slotUsed.begin(), slotUsed.end(), 0);
+		std::fill(tableSlot.begin(), tableSlot.end(), 0);
+	}
+
+	// On a hit returns true with the slot, which becomes the most recently used
+	bool Lookup(uint64_t key, uint32_t& slot) {
+		lookups++;
+		size_t i = Find(key);
+		if (!tableSlot[i]) return false;
+		slot = tableSlot[i] - 1;
+		lru.Touch(slot);
+		hits++;
+		return true;
+	}
+
+	// Stores key in the least recently used slot (evicting its entry) and returns the slot
+	uint32_t Insert(uint64_t key) {
+		uint32_t slot = lru.Insert();
+		if (slotUsed[slot]) Erase(slotKey[slot]);
+		size_t i = Find(key);
+		if (tableSlot[i]) {
+			// Same content already cached under another slot; repoint to the new one
+			uint32_t old = tableSlot[i] - 1;
+			slotUsed[old] = 0;
+		}
+		tableKey[i] = key;
+		tableSlot[i] = slot + 1;
+		slotKey[slot] = key;
+		slotUsed[slot] = 1;
+		return slot;
+	}
+};
+
+// --- Tile codecs ---
+inline void WriteTileHeader(uint8_t* record, int x, int y, int w, int h, uint8_t type,
+	uint32_t payloadLen, uint32_t param) {
+	uint32_t rect[4] = { htonl(x), htonl(y), htonl(w), htonl(h) };
+	uint32_t lens[2] = { htonl(payloadLen), htonl(param) };
+	memcpy(record, rect, sizeof(rect));
+	record[16] = type;
+	memcpy(record + 17, lens, sizeof(lens));
+}
+
+inline size_t WriteVarint(uint8_t* out, uint32_t value) {
+	size_t n = 0;
+	while (value >= 0x80) {
+		out[n++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	out[n++] = (uint8_t)value;
+	return n;
+}
+
+// Where the payload of the record at record is encoded: the first 8-byte aligned address with
+// room for a full header in front, since XRLE stores a 64-bit word at a time
+inline uint8_t* TilePayloadStage(uint8_t* record) {
+	return (uint8_t*)(((uintptr_t)record + TILE_HEADER_SIZE + 7) & ~(uintptr_t)7);
+}
+
+// Writes the header of a record whose payload is staged at TilePayloadStage(record); the payload
+// then moves down to meet the header. Returns the record size.
+inline size_t FinishTileRecord(uint8_t* record, int recordFormat, int x, int y, int w, int h, uint8_t type,
+	uint32_t payloadLen, uint32_t param) {
+	size_t at;
+	if (recordFormat == TILE_RECORD_V1) {
+		WriteTileHeader(record, x, y, w, h, type, payloadLen, param);
+		at = TILE_HEADER_SIZE;
+	} else {
+		record[0] = type;
+		at = 1 + WriteVarint(record + 1, type == TILE_CACHED ? param : payloadLen);
+		if (type & TILE_XRLE) at += WriteVarint(record + at, param);
+	}
+	if (payloadLen) memmove(record + at, TilePayloadStage(record), payloadLen);
+	return at + payloadLen;
+}
+
+inline uint8_t TileRecordType(const uint8_t* record, int recordFormat) {
+	return recordFormat == TILE_RECORD_V1 ? record[16] : record[0];
+}
+
+// Encodes one tile of a 32bpp frame as a wire record with the cheapest codec for its content.
+// prev is the previous frame as the client already has it (after copy rects), or null when the
+// tile must not depend on it. record must hold TILE_RECORD_BOUND bytes and scratch
+// TILE_ENCODE_SCRATCH bytes. Returns the record size, or 0 if the tile could not be encoded.
+inline size_t EncodeTileRecord(uint8_t* record, uint8_t* scratch, const uint8_t* frame, const uint8_t* prev,
+	int frameWidth, int x, int y, int w, int h, bool useXrle, int recordFormat) {
+	const size_t stride = (size_t)frameWidth * 4;
+	const size_t origin = (size_t)y * stride + (size_t)x * 4;
+	const uint8_t* src = frame + origin;
+	const int pixels = w * h;
+	const size_t rawSize = (size_t)pixels * 4;
+	uint8_t* payload = TilePayloadStage(record);
+
+	// One pass of statistics: up to 16 distinct colors with the index of every pixel,
+	// and how many pixels differ from the previous frame
+	uint32_t palette[16];
+	uint8_t indices[TILE_W * TILE_H];
+	int colors = 0, last = 0, changed = 0;
+	for (int row = 0; row < h; ++row) {
+		const uint32_t* p = (const uint32_t*)(src + row * stride);
+		if (prev) {
+			const uint32_t* q = (const uint32_t*)(prev + origin + row * stride);
+			for (int col = 0; col < w; ++col) changed += p[col] != q[col];
+		}
+		for (int col = 0; col < w && colors <= 16; ++col) {
+			uint32_t c = p[col];
+			if (colors == 0 || palette[last] != c) {
+				last = 0;
+				while (last < colors && palette[last] != c) ++last;
+				if (last == colors) {
+					if (colors == 16) { colors = 17; break; }
+					palette[colors++] = c;
+				}
+			}
+			indices[row * w + col] = (uint8_t)last;
+		}
+	}
+
+	if (colors == 1) {
+		memcpy(payload, palette, 4);
+		return FinishTileRecord(record, recordFormat, x, y, w, h, TILE_SOLID, 4, 4);
+	}
+
+	uint8_t type = TILE_RAW;
+	const uint8_t* body = nullptr;
+	size_t bodySize = rawSize;
+
+	if (colors <= 16) {
+		const int bits = colors <= 2 ? 1 : colors <= 4 ? 2 : 4;
+		uint8_t* out = scratch;
+		out[0] = (uint8_t)colors;
+		memcpy(out + 1, palette, colors * 4);
+		uint8_t* packed = out + 1 + colors * 4;
+		size_t packedSize = ((size_t)pixels * bits + 7) / 8;
+		memset(packed, 0, packedSize);
+		for (int i = 0; i < pixels; ++i) {
+			int bit = i * bits;
+			packed[bit >> 3] |= indices[i] << (8 - bits - (bit & 7));
+		}
+		size_t size = 1 + colors * 4 + packedSize;
+		if (size < bodySize) { type = TILE_PALETTE; body = out; bodySize = size; }
+	}
+
+	// Up to four colors the packed indices are hard to beat; anything richer also tries QOI
+	if (colors > 4) {
+		qoi_desc desc;
+		desc.width = w;
+		desc.height = h;
+		desc.channels = 4;
+		desc.colorspace = QOI_SRGB;
+		uint8_t* out = scratch + TILE_SCRATCH_HALF;
+		size_t size = qoi_encode_into(out, (int)TILE_QOI_BOUND, src, (int)stride, &desc);
+		if (size == 0) return 0;
+		if (recordFormat == TILE_RECORD_V2) {
+			// Size and channels are known to the client; keep the chunks at the aligned start for XRLE
+			size -= QOI_CHUNKS_OFFSET + QOI_CHUNKS_TRAILER;
+			memmove(out, out + QOI_CHUNKS_OFFSET, size);
+		}
+		if (size < bodySize) { type = TILE_QOI; body = out; bodySize = size; }
+	}
+
+	// A small change on top of the previous content leaves mostly zero words after XOR,
+	// which XRLE collapses; it is compressed straight into the payload
+	if (prev && changed * 4 <= pixels) {
+		uint32_t* delta = (uint32_t*)(body == scratch ? scratch + TILE_SCRATCH_HALF : scratch);
+		for (int row = 0; row < h; ++row) {
+			const uint32_t* p = (const uint32_t*)(src + row * stride);
+			const uint32_t* q = (const uint32_t*)(prev + origin + row * stride);
+			for (int col = 0; col < w; ++col) delta[row * w + col] = p[col] ^ q[col];
+		}
+		size_t size = xrle_compress(payload, (const uint8_t*)delta, rawSize);
+		if (size < bodySize) {
+			return FinishTileRecord(record, recordFormat, x, y, w, h, TILE_XOR | TILE_XRLE, (uint32_t)size, (uint32_t)rawSize);
+		}
+	}
+
+	if (type == TILE_RAW) {
+		uint8_t* out = scratch;
+		for (int row = 0; row < h; ++row)
+			memcpy(out + row * w * 4, src + row * stride, w * 4);
+		body = out;
+	}
+
+	if (useXrle) {
+		size_t size = xrle_compress(payload, body, bodySize);
+		if (size < bodySize) {
+			return FinishTileRecord(record, recordFormat, x, y, w, h, type | TILE_XRLE, (uint32_t)size, (uint32_t)bodySize);
+		}
+	}
+	memcpy(payload, body, bodySize);
+	return FinishTileRecord(record, recordFormat, x, y, w, h, type, (uint32_t)bodySize, (uint32_t)bodySize);
+}
+
+// Encodes one tile the way every tile was before the codec was picked per tile: QOI, then XRLE
+// of it when that is smaller. Kept for measuring what the choice saves (tests/CorpusBench.cpp).
+inline size_t EncodeTileRecordQoi(uint8_t* record, uint8_t* scratch, const uint8_t* frame, int frameWidth,
+	int x, int y, int w, int h, bool useXrle, int recordFormat) {
+	const size_t stride = (size_t)frameWidth * 4;
+	const uint8_t* src = frame + (size_t)y * stride + (size_t)x * 4;
+	uint8_t* payload = TilePayloadStage(record);
+	qoi_desc desc;
+	desc.width = w;
+	desc.height = h;
+	desc.channels = 4;
+	desc.colorspace = QOI_SRGB;
+	size_t size = qoi_encode_into(scratch, (int)TILE_QOI_BOUND, src, (int)stride, &desc);
+	if (size == 0) return 0;
+	if (recordFormat == TILE_RECORD_V2) {
+		size -= QOI_CHUNKS_OFFSET + QOI_CHUNKS_TRAILER;
+		memmove(scratch, scratch + QOI_CHUNKS_OFFSET, size);
+	}
+	if (useXrle) {
+		size_t packed = xrle_compress(payload, scratch, size);
+		if (packed < size) return FinishTileRecord(record, recordFormat, x, y, w, h, TILE_QOI | TILE_XRLE, (uint32_t)packed, (uint32_t)size);
+	}
+	memcpy(payload, scratch, size);
+	return FinishTileRecord(record, recordFormat, x, y, w, h, TILE_QOI, (uint32_t)size, (uint32_t)size);
+}
+
+// Decodes a tile body of the given codec into BGRA pixels at dst; TILE_XOR applies the delta to
+// what is already there. The body is in pixelFormat order and as recordFormat encodes it; a bare
+// QOI body needs QOI_CHUNKS_TRAILER readable bytes after it. Returns false if it does not fit a
+// w x h tile.
+inline bool DecodeTileBody(uint8_t codec, const uint8_t* body, size_t bodySize, uint8_t* dst, int pitch, int w, int h,
+	int pixelFormat, int recordFormat) {
+	const size_t pixels = (size_t)w * h;
+	const bool swizzle = pixelFormat == PIXEL_FORMAT_RGBA;
+	auto bgra = [swizzle](uint32_t px) -> uint32_t {
+		return swizzle ? (px & 0xFF00FF00u) | ((px & 0xFFu) << 16) | ((px >> 16) & 0xFFu) : px;
+	};
+
+	switch (codec) {
+	case TILE_RAW:
+	case TILE_XOR: {
+		if (bodySize != pixels * 4) return false;
+		const uint32_t* src = (const uint32_t*)body;
+		for (int row = 0; row < h; ++row) {
+			uint32_t* out = (uint32_t*)(dst + (size_t)row * pitch);
+			if (codec == TILE_RAW)
+				for (int col = 0; col < w; ++col) out[col] = bgra(src[col]);
+			else
+				for (int col = 0; col < w; ++col) out[col] ^= bgra(src[col]);
+			src += w;
+		}
+		return true;
+	}
+	case TILE_SOLID: {
+		if (bodySize != 4) return false;
+		uint32_t rgba;
+		memcpy(&rgba, body, 4);
+		uint32_t c = bgra(rgba);
+		for (int row = 0; row < h; ++row) {
+			uint32_t* out = (uint32_t*)(dst + (size_t)row * pitch);
+			for (int col = 0; col < w; ++col) out[col] = c;
+		}
+		return true;
+	}
+	case TILE_PALETTE: {
+		if (bodySize < 1) return false;
+		int colors = body[0];
+		if (colors < 1 || colors > 16) return false;
+		const int bits = colors <= 2 ? 1 : colors <= 4 ? 2 : 4;
+		if (bodySize != 1 + colors * 4 + (pixels * bits + 7) / 8) return false;
+		uint32_t palette[16];
+		memcpy(palette, body + 1, colors * 4);
+		for (int i = 0; i < colors; ++i) palette[i] = bgra(palette[i]);
+		for (int i = colors; i < 16; ++i) palette[i] = palette[0];
+		const uint8_t* packed = body + 1 + colors * 4;
+		const int mask = (1 << bits) - 1;
+		size_t i = 0;
+		for (int row = 0; row < h; ++row) {
+			uint32_t* out = (uint32_t*)(dst + (size_t)row * pitch);
+			for (int col = 0; col < w; ++col, ++i) {
+				size_t bit = i * bits;
+				out[col] = palette[(packed[bit >> 3] >> (8 - bits - (bit & 7))) & mask];
+			}
+		}
+		return true;
+	}
+	case TILE_QOI: {
+		qoi_desc desc;
+		if (recordFormat == TILE_RECORD_V2) {
+			desc.width = w;
+			desc.height = h;
+			return qoi_decode_chunks_into(body, (int)bodySize, &desc, dst, pitch, 4, swizzle ? QOI_DECODE_BGR : 0) != 0;
+		}
+		return qoi_decode_into(body, (int)bodySize, &desc, dst, pitch, w, h, 4, swizzle ? QOI_DECODE_BGR : 0) &&
+			desc.width == (unsigned int)w && desc.height == (unsigned int)h;
+	}
+	}
+	return false;
+}
@@ -0,0 +1,123 @@
+// Dirty tile detection: which 32x32 tiles of a 32bpp frame differ from the previous frame.
+// Header only and free of Win32, so it can be tested on its own (tests/TileCompareBench.cpp).
+// The AVX2 kernel is picked when xrle_simd_level() reports AVX2; a C++ file that links a C build
+// of xrle.c includes xrle.h inside extern "C" before this header.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "xrle.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define TILE_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#define TILE_TARGET_AVX2
+#else
+#define TILE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define TILE_SIMD_X86 0
+#endif
+
+// --- DIRTY TILE STRUCT ---
+struct DirtyTile {
+	int left, top, right, bottom;
+};
+
+constexpr int TILE_W = 32;
+constexpr int TILE_H = 32;
+
+// --- Dirty tile comparison ---
+// Compares one band (tile row) of two 32bpp frames and sets dirty[tx] for every tile of the band
+// that differs. The band is walked a scanline at a time across its whole width, so both frames
+// stream through memory in order; tiles already found dirty are skipped, and the walk stops as
+// soon as no clean tile is left. dirty must hold one entry per tile of the band.
+static_assert(TILE_W % 8 == 0, "tiles are compared in 32-byte chunks");
+
+inline void CompareTileBand_Scalar(const uint8_t* prev, const uint8_t* curr, size_t stride, int width, int rows, uint8_t* dirty) {
+	int tilesX = (width + TILE_W - 1) / TILE_W;
+	int clean = 0;
+	for (int tx = 0; tx < tilesX; ++tx) clean += !dirty[tx];
+	for (int y = 0; y < rows && clean; ++y) {
+		const uint8_t* p = prev + y * stride;
+		const uint8_t* c = curr + y * stride;
+		for (int tx = 0; tx < tilesX; ++tx) {
+			if (dirty[tx]) continue;
+			int x = tx * TILE_W, bytes = std::min(TILE_W, width - x) * 4;
+			if (memcmp(p + x * 4, c + x * 4, bytes) != 0) {
+				dirty[tx] = 1;
+				clean--;
+			}
+		}
+	}
+}
+
+#if TILE_SIMD_X86
+TILE_TARGET_AVX2 inline void CompareTileBand_AVX2(const uint8_t* prev, const uint8_t* curr, size_t stride, int width, int rows, uint8_t* dirty) {
+	int tilesX = (width + TILE_W - 1) / TILE_W;
+	int fullTiles = width / TILE_W;
+	int clean = 0;
+	for (int tx = 0; tx < tilesX; ++tx) clean += !dirty[tx];
+	for (int y = 0; y < rows && clean; ++y) {
+		const uint8_t* p = prev + y * stride;
+		const uint8_t* c = curr + y * stride;
+		for (int tx = 0; tx < fullTiles; ++tx) {
+			if (dirty[tx]) continue;
+			const __m256i* a = (const __m256i*)(p + tx * TILE_W * 4);
+			const __m256i* b = (const __m256i*)(c + tx * TILE_W * 4);
+			__m256i diff = _mm256_xor_si256(_mm256_loadu_si256(a), _mm256_loadu_si256(b));
+			for (int k = 1; k < TILE_W / 8; ++k)
+				diff = _mm256_or_si256(diff, _mm256_xor_si256(_mm256_loadu_si256(a + k), _mm256_loadu_si256(b + k)));
+			if (!_mm256_testz_si256(diff, diff)) {
+				dirty[tx] = 1;
+				clean--;
+			}
+		}
+		if (fullTiles < tilesX && !dirty[fullTiles]) {
+			int x = fullTiles * TILE_W;
+			if (memcmp(p + x * 4, c + x * 4, (width - x) * 4) != 0) {
+				dirty[fullTiles] = 1;
+				clean--;
+			}
+		}
+	}
+}
+#endif
+
+inline void CompareTileBand(const uint8_t* prev, const uint8_t* curr, size_t stride, int width, int rows, uint8_t* dirty) {
+#if TILE_SIMD_X86
+	if (xrle_simd_level() >= XRLE_SIMD_AVX2) {
+		CompareTileBand_AVX2(prev, curr, stride, width, rows, dirty);
+		return;
+	}
+#endif
+	CompareTileBand_Scalar(prev, curr, stride, width, rows, dirty);
+}
+
+/**
+ * Compare two 32bpp RGBA framebuffers and collect dirty tiles, one band of tiles at a time.
+ */
+inline void detect_dirty_tiles(
+	const uint32_t* prev, const uint32_t* curr, int width, int height,
+	std::vector<DirtyTile>& out_tiles
+) {
+	out_tiles.clear();
+	int tilesX = (width + TILE_W - 1) / TILE_W;
+	std::vector<uint8_t> dirty(tilesX);
+	for (int ty = 0; ty < height; ty += TILE_H) {
+		int th = std::min(TILE_H, height - ty);
+		std::fill(dirty.begin(), dirty.end(), 0);
+		CompareTileBand((const uint8_t*)(prev + (size_t)ty * width), (const uint8_t*)(curr + (size_t)ty * width),
+			(size_t)width * 4, width, th, dirty.data());
+		for (int i = 0; i < tilesX; ++i) {
+			if (dirty[i]) {
+				int tx = i * TILE_W;
+				out_tiles.push_back({ tx, ty, std::min(width, tx + TILE_W), ty + th });
+			}
+		}
+	}
+}
@@ -0,0 +1,111 @@
+// 64-bit tile content hashes, used to find changed tiles without a copy of the previous frame
+// and as tile cache keys. Header only and free of Win32, so it can be benchmarked on its own
+// (tests/TileHashBench.cpp); see TileCompare.h for how xrle.h is included.
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "TileCompare.h"
+
+inline uint64_t TileHashMix(uint64_t hash, uint64_t v) {
+	hash ^= v * 0x9E3779B97F4A7C15ull;
+	hash = (hash << 31) | (hash >> 33);
+	return hash * 0xC2B2AE3D27D4EB4Full;
+}
+
+// --- Tile hashing ---
+// 64-bit content hash of a w x h rectangle of a 32bpp image (the size is part of the hash), in
+// the style of XXH3: four 64-bit lanes take 32-byte stripes, each adding lo32 * hi32 of the
+// keyed input plus the neighbouring input word. The lanes are scrambled after every row, so
+// row order matters, and folded at the end. The AVX2 and scalar paths compute the same hash.
+alignas(32) static const uint64_t TILE_HASH_KEYS[4][4] = {
+	{ 0xBE4BA423396CFEB8ull, 0x1CAD21F72C81017Cull, 0xDB979083E96DD4DEull, 0x1F67B3B7A4A44072ull },
+	{ 0x78E5C0CC4EE679CBull, 0x2172FFCC7DD05A82ull, 0x8E2443F7744608B8ull, 0x4C263A81E69035E0ull },
+	{ 0xCB00C391BB52283Cull, 0xA32E531B8B65D088ull, 0x4EF90DA297486471ull, 0xD8ACDEA946EF1938ull },
+	{ 0x3F349CE33F76FAA8ull, 0x1D4F0BC7C7BBDCF9ull, 0x3159B4CD4BE0518Aull, 0x647378D9C97E9FC8ull },
+};
+alignas(32) static const uint64_t TILE_HASH_SCRAMBLE[4] = {
+	0xC3EBD33483ACC5EAull, 0xEB6313FAFFA081C5ull, 0x49DAF0B751DD0D17ull, 0x9E68D429265516D3ull,
+};
+alignas(32) static const uint64_t TILE_HASH_SEEDS[4] = {
+	0x9E3779B185EBCA87ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0x85EBCA77C2B2AE63ull,
+};
+constexpr uint32_t TILE_HASH_PRIME = 0x9E3779B1u;
+static_assert(TILE_W * 4 <= sizeof(TILE_HASH_KEYS[0]) * 4, "one hash key per 32-byte stripe of a tile row");
+
+inline uint64_t TileHashFold(const uint64_t acc[4], int w, int h) {
+	uint64_t hash = 0x27D4EB2F165667C5ull ^ ((uint64_t)w << 32 | (uint32_t)h);
+	for (int i = 0; i < 4; ++i) hash = TileHashMix(hash, acc[i]);
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDull;
+	hash ^= hash >> 29;
+	return hash;
+}
+
+inline uint64_t TileHash64_Scalar(const uint8_t* src, int stride, int w, int h) {
+	uint64_t acc[4] = { TILE_HASH_SEEDS[0], TILE_HASH_SEEDS[1], TILE_HASH_SEEDS[2], TILE_HASH_SEEDS[3] };
+	int rowBytes = w * 4;
+	for (int y = 0; y < h; ++y) {
+		const uint8_t* row = src + (size_t)y * stride;
+		for (int k = 0, i = 0; i < rowBytes; ++k, i += 32) {
+			uint64_t d[4];
+			if (i + 32 <= rowBytes) {
+				memcpy(d, row + i, 32);
+			} else {
+				memset(d, 0, 32);
+				memcpy(d, row + i, rowBytes - i);
+			}
+			for (int l = 0; l < 4; ++l) {
+				uint64_t dk = d[l] ^ TILE_HASH_KEYS[k][l];
+				acc[l] += d[l ^ 1] + (dk & 0xFFFFFFFFu) * (dk >> 32);
+			}
+		}
+		for (int l = 0; l < 4; ++l)
+			acc[l] = (acc[l] ^ (acc[l] >> 47) ^ TILE_HASH_SCRAMBLE[l]) * TILE_HASH_PRIME;
+	}
+	return TileHashFold(acc, w, h);
+}
+
+#if TILE_SIMD_X86
+TILE_TARGET_AVX2 inline uint64_t TileHash64_AVX2(const uint8_t* src, int stride, int w, int h) {
+	__m256i acc = _mm256_load_si256((const __m256i*)TILE_HASH_SEEDS);
+	const __m256i scramble = _mm256_load_si256((const __m256i*)TILE_HASH_SCRAMBLE);
+	const __m256i prime = _mm256_set1_epi64x(TILE_HASH_PRIME);
+	int rowBytes = w * 4, fullBytes = rowBytes & ~31;
+	for (int y = 0; y < h; ++y) {
+		const uint8_t* row = src + (size_t)y * stride;
+		int k = 0, i = 0;
+		for (; i < rowBytes; ++k, i += 32) {
+			__m256i d;
+			if (i < fullBytes) {
+				d = _mm256_loadu_si256((const __m256i*)(row + i));
+			} else {
+				alignas(32) uint8_t tail[32] = {};
+				memcpy(tail, row + i, rowBytes - i);
+				d = _mm256_load_si256((const __m256i*)tail);
+			}
+			__m256i dk = _mm256_xor_si256(d, _mm256_load_si256((const __m256i*)TILE_HASH_KEYS[k]));
+			__m256i product = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+			__m256i swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+			acc = _mm256_add_epi64(acc, _mm256_add_epi64(swapped, product));
+		}
+		acc = _mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47));
+		acc = _mm256_xor_si256(acc, scramble);
+		__m256i lo = _mm256_mul_epu32(acc, prime);
+		__m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(acc, 32), prime);
+		acc = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+	}
+	alignas(32) uint64_t lanes[4];
+	_mm256_store_si256((__m256i*)lanes, acc);
+	return TileHashFold(lanes, w, h);
+}
+#endif
+
+// w must not exceed TILE_W
+inline uint64_t TileHash64(const uint8_t* src, int stride, int w, int h) {
+#if TILE_SIMD_X86
+	if (xrle_simd_level() >= XRLE_SIMD_AVX2) return TileHash64_AVX2(src, stride, w, h);
+#endif
+	return TileHash64_Scalar(src, stride, w, h);
+}
@@ -0,0 +1,136 @@
+// Hand-over of decoded frames from the decode thread to the window's paint loop.
+// Header only and free of Win32, so it can be stress-tested on its own (tests/TripleFrameBufferTest.cpp).
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// A changed region of a frame, in frame pixels
+struct DamageRect {
+	int x, y, w, h;
+};
+
+// Single-producer/single-consumer triple buffer of frames. The writer owns one buffer, the
+// reader another, and the third is handed over through a single atomic word packing its index
+// with the generation of the frame in it. Publishing exchanges the writer's finished buffer into
+// that word; reading swaps the reader's buffer in only when the word carries a newer generation.
+// Neither side can ever get hold of the buffer the other is using, so the writer may reallocate
+// its own buffer freely, and a reader that is up to date takes nothing and copies nothing.
+class TripleFrameBuffer {
+public:
+	struct Frame {
+		std::vector<uint8_t> pixels;     // width * height BGRA pixels, unpadded
+		int width = 0, height = 0;
+		uint64_t timestamp = 0;          // steady_clock milliseconds at publication
+		uint64_t generation = 0;         // 1 for the first frame published, +1 for each after it
+		std::vector<DamageRect> damage;  // what changed relative to generation - 1
+	};
+
+private:
+	static const uint64_t INDEX_MASK = 3;
+	static uint64_t Pack(uint64_t generation, int index) { return (generation << 2) | (uint64_t)index; }
+
+	Frame frames[3];
+	std::atomic<uint64_t> shared{Pack(0, 1)};
+
+	// Writer side
+	int back = 0;
+	uint64_t generation = 0;
+	int publishedWidth = 0, publishedHeight = 0;
+	std::vector<DamageRect> pending[3]; // damage published since each buffer was last written
+	size_t pendingArea[3] = { 0, 0, 0 }; // pixels covered by pending, overlaps counted twice
+	bool stale[3] = { true, true, true }; // contents unusable, the next write copies everything
+
+	// Reader side
+	int front = 2;
+	uint64_t frontGeneration = 0;
+
+	// Beyond this many outstanding rects a buffer is recopied whole instead
+	static const size_t MAX_PENDING_DAMAGE = 4096;
+
+	static size_t DamageArea(const std::vector<DamageRect>& rects) {
+		size_t area = 0;
+		for (const DamageRect& r : rects) area += (size_t)r.w * r.h;
+		return area;
+	}
+
+public:
+	// Writer: publishes a frame of which only `damage` changed since the previous one. The
+	// buffers persist between frames, so the writer's buffer is brought up to date by copying just
+	// the rects it has missed: the cost follows the number of changed tiles, not the frame size.
+	void Publish(int width, int height, const uint8_t* srcData, const std::vector<DamageRect>& damage) {
+		Frame& frame = frames[back];
+		size_t requiredSize = (size_t)width * height * 4;
+		size_t pitch = (size_t)width * 4;
+		size_t damageArea = DamageArea(damage);
+
+		if (width != publishedWidth || height != publishedHeight) {
+			for (bool& s : stale) s = true;
+			publishedWidth = width;
+			publishedHeight = height;
+		}
+		for (int i = 0; i < 3; ++i) {
+			if (i == back || stale[i]) continue;
+			if (pending[i].size() + damage.size() > MAX_PENDING_DAMAGE) {
+				stale[i] = true;
+				pending[i].clear();
+				pendingArea[i] = 0;
+			} else {
+				pending[i].insert(pending[i].end(), damage.begin(), damage.end());
+				pendingArea[i] += damageArea;
+			}
+		}
+
+		if (frame.pixels.size() != requiredSize) {
+			frame.pixels.resize(requiredSize);
+			stale[back] = true;
+		}
+		uint8_t* dst = frame.pixels.data();
+		auto copyRects = [&](const std::vector<DamageRect>& rects) {
+			for (const DamageRect& r : rects) {
+				size_t offset = (size_t)r.y * pitch + (size_t)r.x * 4;
+				for (int row = 0; row < r.h; ++row)
+					memcpy(dst + offset + row * pitch, srcData + offset + row * pitch, (size_t)r.w * 4);
+			}
+		};
+		// Scattered rows stop paying off well before the damage covers the frame
+		if (stale[back] || (pendingArea[back] + damageArea) * 2 >= (size_t)width * height) {
+			memcpy(dst, srcData, requiredSize);
+			stale[back] = false;
+		} else {
+			copyRects(pending[back]);
+			copyRects(damage);
+		}
+		pending[back].clear();
+		pendingArea[back] = 0;
+
+		frame.width = width;
+		frame.height = height;
+		frame.timestamp = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+		frame.generation = ++generation;
+		frame.damage.assign(damage.begin(), damage.end());
+
+		// Hand the frame over and take back whichever buffer was in the shared word
+		uint64_t previous = shared.exchange(Pack(generation, back), std::memory_order_acq_rel);
+		back = (int)(previous & INDEX_MASK);
+	}
+
+	// Reader: the most recent frame, or null before the first one. The frame stays valid and
+	// unchanged until the next call; callers compare its generation with what they last showed.
+	const Frame* Latest() {
+		uint64_t current = shared.load(std::memory_order_acquire);
+		while ((current >> 2) != frontGeneration) {
+			// Give back the buffer already shown under the generation just seen, so it is not taken twice
+			if (shared.compare_exchange_weak(current, Pack(current >> 2, front), std::memory_order_acq_rel, std::memory_order_acquire)) {
+				front = (int)(current & INDEX_MASK);
+				frontGeneration = current >> 2;
+				break;
+			}
+		}
+		return frontGeneration ? &frames[front] : nullptr;
+	}
+};
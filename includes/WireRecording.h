@@ -0,0 +1,352 @@
+// Recording the bytes the server sends, and replaying them through the client's parsers.
+// Header only and free of Win32, so recorded sessions can be replayed and benchmarked without a
+// window (tests/ReplayBench.cpp).
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "SendGather.h"
+#include "StreamInput.h"
+#include "Metrics.h"
+#include "FramePresenter.h"
+#include "ParallelFrameDecoder.h"
+#include "AudioStream.h"
+
+// --- Wire recording ---
+// --record PATH tees every byte the server sends on the screen and audio sockets into one file,
+// so a session can be replayed through the client without a network or a window (--replay).
+// The file is "RWIRE01\n" followed by chunks: a WireChunk header, then len bytes exactly as they
+// were handed to send(). Fields are in host byte order; us counts from the start of the recording.
+enum WireKind : uint8_t { WIRE_SCREEN = 0, WIRE_AUDIO = 1 };
+static const char WIRE_MAGIC[8] = { 'R', 'W', 'I', 'R', 'E', '0', '1', '\n' };
+#pragma pack(push, 1)
+struct WireChunk {
+	int64_t us;
+	uint32_t stream; // one per connection, in the order they were accepted
+	uint8_t kind;    // WireKind
+	uint32_t len;
+};
+#pragma pack(pop)
+
+class WireRecorder {
+	std::mutex fileMutex;
+	std::ofstream file;
+	int64_t startUs = 0;
+	std::atomic<bool> open{false};
+	std::atomic<uint32_t> streams{0};
+public:
+	bool Open(const std::string& path) {
+		std::lock_guard<std::mutex> lock(fileMutex);
+		file.open(path, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) return false;
+		file.write(WIRE_MAGIC, sizeof(WIRE_MAGIC));
+		startUs = LatencyNowUs();
+		open = true;
+		return true;
+	}
+
+	bool IsOpen() const { return open.load(std::memory_order_relaxed); }
+
+	// Id for the chunks of a new connection
+	uint32_t NewStream() { return streams.fetch_add(1); }
+
+	void Write(uint32_t stream, WireKind kind, const void* data, size_t len) {
+		if (!IsOpen() || len == 0) return;
+		std::lock_guard<std::mutex> lock(fileMutex);
+		WireChunk chunk = { LatencyNowUs() - startUs, stream, (uint8_t)kind, (uint32_t)len };
+		file.write((const char*)&chunk, sizeof(chunk));
+		file.write((const char*)data, len);
+	}
+
+	// One chunk of everything in slices, as SendGather sends it
+	void Write(uint32_t stream, WireKind kind, const WireSlice* slices, size_t count) {
+		if (!IsOpen()) return;
+		size_t len = 0;
+		for (size_t i = 0; i < count; ++i) len += slices[i].len;
+		if (len == 0) return;
+		std::lock_guard<std::mutex> lock(fileMutex);
+		WireChunk chunk = { LatencyNowUs() - startUs, stream, (uint8_t)kind, (uint32_t)len };
+		file.write((const char*)&chunk, sizeof(chunk));
+		for (size_t i = 0; i < count; ++i) file.write((const char*)slices[i].data, slices[i].len);
+	}
+
+	void Flush() {
+		if (!IsOpen()) return;
+		std::lock_guard<std::mutex> lock(fileMutex);
+		file.flush();
+	}
+};
+
+// --- Wire replay ---
+// --replay PATH feeds a --record file through the client's screen and audio parsers with no socket
+// and no window: the screen stream is decoded by ParallelFrameDecoder into a MemoryPresenter and
+// the audio packets are decompressed but not played. By default the bytes are read as fast as the
+// client takes them; --replay-speed recorded delivers every chunk at the time it was sent. Frame
+// latency then counts from when a frame's header would have arrived rather than from the server's
+// clock. The hash of the final framebuffer makes two replays of one recording comparable.
+
+// The chunks of one connection of a recording, joined back into a byte stream
+struct WireStream {
+	uint32_t id = 0;
+	WireKind kind = WIRE_SCREEN;
+	std::vector<uint8_t> bytes;
+	std::vector<std::pair<size_t, int64_t>> chunkEnds; // end offset of each chunk in bytes, its time
+};
+
+inline bool LoadWireRecording(const std::string& path, std::vector<WireStream>& streams) {
+	std::ifstream file(path, std::ios::binary);
+	char magic[sizeof(WIRE_MAGIC)];
+	if (!file.read(magic, sizeof(magic)) || memcmp(magic, WIRE_MAGIC, sizeof(magic)) != 0) return false;
+	WireChunk chunk;
+	while (file.read((char*)&chunk, sizeof(chunk))) {
+		if (chunk.kind > WIRE_AUDIO) return false;
+		auto it = std::find_if(streams.begin(), streams.end(), [&](const WireStream& s) { return s.id == chunk.stream; });
+		if (it == streams.end()) {
+			streams.emplace_back();
+			it = streams.end() - 1;
+			it->id = chunk.stream;
+			it->kind = (WireKind)chunk.kind;
+		}
+		size_t offset = it->bytes.size();
+		it->bytes.resize(offset + chunk.len);
+		if (!file.read((char*)it->bytes.data() + offset, chunk.len)) {
+			it->bytes.resize(offset); // the server stopped mid-chunk; replay up to there
+			break;
+		}
+		it->chunkEnds.push_back({ offset + chunk.len, chunk.us });
+	}
+	return true;
+}
+
+class ReplayInput : public StreamInput {
+	const WireStream& stream;
+	const int64_t startUs; // local time of the start of the recording, when paced
+	const bool paced;
+	size_t pos = 0, chunk = 0;
+	int64_t arrivedUs = 0; // when the chunk at pos became available
+public:
+	ReplayInput(const WireStream& s, int64_t start, bool recordedSpeed) : stream(s), startUs(start), paced(recordedSpeed) {}
+
+	size_t Position() const { return pos; }
+
+	bool Read(void* dst, size_t len) override {
+		uint8_t* out = (uint8_t*)dst;
+		while (len > 0) {
+			if (pos == stream.bytes.size()) return false;
+			// Entering a new chunk: wait for it when paced
+			if (chunk == 0 || pos == stream.chunkEnds[chunk - 1].first) {
+				while (stream.chunkEnds[chunk].first == pos) ++chunk; // empty chunks are never written
+				if (paced) {
+					arrivedUs = startUs + stream.chunkEnds[chunk].second;
+					int64_t waitUs = arrivedUs - LatencyNowUs();
+					if (waitUs > 0) std::this_thread::sleep_for(std::chrono::microseconds(waitUs));
+				}
+				else {
+					arrivedUs = LatencyNowUs();
+				}
+				++chunk;
+			}
+			size_t n = std::min(len, stream.chunkEnds[chunk - 1].first - pos);
+			memcpy(out, stream.bytes.data() + pos, n);
+			out += n;
+			pos += n;
+			len -= n;
+		}
+		return true;
+	}
+
+	int64_t CaptureTimeUs(int64_t) override { return arrivedUs; }
+};
+
+// What replaying one stream of a recording came to
+struct ReplayResult {
+	uint64_t units = 0;     // frames or audio packets
+	uint64_t pcmBytes = 0;  // audio only: decompressed bytes
+	uint64_t finalHash = 14695981039346656037ull; // screen only: FNV-1a of the final framebuffer
+	bool ok = false;        // the stream parsed up to its end, which falls between two messages
+};
+
+// Decodes a screen stream the way ScreenRecvThread does, into a MemoryPresenter. startUs is the
+// local time the recording starts at when recordedSpeed paces it.
+inline ReplayResult ReplayScreenStream(const WireStream& stream, int64_t startUs, bool recordedSpeed, int decodeThreads) {
+	ReplayResult result;
+	ReplayInput input(stream, startUs, recordedSpeed);
+	MessageReader reader(input);
+	MsgHeader header;
+	ScreenStreamInfo info;
+	if (!reader.Next(header) || header.type != MsgType::ScreenInfo || !ReadScreenHandshake(reader.Payload(), info)) return result;
+	FrameSurface surface;
+	MemoryPresenter* presenter = new MemoryPresenter();
+	surface.presenter = presenter;
+	{
+		ParallelFrameDecoder decoder(&surface, decodeThreads, info.cacheSlots, info.pixelFormat, info.recordFormat);
+		std::vector<CopyRect> pendingMoves;
+		size_t messageEnd = input.Position();
+		while (reader.Next(header)) {
+			if (header.type == MsgType::ScreenFrame) {
+				if (!ReadScreenFrame(reader.Payload(), info.width, info.height, decoder, pendingMoves)) break;
+				result.units++;
+			}
+			messageEnd = input.Position() + reader.Remaining();
+		}
+		result.ok = messageEnd == stream.bytes.size();
+		decoder.Flush();
+	}
+	const uint8_t* bits = presenter->Bits();
+	for (size_t i = 0, n = (size_t)presenter->Pitch() * surface.imgH; i < n; ++i)
+		result.finalHash = (result.finalHash ^ bits[i]) * 1099511628211ull;
+	return result;
+}
+
+// Reads an audio stream the way the audio client does, without playing it
+inline ReplayResult ReplayAudioStream(const WireStream& stream, int64_t startUs, bool recordedSpeed) {
+	ReplayResult result;
+	ReplayInput input(stream, startUs, recordedSpeed);
+	std::vector<uint8_t> format, pcm;
+	if (!ReadAudioFormat(input, format)) return result;
+	size_t packetStart;
+	while (packetStart = input.Position(), ReadAudioPacket(input, pcm)) {
+		result.units++;
+		result.pcmBytes += pcm.size();
+	}
+	result.ok = packetStart == stream.bytes.size();
+	return result;
+}
+
+// --- Receive benchmark ---
+// --bench-recv PATH (main.cpp) and tests/ReplayBench.cpp serve a stream of a recording over
+// loopback, chunk by chunk as it was sent, and read it back through the client's parsers: with
+// SocketInput, which calls recv() for every field, or with BufferedSocketInput. Screen frames are
+// decoded as in a replay, so the throughput includes the decoder.
+
+inline void CloseWireSocket(SOCKET s) {
+#ifdef _WIN32
+	closesocket(s);
+#else
+	close(s);
+#endif
+}
+
+// Sends the chunks of a stream to whoever connects to the returned socket's port, then closes.
+// (SOCKET)-1 if no loopback connection can be made; server is then joinable if it was started.
+inline SOCKET ServeWireStream(const WireStream& stream, std::thread& server) {
+	const SOCKET NO_SOCKET = (SOCKET)-1; // INVALID_SOCKET
+#ifdef _WIN32
+	const int SHUT_SEND = SD_SEND;
+#else
+	const int SHUT_SEND = SHUT_WR;
+#endif
+	SOCKET sktListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addrLen = sizeof(addr);
+	if (sktListen == NO_SOCKET || bind(sktListen, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+		listen(sktListen, 1) != 0 || getsockname(sktListen, (sockaddr*)&addr, &addrLen) != 0) {
+		if (sktListen != NO_SOCKET) CloseWireSocket(sktListen);
+		return NO_SOCKET;
+	}
+	SOCKET sktClient = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	server = std::thread([&stream, sktListen, NO_SOCKET, SHUT_SEND]() {
+		SOCKET skt = accept(sktListen, NULL, NULL);
+		CloseWireSocket(sktListen);
+		if (skt == NO_SOCKET) return;
+		size_t offset = 0;
+		for (const auto& chunk : stream.chunkEnds) {
+			if (!SendAll(skt, stream.bytes.data() + offset, chunk.first - offset)) break;
+			offset = chunk.first;
+		}
+		shutdown(skt, SHUT_SEND);
+		char drain[256];
+		while (recv(skt, drain, sizeof(drain), 0) > 0) {} // until the reader is done with it
+		CloseWireSocket(skt);
+	});
+	if (sktClient == NO_SOCKET || connect(sktClient, (sockaddr*)&addr, sizeof(addr)) != 0) {
+		if (sktClient != NO_SOCKET) CloseWireSocket(sktClient);
+		return NO_SOCKET;
+	}
+	return sktClient;
+}
+
+struct RecvBenchResult {
+	uint64_t units = 0; // frames or audio packets
+	uint64_t recvCalls = 0;
+	uint64_t presentedHash = 0; // MemoryPresenter::presentedHash, screen with hashFrames only
+	double seconds = 0;
+	bool ok = false;
+};
+
+// Reads stream back over loopback through Input (SocketInput or BufferedSocketInput)
+template <class Input>
+inline RecvBenchResult BenchRecvStream(const WireStream& stream, int decodeThreads, bool hashFrames = false) {
+#ifdef _WIN32
+	const int SHUT_BOTH = SD_BOTH;
+#else
+	const int SHUT_BOTH = SHUT_RDWR;
+#endif
+	RecvBenchResult result;
+	std::thread server;
+	SOCKET skt = ServeWireStream(stream, server);
+	if (skt == (SOCKET)-1) {
+		if (server.joinable()) server.join();
+		return result;
+	}
+	auto start = std::chrono::steady_clock::now();
+	Input input(skt);
+	if (stream.kind == WIRE_SCREEN) {
+		MessageReader reader(input);
+		MsgHeader header;
+		ScreenStreamInfo info;
+		if (reader.Next(header) && header.type == MsgType::ScreenInfo && ReadScreenHandshake(reader.Payload(), info)) {
+			FrameSurface surface;
+			MemoryPresenter* presenter = new MemoryPresenter();
+			presenter->hashPresented = hashFrames;
+			surface.presenter = presenter;
+			ParallelFrameDecoder decoder(&surface, decodeThreads, info.cacheSlots, info.pixelFormat, info.recordFormat);
+			std::vector<CopyRect> pendingMoves;
+			result.ok = true;
+			while (reader.Next(header)) {
+				if (header.type != MsgType::ScreenFrame) continue;
+				if (!ReadScreenFrame(reader.Payload(), info.width, info.height, decoder, pendingMoves)) {
+					result.ok = false;
+					break;
+				}
+				result.units++;
+			}
+			decoder.Flush();
+			result.presentedHash = presenter->presentedHash;
+		}
+	}
+	else {
+		std::vector<uint8_t> format, pcm;
+		if (ReadAudioFormat(input, format)) {
+			while (ReadAudioPacket(input, pcm)) result.units++;
+			result.ok = true;
+		}
+	}
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	result.recvCalls = input.RecvCalls();
+	shutdown(skt, SHUT_BOTH);
+	CloseWireSocket(skt);
+	server.join();
+	return result;
+}
@@ -278,6 +278,22 @@ The returned qoi data should be free()d after use. */
 void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len);
 
 
+/* Encode raw RGB or RGBA pixels into a caller-supplied buffer.
+
+The pixels are read row by row: stride is the distance in bytes between the
+start of two consecutive rows, so a rectangle of a larger image can be
+encoded in place by pointing data at its top-left pixel. out_cap must be at
+least QOI_ENCODE_BOUND(width, height, channels); nothing is allocated.
+
+The function returns 0 on failure (invalid parameters or out_cap too small)
+or the number of bytes written on success. */
+
+#define QOI_ENCODE_BOUND(w, h, channels) \
+	((w) * (h) * ((channels) + 1) + 14 + 8)
+
+int qoi_encode_into(void *out, int out_cap, const void *data, int stride, const qoi_desc *desc);
+
+
 /* Decode a QOI image from memory.
 
 The function either returns NULL on failure (invalid parameters or malloc
@@ -289,6 +305,42 @@ The returned pixel data should be free()d after use. */
 void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels);
 
 
+/* Decode a QOI image into a caller-supplied pixel buffer.
+
+out points to the top-left pixel of the destination rectangle and stride is
+the distance in bytes between two of its rows, so an image can be decoded
+directly into a region of a larger framebuffer. The decoded image must fit
+into max_w x max_h pixels, otherwise nothing is written. channels is 3 or 4
+(0 uses the channel count from the header); with QOI_DECODE_BGR the red and
+blue components are swapped on output, e.g. to produce BGRA for GDI.
+
+The function returns 0 on failure (invalid parameters, corrupt header or the
+image does not fit) or 1 on success. The qoi_desc struct is filled with the
+description from the file header whenever the header could be read. */
+
+#define QOI_DECODE_BGR 1
+
+int qoi_decode_into(const void *data, int size, qoi_desc *desc, void *out, int stride, int max_w, int max_h, int channels, int flags);
+
+
+/* Decode bare QOI chunks into a caller-supplied pixel buffer.
+
+For containers that carry the image size themselves: the chunks are the bytes
+qoi_encode_into writes after the QOI_CHUNKS_OFFSET byte header and before the
+QOI_CHUNKS_TRAILER byte end marker. desc supplies width and height; its
+channels and colorspace are ignored. out, stride, channels and flags are as
+for qoi_decode_into. Without the end marker to stop at, the decoder may read
+up to QOI_CHUNKS_TRAILER bytes past data + size, so that much of the buffer
+must be readable (its content does not matter).
+
+The function returns 0 on invalid parameters or 1 on success. */
+
+#define QOI_CHUNKS_OFFSET 14
+#define QOI_CHUNKS_TRAILER 8
+
+int qoi_decode_chunks_into(const void *data, int size, const qoi_desc *desc, void *out, int stride, int channels, int flags);
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -298,7 +350,8 @@ void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels);
 /* -----------------------------------------------------------------------------
 Implementation */
 
-#ifdef QOI_IMPLEMENTATION
+#if defined(QOI_IMPLEMENTATION) && !defined(QOI_IMPLEMENTATION_INCLUDED)
+#define QOI_IMPLEMENTATION_INCLUDED
 #include <stdlib.h>
 #include <string.h>
 
@@ -353,43 +406,28 @@ static unsigned int qoi_read_32(const unsigned char *bytes, int *p) {
 	return a << 24 | b << 16 | c << 8 | d;
 }
 
-void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
-	int i, max_size, p, run;
-	int px_len, px_end, px_pos, channels;
-	unsigned char *bytes;
-	const unsigned char *pixels;
+static int qoi_desc_valid(const qoi_desc *desc) {
+	return
+		desc->width != 0 && desc->height != 0 &&
+		desc->channels >= 3 && desc->channels <= 4 &&
+		desc->colorspace <= 1 &&
+		desc->height < QOI_PIXELS_MAX / desc->width;
+}
+
+static int qoi_encode_rows(unsigned char *bytes, const unsigned char *pixels, int stride, const qoi_desc *desc) {
+	int i, p, run, x, y;
+	int row_len, row_end, channels;
+	const unsigned char *row;
 	qoi_rgba_t index[64];
 	qoi_rgba_t px, px_prev;
 
-	if (
-		data == NULL || out_len == NULL || desc == NULL ||
-		desc->width == 0 || desc->height == 0 ||
-		desc->channels < 3 || desc->channels > 4 ||
-		desc->colorspace > 1 ||
-		desc->height >= QOI_PIXELS_MAX / desc->width
-	) {
-		return NULL;
-	}
-
-	max_size =
-		desc->width * desc->height * (desc->channels + 1) +
-		QOI_HEADER_SIZE + sizeof(qoi_padding);
-
 	p = 0;
-	bytes = (unsigned char *) QOI_MALLOC(max_size);
-	if (!bytes) {
-		return NULL;
-	}
-
 	qoi_write_32(bytes, &p, QOI_MAGIC);
 	qoi_write_32(bytes, &p, desc->width);
 	qoi_write_32(bytes, &p, desc->height);
 	bytes[p++] = desc->channels;
 	bytes[p++] = desc->colorspace;
 
-
-	pixels = (const unsigned char *)data;
-
 	QOI_ZEROARR(index);
 
 	run = 0;
@@ -399,110 +437,140 @@ void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
 	px_prev.rgba.a = 255;
 	px = px_prev;
 
-	px_len = desc->width * desc->height * desc->channels;
-	px_end = px_len - desc->channels;
 	channels = desc->channels;
+	row_len = desc->width * channels;
+	row_end = row_len - channels;
 
-	for (px_pos = 0; px_pos < px_len; px_pos += channels) {
-		px.rgba.r = pixels[px_pos + 0];
-		px.rgba.g = pixels[px_pos + 1];
-		px.rgba.b = pixels[px_pos + 2];
+	for (y = 0; y < (int)desc->height; y++) {
+		int last_row = (y == (int)desc->height - 1);
+		row = pixels + (size_t)y * stride;
 
-		if (channels == 4) {
-			px.rgba.a = pixels[px_pos + 3];
-		}
+		for (x = 0; x < row_len; x += channels) {
+			px.rgba.r = row[x + 0];
+			px.rgba.g = row[x + 1];
+			px.rgba.b = row[x + 2];
 
-		if (px.v == px_prev.v) {
-			run++;
-			if (run == 62 || px_pos == px_end) {
-				bytes[p++] = QOI_OP_RUN | (run - 1);
-				run = 0;
+			if (channels == 4) {
+				px.rgba.a = row[x + 3];
 			}
-		}
-		else {
-			int index_pos;
 
-			if (run > 0) {
-				bytes[p++] = QOI_OP_RUN | (run - 1);
-				run = 0;
+			if (px.v == px_prev.v) {
+				run++;
+				if (run == 62 || (last_row && x == row_end)) {
+					bytes[p++] = QOI_OP_RUN | (run - 1);
+					run = 0;
+				}
 			}
+			else {
+				int index_pos;
 
-			index_pos = QOI_COLOR_HASH(px) & (64 - 1);
+				if (run > 0) {
+					bytes[p++] = QOI_OP_RUN | (run - 1);
+					run = 0;
+				}
 
-			if (index[index_pos].v == px.v) {
-				bytes[p++] = QOI_OP_INDEX | index_pos;
-			}
-			else {
-				index[index_pos] = px;
-
-				if (px.rgba.a == px_prev.rgba.a) {
-					signed char vr = px.rgba.r - px_prev.rgba.r;
-					signed char vg = px.rgba.g - px_prev.rgba.g;
-					signed char vb = px.rgba.b - px_prev.rgba.b;
-
-					signed char vg_r = vr - vg;
-					signed char vg_b = vb - vg;
-
-					if (
-						vr > -3 && vr < 2 &&
-						vg > -3 && vg < 2 &&
-						vb > -3 && vb < 2
-					) {
-						bytes[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
-					}
-					else if (
-						vg_r >  -9 && vg_r <  8 &&
-						vg   > -33 && vg   < 32 &&
-						vg_b >  -9 && vg_b <  8
-					) {
-						bytes[p++] = QOI_OP_LUMA     | (vg   + 32);
-						bytes[p++] = (vg_r + 8) << 4 | (vg_b +  8);
+				index_pos = QOI_COLOR_HASH(px) & (64 - 1);
+
+				if (index[index_pos].v == px.v) {
+					bytes[p++] = QOI_OP_INDEX | index_pos;
+				}
+				else {
+					index[index_pos] = px;
+
+					if (px.rgba.a == px_prev.rgba.a) {
+						signed char vr = px.rgba.r - px_prev.rgba.r;
+						signed char vg = px.rgba.g - px_prev.rgba.g;
+						signed char vb = px.rgba.b - px_prev.rgba.b;
+
+						signed char vg_r = vr - vg;
+						signed char vg_b = vb - vg;
+
+						if (
+							vr > -3 && vr < 2 &&
+							vg > -3 && vg < 2 &&
+							vb > -3 && vb < 2
+						) {
+							bytes[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+						}
+						else if (
+							vg_r >  -9 && vg_r <  8 &&
+							vg   > -33 && vg   < 32 &&
+							vg_b >  -9 && vg_b <  8
+						) {
+							bytes[p++] = QOI_OP_LUMA     | (vg   + 32);
+							bytes[p++] = (vg_r + 8) << 4 | (vg_b +  8);
+						}
+						else {
+							bytes[p++] = QOI_OP_RGB;
+							bytes[p++] = px.rgba.r;
+							bytes[p++] = px.rgba.g;
+							bytes[p++] = px.rgba.b;
+						}
 					}
 					else {
-						bytes[p++] = QOI_OP_RGB;
+						bytes[p++] = QOI_OP_RGBA;
 						bytes[p++] = px.rgba.r;
 						bytes[p++] = px.rgba.g;
 						bytes[p++] = px.rgba.b;
+						bytes[p++] = px.rgba.a;
 					}
 				}
-				else {
-					bytes[p++] = QOI_OP_RGBA;
-					bytes[p++] = px.rgba.r;
-					bytes[p++] = px.rgba.g;
-					bytes[p++] = px.rgba.b;
-					bytes[p++] = px.rgba.a;
-				}
 			}
+			px_prev = px;
 		}
-		px_prev = px;
 	}
 
 	for (i = 0; i < (int)sizeof(qoi_padding); i++) {
 		bytes[p++] = qoi_padding[i];
 	}
 
-	*out_len = p;
-	return bytes;
+	return p;
 }
 
-void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
-	const unsigned char *bytes;
-	unsigned int header_magic;
-	unsigned char *pixels;
-	qoi_rgba_t index[64];
-	qoi_rgba_t px;
-	int px_len, chunks_len, px_pos;
-	int p = 0, run = 0;
+void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
+	int max_size;
+	unsigned char *bytes;
 
 	if (
-		data == NULL || desc == NULL ||
-		(channels != 0 && channels != 3 && channels != 4) ||
-		size < QOI_HEADER_SIZE + (int)sizeof(qoi_padding)
+		data == NULL || out_len == NULL || desc == NULL ||
+		!qoi_desc_valid(desc)
 	) {
 		return NULL;
 	}
 
-	bytes = (const unsigned char *)data;
+	max_size =
+		desc->width * desc->height * (desc->channels + 1) +
+		QOI_HEADER_SIZE + sizeof(qoi_padding);
+
+	bytes = (unsigned char *) QOI_MALLOC(max_size);
+	if (!bytes) {
+		return NULL;
+	}
+
+	*out_len = qoi_encode_rows(bytes, (const unsigned char *)data, desc->width * desc->channels, desc);
+	return bytes;
+}
+
+int qoi_encode_into(void *out, int out_cap, const void *data, int stride, const qoi_desc *desc) {
+	if (
+		out == NULL || data == NULL || desc == NULL ||
+		!qoi_desc_valid(desc) ||
+		stride < (int)(desc->width * desc->channels) ||
+		out_cap < (int)QOI_ENCODE_BOUND(desc->width, desc->height, desc->channels)
+	) {
+		return 0;
+	}
+
+	return qoi_encode_rows((unsigned char *)out, (const unsigned char *)data, stride, desc);
+}
+
+static int qoi_read_header(const unsigned char *bytes, int size, qoi_desc *desc) {
+	unsigned int header_magic;
+	int p = 0;
+
+	if (size < QOI_HEADER_SIZE + (int)sizeof(qoi_padding)) {
+		return 0;
+	}
 
 	header_magic = qoi_read_32(bytes, &p);
 	desc->width = qoi_read_32(bytes, &p);
@@ -510,12 +578,90 @@ void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
 	desc->channels = bytes[p++];
 	desc->colorspace = bytes[p++];
 
+	return
+		header_magic == QOI_MAGIC &&
+		qoi_desc_valid(desc);
+}
+
+/* Decodes the chunks from bytes[p] on; ops are only started before chunks_len */
+static void qoi_decode_rows(const unsigned char *bytes, int p, int chunks_len, const qoi_desc *desc, unsigned char *pixels, int stride, int channels, int flags) {
+	qoi_rgba_t index[64];
+	qoi_rgba_t px;
+	unsigned char *row;
+	int row_len, x, y;
+	int run = 0;
+	int ri = (flags & QOI_DECODE_BGR) ? 2 : 0;
+	int bi = 2 - ri;
+
+	QOI_ZEROARR(index);
+	px.rgba.r = 0;
+	px.rgba.g = 0;
+	px.rgba.b = 0;
+	px.rgba.a = 255;
+
+	row_len = desc->width * channels;
+	for (y = 0; y < (int)desc->height; y++) {
+		row = pixels + (size_t)y * stride;
+
+		for (x = 0; x < row_len; x += channels) {
+			if (run > 0) {
+				run--;
+			}
+			else if (p < chunks_len) {
+				int b1 = bytes[p++];
+
+				if (b1 == QOI_OP_RGB) {
+					px.rgba.r = bytes[p++];
+					px.rgba.g = bytes[p++];
+					px.rgba.b = bytes[p++];
+				}
+				else if (b1 == QOI_OP_RGBA) {
+					px.rgba.r = bytes[p++];
+					px.rgba.g = bytes[p++];
+					px.rgba.b = bytes[p++];
+					px.rgba.a = bytes[p++];
+				}
+				else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+					px = index[b1];
+				}
+				else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+					px.rgba.r += ((b1 >> 4) & 0x03) - 2;
+					px.rgba.g += ((b1 >> 2) & 0x03) - 2;
+					px.rgba.b += ( b1       & 0x03) - 2;
+				}
+				else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+					int b2 = bytes[p++];
+					int vg = (b1 & 0x3f) - 32;
+					px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
+					px.rgba.g += vg;
+					px.rgba.b += vg - 8 +  (b2       & 0x0f);
+				}
+				else if ((b1 & QOI_MASK_2) == QOI_OP_RUN) {
+					run = (b1 & 0x3f);
+				}
+
+				index[QOI_COLOR_HASH(px) & (64 - 1)] = px;
+			}
+
+			row[x + ri] = px.rgba.r;
+			row[x + 1] = px.rgba.g;
+			row[x + bi] = px.rgba.b;
+
+			if (channels == 4) {
+				row[x + 3] = px.rgba.a;
+			}
+		}
+	}
+}
+
+void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
+	unsigned char *pixels;
+	int px_len;
+
 	if (
-		desc->width == 0 || desc->height == 0 ||
-		desc->channels < 3 || desc->channels > 4 ||
-		desc->colorspace > 1 ||
-		header_magic != QOI_MAGIC ||
-		desc->height >= QOI_PIXELS_MAX / desc->width
+		data == NULL || desc == NULL ||
+		(channels != 0 && channels != 3 && channels != 4) ||
+		!qoi_read_header((const unsigned char *)data, size, desc)
 	) {
 		return NULL;
 	}
@@ -530,63 +676,47 @@ void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
 		return NULL;
 	}
 
-	QOI_ZEROARR(index);
-	px.rgba.r = 0;
-	px.rgba.g = 0;
-	px.rgba.b = 0;
-	px.rgba.a = 255;
+	qoi_decode_rows((const unsigned char *)data, QOI_HEADER_SIZE, size - (int)sizeof(qoi_padding), desc, pixels, desc->width * channels, channels, 0);
+	return pixels;
+}
 
-	chunks_len = size - (int)sizeof(qoi_padding);
-	for (px_pos = 0; px_pos < px_len; px_pos += channels) {
-		if (run > 0) {
-			run--;
-		}
-		else if (p < chunks_len) {
-			int b1 = bytes[p++];
+int qoi_decode_into(const void *data, int size, qoi_desc *desc, void *out, int stride, int max_w, int max_h, int channels, int flags) {
+	if (
+		data == NULL || desc == NULL || out == NULL ||
+		(channels != 0 && channels != 3 && channels != 4) ||
+		!qoi_read_header((const unsigned char *)data, size, desc)
+	) {
+		return 0;
+	}
 
-			if (b1 == QOI_OP_RGB) {
-				px.rgba.r = bytes[p++];
-				px.rgba.g = bytes[p++];
-				px.rgba.b = bytes[p++];
-			}
-			else if (b1 == QOI_OP_RGBA) {
-				px.rgba.r = bytes[p++];
-				px.rgba.g = bytes[p++];
-				px.rgba.b = bytes[p++];
-				px.rgba.a = bytes[p++];
-			}
-			else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
-				px = index[b1];
-			}
-			else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
-				px.rgba.r += ((b1 >> 4) & 0x03) - 2;
-				px.rgba.g += ((b1 >> 2) & 0x03) - 2;
-				px.rgba.b += ( b1       & 0x03) - 2;
-			}
-			else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
-				int b2 = bytes[p++];
-				int vg = (b1 & 0x3f) - 32;
-				px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
-				px.rgba.g += vg;
-				px.rgba.b += vg - 8 +  (b2       & 0x0f);
-			}
-			else if ((b1 & QOI_MASK_2) == QOI_OP_RUN) {
-				run = (b1 & 0x3f);
-			}
+	if (channels == 0) {
+		channels = desc->channels;
+	}
 
-			index[QOI_COLOR_HASH(px) & (64 - 1)] = px;
-		}
+	if (
+		(int)desc->width > max_w || (int)desc->height > max_h ||
+		stride < (int)desc->width * channels
+	) {
+		return 0;
+	}
 
-		pixels[px_pos + 0] = px.rgba.r;
-		pixels[px_pos + 1] = px.rgba.g;
-		pixels[px_pos + 2] = px.rgba.b;
-		
-		if (channels == 4) {
-			pixels[px_pos + 3] = px.rgba.a;
-		}
+	qoi_decode_rows((const unsigned char *)data, QOI_HEADER_SIZE, size - (int)sizeof(qoi_padding), desc, (unsigned char *)out, stride, channels, flags);
+	return 1;
+}
+
+int qoi_decode_chunks_into(const void *data, int size, const qoi_desc *desc, void *out, int stride, int channels, int flags) {
+	if (
+		data == NULL || desc == NULL || out == NULL || size < 0 ||
+		(channels != 3 && channels != 4) ||
+		desc->width == 0 || desc->height == 0 ||
+		desc->height >= QOI_PIXELS_MAX / desc->width ||
+		stride < (int)desc->width * channels
+	) {
+		return 0;
 	}
 
-	return pixels;
+	qoi_decode_rows((const unsigned char *)data, 0, size, desc, (unsigned char *)out, stride, channels, flags);
+	return 1;
 }
 
 #ifndef QOI_NO_STDIO
@@ -36,10 +36,32 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "xrle.h"
+
 #define U64 uint64_t
 #define U32 uint32_t
 
-size_t xrle_compress(void * out,const void * in,size_t in_size)
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define XRLE_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define XRLE_TARGET_SSE41
+#define XRLE_TARGET_AVX2
+#else
+#include <cpuid.h>
+#define XRLE_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define XRLE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define XRLE_X86 0
+#endif
+
+/*
+ * Reference implementation. The SIMD variants below must produce exactly
+ * the same stream, so any change here has to be mirrored there.
+ */
+size_t xrle_compress_scalar(void * out,const void * in,size_t in_size)
 {
 	U64 *in_pos = (U64 *) in,*out_pos = (U64 *) out;
 	U32 tail = in_size & 7,*descr,repeat;
@@ -85,7 +107,7 @@ end_all:
 	return (char *)out_pos - (char *)out + tail;
 }
 
-size_t xrle_decompress(void * out,const void * in,size_t in_size)
+size_t xrle_decompress_scalar(void * out,const void * in,size_t in_size)
 {
 
 	U64 *in_pos = (U64 *) in,*out_pos = (U64 *) out,word,tmp;
@@ -116,3 +138,415 @@ size_t xrle_decompress(void * out,const void * in,size_t in_size)
 	memcpy(out_pos,(char *)in + in_size - tail,tail);
 	return (char *)out_pos - (char *)out + tail;
 }
+
+/*
+ * Block scanners used by the vectorized compressor.
+ *
+ * copy_literals copies w[start..k] to dst and returns k, the first index in
+ * [start, n - 1) with w[k] == w[k + 1], or n - 1 if there is none. It may
+ * write up to 8 words past dst[k - start] as long as they stay inside the
+ * input range. find_diff returns the first index j in [start, n) with
+ * w[j] != value, or n if the run reaches the end.
+ */
+typedef size_t (*xrle_copy_literals_fn)(U64 *dst,const U64 *w,size_t start,size_t n);
+typedef size_t (*xrle_find_diff_fn)(const U64 *w,size_t start,size_t n,U64 value);
+
+static size_t xrle_copy_literals_scalar(U64 *dst,const U64 *w,size_t k,size_t n)
+{
+	for(;k + 1 < n;k++){
+		*dst++ = w[k];
+		if(w[k] == w[k + 1])
+			return k;
+	}
+	*dst = w[k];
+	return k;
+}
+
+static size_t xrle_find_diff_scalar(const U64 *w,size_t j,size_t n,U64 value)
+{
+	for(;j < n;j++)
+		if(w[j] != value)
+			return j;
+	return n;
+}
+
+static unsigned xrle_ctz(unsigned v)
+{
+#if defined(_MSC_VER)
+	unsigned long idx;
+	_BitScanForward(&idx,v);
+	return (unsigned)idx;
+#else
+	return (unsigned)__builtin_ctz(v);
+#endif
+}
+
+/*
+ * Same stream as xrle_compress_scalar, but group boundaries are located a
+ * block at a time and literals are stored while they are scanned.
+ */
+static size_t xrle_compress_blocks(void * out,const void * in,size_t in_size,
+	xrle_copy_literals_fn copy_literals,xrle_find_diff_fn find_diff)
+{
+	const U64 *w = (const U64 *) in;
+	U64 *out_pos = (U64 *) out;
+	U32 tail = in_size & 7,*descr;
+	size_t n = in_size >> 3,s = 0,k,j;
+
+	if(in_size < 16){
+		memcpy(out,in,in_size);
+		return in_size;
+	}
+	for(;;){
+		descr = (U32 *)out_pos;
+		out_pos++;
+
+		k = copy_literals(out_pos,w,s,n);
+		out_pos += k - s + 1;
+		descr[0] = (U32)(k - s);
+		if(k == n - 1){
+			descr[1] = 1;
+			break;
+		}
+
+		j = find_diff(w,k + 2,n,w[k]);
+		descr[1] = (U32)(j - k);
+		if(j == n)
+			break;
+		s = j;
+	}
+	memcpy(out_pos,(char *)in + in_size - tail,tail);
+	return (char *)out_pos - (char *)out + tail;
+}
+
+#if XRLE_X86
+
+XRLE_TARGET_SSE41
+static size_t xrle_copy_literals_sse41(U64 *dst,const U64 *w,size_t k,size_t n)
+{
+	size_t s = k;
+
+	for(;k + 2 < n;k += 2){
+		__m128i a = _mm_loadu_si128((const __m128i *)(w + k));
+		__m128i b = _mm_loadu_si128((const __m128i *)(w + k + 1));
+		int m = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(a,b)));
+		_mm_storeu_si128((__m128i *)(dst + (k - s)),a);
+		if(m)
+			return k + xrle_ctz((unsigned)m);
+	}
+	return xrle_copy_literals_scalar(dst + (k - s),w,k,n);
+}
+
+XRLE_TARGET_SSE41
+static size_t xrle_find_diff_sse41(const U64 *w,size_t j,size_t n,U64 value)
+{
+	__m128i v = _mm_set1_epi64x((long long)value);
+	for(;j + 2 <= n;j += 2){
+		__m128i a = _mm_loadu_si128((const __m128i *)(w + j));
+		int m = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(a,v)));
+		if(m != 0x3)
+			return j + xrle_ctz((unsigned)(~m & 0x3));
+	}
+	return xrle_find_diff_scalar(w,j,n,value);
+}
+
+XRLE_TARGET_AVX2
+static size_t xrle_copy_literals_avx2(U64 *dst,const U64 *w,size_t k,size_t n)
+{
+	size_t s = k;
+
+	/* two 4-word compares per step: 64 bytes of pairs each */
+	for(;k + 8 < n;k += 8){
+		__m256i a0 = _mm256_loadu_si256((const __m256i *)(w + k));
+		__m256i b0 = _mm256_loadu_si256((const __m256i *)(w + k + 1));
+		__m256i a1 = _mm256_loadu_si256((const __m256i *)(w + k + 4));
+		__m256i b1 = _mm256_loadu_si256((const __m256i *)(w + k + 5));
+		int m0 = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a0,b0)));
+		int m1 = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a1,b1)));
+		int m = m0 | (m1 << 4);
+		_mm256_storeu_si256((__m256i *)(dst + (k - s)),a0);
+		_mm256_storeu_si256((__m256i *)(dst + (k - s) + 4),a1);
+		if(m)
+			return k + xrle_ctz((unsigned)m);
+	}
+	for(;k + 4 < n;k += 4){
+		__m256i a = _mm256_loadu_si256((const __m256i *)(w + k));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(w + k + 1));
+		int m = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a,b)));
+		_mm256_storeu_si256((__m256i *)(dst + (k - s)),a);
+		if(m)
+			return k + xrle_ctz((unsigned)m);
+	}
+	return xrle_copy_literals_scalar(dst + (k - s),w,k,n);
+}
+
+XRLE_TARGET_AVX2
+static size_t xrle_find_diff_avx2(const U64 *w,size_t j,size_t n,U64 value)
+{
+	__m256i v = _mm256_set1_epi64x((long long)value);
+	for(;j + 8 <= n;j += 8){
+		__m256i a0 = _mm256_loadu_si256((const __m256i *)(w + j));
+		__m256i a1 = _mm256_loadu_si256((const __m256i *)(w + j + 4));
+		int m0 = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a0,v)));
+		int m1 = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a1,v)));
+		int m = m0 | (m1 << 4);
+		if(m != 0xff)
+			return j + xrle_ctz((unsigned)(~m & 0xff));
+	}
+	for(;j + 4 <= n;j += 4){
+		__m256i a = _mm256_loadu_si256((const __m256i *)(w + j));
+		int m = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a,v)));
+		if(m != 0xf)
+			return j + xrle_ctz((unsigned)(~m & 0xf));
+	}
+	return xrle_find_diff_scalar(w,j,n,value);
+}
+
+size_t xrle_compress_sse41(void * out,const void * in,size_t in_size)
+{
+	return xrle_compress_blocks(out,in,in_size,xrle_copy_literals_sse41,xrle_find_diff_sse41);
+}
+
+size_t xrle_compress_avx2(void * out,const void * in,size_t in_size)
+{
+	return xrle_compress_blocks(out,in,in_size,xrle_copy_literals_avx2,xrle_find_diff_avx2);
+}
+
+XRLE_TARGET_SSE41
+size_t xrle_decompress_sse41(void * out,const void * in,size_t in_size)
+{
+	const U64 *in_pos = (const U64 *) in;
+	U64 *out_pos = (U64 *) out;
+	U32 tail = in_size & 7,lit_len,repeat,i;
+	const U64 *in_limit = (const U64 *)((const char *)in + in_size - tail);
+	__m128i v;
+
+	if(in_size < 16){
+		memcpy(out,in,in_size);
+		return in_size;
+	}
+	while(in_pos < in_limit){
+		lit_len = ((const U32 *) in_pos)[0];
+		repeat = ((const U32 *) in_pos)[1];
+		in_pos++;
+
+		memcpy(out_pos,in_pos,(size_t)lit_len * sizeof(U64));
+		in_pos += lit_len;
+		out_pos += lit_len;
+
+		v = _mm_set1_epi64x((long long)*in_pos++);
+		for(i = 0;i + 2 <= repeat;i += 2)
+			_mm_storeu_si128((__m128i *)(out_pos + i),v);
+		if(i < repeat)
+			_mm_storel_epi64((__m128i *)(out_pos + i),v);
+		out_pos += repeat;
+	}
+	memcpy(out_pos,(const char *)in + in_size - tail,tail);
+	return (char *)out_pos - (char *)out + tail;
+}
+
+XRLE_TARGET_AVX2
+size_t xrle_decompress_avx2(void * out,const void * in,size_t in_size)
+{
+	const U64 *in_pos = (const U64 *) in;
+	U64 *out_pos = (U64 *) out;
+	U32 tail = in_size & 7,lit_len,repeat,i;
+	const U64 *in_limit = (const U64 *)((const char *)in + in_size - tail);
+	U64 word;
+	__m256i v;
+
+	if(in_size < 16){
+		memcpy(out,in,in_size);
+		return in_size;
+	}
+	while(in_pos < in_limit){
+		lit_len = ((const U32 *) in_pos)[0];
+		repeat = ((const U32 *) in_pos)[1];
+		in_pos++;
+
+		memcpy(out_pos,in_pos,(size_t)lit_len * sizeof(U64));
+		in_pos += lit_len;
+		out_pos += lit_len;
+
+		word = *in_pos++;
+		v = _mm256_set1_epi64x((long long)word);
+		for(i = 0;i + 8 <= repeat;i += 8){
+			_mm256_storeu_si256((__m256i *)(out_pos + i),v);
+			_mm256_storeu_si256((__m256i *)(out_pos + i + 4),v);
+		}
+		for(;i + 4 <= repeat;i += 4)
+			_mm256_storeu_si256((__m256i *)(out_pos + i),v);
+		for(;i < repeat;i++)
+			out_pos[i] = word;
+		out_pos += repeat;
+	}
+	memcpy(out_pos,(const char *)in + in_size - tail,tail);
+	return (char *)out_pos - (char *)out + tail;
+}
+
+static void xrle_cpuid(unsigned leaf,unsigned sub,unsigned r[4])
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuidex(info,(int)leaf,(int)sub);
+	r[0] = (unsigned)info[0]; r[1] = (unsigned)info[1];
+	r[2] = (unsigned)info[2]; r[3] = (unsigned)info[3];
+#else
+	__cpuid_count(leaf,sub,r[0],r[1],r[2],r[3]);
+#endif
+}
+
+static U64 xrle_xgetbv0(void)
+{
+#if defined(_MSC_VER)
+	return (U64)_xgetbv(0);
+#else
+	U32 lo,hi;
+	__asm__ __volatile__("xgetbv" : "=a"(lo),"=d"(hi) : "c"(0));
+	return ((U64)hi << 32) | lo;
+#endif
+}
+
+static int xrle_detect_simd(void)
+{
+	unsigned r[4];
+	int level = XRLE_SIMD_NONE;
+
+	xrle_cpuid(0,0,r);
+	if(r[0] < 1)
+		return level;
+	xrle_cpuid(1,0,r);
+	if(r[2] & (1u << 19))
+		level = XRLE_SIMD_SSE41;
+
+	/* AVX2 needs the OS to save YMM state (OSXSAVE + XCR0 bits 1,2) */
+	if((r[2] & (1u << 27)) && (r[2] & (1u << 28)) && (xrle_xgetbv0() & 6) == 6){
+		xrle_cpuid(0,0,r);
+		if(r[0] >= 7){
+			xrle_cpuid(7,0,r);
+			if(r[1] & (1u << 5))
+				level = XRLE_SIMD_AVX2;
+		}
+	}
+	return level;
+}
+
+#else
+
+static int xrle_detect_simd(void)
+{
+	return XRLE_SIMD_NONE;
+}
+
+#endif /* XRLE_X86 */
+
+typedef size_t (*xrle_fn)(void *,const void *,size_t);
+
+/*
+ * The implementations in use are published as one pointer to a constant
+ * table, so a thread calling in while another resolves or changes the level
+ * sees either the old table or the new one, never half of each. Loads and
+ * stores of the pointer are atomic: __atomic builtins on GCC/Clang (which
+ * ThreadSanitizer understands), an aligned volatile pointer on MSVC.
+ */
+typedef struct {
+	int level;
+	xrle_fn compress;
+	xrle_fn decompress;
+} xrle_impl;
+
+static const xrle_impl xrle_impls[] = {
+	{ XRLE_SIMD_NONE,xrle_compress_scalar,xrle_decompress_scalar },
+#if XRLE_X86
+	{ XRLE_SIMD_SSE41,xrle_compress_sse41,xrle_decompress_sse41 },
+	{ XRLE_SIMD_AVX2,xrle_compress_avx2,xrle_decompress_avx2 },
+#endif
+};
+
+static const xrle_impl * volatile xrle_active;
+
+#if defined(_MSC_VER)
+#define XRLE_LOAD_IMPL() (xrle_active)
+#define XRLE_STORE_IMPL(p) (xrle_active = (p))
+#else
+#define XRLE_LOAD_IMPL() __atomic_load_n(&xrle_active,__ATOMIC_ACQUIRE)
+#define XRLE_STORE_IMPL(p) __atomic_store_n(&xrle_active,(p),__ATOMIC_RELEASE)
+#endif
+
+int xrle_set_simd_level(int level)
+{
+	int supported = xrle_detect_simd();
+
+	if(level < 0 || level > supported)
+		level = supported;
+	XRLE_STORE_IMPL(&xrle_impls[level]);
+	return level;
+}
+
+/* The table in use, picked with CPUID on first use; racing first calls all pick the same one */
+static const xrle_impl *xrle_current(void)
+{
+	const xrle_impl *impl = XRLE_LOAD_IMPL();
+
+	if(!impl){
+		xrle_set_simd_level(-1);
+		impl = XRLE_LOAD_IMPL();
+	}
+	return impl;
+}
+
+int xrle_simd_level(void)
+{
+	return xrle_current()->level;
+}
+
+/*
+ * Below this size there are too few words for the block scanners to pay for
+ * their setup (dirty-tile bitmasks are a few hundred bytes), so the scalar
+ * loop is used whatever the level.
+ */
+#define XRLE_SIMD_MIN_COMPRESS 1024
+
+size_t xrle_compress(void * out,const void * in,size_t in_size)
+{
+	if(in_size < XRLE_SIMD_MIN_COMPRESS)
+		return xrle_compress_scalar(out,in,in_size);
+	return xrle_current()->compress(out,in,in_size);
+}
+
+size_t xrle_decompress(void * out,const void * in,size_t in_size)
+{
+	return xrle_current()->decompress(out,in,in_size);
+}
+
+/*
+ * Walks the descriptors without writing anything, so a damaged or hostile
+ * stream is refused before any level's decompressor runs on it.
+ */
+size_t xrle_decompress_bounded(void * out,size_t out_cap,const void * in,size_t in_size)
+{
+	const U32 *descr;
+	U32 tail = in_size & 7;
+	size_t words = (in_size - tail) >> 3,pos = 0,out_words = 0,group;
+
+	if(in_size < 16){
+		if(in_size > out_cap)
+			return XRLE_ERROR;
+		memcpy(out,in,in_size);
+		return in_size;
+	}
+	while(pos < words){
+		descr = (const U32 *)((const U64 *) in + pos);
+		/* descriptor, literals and the word to repeat */
+		group = (size_t)descr[0] + 2;
+		if(group > words - pos)
+			return XRLE_ERROR;
+		pos += group;
+		out_words += (size_t)descr[0] + descr[1];
+		if(out_words > out_cap >> 3)
+			return XRLE_ERROR;
+	}
+	if((out_words << 3) + tail > out_cap)
+		return XRLE_ERROR;
+	return xrle_decompress(out,in,in_size);
+}
@@ -24,6 +24,11 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef XRLE_H
+#define XRLE_H
+
+#include <stddef.h>
+
 /*
  * in: buffer to compress
  * out: buffer to store compressed data
@@ -52,5 +57,44 @@ size_t xrle_compress(void * out,const void * in,size_t in_size);
  */
 size_t xrle_decompress(void * out,const void * in,size_t in_size);
 
+/*
+ * As xrle_decompress, for data that may be damaged or hostile.
+ * out_cap: size of the out buffer in bytes
+ *
+ * return value: size of decompressed data in bytes, or XRLE_ERROR, with
+ * nothing written, if a descriptor runs past the end of the input or the
+ * data would not fit in out_cap bytes
+ */
+#define XRLE_ERROR ((size_t)-1)
+size_t xrle_decompress_bounded(void * out,size_t out_cap,const void * in,size_t in_size);
+
 /* This macro returns the maximum size of compressed data in bytes */
 #define xrle_max_out(A) ((A) + 8)
+
+/*
+ * xrle_compress and xrle_decompress dispatch at runtime to the widest
+ * implementation the CPU supports (checked with CPUID/XGETBV on first use).
+ * All variants produce and accept exactly the same stream. The selection is
+ * published atomically, so first calls may come from several threads at once
+ * and xrle_set_simd_level may be called while other threads are compressing.
+ */
+#define XRLE_SIMD_NONE  0
+#define XRLE_SIMD_SSE41 1
+#define XRLE_SIMD_AVX2  2
+
+/* return value: the SIMD level currently in use */
+int xrle_simd_level(void);
+
+/*
+ * Force a SIMD level (mainly for benchmarking and verification).
+ * Levels the CPU does not support are clamped; pass -1 for the best one.
+ *
+ * return value: the level actually selected
+ */
+int xrle_set_simd_level(int level);
+
+/* Portable reference implementations */
+size_t xrle_compress_scalar(void * out,const void * in,size_t in_size);
+size_t xrle_decompress_scalar(void * out,const void * in,size_t in_size);
+
+#endif /* XRLE_H */
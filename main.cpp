@@ -37,6 +37,23 @@
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <iphlpapi.h>
+#include "SendGather.h"
+#include "TileCompare.h"
+#include "TileHash.h"
+#include "TripleFrameBuffer.h"
+#include "FramePresenter.h"
+#include "PipelineTrace.h"
+#include "WorkStealingPool.h"
+#include "Metrics.h"
+#include "StreamInput.h"
+#include "TileCodec.h"
+#include "MotionDetector.h"
+#include "FrameSource.h"
+#include "ScreenFrameEncoder.h"
+#include "ParallelFrameDecoder.h"
+#include "ScreenBroadcaster.h"
+#include "AudioStream.h"
+#include "WireRecording.h"
 #include <set> // DIRTY TILE
 #include <algorithm> // DIRTY TILE
 #pragma comment(lib, "Ws2_32.lib")
@@ -202,40 +219,79 @@ namespace ColorConversion {
 	}
 }
 
-// Enhanced performance monitoring structure
-struct PerformanceMonitor {
-	std::chrono::steady_clock::time_point lastUpdate;
-	int frameCount = 0;
-	double avgPaintTime = 0.0;
-	double avgConversionTime = 0.0;
-	double avgCompressionTime = 0.0;
-	double avgNetworkBatchSize = 0.0;
-	int compressionSkipCount = 0;
-	
-	void RecordFrame(double paintTimeMs, double conversionTimeMs, double compressionTimeMs = 0.0, double batchSizeKB = 0.0, bool compressionSkipped = false) {
-		frameCount++;
-		avgPaintTime = (avgPaintTime * (static_cast<double>(frameCount) - 1) + paintTimeMs) / frameCount;
-		avgConversionTime = (avgConversionTime * (static_cast<double>(frameCount) - 1) + conversionTimeMs) / frameCount;
-		avgCompressionTime = (avgCompressionTime * (static_cast<double>(frameCount) - 1) + compressionTimeMs) / frameCount;
-		avgNetworkBatchSize = (avgNetworkBatchSize * (static_cast<double>(frameCount) - 1) + batchSizeKB) / frameCount;
-		if (compressionSkipped) compressionSkipCount++;
-		
-		auto now = std::chrono::steady_clock::now();
-		if (std::chrono::duration_cast<std::chrono::seconds>(now - lastUpdate).count() >= 5) {
-			std::cout << "🚀 Performance Report: " << frameCount << " frames" << std::endl;
-			std::cout << "   📊 Paint: " << avgPaintTime << "ms, Conversion: " << avgConversionTime << "ms" << std::endl;
-			std::cout << "   🗜️  Compression: " << avgCompressionTime << "ms (" << compressionSkipCount << " skipped)" << std::endl;
-			std::cout << "   📡 Network batch: " << avgNetworkBatchSize << "KB avg" << std::endl;
-			lastUpdate = now;
-			frameCount = 0;
-			avgPaintTime = 0.0;
-			avgConversionTime = 0.0;
-			avgCompressionTime = 0.0;
-			avgNetworkBatchSize = 0.0;
-			compressionSkipCount = 0;
+// --- Metrics ---
+// Frame stages, g_metrics and the frame latency rings are in Metrics.h
+
+// Publishes g_metrics once a second: rewritten into path (via a temporary, so readers never see a
+// partial file) and/or served over HTTP to scrapers on 127.0.0.1:port. Empty path / port 0 = off.
+void StartMetricsExport(const std::string& path, int port) {
+	if (!path.empty()) {
+		std::thread([path]() {
+			std::string tmp = path + ".tmp";
+			for (;;) {
+				{
+					std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+					f << g_metrics.Exposition();
+				}
+				MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+				std::this_thread::sleep_for(std::chrono::seconds(1));
+			}
+		}).detach();
+	}
+	if (port > 0) {
+		SOCKET sktListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons((u_short)port);
+		inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+		if (sktListen == INVALID_SOCKET || bind(sktListen, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+			listen(sktListen, SOMAXCONN) == SOCKET_ERROR) {
+			std::cout << "metrics: can't listen on 127.0.0.1:" << port << ": " << WSAGetLastError() << std::endl;
+			if (sktListen != INVALID_SOCKET) closesocket(sktListen);
+			return;
 		}
+		std::thread([sktListen]() {
+			for (;;) {
+				SOCKET skt = accept(sktListen, NULL, NULL);
+				if (skt == INVALID_SOCKET) {
+					int error = WSAGetLastError();
+					if (error == WSAENOTSOCK || error == WSAEINVAL) {
+						std::cout << "metrics: accept failed (" << error << "), exporter stopped" << std::endl;
+						break;
+					}
+					std::this_thread::sleep_for(std::chrono::milliseconds(100)); // out of sockets or buffers; retry later
+					continue;
+				}
+				// A client that connects and then says nothing (or reads nothing) must not hold up the next scrape
+				DWORD timeoutMs = 2000;
+				setsockopt(skt, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs));
+				setsockopt(skt, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs));
+				char request[1024];
+				recv(skt, request, sizeof(request), 0); // whatever was asked for, the answer is the same
+				std::string body = g_metrics.Exposition();
+				std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+					std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+				send(skt, response.data(), (int)response.size(), 0);
+				closesocket(skt);
+			}
+			closesocket(sktListen);
+		}).detach();
 	}
-};
+}
+
+std::atomic<bool> g_latencyDump(false); // --latency-dump: write the ring out when a stream ends
+
+// Prints the summary of a ring and writes it to path
+static void DumpLatencyTrace(const FrameLatencyRing& ring, const char* path) {
+	std::cout << "Frame latency (" << path << "):\n" << ring.Summary();
+	if (!ring.Dump(path)) std::cout << "can't write " << path << std::endl;
+}
+
+// Writes the trace to path and says so
+static void DumpPipelineTrace(const char* path) {
+	if (g_trace.Dump(path)) std::cout << "Pipeline trace written to " << path << std::endl;
+	else std::cout << "can't write " << path << std::endl;
+}
 
 // Memory pool for efficient bitmap management
 class BitmapPool {
@@ -273,83 +329,6 @@ public:
 	}
 };
 
-// Lock-free frame buffer for ultra-high performance rendering
-struct LockFreeFrameBuffer {
-	struct FrameSlot {
-		std::atomic<uint8_t*> pBits{nullptr};
-		std::atomic<int> width{0};
-		std::atomic<int> height{0};
-		std::atomic<bool> ready{false};
-		std::atomic<uint64_t> timestamp{0};
-	};
-	
-	// Triple buffering for lock-free operation
-	FrameSlot slots[3];
-	std::atomic<int> writeSlot{0};
-	std::atomic<int> readSlot{1};
-	std::atomic<int> processingSlot{2};
-	
-	// Memory pools to avoid allocations
-	std::atomic<uint8_t*> memoryPool[3]{nullptr, nullptr, nullptr};
-	std::atomic<size_t> poolSizes[3]{0, 0, 0};
-	
-	void SetFrame(int width, int height, const uint8_t* srcData) {
-		int currentWrite = writeSlot.load();
-		size_t requiredSize = width * height * 4;
-		
-		// Ensure memory pool is large enough
-		if (poolSizes[currentWrite].load() < requiredSize) {
-			uint8_t* oldPtr = memoryPool[currentWrite].exchange(nullptr);
-			delete[] oldPtr;
-			
-			uint8_t* newPtr = new uint8_t[requiredSize];
-			memoryPool[currentWrite].store(newPtr);
-			poolSizes[currentWrite].store(requiredSize);
-		}
-		
-		uint8_t* dst = memoryPool[currentWrite].load();
-		if (dst) {
-			// Fast memory copy with SIMD optimization
-			memcpy(dst, srcData, requiredSize);
-			
-			// Atomically update frame info
-			slots[currentWrite].width.store(width);
-			slots[currentWrite].height.store(height);
-			slots[currentWrite].pBits.store(dst);
-			slots[currentWrite].timestamp.store(GetTickCount64());
-			slots[currentWrite].ready.store(true);
-			
-			// Rotate buffers
-			int nextWrite = (currentWrite + 1) % 3;
-			int oldRead = readSlot.exchange(currentWrite);
-			writeSlot.store(nextWrite);
-			processingSlot.store(oldRead);
-		}
-	}
-	
-	bool GetLatestFrame(int& width, int& height, uint8_t*& pBits, uint64_t& timestamp) {
-		int current = readSlot.load();
-		if (slots[current].ready.load()) {
-			width = slots[current].width.load();
-			height = slots[current].height.load();
-			pBits = slots[current].pBits.load();
-			timestamp = slots[current].timestamp.load();
-			return true;
-		}
-		return false;
-	}
-	
-	~LockFreeFrameBuffer() {
-		for (int i = 0; i < 3; ++i) {
-			uint8_t* ptr = memoryPool[i].exchange(nullptr);
-			delete[] ptr;
-		}
-	}
-};
-
-// Global performance monitor instance
-static PerformanceMonitor g_perfMonitor;
-
 // Ultra-fast DIB cache with direct memory mapping
 struct UltraFastDIBCache {
 	HBITMAP hBmp = NULL;
@@ -360,6 +339,8 @@ struct UltraFastDIBCache {
 	uint64_t lastUpdateTime = 0;
 	std::atomic<bool> inUse{false};
 	bool gdiSettingsApplied = false; // Track if GDI settings are already set
+	uint64_t generation = 0;         // g_frameBuffer generation the bits hold, 0 if none
+	int frameW = 0, frameH = 0;
 	
 	bool PrepareForSize(int w, int h) {
 		// Only recreate if size differs by more than tolerance (avoids pixel-level flickering)
@@ -420,6 +401,8 @@ struct UltraFastDIBCache {
 			pBits = nullptr;
 		}
 		width = height = 0;
+		generation = 0;
+		frameW = frameH = 0;
 		gdiSettingsApplied = false; // Reset flag on cleanup
 	}
 	
@@ -429,7 +412,7 @@ struct UltraFastDIBCache {
 };
 
 static std::unordered_map<HWND, UltraFastDIBCache> g_ultraFastCache;
-static LockFreeFrameBuffer g_frameBuffer;
+static TripleFrameBuffer g_frameBuffer;
 
 // Optimized color conversion worker with condition variables
 class AsyncColorConverter {
@@ -502,6 +485,10 @@ public:
 
 static AsyncColorConverter g_asyncConverter;
 
+// Worker counts for the parallel tile encoder/decoder (0 = one per hardware thread)
+std::atomic<int> g_encodeThreads(0);
+std::atomic<int> g_decodeThreads(0);
+
 void MinimizeConsoleWindow() {
 	HWND hwndConsole = GetConsoleWindow();
 	if (hwndConsole != NULL) {
@@ -521,33 +508,30 @@ int recvn(SOCKET s, char* buf, int len) {
 	return received;
 }
 
-// === CLIPBOARD PROTOCOL ===
-enum class MsgType : uint8_t {
-	Input = 0,
-	RemoteCtrl = 1,
-	Clipboard = 2 // new
-};
+// --- Stream inputs ---
+// StreamInput, SocketInput and BufferedSocketInput are in StreamInput.h
 
-#pragma pack(push, 1)
-struct ClipboardMsg {
-	MsgType type; // Must be Clipboard
-	uint32_t length; // length of the following UTF-8 string
-	// char data[]; // immediately following, not part of struct
-};
-#pragma pack(pop)
+// --- Wire recording ---
+// WireChunk, WireRecorder and the replay of a recording are in WireRecording.h
 
+static WireRecorder g_wireRecorder;
+
+// send() that also records what was sent when --record is on
+static int SendRecorded(SOCKET s, uint32_t stream, WireKind kind, const void* data, int len) {
+	int sent = send(s, (const char*)data, len, 0);
+	if (sent > 0) g_wireRecorder.Write(stream, kind, data, (size_t)sent);
+	return sent;
+}
+
+// === MESSAGE FRAMING ===
+// MsgHeader, MessageReader and SendMsg are in StreamInput.h
 
 // === CLIPBOARD UTILITIES ===
 static HWND g_clipboardNext = nullptr;
 static SOCKET g_clipboardSocket = INVALID_SOCKET; // set to connected socket on client/server
 
 void SendClipboardPacket(SOCKET sock, const std::string& utf8) {
-	ClipboardMsg msg;
-	msg.type = MsgType::Clipboard;
-	msg.length = static_cast<uint32_t>(utf8.size());
-	send(sock, (const char*)&msg, sizeof(msg), 0);
-	if (!utf8.empty())
-		send(sock, utf8.data(), (int)utf8.size(), 0);
+	SendMsg(sock, MsgType::Clipboard, utf8.data(), (uint32_t)utf8.size());
 }
 
 // Send local clipboard to peer
@@ -618,65 +602,36 @@ struct RemoteCtrlMsg {
 	RemoteCtrlType type;
 	uint8_t value; // fps: [5,10,20,30,40,60]
 };
+#pragma pack(pop)
 
-// --- DIRTY TILE STRUCT ---
-// Replace this struct with your existing one if it differs
-struct DirtyTile {
-	int left, top, right, bottom;
-};
+// --- Tile records ---
+// The tile record format, the tile codecs and the tile content cache are in TileCodec.h, scroll
+// and move detection in MotionDetector.h
+std::atomic<int> g_pixelFormat(PIXEL_FORMAT_BGRA); // the server's preference
+// Cache size in MB, sent to the client as a slot count at connect (0 disables the cache)
+std::atomic<int> g_tileCacheMB(16);
+std::atomic<uint64_t> g_tileCacheLookups(0);
+std::atomic<uint64_t> g_tileCacheHits(0);
 
-constexpr int TILE_W = 32;
-constexpr int TILE_H = 32;
+// How the server finds changed tiles: exact compares them against a full copy of the previous
+// frame, hash keeps one TileHash64 per tile instead (no copy, and half the memory traffic)
+enum ChangeDetectMode { CHANGE_DETECT_EXACT = 0, CHANGE_DETECT_HASH = 1 };
+std::atomic<int> g_changeDetect(CHANGE_DETECT_EXACT);
 
 class BasicBitmap;
 class MainWindow;
 
-// --- Per-window state using BasicBitmap for framebuffer (no hBitmap or dibBits needed) ---
-// State for each streamed window
-struct ScreenBitmapState {
-	BasicBitmap* bmp = nullptr;
-	int imgW = 0;
-	int imgH = 0;
-	CRITICAL_SECTION cs;
+// --- Client frame presentation ---
+// PresentMode, FramePresenter and MemoryPresenter are in FramePresenter.h
+std::atomic<int> g_presentMode(PRESENT_DIRECT);
+
+// --- Per-window state: the presenter owns the framebuffer ---
+// State for each streamed window: FrameSurface (FramePresenter.h) plus what the window needs
+struct ScreenBitmapState : FrameSurface {
 	SOCKET* psktInput = nullptr;
 	MainWindow* mainWindow = nullptr;
-
-	ScreenBitmapState() { InitializeCriticalSection(&cs); }
-	~ScreenBitmapState() { if (bmp) delete bmp; DeleteCriticalSection(&cs); }
 };
 
-/**
- * Compare two 32bpp RGBA framebuffers and collect dirty tiles.
- * A simple line-by-line approach: every run of changed pixels on a scanline is a tile.
- */
-void detect_dirty_tiles(
-	const uint32_t* prev, const uint32_t* curr, int width, int height,
-	std::vector<DirtyTile>& out_tiles
-) {
-	out_tiles.clear();
-	for (int ty = 0; ty < height; ty += TILE_H) {
-		int th = std::min(TILE_H, height - ty);
-		for (int tx = 0; tx < width; tx += TILE_W) {
-			int tw = std::min(TILE_W, width - tx);
-
-			bool dirty = false;
-			for (int y = 0; y < th && !dirty; ++y) {
-				const uint32_t* row_prev = prev + (ty + y) * width + tx;
-				const uint32_t* row_curr = curr + (ty + y) * width + tx;
-				for (int x = 0; x < tw; ++x) {
-					if (row_prev[x] != row_curr[x]) {
-						dirty = true;
-						break;
-					}
-				}
-			}
-			if (dirty) {
-				out_tiles.push_back({ tx, ty, tx + tw, ty + th });
-			}
-		}
-	}
-}
-
 // Extract a tile from a source RGBA buffer into a new BasicBitmap
 BasicBitmap* extract_tile_basicbitmap(const uint8_t* rgba, int width, int height, const DirtyTile& r) {
 	int rw = r.right - r.left, rh = r.bottom - r.top;
@@ -694,25 +649,16 @@ bool QOIEncodeSubimage_BasicBitmap(
 	const std::vector<uint8_t>& rgba, int width, int height, const DirtyTile& r, std::vector<uint8_t>& outQoi
 ) {
 	int rw = r.right - r.left, rh = r.bottom - r.top;
-	BasicBitmap tile(rw, rh, BasicBitmap::A8R8G8B8);
-
-	for (int row = 0; row < rh; ++row) {
-		const uint8_t* src = &rgba[((r.top + row) * width + r.left) * 4];
-		uint8_t* dst = tile.Bits() + row * rw * 4;
-		memcpy(dst, src, rw * 4);
-	}
 
 	qoi_desc desc;
-	desc.width = tile.Width();
-	desc.height = tile.Height();
+	desc.width = rw;
+	desc.height = rh;
 	desc.channels = 4;
 	desc.colorspace = QOI_SRGB;
-	int out_len = 0;
-	void* qoi_data = qoi_encode(tile.Bits(), &desc, &out_len);
-	if (!qoi_data) return false;
+	outQoi.resize(QOI_ENCODE_BOUND(rw, rh, 4));
+	int out_len = qoi_encode_into(outQoi.data(), (int)outQoi.size(), &rgba[(r.top * width + r.left) * 4], width * 4, &desc);
+	if (!out_len) return false;
 	outQoi.resize(out_len);
-	memcpy(outQoi.data(), qoi_data, out_len);
-	free(qoi_data);
 	return true;
 }
 
@@ -769,12 +715,14 @@ void AudioStreamServerThreadXRLE(SOCKET clientSock) {
 	if (pwfx->wFormatTag == WAVE_FORMAT_EXTENSIBLE && pwfx->cbSize >= 22) {
 		wfexSendSize += pwfx->cbSize;
 	}
+	const uint32_t wireStream = g_wireRecorder.NewStream();
 	const uint8_t* wfexBytes = reinterpret_cast<const uint8_t*>(pwfx);
-	if (send(clientSock, (const char*)wfexBytes, (int)wfexSendSize, 0) != (int)wfexSendSize) {
+	if (SendRecorded(clientSock, wireStream, WIRE_AUDIO, wfexBytes, (int)wfexSendSize) != (int)wfexSendSize) {
 		goto end;
 	}
 
 	const int FRAMES_PER_BUFFER = 4096;
+	g_trace.SetThreadName("audio server");
 	while (true) {
 		UINT32 packetLength = 0;
 		if (FAILED(captureClient->GetNextPacketSize(&packetLength))) break;
@@ -785,6 +733,7 @@ void AudioStreamServerThreadXRLE(SOCKET clientSock) {
 		DWORD flags;
 		if (FAILED(captureClient->GetBuffer(&pData, &nFrames, &flags, nullptr, nullptr))) break;
 		if (nFrames == 0) { captureClient->ReleaseBuffer(0); continue; }
+		TRACE_SCOPE("audio packet");
 
 		int bytes_uncompressed = nFrames * pwfx->nBlockAlign;
 		std::vector<uint8_t> xrle_buf(bytes_uncompressed * 2); // enough space for worst-case
@@ -792,9 +741,9 @@ void AudioStreamServerThreadXRLE(SOCKET clientSock) {
 
 		uint32_t net_uncompressed = htonl(bytes_uncompressed);
 		uint32_t net_compressed = htonl((uint32_t)bytes_compressed);
-		if (send(clientSock, (char*)&net_uncompressed, 4, 0) != 4) break;
-		if (send(clientSock, (char*)&net_compressed, 4, 0) != 4) break;
-		if (send(clientSock, (char*)xrle_buf.data(), (int)bytes_compressed, 0) != (int)bytes_compressed) break;
+		if (SendRecorded(clientSock, wireStream, WIRE_AUDIO, &net_uncompressed, 4) != 4) break;
+		if (SendRecorded(clientSock, wireStream, WIRE_AUDIO, &net_compressed, 4) != 4) break;
+		if (SendRecorded(clientSock, wireStream, WIRE_AUDIO, xrle_buf.data(), (int)bytes_compressed) != (int)bytes_compressed) break;
 
 		captureClient->ReleaseBuffer(nFrames);
 	}
@@ -804,12 +753,11 @@ end:
 	audioClient->Release();
 	CoTaskMemFree(pwfx); // <-- free mix format when done
 	closesocket(clientSock);
+	g_wireRecorder.Flush();
 }
 
-// Helper: check if WAVEFORMATEX is actually WAVEFORMATEXTENSIBLE
-bool IsWaveFormatExtensible(const WAVEFORMATEX* wfex) {
-	return (wfex->wFormatTag == WAVE_FORMAT_EXTENSIBLE && wfex->cbSize >= 22);
-}
+// ReadAudioFormat and ReadAudioPacket are in AudioStream.h
+static_assert(sizeof(WAVEFORMATEX) == AUDIO_FORMAT_BYTES, "the audio format is sent as a packed WAVEFORMATEX");
 
 void AudioStreamClientThreadXRLE(const std::string& serverIp) {
 	// Networking: (same as before)
@@ -821,21 +769,10 @@ void AudioStreamClientThreadXRLE(const std::string& serverIp) {
 	if (connect(sock, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) { closesocket(sock); return; }
 
 	// Receive format struct from server
-	WAVEFORMATEX wfex = {};
-	if (recvn(sock, (char*)&wfex, sizeof(WAVEFORMATEX)) != sizeof(WAVEFORMATEX)) { closesocket(sock); return; }
-	std::vector<uint8_t> extBytes;
+	BufferedSocketInput input(sock);
 	std::vector<uint8_t> fullFmt;
-	const WAVEFORMATEX* pwfx = &wfex;
-	if (IsWaveFormatExtensible(&wfex)) {
-		extBytes.resize(wfex.cbSize);
-		if (recvn(sock, (char*)extBytes.data(), wfex.cbSize) != wfex.cbSize) {
-			closesocket(sock); return;
-		}
-		fullFmt.resize(sizeof(WAVEFORMATEX) + extBytes.size());
-		memcpy(fullFmt.data(), &wfex, sizeof(WAVEFORMATEX));
-		memcpy(fullFmt.data() + sizeof(WAVEFORMATEX), extBytes.data(), extBytes.size());
-		pwfx = (const WAVEFORMATEX*)fullFmt.data();
-	}
+	if (!ReadAudioFormat(input, fullFmt)) { closesocket(sock); return; }
+	const WAVEFORMATEX* pwfx = (const WAVEFORMATEX*)fullFmt.data();
 
 	// WASAPI Initialization
 	CoInitialize(nullptr);
@@ -861,18 +798,13 @@ void AudioStreamClientThreadXRLE(const std::string& serverIp) {
 
 	pAudioClient->Start();
 
+	g_trace.SetThreadName("audio client");
+	std::vector<uint8_t> pcm_buf;
 	while (true) {
-		uint32_t net_bytes_uncompressed, net_bytes_compressed;
-		if (recvn(sock, (char*)&net_bytes_uncompressed, 4) != 4) break;
-		if (recvn(sock, (char*)&net_bytes_compressed, 4) != 4) break;
-		uint32_t bytes_uncompressed = ntohl(net_bytes_uncompressed);
-		uint32_t bytes_compressed = ntohl(net_bytes_compressed);
-
-		std::vector<uint8_t> xrle_buf(bytes_compressed);
-		if (recvn(sock, (char*)xrle_buf.data(), bytes_compressed) != (int)bytes_compressed) break;
-		std::vector<uint8_t> pcm_buf(bytes_uncompressed);
-		if (xrle_decompress(pcm_buf.data(), xrle_buf.data(), bytes_compressed) != bytes_uncompressed) break;
+		if (!ReadAudioPacket(input, pcm_buf)) break;
+		TRACE_SCOPE("audio render");
 
+		UINT32 bytes_uncompressed = (UINT32)pcm_buf.size();
 		UINT32 framesToWrite = (bytes_uncompressed / pwfx->nBlockAlign);
 		UINT32 framesWritten = 0;
 		while (framesToWrite > 0) {
@@ -935,6 +867,8 @@ extern MainWindow* g_pMainWindow;
 #define IDM_VIDEO_FPS_60      6016
 
 #define IDM_ALWAYS_ON_TOP     6020
+#define IDM_DUMP_LATENCY      6040
+#define IDM_TOGGLE_TRACE      6041
 
 #define IDM_SENDKEYS          6030
 #define IDM_SENDKEYS_ALTF4    6031
@@ -977,6 +911,9 @@ HMENU CreateScreenContextMenu() {
 	AppendMenuA(hSendKeysMenu, MF_STRING, IDM_SENDKEYS_CTRALTDEL, "Ctrl + Alt + Del");
 	AppendMenuA(hSendKeysMenu, MF_STRING, IDM_SENDKEYS_PRNTSCRN, "PrintScreen");
 	AppendMenuA(hMenu, MF_POPUP, (UINT_PTR)hSendKeysMenu, "Send Keys");
+	AppendMenuA(hMenu, MF_STRING, IDM_DUMP_LATENCY, "Dump Latency Trace");
+	AppendMenuA(hMenu, MF_STRING | (g_traceEnabled ? MF_CHECKED : 0), IDM_TOGGLE_TRACE,
+		g_traceEnabled ? "Stop Pipeline Trace" : "Start Pipeline Trace");
 
 	return hMenu;
 }
@@ -1022,7 +959,7 @@ void SendRemoteKeyCombo(HWND hwnd, int combo) {
 		break;
 	}
 	for (int i = 0; i < n; ++i)
-		send(*psktInput, (char*)&input[i], sizeof(INPUT), 0);
+		SendMsg(*psktInput, MsgType::Input, &input[i], sizeof(INPUT));
 }
 
 #define DEFAULT_PORT 27015
@@ -1037,40 +974,103 @@ const int nNormalized = 65535;
 
 // --- Capture screen to BasicBitmap, with RGBA output ---
 // --- Capture screen into a BasicBitmap (RGBA) ---
-bool CaptureScreenToBasicBitmap(BasicBitmap*& outBmp) {
-	int width = GetSystemMetrics(SM_CXSCREEN);
-	int height = GetSystemMetrics(SM_CYSCREEN);
-	HDC hScreenDC = GetDC(NULL);
-	BITMAPINFO bmi = { 0 };
-	bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-	bmi.bmiHeader.biWidth = width;
-	bmi.bmiHeader.biHeight = -height;
-	bmi.bmiHeader.biPlanes = 1;
-	bmi.bmiHeader.biBitCount = 32;
-	bmi.bmiHeader.biCompression = BI_RGB;
-	void* pBits = nullptr;
-	HBITMAP hBitmap = CreateDIBSection(NULL, &bmi, DIB_RGB_COLORS, &pBits, NULL, 0);
-	if (!hBitmap) { ReleaseDC(NULL, hScreenDC); return false; }
-	HDC hMemDC = CreateCompatibleDC(hScreenDC);
-	HGDIOBJ oldObj = SelectObject(hMemDC, hBitmap);
-	BitBlt(hMemDC, 0, 0, width, height, hScreenDC, 0, 0, SRCCOPY);
-	SelectObject(hMemDC, oldObj);
-	DeleteDC(hMemDC);
-	ReleaseDC(NULL, hScreenDC);
-
-	BasicBitmap* bmp = new BasicBitmap(width, height, BasicBitmap::A8R8G8B8);
-	uint8_t* src = static_cast<uint8_t*>(pBits);
-	uint8_t* dst = bmp->Bits();
-	for (int i = 0; i < width * height; ++i) {
-		dst[i * 4 + 0] = src[i * 4 + 2]; // R
-		dst[i * 4 + 1] = src[i * 4 + 1]; // G
-		dst[i * 4 + 2] = src[i * 4 + 0]; // B
-		dst[i * 4 + 3] = 255;
-	}
-	DeleteObject(hBitmap);
-	outBmp = bmp;
-	return true;
+// Build with REMOTE_COUNT_ALLOCS defined to count heap allocations. The server then reports
+// allocations per frame, which stays at zero once its buffers have reached their working size.
+#ifdef REMOTE_COUNT_ALLOCS
+std::atomic<uint64_t> g_heapAllocs(0);
+void* operator new(size_t size) {
+	g_heapAllocs.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
 }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+#endif
+
+// --- Frame capture ---
+// FrameSource, the synthetic and corpus sources and CaptureContext are in FrameSource.h
+
+// Desktop capture with GDI. The screen DC, memory DC and DIB section live as long as the
+// source; the DIB is only recreated when the screen size changes.
+class GdiFrameSource : public FrameSource {
+private:
+	HDC screenDC = nullptr;
+	HDC memDC = nullptr;
+	HBITMAP dib = nullptr;
+	HGDIOBJ oldObj = nullptr;
+	const uint8_t* dibBits = nullptr;
+	int dibW = 0, dibH = 0;
+
+	void ReleaseDib() {
+		if (!dib) return;
+		SelectObject(memDC, oldObj);
+		DeleteObject(dib);
+		dib = nullptr;
+		dibBits = nullptr;
+	}
+
+public:
+	GdiFrameSource() {
+		screenDC = GetDC(NULL);
+		if (screenDC) memDC = CreateCompatibleDC(screenDC);
+	}
+
+	~GdiFrameSource() {
+		ReleaseDib();
+		if (memDC) DeleteDC(memDC);
+		if (screenDC) ReleaseDC(NULL, screenDC);
+	}
+
+	bool QuerySize(int& width, int& height) override {
+		width = GetSystemMetrics(SM_CXSCREEN);
+		height = GetSystemMetrics(SM_CYSCREEN);
+		return width > 0 && height > 0;
+	}
+
+	bool Capture(uint8_t* bits, int pitch, int width, int height, bool bgra) override {
+		if (!memDC) return false;
+		if (!dib || dibW != width || dibH != height) {
+			ReleaseDib();
+			BITMAPINFO bmi = { 0 };
+			bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+			bmi.bmiHeader.biWidth = width;
+			bmi.bmiHeader.biHeight = -height;
+			bmi.bmiHeader.biPlanes = 1;
+			bmi.bmiHeader.biBitCount = 32;
+			bmi.bmiHeader.biCompression = BI_RGB;
+			void* pBits = nullptr;
+			dib = CreateDIBSection(screenDC, &bmi, DIB_RGB_COLORS, &pBits, NULL, 0);
+			if (!dib) return false;
+			oldObj = SelectObject(memDC, dib);
+			dibBits = static_cast<const uint8_t*>(pBits);
+			dibW = width;
+			dibH = height;
+		}
+		if (!BitBlt(memDC, 0, 0, width, height, screenDC, 0, 0, SRCCOPY)) return false;
+		GdiFlush();
+
+		// The DIB is BGRA already, with an undefined alpha byte that the client ignores
+		if (bgra) {
+			for (int y = 0; y < height; ++y)
+				memcpy(bits + (size_t)y * pitch, dibBits + (size_t)y * width * 4, (size_t)width * 4);
+			return true;
+		}
+
+		// BGRA -> RGBA, alpha forced opaque
+		for (int y = 0; y < height; ++y) {
+			const uint32_t* src = reinterpret_cast<const uint32_t*>(dibBits + (size_t)y * width * 4);
+			uint32_t* dst = reinterpret_cast<uint32_t*>(bits + (size_t)y * pitch);
+			for (int x = 0; x < width; ++x) {
+				uint32_t v = src[x];
+				dst[x] = 0xFF000000u | (v & 0x0000FF00u) | ((v >> 16) & 0xFFu) | ((v & 0xFFu) << 16);
+			}
+		}
+		return true;
+	}
+};
+
+enum CaptureSourceKind { CAPTURE_GDI = 0, CAPTURE_SYNTHETIC = 1 };
+std::atomic<int> g_captureSource(CAPTURE_GDI);
 
 
 
@@ -1114,12 +1114,10 @@ bool QOIEncodeBasicBitmap(const BasicBitmap* bmp, std::vector<uint8_t>& outQoi)
 	desc.height = bmp->Height();
 	desc.channels = 4;
 	desc.colorspace = QOI_SRGB;
-	int out_len = 0;
-	void* qoi_data = qoi_encode(bmp->Bits(), &desc, &out_len);
-	if (!qoi_data) return false;
+	outQoi.resize(QOI_ENCODE_BOUND(desc.width, desc.height, 4));
+	int out_len = qoi_encode_into(outQoi.data(), (int)outQoi.size(), bmp->Bits(), bmp->Pitch(), &desc);
+	if (!out_len) return false;
 	outQoi.resize(out_len);
-	memcpy(outQoi.data(), qoi_data, out_len);
-	free(qoi_data);
 	return true;
 }
 
@@ -1237,13 +1235,10 @@ void AudioStreamAcceptLoop(int port) {
 }
 
 int BroadcastInput(std::vector<SOCKET> vsktSend, INPUT* input) {
-	int iResult = 0;
-
 	for (auto& sktSend : vsktSend) {
 		if (sktSend != INVALID_SOCKET) {
 
-			iResult = send(sktSend, (char*)input, sizeof(INPUT), 0);
-			if (iResult == SOCKET_ERROR) {
+			if (!SendMsg(sktSend, MsgType::Input, input, sizeof(INPUT))) {
 				std::cout << "send failed: " << WSAGetLastError() << std::endl;
 			}
 		}
@@ -1322,19 +1317,17 @@ int ConnectScreenStreamServer(SOCKET& sktConn, std::string serverAdd, int port)
 }
 
 int ReceiveServer(SOCKET sktConn, INPUT& data) {
-	INPUT buff;
-	int iResult = recvn(sktConn, (char*)&buff, sizeof(INPUT));
-	if (iResult != sizeof(INPUT)) {
-		if (iResult == 0) {
-			std::cout << "Connection closed" << std::endl;
-		}
-		else {
-			std::cout << "Receive failed with error: " << WSAGetLastError() << std::endl;
-		}
-		return 1;
+	// Unbuffered, so that nothing past this message is taken off the socket
+	SocketInput input(sktConn);
+	MessageReader reader(input);
+	MsgHeader header;
+	while (reader.Next(header)) {
+		if (header.type != MsgType::Input || header.length != sizeof(INPUT)) continue;
+		if (reader.Payload().Read(&data, sizeof(INPUT))) return 0;
+		break;
 	}
-	data = buff;
-	return 0;
+	std::cout << "Connection closed or receive failed: " << WSAGetLastError() << std::endl;
+	return 1;
 }
 int CloseConnection(SOCKET* sktConn) {
 	closesocket(*sktConn);
@@ -1344,303 +1337,135 @@ int CloseConnection(SOCKET* sktConn) {
 // =================== SCREEN STREAM SERVER =====================
 
 // --- Optimized server thread: now uses XRLE for dirty bitmask and QOI tiles ---
-// Uncomment this line for verbose debug output on the server
-//#define SCREENSTREAMSERVER_DEBUG
-
-#ifdef SCREENSTREAMSERVER_DEBUG
-#define SSDPRINTF(...)        \
-    do {                      \
-        printf(__VA_ARGS__);  \
-        fflush(stdout);       \
-    } while (0)
-#else
-#define SSDPRINTF(...) do {} while (0)
-#endif
+// EncodedFrame and ScreenFrameEncoder are in ScreenFrameEncoder.h
 
-void ScreenStreamServerThread(SOCKET sktClient) {
-	using namespace std::chrono;
-
-	// --- Clipboard protocol structures (should match recvn side) ---
-	enum class MsgType : uint8_t {
-		Input = 0,
-		RemoteCtrl = 1,
-		Clipboard = 2
-	};
-#pragma pack(push, 1)
-	struct ClipboardMsg {
-		MsgType type;
-		uint32_t length;
-		// char data[] follows
-	};
-#pragma pack(pop)
-
-	std::unique_ptr<BasicBitmap> prevBmp;
-	std::unique_ptr<BasicBitmap> currBmp;
-	bool first = true;
-	static int frameCounter = 0;
+// Tile cache slots for g_tileCacheMB; every viewer is sent the same count when it starts
+static uint32_t TileCacheSlots() {
+	return (uint32_t)((size_t)std::max(0, g_tileCacheMB.load()) * 1024 * 1024 / TILE_CACHE_SLOT_BYTES);
+}
 
-	auto lastPrint = steady_clock::now();
-	int frames = 0;
-	size_t bytes = 0;
+// --- Screen broadcast ---
+// ScreenViewer and ScreenBroadcaster are in ScreenBroadcaster.h; the producers follow the server's
+// settings through ServerBroadcastHost
 
-	g_screenStreamActive = true;
-	g_screenStreamBytes = 0;
-	g_screenStreamFPS = 0;
-
-	// --- CAPTURE SCREEN ONCE TO GET SIZE ---
-	BasicBitmap* pTmpBmp = nullptr;
-	while (!pTmpBmp) {
-		CaptureScreenToBasicBitmap(pTmpBmp);
+class ServerBroadcastHost : public ScreenBroadcastHost {
+#ifdef REMOTE_COUNT_ALLOCS
+	uint64_t allocsAtReport = 0;
+#endif
+public:
+	std::unique_ptr<FrameSource> NewFrameSource() override {
+		if (g_captureSource.load() == CAPTURE_SYNTHETIC)
+			return std::unique_ptr<FrameSource>(new SyntheticFrameSource(1920, 1080));
+		return std::unique_ptr<FrameSource>(new GdiFrameSource());
 	}
-	int screen_width = pTmpBmp->Width();
-	int screen_height = pTmpBmp->Height();
-	delete pTmpBmp;
-
-	// --- SEND WIDTH/HEIGHT TO CLIENT BEFORE MAIN LOOP ---
-	uint32_t widthNet = htonl((uint32_t)screen_width);
-	uint32_t heightNet = htonl((uint32_t)screen_height);
-	send(sktClient, (const char*)&widthNet, 4, 0);
-	send(sktClient, (const char*)&heightNet, 4, 0);
-	SSDPRINTF("ScreenStreamServerThread: sent initial screen size %dx%d\n", screen_width, screen_height);
-
-	// --- Start XRLE audio streaming in parallel ---
-	std::thread audioThread([sktClient]() {
-		// Each client should get a separate audio socket/connection.
-		// If you want to use the same socket as screen, use sktClient directly.
-		// Otherwise, accept a separate connection and call AudioStreamServerThreadXRLE().
-		// Here, we assume a **separate audio socket** (recommended), so nothing here.
-		// If you want to use the same socket, call AudioStreamServerThreadXRLE() here:
-		// AudioStreamServerThreadXRLE(sktClient);
-
-		// If your design is to use a SEPARATE socket, you simply launch the audio server thread elsewhere.
-		// If your design is to use the SAME socket for both video and audio, you can call:
-		// AudioStreamServerThreadXRLE(sktClient);
-
-		// For most remote desktop designs, audio and screen use SEPARATE sockets.
-		// So you likely do NOT need to call AudioStreamServerThreadXRLE here.
-		// Remove or adapt this lambda as needed for your architecture.
-		});
-	audioThread.detach();
+	int EncodeThreads() override { return g_encodeThreads.load(); }
+	uint32_t TileCacheSlots() override { return ::TileCacheSlots(); }
+	bool StreamActive() override { return g_screenStreamActive.load(); }
+	int Fps() override { return g_streamingFps.load(); }
+	bool HashDetect() override { return g_changeDetect.load() == CHANGE_DETECT_HASH; }
 
-	// --- Clipboard: allow receiving clipboard packets from client and apply locally ---
-	auto try_receive_clipboard = [&]() {
-		u_long nonblock = 1;
-		ioctlsocket(sktClient, FIONBIO, &nonblock);
-		char cbuf[8192];
-		int peeked = recv(sktClient, cbuf, sizeof(ClipboardMsg), MSG_PEEK);
-		if (peeked >= (int)sizeof(ClipboardMsg)) {
-			ClipboardMsg* cmsg = (ClipboardMsg*)cbuf;
-			int total_len = int(sizeof(ClipboardMsg) + cmsg->length);
-			if (cmsg->type == MsgType::Clipboard && peeked >= total_len) {
-				std::vector<char> msgbuf(total_len);
-				int recvd = recvn(sktClient, msgbuf.data(), total_len);
-				if (recvd == total_len) {
-					std::string utf8(msgbuf.data() + sizeof(ClipboardMsg), cmsg->length);
-					ApplyRemoteClipboard(utf8);
-				}
-				u_long block = 0;
-				ioctlsocket(sktClient, FIONBIO, &block);
-				return true;
-			}
+	void Report(int frames, size_t bytes, int width, int height, ScreenFrameEncoder& encoder, bool hashDetect) override {
+		g_screenStreamW = width;
+		g_screenStreamH = height;
+		g_screenStreamFPS = frames;
+		g_screenStreamBytes = bytes;
+		TileContentCache* tileCache = encoder.Cache();
+		if (tileCache && tileCache->lookups) {
+			SSDPRINTF("ScreenBroadcaster: tile cache hit rate %.1f%% (%llu of %llu)\n",
+				100.0 * tileCache->hits / tileCache->lookups,
+				(unsigned long long)tileCache->hits, (unsigned long long)tileCache->lookups);
+			g_tileCacheLookups += tileCache->lookups;
+			g_tileCacheHits += tileCache->hits;
+			tileCache->lookups = tileCache->hits = 0;
 		}
-		u_long block = 0;
-		ioctlsocket(sktClient, FIONBIO, &block);
-		return false;
-	};
-
-	while (g_screenStreamActive) {
-		try_receive_clipboard();
-
-		int fps = g_streamingFps.load();
-		int frameInterval = 1000 / fps;
-		auto start = steady_clock::now();
-
-		BasicBitmap* pBmp = nullptr;
-		if (!CaptureScreenToBasicBitmap(pBmp)) continue;
-		currBmp.reset(pBmp);
-		if (!currBmp) continue;
+		SSDPRINTF("ScreenBroadcaster: tiles so far raw %llu solid %llu palette %llu qoi %llu xor %llu cached %llu\n",
+			(unsigned long long)g_metrics.Counter(METRIC_SERVER_TILES_RAW), (unsigned long long)g_metrics.Counter(METRIC_SERVER_TILES_SOLID),
+			(unsigned long long)g_metrics.Counter(METRIC_SERVER_TILES_PALETTE), (unsigned long long)g_metrics.Counter(METRIC_SERVER_TILES_QOI),
+			(unsigned long long)g_metrics.Counter(METRIC_SERVER_TILES_XOR), (unsigned long long)g_metrics.Counter(METRIC_SERVER_TILES_CACHED));
+		uint64_t detectNs, detectTiles;
+		encoder.TakeDetectStats(detectNs, detectTiles);
+		if (detectTiles)
+			SSDPRINTF("ScreenBroadcaster: %s change detection %.0f ns/tile\n",
+				hashDetect ? "hash" : "exact", (double)detectNs / detectTiles);
+		SSDPRINTF("ScreenBroadcaster: frame latency\n%s", g_serverLatency.Summary().c_str());
+#ifdef REMOTE_COUNT_ALLOCS
+		uint64_t allocs = g_heapAllocs.load();
+		SSDPRINTF("ScreenBroadcaster: %.1f heap allocations per frame\n", (double)(allocs - allocsAtReport) / frames);
+		allocsAtReport = allocs;
+#endif
+	}
+};
 
-		int width = currBmp->Width();
-		int height = currBmp->Height();
-		const uint8_t* curr_rgba = currBmp->Bits();
+static ServerBroadcastHost g_serverBroadcastHost;
+static ScreenBroadcaster g_screenBroadcasterRgba(PIXEL_FORMAT_RGBA, TILE_RECORD_V1, g_serverBroadcastHost);
+static ScreenBroadcaster g_screenBroadcasterBgra(PIXEL_FORMAT_BGRA, TILE_RECORD_V1, g_serverBroadcastHost);
+static ScreenBroadcaster g_screenBroadcasterRgbaV2(PIXEL_FORMAT_RGBA, TILE_RECORD_V2, g_serverBroadcastHost);
+static ScreenBroadcaster g_screenBroadcasterBgraV2(PIXEL_FORMAT_BGRA, TILE_RECORD_V2, g_serverBroadcastHost);
+
+// The producer of the stream a viewer negotiated; viewers that agree share its encoded frames
+static ScreenBroadcaster& ScreenBroadcasterFor(int pixelFormat, int recordFormat) {
+	if (recordFormat == TILE_RECORD_V2)
+		return pixelFormat == PIXEL_FORMAT_BGRA ? g_screenBroadcasterBgraV2 : g_screenBroadcasterRgbaV2;
+	return pixelFormat == PIXEL_FORMAT_BGRA ? g_screenBroadcasterBgra : g_screenBroadcasterRgba;
+}
 
-		size_t tiles_x = (width + TILE_W - 1) / TILE_W;
-		size_t tiles_y = (height + TILE_H - 1) / TILE_H;
-		size_t numTiles = tiles_x * tiles_y;
+// One viewer: negotiates the pixel and tile record formats, then sends it the frames of the matching producer
+void ScreenStreamServerThread(SOCKET sktClient) {
+	g_trace.SetThreadName("screen sender");
+
+	// --- The client's capabilities decide the pixel and tile record formats ---
+	BufferedSocketInput input(sktClient);
+	MessageReader reader(input);
+	MsgHeader header;
+	uint32_t capsNet = 0;
+	if (!reader.Next(header) || header.type != MsgType::ScreenCaps || !reader.Payload().Read(&capsNet, 4)) {
+		SSDPRINTF("ScreenStreamServerThread: no capabilities from client\n");
+		closesocket(sktClient);
+		return;
+	}
+	uint32_t caps = ntohl(capsNet);
+	int pixelFormat = (g_pixelFormat.load() == PIXEL_FORMAT_BGRA && (caps & SCREEN_CAP_BGRA))
+		? PIXEL_FORMAT_BGRA : PIXEL_FORMAT_RGBA;
+	int recordFormat = (caps & SCREEN_CAP_TILE_V2) ? TILE_RECORD_V2 : TILE_RECORD_V1;
+	ScreenBroadcaster& broadcaster = ScreenBroadcasterFor(pixelFormat, recordFormat);
 
-		std::vector<uint8_t> dirtyBitmask((numTiles + 7) / 8, 0);
-		std::vector<std::pair<int, int>> DirtyTileIndices;
+	g_screenStreamActive = true;
+	g_screenStreamBytes = 0;
+	g_screenStreamFPS = 0;
+	std::shared_ptr<ScreenViewer> viewer = std::make_shared<ScreenViewer>();
+	broadcaster.Add(viewer);
+
+	// Everything goes out through send_slices, so that --record sees exactly what the client does
+	const uint32_t wireStream = g_wireRecorder.NewStream();
+	auto send_slices = [&](const std::vector<WireSlice>& slices) -> bool {
+		if (!SendGather(sktClient, slices.data(), slices.size())) return false;
+		g_wireRecorder.Write(wireStream, WIRE_SCREEN, slices.data(), slices.size());
+		return true;
+	};
 
-		frameCounter++;
-		if (first || frameCounter % 60 == 0) {
-			for (size_t ty = 0; ty < tiles_y; ++ty)
-				for (size_t tx = 0; tx < tiles_x; ++tx) {
-					size_t tidx = ty * tiles_x + tx;
-					dirtyBitmask[tidx / 8] |= 1 << (tidx % 8);
-					DirtyTileIndices.push_back({ (int)tx, (int)ty });
-				}
-			prevBmp = std::make_unique<BasicBitmap>(*currBmp);
-			first = false;
-		}
-		else {
-			if (prevBmp && prevBmp->Width() == width && prevBmp->Height() == height) {
-				const uint8_t* prev = prevBmp->Bits();
-				for (size_t ty = 0; ty < tiles_y; ++ty) {
-					for (size_t tx = 0; tx < tiles_x; ++tx) {
-						int tileLeft = (int)(tx * TILE_W);
-						int tileTop = (int)(ty * TILE_H);
-						int tileW = std::min(TILE_W, width - tileLeft);
-						int tileH = std::min(TILE_H, height - tileTop);
-						bool dirty = false;
-						for (int row = 0; row < tileH; ++row) {
-							int y = tileTop + row;
-							const uint8_t* prevRow = prev + (y * width + tileLeft) * 4;
-							const uint8_t* currRow = curr_rgba + (y * width + tileLeft) * 4;
-							if (memcmp(prevRow, currRow, tileW * 4) != 0) {
-								dirty = true;
-								break;
-							}
-						}
-						if (dirty) {
-							size_t tidx = ty * tiles_x + tx;
-							dirtyBitmask[tidx / 8] |= 1 << (tidx % 8);
-							DirtyTileIndices.push_back({ (int)tx, (int)ty });
-						}
-					}
-				}
-			}
-			else {
-				for (size_t ty = 0; ty < tiles_y; ++ty)
-					for (size_t tx = 0; tx < tiles_x; ++tx) {
-						size_t tidx = ty * tiles_x + tx;
-						dirtyBitmask[tidx / 8] |= 1 << (tidx % 8);
-						DirtyTileIndices.push_back({ (int)tx, (int)ty });
-					}
-			}
+	// --- The client's messages after the capabilities are read on their own thread; a client
+	// that goes away is noticed by the next send ---
+	std::thread clientReader([&]() {
+		g_trace.SetThreadName("screen client messages");
+		MsgHeader message;
+		while (reader.Next(message)) {
+			if (message.type != MsgType::Clipboard) continue;
+			std::string utf8;
+			if (!reader.ReadPayload(utf8)) break;
+			ApplyRemoteClipboard(utf8);
 		}
+	});
 
-		std::vector<uint8_t> xrleBitmask(std::max<size_t>(1, dirtyBitmask.size() * 2));
-		size_t xrleBitmaskLen = xrle_compress(xrleBitmask.data(), dirtyBitmask.data(), dirtyBitmask.size());
-		xrleBitmask.resize(xrleBitmaskLen);
-		uint32_t xrleBitmaskLenNet = htonl((uint32_t)xrleBitmaskLen);
-		send(sktClient, (const char*)&xrleBitmaskLenNet, 4, 0);
-		if (xrleBitmaskLen > 0)
-			send(sktClient, (const char*)xrleBitmask.data(), xrleBitmaskLen, 0);
-
-		uint32_t nTilesNet = htonl((uint32_t)DirtyTileIndices.size());
-		send(sktClient, (const char*)&nTilesNet, 4, 0);
-
-		size_t tileSeq = 0;
-		for (const auto& idx : DirtyTileIndices) {
-			int tx = idx.first, ty = idx.second;
-			int tileLeft = tx * TILE_W;
-			int tileTop = ty * TILE_H;
-			int tileW = std::min(TILE_W, width - tileLeft);
-			int tileH = std::min(TILE_H, height - tileTop);
-
-			BasicBitmap tile(tileW, tileH, BasicBitmap::A8R8G8B8);
-			for (int row = 0; row < tileH; ++row) {
-				const uint8_t* src = curr_rgba + ((tileTop + row) * width + tileLeft) * 4;
-				uint8_t* dst = tile.Bits() + row * tileW * 4;
-				memcpy(dst, src, tileW * 4);
-			}
-			std::vector<uint8_t> qoiData;
-			QOIEncodeBasicBitmap(&tile, qoiData);
-
-			// Adaptive compression: skip XRLE for high FPS to reduce CPU overhead
-			std::vector<uint8_t> xrleData;
-			size_t xrleSize = qoiData.size();
-			int currentFps = g_streamingFps.load();
-			bool useDoubleCompression = (currentFps <= 30); // Only use XRLE for FPS <= 30
-			
-			if (useDoubleCompression) {
-				xrleData.resize(std::max<size_t>(1, qoiData.size() * 2));
-				xrleSize = xrle_compress(xrleData.data(), qoiData.data(), qoiData.size());
-				xrleData.resize(xrleSize);
-			} else {
-				// For high FPS, use QOI data directly to reduce compression overhead
-				xrleData = qoiData;
-				xrleSize = qoiData.size();
-			}
+	// --- The first frame is a keyframe; its size and tile cache go out ahead of it ---
+	SendScreenFrames(broadcaster, *viewer, pixelFormat, recordFormat, send_slices);
 
-			// Network batching: collect multiple tiles into a single buffer to reduce send() calls
-			static std::vector<uint8_t> networkBuffer;
-			static constexpr size_t MAX_BATCH_SIZE = 64 * 1024; // 64KB batches for optimal network performance
-			
-			// Prepare tile data for batching
-			uint32_t xNet = htonl(tileLeft);
-			uint32_t yNet = htonl(tileTop);
-			uint32_t wNet = htonl(tileW);
-			uint32_t hNet = htonl(tileH);
-			uint32_t xrleLenNet = htonl((uint32_t)xrleData.size());
-			uint32_t qoiOrigLenNet = htonl((uint32_t)qoiData.size());
-			
-			// Calculate total size for this tile
-			size_t tilePacketSize = 24 + xrleData.size(); // 6 * 4 bytes headers + data
-			
-			// If adding this tile would exceed batch size, send current batch first
-			if (!networkBuffer.empty() && networkBuffer.size() + tilePacketSize > MAX_BATCH_SIZE) {
-				size_t offset = 0;
-				while (offset < networkBuffer.size()) {
-					int sent = send(sktClient, (const char*)(networkBuffer.data() + offset), networkBuffer.size() - offset, 0);
-					if (sent <= 0) goto END;
-					offset += sent;
-				}
-				networkBuffer.clear();
-			}
-			
-			// Add tile to batch buffer
-			size_t currentPos = networkBuffer.size();
-			networkBuffer.resize(currentPos + tilePacketSize);
-			
-			memcpy(networkBuffer.data() + currentPos, &xNet, 4); currentPos += 4;
-			memcpy(networkBuffer.data() + currentPos, &yNet, 4); currentPos += 4;
-			memcpy(networkBuffer.data() + currentPos, &wNet, 4); currentPos += 4;
-			memcpy(networkBuffer.data() + currentPos, &hNet, 4); currentPos += 4;
-			memcpy(networkBuffer.data() + currentPos, &xrleLenNet, 4); currentPos += 4;
-			memcpy(networkBuffer.data() + currentPos, &qoiOrigLenNet, 4); currentPos += 4;
-			memcpy(networkBuffer.data() + currentPos, xrleData.data(), xrleData.size());
-			
-			bytes += xrleData.size() + 24;
-			tileSeq++;
-			
-			// Send batch if we're at the end of dirty tiles or batch is getting large
-			bool isLastTile = (tileSeq >= DirtyTileIndices.size());
-			bool shouldFlushBatch = (networkBuffer.size() >= MAX_BATCH_SIZE / 2) || isLastTile;
-			
-			if (shouldFlushBatch && !networkBuffer.empty()) {
-				size_t offset = 0;
-				while (offset < networkBuffer.size()) {
-					int sent = send(sktClient, (const char*)(networkBuffer.data() + offset), networkBuffer.size() - offset, 0);
-					if (sent <= 0) goto END;
-					offset += sent;
-				}
-				networkBuffer.clear();
-			}
-		}
-		prevBmp = std::make_unique<BasicBitmap>(*currBmp);
-
-		frames++;
-		g_screenStreamW = width;
-		g_screenStreamH = height;
-		auto now = steady_clock::now();
-		if (duration_cast<seconds>(now - lastPrint).count() >= 1) {
-			g_screenStreamFPS = frames;
-			g_screenStreamBytes = bytes;
-			frames = 0;
-			bytes = 0;
-			lastPrint = now;
-		}
-		auto elapsed = duration_cast<milliseconds>(steady_clock::now() - start).count();
-		// Use high-resolution timing instead of Sleep for better performance
-		if (elapsed < frameInterval) {
-			auto targetTime = start + milliseconds(frameInterval);
-			std::this_thread::sleep_until(targetTime);
-		}
-	}
-END:
+	broadcaster.Remove(viewer);
+	shutdown(sktClient, SD_BOTH); // wakes the reader if the client is still connected
+	clientReader.join();
 	closesocket(sktClient);
-	g_screenStreamActive = false;
+	g_wireRecorder.Flush();
+	if (g_latencyDump.load()) DumpLatencyTrace(g_serverLatency, "latency_server.csv");
+	if (g_traceDump.load()) DumpPipelineTrace("trace_server.json");
 	SSDPRINTF("ScreenStreamServerThread: closesocket, exiting thread\n");
 }
 
@@ -1652,18 +1477,7 @@ END:
 // You must set this on window creation.
 
 // --- Client streaming: receive XRLE bitmask and XRLE tiles ---
-// Uncomment this line for verbose debug output
-//#define SCREENRECV_DEBUG
-
-#ifdef SCREENRECV_DEBUG
-#define SRDPRINTF(...)        \
-    do {                      \
-        printf(__VA_ARGS__);  \
-        fflush(stdout);       \
-    } while (0)
-#else
-#define SRDPRINTF(...) do {} while (0)
-#endif
+// ParallelFrameDecoder, ReadScreenHandshake and ReadScreenFrame are in ParallelFrameDecoder.h
 
 // Set "Reconnecting..." in the title bar
 inline void SetReconnectingTitle(HWND hwnd, const std::string& ip) {
@@ -1700,25 +1514,216 @@ inline void SetConnectionTitle(HWND hwnd, const std::string& ip, int port, const
 	PostMessage(hwnd, WM_USER + 2, 0, (LPARAM)title);
 }
 
+// Smallest rect containing every rect of a non-empty damage list
+static DamageRect DamageBounds(const std::vector<DamageRect>& damage) {
+	int left = damage[0].x, top = damage[0].y, right = left + damage[0].w, bottom = top + damage[0].h;
+	for (const DamageRect& d : damage) {
+		left = std::min(left, d.x);
+		top = std::min(top, d.y);
+		right = std::max(right, d.x + d.w);
+		bottom = std::max(bottom, d.y + d.h);
+	}
+	return { left, top, right - left, bottom - top };
+}
+
+// Client area covered by a frame rect when the frame is stretched over clientW x clientH,
+// rounded outwards with a pixel to spare for the halftone filter
+static RECT FrameToClientRect(const DamageRect& d, int frameW, int frameH, int clientW, int clientH) {
+	RECT r;
+	r.left = (LONG)((int64_t)d.x * clientW / frameW) - 1;
+	r.top = (LONG)((int64_t)d.y * clientH / frameH) - 1;
+	r.right = (LONG)(((int64_t)(d.x + d.w) * clientW + frameW - 1) / frameW) + 1;
+	r.bottom = (LONG)(((int64_t)(d.y + d.h) * clientH + frameH - 1) / frameH) + 1;
+	return r;
+}
+
+// Decodes straight into a DIB section sized exactly to the frame. Present() only invalidates
+// the damage; WM_PAINT then blits the rects of the update region out of the DIB, so a changed
+// pixel is written once by the decoder and read once by GDI.
+class DibPresenter : public FramePresenter {
+	HWND hwnd;
+	HBITMAP hBmp = NULL;
+	HDC hMemDC = NULL;
+	HGDIOBJ oldObj = NULL;
+	uint8_t* bits = nullptr;
+	int width = 0, height = 0;
+	std::vector<uint8_t> regionData; // GetRegionData buffer, reused across paints
+
+	// Past this many rects a frame invalidates, and a paint blits, their bounding box instead
+	static const size_t MAX_PAINT_RECTS = 64;
+
+	void Release() {
+		if (hMemDC) {
+			if (oldObj) SelectObject(hMemDC, oldObj);
+			DeleteDC(hMemDC);
+			hMemDC = NULL;
+			oldObj = NULL;
+		}
+		if (hBmp) {
+			DeleteObject(hBmp);
+			hBmp = NULL;
+		}
+		bits = nullptr;
+		width = height = 0;
+	}
+
+	void BlitRect(HDC hdc, const RECT& r, int clientW, int clientH) {
+		if (clientW == width && clientH == height) {
+			BitBlt(hdc, r.left, r.top, r.right - r.left, r.bottom - r.top, hMemDC, r.left, r.top, SRCCOPY);
+			return;
+		}
+		// Source pixels under the rect, then exactly the client area they stretch to, so the
+		// pieces of one paint line up; the update region clips whatever spills over
+		int sx0 = std::max(0, (int)((int64_t)r.left * width / clientW) - 1);
+		int sy0 = std::max(0, (int)((int64_t)r.top * height / clientH) - 1);
+		int sx1 = std::min(width, (int)(((int64_t)r.right * width + clientW - 1) / clientW) + 1);
+		int sy1 = std::min(height, (int)(((int64_t)r.bottom * height + clientH - 1) / clientH) + 1);
+		if (sx1 <= sx0 || sy1 <= sy0) return;
+		int dx0 = (int)((int64_t)sx0 * clientW / width), dx1 = (int)((int64_t)sx1 * clientW / width);
+		int dy0 = (int)((int64_t)sy0 * clientH / height), dy1 = (int)((int64_t)sy1 * clientH / height);
+		StretchBlt(hdc, dx0, dy0, dx1 - dx0, dy1 - dy0, hMemDC, sx0, sy0, sx1 - sx0, sy1 - sy0, SRCCOPY);
+	}
+
+public:
+	explicit DibPresenter(HWND hwnd) : hwnd(hwnd) {}
+	~DibPresenter() { Release(); }
+
+	bool Resize(int w, int h) override {
+		Release();
+		BITMAPINFO bmi = {0};
+		bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+		bmi.bmiHeader.biWidth = w;
+		bmi.bmiHeader.biHeight = -h; // Top-down DIB
+		bmi.bmiHeader.biPlanes = 1;
+		bmi.bmiHeader.biBitCount = 32;
+		bmi.bmiHeader.biCompression = BI_RGB;
+
+		void* pBits = nullptr;
+		hBmp = CreateDIBSection(NULL, &bmi, DIB_RGB_COLORS, &pBits, NULL, 0);
+		if (!hBmp) return false;
+		hMemDC = CreateCompatibleDC(NULL);
+		if (!hMemDC || !(oldObj = SelectObject(hMemDC, hBmp))) {
+			Release();
+			return false;
+		}
+		bits = (uint8_t*)pBits;
+		width = w;
+		height = h;
+		return true;
+	}
+
+	uint8_t* Bits() override { return bits; }
+	int Pitch() override { return width * 4; } // 32bpp rows need no padding
+
+	void Present(const std::vector<DamageRect>& damage) override {
+		RECT client;
+		GetClientRect(hwnd, &client);
+		int clientW = client.right - client.left, clientH = client.bottom - client.top;
+		if (clientW <= 0 || clientH <= 0 || !width) return;
+		if (damage.size() <= MAX_PAINT_RECTS) {
+			for (const DamageRect& d : damage) {
+				RECT r = FrameToClientRect(d, width, height, clientW, clientH);
+				InvalidateRect(hwnd, &r, FALSE);
+			}
+			return;
+		}
+		RECT r = FrameToClientRect(DamageBounds(damage), width, height, clientW, clientH);
+		InvalidateRect(hwnd, &r, FALSE);
+	}
+
+	// Blits the parts of the DIB under updateRgn (taken before BeginPaint validated it).
+	// Called from WM_PAINT with bmpState->paintMutex held.
+	void Paint(HDC hdc, HRGN updateRgn, int clientW, int clientH) {
+		if (!hMemDC) return;
+		SetStretchBltMode(hdc, HALFTONE);
+		SetBrushOrgEx(hdc, 0, 0, NULL);
+
+		DWORD size = GetRegionData(updateRgn, 0, NULL);
+		if (size > regionData.size()) regionData.resize(size);
+		RGNDATA* data = (RGNDATA*)regionData.data();
+		if (!size || !GetRegionData(updateRgn, size, data)) {
+			RECT all = { 0, 0, clientW, clientH };
+			BlitRect(hdc, all, clientW, clientH);
+			return;
+		}
+		if (data->rdh.nCount > MAX_PAINT_RECTS) {
+			BlitRect(hdc, data->rdh.rcBound, clientW, clientH);
+			return;
+		}
+		const RECT* rects = (const RECT*)data->Buffer;
+		for (DWORD i = 0; i < data->rdh.nCount; ++i)
+			BlitRect(hdc, rects[i], clientW, clientH);
+	}
+};
+
+// The previous presentation: the surface is a plain bitmap, published by damage into
+// g_frameBuffer, and WM_PAINT copies the latest frame into a paint DIB and stretches it over
+// the window. Invalidation is throttled to the stream's frame rate.
+class FrameBufferPresenter : public FramePresenter {
+	HWND hwnd;
+	BasicBitmap* bmp = nullptr;
+	uint64_t lastInvalidateTime = 0;
+	int frameCounter = 0;
+
+public:
+	explicit FrameBufferPresenter(HWND hwnd) : hwnd(hwnd) {}
+	~FrameBufferPresenter() { delete bmp; }
+
+	bool Resize(int w, int h) override {
+		delete bmp;
+		bmp = new BasicBitmap(w, h, BasicBitmap::A8R8G8B8);
+		return true;
+	}
+
+	uint8_t* Bits() override { return bmp ? bmp->Bits() : nullptr; }
+	int Pitch() override { return bmp ? (int)bmp->Pitch() : 0; }
+
+	void Present(const std::vector<DamageRect>& damage) override {
+		const int frameW = bmp->Width(), frameH = bmp->Height();
+		g_frameBuffer.Publish(frameW, frameH, bmp->Bits(), damage);
+
+		// Optimized invalidation: reduce Windows API calls for better performance
+		frameCounter++;
+
+		// Only check timing every 4th frame to reduce GetTickCount64 overhead
+		bool shouldCheckTiming = (frameCounter % 4 == 0);
+		uint64_t currentTime = shouldCheckTiming ? GetTickCount64() : lastInvalidateTime + 50;
+
+		// Synchronized frame rate limiting: match capture FPS instead of hardcoded 60 FPS
+		int currentFps = g_streamingFps.load();
+		uint64_t frameIntervalMs = (currentFps > 0) ? (1000 / currentFps) : 50; // fallback to 20 FPS
+
+		// Additional performance optimization: increase minimum interval for high CPU usage scenarios
+		uint64_t minInterval = std::max(frameIntervalMs, (uint64_t)33); // At most 30 FPS invalidation
+
+		if (shouldCheckTiming && (currentTime - lastInvalidateTime < minInterval)) {
+			// Skip this update to maintain synchronized frame rate and reduce paint events
+			SRDPRINTF("FrameBufferPresenter: Skipping update for frame rate sync (target: %d FPS, min interval: %llu ms)\n", currentFps, minInterval);
+			return;
+		}
+
+		// Single invalidation call over the bounding rect - maximum efficiency
+		RECT client;
+		GetClientRect(hwnd, &client);
+		RECT r = FrameToClientRect(DamageBounds(damage), frameW, frameH, client.right - client.left, client.bottom - client.top);
+		InvalidateRect(hwnd, &r, FALSE);
+		if (shouldCheckTiming) lastInvalidateTime = currentTime;
+
+		SRDPRINTF("FrameBufferPresenter: Ultra-fast InvalidateRect with %zu rects\n", damage.size());
+	}
+};
+
+FramePresenter* CreateFramePresenter(HWND hwnd) {
+	if (g_presentMode.load() == PRESENT_COPY) return new FrameBufferPresenter(hwnd);
+	return new DibPresenter(hwnd);
+}
+
 void ScreenRecvThread(SOCKET skt, HWND hwnd, std::string ip, int server_port) {
 	using namespace std::chrono;
+	g_trace.SetThreadName("screen recv");
 	std::string last_ip = ip;
 	int last_port = server_port;
 
-	// --- Clipboard protocol structures (must match those used elsewhere) ---
-	enum class MsgType : uint8_t {
-		Input = 0,
-		RemoteCtrl = 1,
-		Clipboard = 2
-	};
-#pragma pack(push, 1)
-	struct ClipboardMsg {
-		MsgType type;
-		uint32_t length; // length of the following UTF-8 string
-		// char data[] follows
-	};
-#pragma pack(pop)
-
 	// --- Start XRLE audio receiving thread (runs in parallel with screen) ---
 	std::thread audioThread([ip]() {
 		AudioStreamClientThreadXRLE(ip);
@@ -1772,33 +1777,30 @@ void ScreenRecvThread(SOCKET skt, HWND hwnd, std::string ip, int server_port) {
 			return;
 		}
 
-		// --- RECEIVE WIDTH/HEIGHT FROM SERVER ---
-		uint32_t widthNet = 0, heightNet = 0;
-		if (recvn(skt, (char*)&widthNet, 4) != 4) {
-			SRDPRINTF("ScreenRecvThread: recvn for width failed\n");
+		// --- SEND CAPABILITIES, RECEIVE WIDTH/HEIGHT FROM SERVER ---
+		uint32_t capsNet = htonl(SCREEN_CAP_BGRA | SCREEN_CAP_TILE_V2);
+		SendMsg(skt, MsgType::ScreenCaps, &capsNet, 4);
+		BufferedSocketInput input(skt);
+		MessageReader reader(input);
+		MsgHeader header;
+		ScreenStreamInfo info;
+		if (!reader.Next(header) || header.type != MsgType::ScreenInfo || !ReadScreenHandshake(reader.Payload(), info)) {
+			SRDPRINTF("ScreenRecvThread: handshake failed\n");
 			closesocket(skt);
 			skt = INVALID_SOCKET;
 			std::this_thread::sleep_for(std::chrono::seconds(2));
 			continue;
 		}
-		if (recvn(skt, (char*)&heightNet, 4) != 4) {
-			SRDPRINTF("ScreenRecvThread: recvn for height failed\n");
-			closesocket(skt);
-			skt = INVALID_SOCKET;
-			std::this_thread::sleep_for(std::chrono::seconds(2));
-			continue;
-		}
-		g_screenStreamW = ntohl(widthNet);
-		g_screenStreamH = ntohl(heightNet);
-		SRDPRINTF("ScreenRecvThread: received screen size: %dx%d\n", g_screenStreamW.load(), g_screenStreamH.load());
+		g_screenStreamW = info.width;
+		g_screenStreamH = info.height;
 
 		if (!WindowStillOpen(hwnd)) {
 			closesocket(skt);
 			return;
 		}
 
-		size_t bytesLastSec = 0;
-		int framesLastSec = 0;
+		uint64_t framesAtSec = g_metrics.Own(METRIC_CLIENT_FRAMES);
+		uint64_t bytesAtSec = g_metrics.Own(METRIC_CLIENT_BYTES);
 		auto lastSec = steady_clock::now();
 
 		ScreenBitmapState* bmpState = reinterpret_cast<ScreenBitmapState*>(GetWindowLongPtr(hwnd, GWLP_USERDATA));
@@ -1808,296 +1810,48 @@ void ScreenRecvThread(SOCKET skt, HWND hwnd, std::string ip, int server_port) {
 			return;
 		}
 
-		std::vector<RECT> invalidateRects;
-		std::vector<uint8_t> qoiData;
+		ParallelFrameDecoder decoder(bmpState, g_decodeThreads.load(), info.cacheSlots, info.pixelFormat, info.recordFormat);
+		SRDPRINTF("ScreenRecvThread: decoding with %d worker(s)\n", decoder.WorkerCount());
+		std::vector<CopyRect> pendingMoves;
 		bool running = true;
 		bool lost_connection = false;
 
 		// --- Streaming loop ---
 		while (running) {
-			// --- Clipboard receive branch ---
-			{
-				// Use non-blocking peek or select to check for clipboard packet (or interleave with dirty tile receive as needed)
-				u_long nonblock = 1;
-				ioctlsocket(skt, FIONBIO, &nonblock);
-				char cbuf[8192];
-				int peeked = recv(skt, cbuf, sizeof(ClipboardMsg), MSG_PEEK);
-				if (peeked >= (int)sizeof(ClipboardMsg)) {
-					ClipboardMsg* cmsg = (ClipboardMsg*)cbuf;
-					int total_len = int(sizeof(ClipboardMsg) + cmsg->length);
-					if (cmsg->type == MsgType::Clipboard && peeked >= total_len) {
-						std::vector<char> msgbuf(total_len);
-						int recvd = recvn(skt, msgbuf.data(), total_len);
-						if (recvd == total_len) {
-							std::string utf8(msgbuf.data() + sizeof(ClipboardMsg), cmsg->length);
-							ApplyRemoteClipboard(utf8);
-						}
-						u_long block = 0;
-						ioctlsocket(skt, FIONBIO, &block);
-						continue;
-					}
-				}
-				u_long block = 0;
-				ioctlsocket(skt, FIONBIO, &block);
+			TraceScope waitTrace("wait frame");
+			if (!reader.Next(header)) {
+				SRDPRINTF("ScreenRecvThread: connection closed or bad message header, breaking\n");
+				lost_connection = true;
+				break;
 			}
-			// --- End Clipboard receive branch ---
+			waitTrace.End();
 
 			if (!WindowStillOpen(hwnd)) {
 				closesocket(skt);
 				return;
 			}
 
-			// ... rest of streaming loop unchanged ...
-			uint32_t xrleBitmaskLenNet = 0;
-			if (recvn(skt, (char*)&xrleBitmaskLenNet, 4) != 4) {
-				SRDPRINTF("ScreenRecvThread: recvn for bitmask length failed\n");
-				lost_connection = true;
-				break;
-			}
-			uint32_t xrleBitmaskLen = ntohl(xrleBitmaskLenNet);
-			SRDPRINTF("ScreenRecvThread: xrleBitmaskLen = %u\n", xrleBitmaskLen);
-
-			if (xrleBitmaskLen == 0 || xrleBitmaskLen > 1024 * 1024) {
-				SRDPRINTF("ScreenRecvThread: xrleBitmaskLen out of range, exiting\n");
-				lost_connection = true;
-				break;
-			}
-
-			std::vector<uint8_t> xrleBitmask(xrleBitmaskLen);
-			if (recvn(skt, (char*)xrleBitmask.data(), xrleBitmaskLen) != xrleBitmaskLen) {
-				SRDPRINTF("ScreenRecvThread: recvn for xrleBitmask data failed\n");
-				lost_connection = true;
-				running = false;
-				break;
-			}
-
-			int width = g_screenStreamW.load();
-			int height = g_screenStreamH.load();
-			SRDPRINTF("ScreenRecvThread: width=%d height=%d\n", width, height);
-			if (width <= 0 || height <= 0) {
-				SRDPRINTF("ScreenRecvThread: Invalid width/height, exiting\n");
-				lost_connection = true;
-				break;
-			}
-
-			size_t tiles_x = (width + TILE_W - 1) / TILE_W;
-			size_t tiles_y = (height + TILE_H - 1) / TILE_H;
-			size_t numTiles = tiles_x * tiles_y;
-			if (numTiles == 0 || numTiles > 100000) {
-				SRDPRINTF("ScreenRecvThread: numTiles out of range (%zu), exiting\n", numTiles);
-				lost_connection = true;
-				break;
-			}
-
-			std::vector<uint8_t> dirtyBitmask((numTiles + 7) / 8);
-			size_t gotLen = xrle_decompress(dirtyBitmask.data(), xrleBitmask.data(), xrleBitmask.size());
-			SRDPRINTF("ScreenRecvThread: gotLen from xrle_decompress = %zu, expected = %zu\n", gotLen, dirtyBitmask.size());
-			if (gotLen != dirtyBitmask.size()) {
-				SRDPRINTF("ScreenRecvThread: xrle_decompress size mismatch, exiting\n");
-				lost_connection = true;
-				break;
-			}
-
-			size_t dirtyCount = 0;
-			SRDPRINTF("ScreenRecvThread: tiles_x=%zu tiles_y=%zu numTiles=%zu\n", tiles_x, tiles_y, numTiles);
-			SRDPRINTF("ScreenRecvThread: DirtyBitmask: ");
-			for (size_t b = 0; b < dirtyBitmask.size(); ++b) {
-				SRDPRINTF("%02X", dirtyBitmask[b]);
-				for (int bit = 0; bit < 8; ++bit)
-					if (dirtyBitmask[b] & (1 << bit))
-						dirtyCount++;
+			if (header.type == MsgType::Clipboard) {
+				std::string utf8;
+				if (!reader.ReadPayload(utf8)) {
+					lost_connection = true;
+					break;
+				}
+				ApplyRemoteClipboard(utf8);
+				continue;
 			}
-			SRDPRINTF("\nScreenRecvThread: dirtyCount=%zu\n", dirtyCount);
+			if (header.type != MsgType::ScreenFrame) continue; // skipped by the next Next()
 
-			uint32_t nTilesNet = 0;
-			if (recvn(skt, (char*)&nTilesNet, 4) != 4) {
-				SRDPRINTF("ScreenRecvThread: recvn for nTiles failed\n");
+			if (!ReadScreenFrame(reader.Payload(), g_screenStreamW.load(), g_screenStreamH.load(), decoder, pendingMoves)) {
+				SRDPRINTF("ScreenRecvThread: frame error, breaking\n");
 				lost_connection = true;
 				break;
 			}
-			uint32_t nTiles = ntohl(nTilesNet);
-			SRDPRINTF("ScreenRecvThread: nTiles (server says) = %u\n", nTiles);
-
-			size_t bytesThisFrame = 4;
-			bool frame_error = false, fullScreenInvalidation = false;
-			invalidateRects.clear();
-
-			size_t receivedDirty = 0;
-			// Collect tile data first, then process in batch
-			struct TileUpdate {
-				uint32_t rx, ry, rw, rh;
-				std::unique_ptr<BasicBitmap> bitmap;
-			};
-			std::vector<TileUpdate> tileUpdates;
-			tileUpdates.reserve(128); // Pre-allocate for typical tile count
-			
-			for (size_t tileIdx = 0; tileIdx < numTiles; ++tileIdx) {
-				if (!(dirtyBitmask[tileIdx / 8] & (1 << (tileIdx % 8))))
-					continue;
-
-				uint32_t rx, ry, rw, rh, xrleLen, qoiOrigLen;
-				if (recvn(skt, (char*)&rx, 4) != 4 ||
-					recvn(skt, (char*)&ry, 4) != 4 ||
-					recvn(skt, (char*)&rw, 4) != 4 ||
-					recvn(skt, (char*)&rh, 4) != 4 ||
-					recvn(skt, (char*)&xrleLen, 4) != 4 ||
-					recvn(skt, (char*)&qoiOrigLen, 4) != 4) {
-					SRDPRINTF("ScreenRecvThread: recvn header failed\n");
-					frame_error = true; lost_connection = true; running = false; break;
-				}
-				bytesThisFrame += 24;
-				rx = ntohl(rx); ry = ntohl(ry); rw = ntohl(rw); rh = ntohl(rh);
-				xrleLen = ntohl(xrleLen); qoiOrigLen = ntohl(qoiOrigLen);
-
-				if (rw == 0 || rh == 0 || xrleLen == 0 || qoiOrigLen == 0) {
-					SRDPRINTF("ScreenRecvThread: invalid header\n");
-					frame_error = true; lost_connection = true; running = false; break;
-				}
-
-				std::vector<uint8_t> xrleData(xrleLen);
-				if (recvn(skt, (char*)xrleData.data(), xrleLen) != xrleLen) {
-					SRDPRINTF("ScreenRecvThread: recvn data failed\n");
-					frame_error = true; lost_connection = true; running = false; break;
-				}
-				bytesThisFrame += xrleLen;
-
-				qoiData.resize(qoiOrigLen);
-				if (xrleLen == qoiOrigLen) {
-					memcpy(qoiData.data(), xrleData.data(), qoiOrigLen);
-				} else {
-					size_t qoiLen = xrle_decompress(qoiData.data(), xrleData.data(), xrleData.size());
-					if (qoiLen != qoiOrigLen) {
-						SRDPRINTF("ScreenRecvThread: decompress failed\n");
-						frame_error = true; lost_connection = true; running = false; break;
-					}
-				}
 
-				BasicBitmap* decoded = QOIDecodeToBasicBitmap(qoiData.data(), qoiOrigLen);
-				if (decoded) {
-					TileUpdate update;
-					update.rx = rx; update.ry = ry; update.rw = rw; update.rh = rh;
-					update.bitmap.reset(decoded);
-					tileUpdates.push_back(std::move(update));
-				}
-				receivedDirty++;
-			}
-			
-			// Process all tiles in single critical section with one color conversion
-			if (!tileUpdates.empty() && !frame_error) {
-				EnterCriticalSection(&bmpState->cs);
-				
-				// Find required dimensions
-				int maxW = bmpState->imgW, maxH = bmpState->imgH;
-				for (const auto& tile : tileUpdates) {
-					maxW = std::max(maxW, (int)(tile.rx + tile.rw));
-					maxH = std::max(maxH, (int)(tile.ry + tile.rh));
-				}
-				
-				// Reallocate if needed
-				if (!bmpState->bmp || bmpState->imgW != maxW || bmpState->imgH != maxH) {
-					delete bmpState->bmp;
-					bmpState->bmp = new BasicBitmap(maxW, maxH, BasicBitmap::A8R8G8B8);
-					bmpState->imgW = maxW; bmpState->imgH = maxH;
-				}
-				
-				// Update all tiles
-				for (const auto& tile : tileUpdates) {
-					for (uint32_t row = 0; row < tile.rh; ++row) {
-						if ((tile.ry + row) >= (uint32_t)bmpState->imgH) continue;
-						uint8_t* dst = bmpState->bmp->Bits() + ((tile.ry + row) * bmpState->imgW + tile.rx) * 4;
-						uint8_t* src = tile.bitmap->Bits() + row * tile.rw * 4;
-						memcpy(dst, src, tile.rw * 4);
-					}
-					
-					if (tile.rx == 0 && tile.ry == 0 && tile.rw == (uint32_t)bmpState->imgW && tile.rh == (uint32_t)bmpState->imgH) {
-						fullScreenInvalidation = true;
-					} else {
-						RECT r = { (LONG)tile.rx, (LONG)tile.ry, (LONG)(tile.rx + tile.rw), (LONG)(tile.ry + tile.rh) };
-						invalidateRects.push_back(r);
-					}
-				}
-				
-				// **SINGLE** color conversion for entire frame (eliminates per-tile overhead)
-				static uint8_t* conversionBuffer = nullptr;
-				static size_t conversionBufferSize = 0;
-				
-				uint8_t* srcData = bmpState->bmp->Bits();
-				int totalPixels = bmpState->imgW * bmpState->imgH;
-				size_t requiredSize = totalPixels * 4;
-				
-				if (conversionBufferSize < requiredSize) {
-					delete[] conversionBuffer;
-					conversionBuffer = new uint8_t[requiredSize];
-					conversionBufferSize = requiredSize;
-				}
-				
-				if (ColorConversion::ConvertRGBAToBGRA != nullptr) {
-					ColorConversion::ConvertRGBAToBGRA(srcData, conversionBuffer, totalPixels);
-				} else {
-					ColorConversion::ConvertRGBAToBGRA_Scalar(srcData, conversionBuffer, totalPixels);
-				}
-				
-				g_frameBuffer.SetFrame(bmpState->imgW, bmpState->imgH, conversionBuffer);
-				
-				LeaveCriticalSection(&bmpState->cs);
-				
-				SRDPRINTF("ScreenRecvThread: Batch processed %zu tiles\n", tileUpdates.size());
-			}
-			SRDPRINTF("ScreenRecvThread: received %zu dirty tiles for %zu dirty bits\n", receivedDirty, dirtyCount);
-
-			// Optimized invalidation: reduce Windows API calls for better performance
-			static uint64_t lastInvalidateTime = 0;
-			static int frameCounter = 0;
-			frameCounter++;
-			
-			// Only check timing every 4th frame to reduce GetTickCount64 overhead
-			bool shouldCheckTiming = (frameCounter % 4 == 0);
-			uint64_t currentTime = shouldCheckTiming ? GetTickCount64() : lastInvalidateTime + 50;
-			
-			// Synchronized frame rate limiting: match capture FPS instead of hardcoded 60 FPS
-			int currentFps = g_streamingFps.load();
-			uint64_t frameIntervalMs = (currentFps > 0) ? (1000 / currentFps) : 50; // fallback to 20 FPS
-			
-			// Additional performance optimization: increase minimum interval for high CPU usage scenarios
-			uint64_t minInterval = std::max(frameIntervalMs, (uint64_t)33); // At most 30 FPS invalidation
-			
-			if (shouldCheckTiming && (currentTime - lastInvalidateTime < minInterval)) {
-				// Skip this update to maintain synchronized frame rate and reduce paint events
-				SRDPRINTF("ScreenRecvThread: Skipping update for frame rate sync (target: %d FPS, min interval: %llu ms)\n", currentFps, minInterval);
-			}
-			else if (fullScreenInvalidation) {
-				InvalidateRect(hwnd, NULL, FALSE);
-				if (shouldCheckTiming) lastInvalidateTime = currentTime;
-				SRDPRINTF("ScreenRecvThread: InvalidateRect(NULL)\n");
-			}
-			else if (!invalidateRects.empty()) {
-				// Ultra-fast bounding rectangle calculation
-				RECT boundingRect = invalidateRects[0];
-				for (size_t i = 1; i < invalidateRects.size(); ++i) {
-					const RECT& r = invalidateRects[i];
-					if (r.left < boundingRect.left) boundingRect.left = r.left;
-					if (r.top < boundingRect.top) boundingRect.top = r.top;
-					if (r.right > boundingRect.right) boundingRect.right = r.right;
-					if (r.bottom > boundingRect.bottom) boundingRect.bottom = r.bottom;
-				}
-				
-				// Single invalidation call - maximum efficiency
-				InvalidateRect(hwnd, &boundingRect, FALSE);
-				if (shouldCheckTiming) lastInvalidateTime = currentTime;
-				
-				SRDPRINTF("ScreenRecvThread: Ultra-fast InvalidateRect with %zu tiles\n", invalidateRects.size());
-			}
-			if (frame_error) {
-				SRDPRINTF("ScreenRecvThread: frame_error, breaking\n");
-				lost_connection = true;
-				break;
-			}
-
-			framesLastSec++;
-			bytesLastSec += bytesThisFrame;
 			auto now = steady_clock::now();
 			if (duration_cast<seconds>(now - lastSec).count() >= 1) {
-				double mbps = (bytesLastSec * 8.0) / 1e6;
+				int framesLastSec = (int)(g_metrics.Own(METRIC_CLIENT_FRAMES) - framesAtSec);
+				double mbps = ((g_metrics.Own(METRIC_CLIENT_BYTES) - bytesAtSec) * 8.0) / 1e6;
 				
 				// Network congestion detection and adaptive quality
 				static double avgMbps = 0.0;
@@ -2131,8 +1885,9 @@ void ScreenRecvThread(SOCKET skt, HWND hwnd, std::string ip, int server_port) {
 					qualityIndicator, last_ip.c_str(), last_port, framesLastSec, mbps, winW, winH);
 				PostMessage(hwnd, WM_USER + 2, 0, (LPARAM)title);
 				SRDPRINTF("ScreenRecvThread: Updated window title (quality: %s, avg: %.2f Mbps)\n", qualityIndicator, avgMbps);
-				bytesLastSec = 0;
-				framesLastSec = 0;
+				SRDPRINTF("ScreenRecvThread: frame latency\n%s", g_clientLatency.Summary().c_str());
+				framesAtSec = g_metrics.Own(METRIC_CLIENT_FRAMES);
+				bytesAtSec = g_metrics.Own(METRIC_CLIENT_BYTES);
 				lastSec = now;
 			}
 		}
@@ -2459,7 +2214,7 @@ void SetRemoteScreenFps(HWND hwnd, int fps) {
 	if (!psktInput || *psktInput == INVALID_SOCKET) return;
 
 	RemoteCtrlMsg msg = { RemoteCtrlType::SetFps, (uint8_t)fps };
-	send(*psktInput, (const char*)&msg, sizeof(msg), 0);
+	SendMsg(*psktInput, MsgType::RemoteCtrl, &msg, sizeof(msg));
 
 	// Save FPS to config
 	if (g_pMainWindow) {
@@ -2480,7 +2235,9 @@ LRESULT CALLBACK ScreenWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam
 
 	switch (msg) {
 	case WM_CREATE:
+		g_trace.SetThreadName("window");
 		bmpState = new ScreenBitmapState();
+		bmpState->presenter = CreateFramePresenter(hwnd);
 		bmpState->mainWindow = g_pMainWindow;
 		SetWindowLongPtr(hwnd, GWLP_USERDATA, (LONG_PTR)bmpState);
 		break;
@@ -2531,6 +2288,11 @@ LRESULT CALLBACK ScreenWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam
 		case IDM_SENDKEYS_CTRLESC:  SendRemoteKeyCombo(hwnd, IDM_SENDKEYS_CTRLESC); break;
 		case IDM_SENDKEYS_CTRALTDEL:SendRemoteKeyCombo(hwnd, IDM_SENDKEYS_CTRALTDEL); break;
 		case IDM_SENDKEYS_PRNTSCRN: SendRemoteKeyCombo(hwnd, IDM_SENDKEYS_PRNTSCRN); break;
+		case IDM_DUMP_LATENCY: DumpLatencyTrace(g_clientLatency, "latency_client.csv"); break;
+		case IDM_TOGGLE_TRACE:
+			// Stopping writes out what was recorded
+			if (g_traceEnabled.exchange(!g_traceEnabled)) DumpPipelineTrace("trace_client.json");
+			break;
 		}
 		break;
 
@@ -2568,7 +2330,7 @@ LRESULT CALLBACK ScreenWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam
 			if (msg == WM_MBUTTONDOWN) input.mi.dwFlags |= MOUSEEVENTF_MIDDLEDOWN;
 			if (msg == WM_MBUTTONUP)   input.mi.dwFlags |= MOUSEEVENTF_MIDDLEUP;
 
-			send(*bmpState->psktInput, (const char*)&input, sizeof(INPUT), 0);
+			SendMsg(*bmpState->psktInput, MsgType::Input, &input, sizeof(INPUT));
 		}
 		break;
 	}
@@ -2578,7 +2340,7 @@ LRESULT CALLBACK ScreenWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam
 			input.type = INPUT_MOUSE;
 			input.mi.dwFlags = MOUSEEVENTF_WHEEL;
 			input.mi.mouseData = GET_WHEEL_DELTA_WPARAM(wParam);
-			send(*bmpState->psktInput, (const char*)&input, sizeof(INPUT), 0);
+			SendMsg(*bmpState->psktInput, MsgType::Input, &input, sizeof(INPUT));
 		}
 		break;
 	}
@@ -2634,7 +2396,7 @@ LRESULT CALLBACK ScreenWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam
 				<< " (" << (((msg == WM_KEYDOWN) || (msg == WM_SYSKEYDOWN)) ? "DOWN" : "UP") << ")"
 				<< std::dec << std::endl;
 
-			send(*bmpState->psktInput, (const char*)&input, sizeof(INPUT), 0);
+			SendMsg(*bmpState->psktInput, MsgType::Input, &input, sizeof(INPUT));
 		}
 		break;
 	}
@@ -2648,7 +2410,7 @@ LRESULT CALLBACK ScreenWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam
 				input.type = INPUT_KEYBOARD;
 				input.ki.wVk = VK_MENU;
 				input.ki.dwFlags = KEYEVENTF_KEYUP | KEYEVENTF_EXTENDEDKEY;
-				send(*bmpState->psktInput, (const char*)&input, sizeof(INPUT), 0);
+				SendMsg(*bmpState->psktInput, MsgType::Input, &input, sizeof(INPUT));
 				altDown = false;
 			}
 			if (f10Down) {
@@ -2656,7 +2418,7 @@ LRESULT CALLBACK ScreenWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam
 				input.type = INPUT_KEYBOARD;
 				input.ki.wVk = VK_F10;
 				input.ki.dwFlags = KEYEVENTF_KEYUP | KEYEVENTF_EXTENDEDKEY;
-				send(*bmpState->psktInput, (const char*)&input, sizeof(INPUT), 0);
+				SendMsg(*bmpState->psktInput, MsgType::Input, &input, sizeof(INPUT));
 				f10Down = false;
 			}
 		}
@@ -2665,7 +2427,20 @@ LRESULT CALLBACK ScreenWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam
 	case WM_ERASEBKGND:
 		return 1; // Prevent flicker
 
+	case WM_SIZE: // The frame is stretched over the client area, so all of it moves
+		InvalidateRect(hwnd, NULL, FALSE);
+		break;
+
 	case WM_PAINT: {
+		TraceScope paintTrace("paint");
+		// The update region is only available until BeginPaint validates it
+		DibPresenter* dibPresenter = bmpState ? dynamic_cast<DibPresenter*>(bmpState->presenter) : nullptr;
+		HRGN updateRgn = NULL;
+		if (dibPresenter) {
+			updateRgn = CreateRectRgn(0, 0, 0, 0);
+			GetUpdateRgn(hwnd, updateRgn, FALSE);
+		}
+
 		PAINTSTRUCT ps;
 		HDC hdc = BeginPaint(hwnd, &ps);
 
@@ -2675,21 +2450,44 @@ LRESULT CALLBACK ScreenWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam
 		int destH = clientRect.bottom - clientRect.top;
 
 		if (destW <= 0 || destH <= 0) {
+			if (updateRgn) DeleteObject(updateRgn);
 			EndPaint(hwnd, &ps);
 			break;
 		}
 
+		if (dibPresenter) {
+			bmpState->paintMutex.lock();
+			dibPresenter->Paint(hdc, updateRgn, destW, destH);
+			bmpState->paintMutex.unlock();
+			DeleteObject(updateRgn);
+		}
 		// High-performance rendering with minimized API calls
-		if (bmpState && bmpState->bmp) {
-			int srcW, srcH;
-			uint8_t* frameData;
-			uint64_t timestamp;
-			
-			if (g_frameBuffer.GetLatestFrame(srcW, srcH, frameData, timestamp)) {
+		else if (bmpState && bmpState->presenter) {
+			// Only this thread reads g_frameBuffer, so the frame is stable until the next paint
+			const TripleFrameBuffer::Frame* frame = g_frameBuffer.Latest();
+			if (frame) {
+				int srcW = frame->width, srcH = frame->height;
+				const uint8_t* frameData = frame->pixels.data();
 				auto& cache = g_ultraFastCache[hwnd];
 				if (cache.PrepareForSize(srcW, srcH) && cache.pBits) {
-					// Direct memory copy (no color conversion here)
-					memcpy(cache.pBits, frameData, srcW * srcH * 4);
+					// The DIB keeps the last frame copied into it: a repaint of the same frame copies
+					// nothing, the next frame only its damage, anything else the whole frame
+					if (frame->generation != cache.generation || srcW != cache.frameW || srcH != cache.frameH) {
+						uint8_t* dib = (uint8_t*)cache.pBits;
+						size_t dibPitch = (size_t)cache.width * 4, srcPitch = (size_t)srcW * 4;
+						if (frame->generation == cache.generation + 1 && srcW == cache.frameW && srcH == cache.frameH) {
+							for (const DamageRect& r : frame->damage) {
+								for (int row = r.y; row < r.y + r.h; ++row)
+									memcpy(dib + row * dibPitch + r.x * 4, frameData + row * srcPitch + r.x * 4, (size_t)r.w * 4);
+							}
+						} else {
+							for (int row = 0; row < srcH; ++row)
+								memcpy(dib + row * dibPitch, frameData + row * srcPitch, srcPitch);
+						}
+						cache.generation = frame->generation;
+						cache.frameW = srcW;
+						cache.frameH = srcH;
+					}
 					
 					// One-time GDI setup (cached)
 					if (!cache.gdiSettingsApplied) {
@@ -2706,6 +2504,16 @@ LRESULT CALLBACK ScreenWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam
 		}
 		
 		EndPaint(hwnd, &ps);
+		paintTrace.End();
+		{
+			static uint32_t lastPaintedSeq = 0;
+			uint32_t seq = g_lastPresentedSeq.load();
+			if (seq != lastPaintedSeq) {
+				g_clientLatency.Stamp(seq, STAGE_PAINTED);
+				g_metrics.Add(METRIC_CLIENT_FRAMES_PAINTED);
+				lastPaintedSeq = seq;
+			}
+		}
 		break;
 	}
 	case WM_EXITSIZEMOVE: // Save window geometry for restoring
@@ -2723,6 +2531,9 @@ LRESULT CALLBACK ScreenWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam
 		break;
 
 	case WM_DESTROY: {
+		if (g_latencyDump.load()) DumpLatencyTrace(g_clientLatency, "latency_client.csv");
+		if (g_traceDump.load()) DumpPipelineTrace("trace_client.json");
+
 		// Clean up ultra-fast DIB cache
 		auto it = g_ultraFastCache.find(hwnd);
 		if (it != g_ultraFastCache.end()) {
@@ -2818,7 +2629,7 @@ LRESULT MainWindow::HandleMessage(UINT uMsg, WPARAM wParam, LPARAM lParam)
 			ConvertInput((PRAWINPUT)lpb, &inputBuff);
 			delete[] lpb;
 			// Send to server
-			send(Client.sktServer, (char*)&inputBuff, sizeof(INPUT), 0);
+			SendMsg(Client.sktServer, MsgType::Input, &inputBuff, sizeof(INPUT));
 		}
 		return 0;
 	case WM_PAINT:
@@ -3746,44 +3557,47 @@ int MainWindow::ListenThread()
 
 // --- Add server-side input receiving and injection thread ---
 
-// New function: receive INPUT structs from each client and inject locally
+// Receives the messages of one client's input socket: INPUT to inject, control and clipboard
 
 void ServerInputRecvThread(SOCKET clientSocket) {
-	while (true) {
-		char buffer[sizeof(INPUT) > sizeof(RemoteCtrlMsg) ? sizeof(INPUT) : sizeof(RemoteCtrlMsg)];
-
-		// Use recvn to ensure we always get a full message (INPUT or RemoteCtrlMsg)
-		int received = recvn(clientSocket, buffer, sizeof(buffer));
-		if (received <= 0) break;
-
-		if (received == sizeof(RemoteCtrlMsg)) {
+	BufferedSocketInput input(clientSocket);
+	MessageReader reader(input);
+	MsgHeader header;
+	while (reader.Next(header)) {
+		if (header.type == MsgType::RemoteCtrl && header.length == sizeof(RemoteCtrlMsg)) {
 			// Handle control messages from client
-			RemoteCtrlMsg* msg = (RemoteCtrlMsg*)buffer;
-			if (msg->type == RemoteCtrlType::SetFps) {
-				int fps = msg->value;
+			RemoteCtrlMsg msg;
+			if (!reader.Payload().Read(&msg, sizeof(msg))) break;
+			if (msg.type == RemoteCtrlType::SetFps) {
+				int fps = msg.value;
 				if (fps == 5 || fps == 10 || fps == 20 || fps == 30 || fps == 40 || fps == 60) {
 					g_streamingFps = fps;
 					std::cout << "Set streaming FPS to " << fps << "\n";
 				}
 			}
-			continue;
 		}
-
-		if (received == sizeof(INPUT)) {
-			INPUT* inp = (INPUT*)buffer;
+		else if (header.type == MsgType::Input && header.length == sizeof(INPUT)) {
+			INPUT inp;
+			if (!reader.Payload().Read(&inp, sizeof(inp))) break;
 			// DEBUG LOGGING: Print what is being injected
-			if (inp->type == INPUT_KEYBOARD) {
+			if (inp.type == INPUT_KEYBOARD) {
 				std::cout << "[SERVER] Injecting INPUT: "
-					<< "VK=0x" << std::hex << (int)inp->ki.wVk
-					<< " Scan=0x" << std::hex << (int)inp->ki.wScan
-					<< " Flags=0x" << std::hex << (int)inp->ki.dwFlags
+					<< "VK=0x" << std::hex << (int)inp.ki.wVk
+					<< " Scan=0x" << std::hex << (int)inp.ki.wScan
+					<< " Flags=0x" << std::hex << (int)inp.ki.dwFlags
 					<< " ("
-					<< ((inp->ki.dwFlags & KEYEVENTF_KEYUP) ? "UP" : "DOWN")
+					<< ((inp.ki.dwFlags & KEYEVENTF_KEYUP) ? "UP" : "DOWN")
 					<< ")"
 					<< std::dec << std::endl;
 			}
-			SendInput(1, inp, sizeof(INPUT));
+			SendInput(1, &inp, sizeof(INPUT));
 		}
+		else if (header.type == MsgType::Clipboard) {
+			std::string utf8;
+			if (!reader.ReadPayload(utf8)) break;
+			ApplyRemoteClipboard(utf8);
+		}
+		// Anything else is skipped by the next Next()
 	}
 	closesocket(clientSocket);
 }
@@ -3856,6 +3670,12 @@ bool MainWindow::SaveConfig()
 	f << "server_ip " << Client.ip << std::endl;
 	f << "max_clients " << Server.maxClients << std::endl;
 	f << "fps " << g_streamingFps.load() << std::endl;
+	f << "encode_threads " << g_encodeThreads.load() << std::endl;
+	f << "decode_threads " << g_decodeThreads.load() << std::endl;
+	f << "tile_cache_mb " << g_tileCacheMB.load() << std::endl;
+	f << "change_detect " << (g_changeDetect.load() == CHANGE_DETECT_HASH ? "hash" : "exact") << std::endl;
+	f << "pixel_format " << (g_pixelFormat.load() == PIXEL_FORMAT_BGRA ? "bgra" : "rgba") << std::endl;
+	f << "present " << (g_presentMode.load() == PRESENT_COPY ? "copy" : "direct") << std::endl;
 	f << "always_on_top " << (g_alwaysOnTop ? 1 : 0) << std::endl;
 	f << "remote_rect " << m_savedRemoteLeft << " " << m_savedRemoteTop << " "
 		<< m_savedRemoteW << " " << m_savedRemoteH << "\n";
@@ -3928,6 +3748,45 @@ bool MainWindow::LoadConfig()
 				g_screenStreamActualFps = fps;
 			}
 		}
+		else if (param == "encode_threads") {
+			int threads = 0;
+			s >> threads;
+			if (threads >= 0 && threads <= 64) {
+				g_encodeThreads = threads;
+			}
+		}
+		else if (param == "decode_threads") {
+			int threads = 0;
+			s >> threads;
+			if (threads >= 0 && threads <= 64) {
+				g_decodeThreads = threads;
+			}
+		}
+		else if (param == "tile_cache_mb") {
+			int mb = 0;
+			s >> mb;
+			if (mb >= 0 && mb <= 1024) {
+				g_tileCacheMB = mb;
+			}
+		}
+		else if (param == "change_detect") {
+			std::string mode;
+			s >> mode;
+			if (mode == "exact") g_changeDetect = CHANGE_DETECT_EXACT;
+			else if (mode == "hash") g_changeDetect = CHANGE_DETECT_HASH;
+		}
+		else if (param == "pixel_format") {
+			std::string format;
+			s >> format;
+			if (format == "bgra") g_pixelFormat = PIXEL_FORMAT_BGRA;
+			else if (format == "rgba") g_pixelFormat = PIXEL_FORMAT_RGBA;
+		}
+		else if (param == "present") {
+			std::string mode;
+			s >> mode;
+			if (mode == "direct") g_presentMode = PRESENT_DIRECT;
+			else if (mode == "copy") g_presentMode = PRESENT_COPY;
+		}
 		else if (param == "always_on_top") {
 			int atop = 0;
 			s >> atop;
@@ -3961,6 +3820,12 @@ bool MainWindow::LoadConfig()
 		<< "    server ip = " << Client.ip << '\n'
 		<< "    max number clients = " << Server.maxClients << std::endl
 		<< "    fps = " << m_savedFps << std::endl
+		<< "    encode threads = " << g_encodeThreads.load() << " (0 = auto)" << std::endl
+		<< "    decode threads = " << g_decodeThreads.load() << " (0 = auto)" << std::endl
+		<< "    tile cache = " << g_tileCacheMB.load() << " MB" << std::endl
+		<< "    change detection = " << (g_changeDetect.load() == CHANGE_DETECT_HASH ? "hash" : "exact") << std::endl
+		<< "    pixel format = " << (g_pixelFormat.load() == PIXEL_FORMAT_BGRA ? "bgra" : "rgba") << std::endl
+		<< "    present = " << (g_presentMode.load() == PRESENT_COPY ? "copy" : "direct") << std::endl
 		<< "    always_on_top = " << (m_savedAlwaysOnTop ? "true" : "false") << std::endl
 		<< "    window rect = (" << m_savedWinLeft << "," << m_savedWinTop << ") "
 		<< m_savedWinW << "x" << m_savedWinH << std::endl
@@ -3984,8 +3849,18 @@ bool CmdOptionExists(const std::vector<std::string>& args, const std::string& op
 
 void PrintUsage(const char* exeName) {
 	std::cout << "Usage:\n";
-	std::cout << "  " << exeName << " --server [--port PORT]\n";
-	std::cout << "  " << exeName << " --client --ip IP_ADDRESS --port PORT\n";
+	std::cout << "  " << exeName << " --server [--port PORT] [--encode-threads N] [--tile-cache-mb MB]\n";
+	std::cout << "          [--change-detect exact|hash] [--capture gdi|synthetic] [--pixel-format bgra|rgba]\n";
+	std::cout << "  " << exeName << " --client --ip IP_ADDRESS --port PORT [--decode-threads N] [--present direct|copy]\n";
+	std::cout << "  " << exeName << " --replay PATH [--replay-speed recorded|max] [--decode-threads N]\n";
+	std::cout << "  " << exeName << " --bench-recv PATH [--decode-threads N]\n";
+	std::cout << "  --latency-dump writes latency_server.csv / latency_client.csv when a stream ends\n";
+	std::cout << "  --trace records the pipeline from the start and writes trace_server.json / trace_client.json\n";
+	std::cout << "          (Chrome trace format) when a stream ends; the viewer menu also starts and stops it\n";
+	std::cout << "  --metrics-file PATH / --metrics-port PORT publish counters and stage histograms in the\n";
+	std::cout << "          Prometheus text format, rewritten every second / served on 127.0.0.1:PORT\n";
+	std::cout << "  --record PATH (server) writes everything sent on the screen and audio sockets to PATH,\n";
+	std::cout << "          for --replay\n";
 	std::cout << "Examples:\n";
 	std::cout << "  " << exeName << " --server\n";
 	std::cout << "  " << exeName << " --server --port 5555\n";
@@ -4116,6 +3991,114 @@ int RunHeadlessClient(const std::string& ip, int port) {
 	return 0;
 }
 
+// --- Wire replay ---
+// WireStream, LoadWireRecording, ReplayInput and the stream replays are in WireRecording.h
+
+// Replays the first screen and audio connection of a recording. Returns the process exit code.
+int RunReplay(const std::string& path, bool recordedSpeed) {
+	using namespace std::chrono;
+	std::vector<WireStream> streams;
+	if (!LoadWireRecording(path, streams)) {
+		std::cout << "can't read " << path << " as a wire recording" << std::endl;
+		return 1;
+	}
+	const WireStream* screen = nullptr;
+	const WireStream* audio = nullptr;
+	for (const WireStream& s : streams) {
+		if (s.kind == WIRE_SCREEN && !screen) screen = &s;
+		if (s.kind == WIRE_AUDIO && !audio) audio = &s;
+	}
+	if (!screen && !audio) {
+		std::cout << path << " holds no streams" << std::endl;
+		return 1;
+	}
+
+	const int64_t startUs = LatencyNowUs();
+	auto start = steady_clock::now();
+
+	ReplayResult audioResult, screenResult;
+	std::thread audioThread;
+	if (audio) {
+		audioThread = std::thread([&]() {
+			g_trace.SetThreadName("audio replay");
+			audioResult = ReplayAudioStream(*audio, startUs, recordedSpeed);
+		});
+	}
+	if (screen) {
+		g_trace.SetThreadName("screen replay");
+		screenResult = ReplayScreenStream(*screen, startUs, recordedSpeed, g_decodeThreads.load());
+	}
+	if (audioThread.joinable()) audioThread.join();
+	double seconds = duration<double>(steady_clock::now() - start).count();
+
+	uint64_t frames = g_metrics.Counter(METRIC_CLIENT_FRAMES);
+	uint64_t bytes = g_metrics.Counter(METRIC_CLIENT_BYTES);
+	printf("replayed %s in %.2f s (%s speed)\n", path.c_str(), seconds, recordedSpeed ? "recorded" : "max");
+	if (screen) {
+		printf("screen: %llu frames, %llu tiles, %.1f MB, %.1f fps, %.1f MB/s, final frame %016llx%s\n",
+			(unsigned long long)frames, (unsigned long long)g_metrics.Counter(METRIC_CLIENT_TILES), bytes / 1e6,
+			frames / seconds, bytes / 1e6 / seconds, (unsigned long long)screenResult.finalHash, screenResult.ok ? "" : " (stream malformed or cut off)");
+		std::cout << "Frame latency:\n" << g_clientLatency.Summary();
+	}
+	if (audio) {
+		printf("audio: %llu packets, %.1f MB of PCM%s\n", (unsigned long long)audioResult.units, audioResult.pcmBytes / 1e6,
+			audioResult.ok ? "" : " (stream malformed or cut off)");
+	}
+	if (g_traceDump.load()) DumpPipelineTrace("trace_replay.json");
+	return (!screen || screenResult.ok) && (!audio || audioResult.ok) ? 0 : 1;
+}
+
+// --- Receive benchmark ---
+// --bench-recv PATH serves the first screen and audio connection of a --record file over loopback,
+// chunk by chunk as they were sent, and reads each back through the client's parsers twice: with
+// SocketInput, which calls recv() for every field, and with BufferedSocketInput. Screen frames are
+// decoded as in --replay, so the throughput includes the decoder. The screen stream is then read
+// again with 1, 2, 4 and 8 decode threads; every presented frame must come out the same each time.
+
+// ServeWireStream and BenchRecvStream are in WireRecording.h
+
+int RunRecvBenchmark(const std::string& path) {
+	std::vector<WireStream> streams;
+	if (!LoadWireRecording(path, streams)) {
+		std::cout << "can't read " << path << " as a wire recording" << std::endl;
+		return 1;
+	}
+	bool ok = true;
+	for (WireKind kind : { WIRE_SCREEN, WIRE_AUDIO }) {
+		auto it = std::find_if(streams.begin(), streams.end(), [&](const WireStream& s) { return s.kind == kind; });
+		if (it == streams.end()) continue;
+		const char* unit = kind == WIRE_SCREEN ? "frame" : "packet";
+		RecvBenchResult results[2] = { BenchRecvStream<SocketInput>(*it, g_decodeThreads.load()),
+			BenchRecvStream<BufferedSocketInput>(*it, g_decodeThreads.load()) };
+		const char* readers[2] = { "recv per field", "ring buffer" };
+		for (int i = 0; i < 2; ++i) {
+			const RecvBenchResult& r = results[i];
+			printf("%s, %-14s: %llu %ss, %.1f MB, %llu recv calls (%.1f per %s), %.1f MB/s%s\n",
+				kind == WIRE_SCREEN ? "screen" : "audio", readers[i], (unsigned long long)r.units, unit,
+				it->bytes.size() / 1e6, (unsigned long long)r.recvCalls, r.units ? (double)r.recvCalls / r.units : 0.0,
+				unit, r.seconds > 0 ? it->bytes.size() / 1e6 / r.seconds : 0.0, r.ok ? "" : " (stream malformed or cut off)");
+			ok = ok && r.ok;
+		}
+		if (kind != WIRE_SCREEN) continue;
+
+		// Tiles are decoded in parallel into disjoint regions; the result must not depend on how many
+		// threads do it. Hashing every frame costs time, so these runs are not timed against the above.
+		bool deterministic = true;
+		RecvBenchResult first;
+		for (int threads : { 1, 2, 4, 8 }) {
+			RecvBenchResult r = BenchRecvStream<BufferedSocketInput>(*it, threads, true);
+			if (threads == 1) first = r;
+			bool same = r.units == first.units && r.presentedHash == first.presentedHash;
+			printf("screen, %d decode thread(s): %llu frames, presented frames hash %016llx%s\n", threads,
+				(unsigned long long)r.units, (unsigned long long)r.presentedHash, same ? "" : " (differs)");
+			deterministic = deterministic && same;
+		}
+		if (!deterministic) printf("screen: decoded frames depend on the decode thread count\n");
+		ok = ok && deterministic;
+	}
+	return ok ? 0 : 1;
+}
+
 int main(int argc, char* argv[])
 {
 	// ---- Ensure WSAStartup is called ONCE here ----
@@ -4129,12 +4112,132 @@ int main(int argc, char* argv[])
 	// Initialize optimal color conversion function pointer
 	ColorConversion::InitializeOptimalConverter();
 
+	// Report which XRLE implementation the CPU dispatch picked
+	static const char* xrleSimdNames[] = { "scalar", "SSE4.1", "AVX2" };
+	std::cout << "🗜️  Using " << xrleSimdNames[xrle_simd_level()] << " XRLE implementation" << std::endl;
+
 	// --- Command line mode check ---
 	std::vector<std::string> args(argv + 1, argv + argc);
 	bool isServer = CmdOptionExists(args, "--server");
 	bool isClient = CmdOptionExists(args, "--client");
 	bool isHeadlessClient = isClient && CmdOptionExists(args, "--headless");
 
+	int encodeThreadsArg = -1;
+	std::string encodeThreadsStr = GetCmdOption(args, "--encode-threads");
+	if (!encodeThreadsStr.empty()) {
+		try { encodeThreadsArg = std::max(0, std::stoi(encodeThreadsStr)); g_encodeThreads = encodeThreadsArg; }
+		catch (...) {
+			std::cerr << "Invalid encode thread count: " << encodeThreadsStr << std::endl;
+			WSACleanup();
+			return 1;
+		}
+	}
+	int decodeThreadsArg = -1;
+	std::string decodeThreadsStr = GetCmdOption(args, "--decode-threads");
+	if (!decodeThreadsStr.empty()) {
+		try { decodeThreadsArg = std::max(0, std::stoi(decodeThreadsStr)); g_decodeThreads = decodeThreadsArg; }
+		catch (...) {
+			std::cerr << "Invalid decode thread count: " << decodeThreadsStr << std::endl;
+			WSACleanup();
+			return 1;
+		}
+	}
+	int tileCacheArg = -1;
+	std::string tileCacheStr = GetCmdOption(args, "--tile-cache-mb");
+	if (!tileCacheStr.empty()) {
+		try { tileCacheArg = std::min(1024, std::max(0, std::stoi(tileCacheStr))); g_tileCacheMB = tileCacheArg; }
+		catch (...) {
+			std::cerr << "Invalid tile cache size: " << tileCacheStr << std::endl;
+			WSACleanup();
+			return 1;
+		}
+	}
+	int changeDetectArg = -1;
+	std::string changeDetectStr = GetCmdOption(args, "--change-detect");
+	if (!changeDetectStr.empty()) {
+		if (changeDetectStr == "exact") changeDetectArg = CHANGE_DETECT_EXACT;
+		else if (changeDetectStr == "hash") changeDetectArg = CHANGE_DETECT_HASH;
+		else {
+			std::cerr << "Invalid change detection mode: " << changeDetectStr << std::endl;
+			WSACleanup();
+			return 1;
+		}
+		g_changeDetect = changeDetectArg;
+	}
+	std::string captureStr = GetCmdOption(args, "--capture");
+	if (!captureStr.empty()) {
+		if (captureStr == "gdi") g_captureSource = CAPTURE_GDI;
+		else if (captureStr == "synthetic") g_captureSource = CAPTURE_SYNTHETIC;
+		else {
+			std::cerr << "Invalid capture source: " << captureStr << std::endl;
+			WSACleanup();
+			return 1;
+		}
+	}
+	int pixelFormatArg = -1;
+	std::string pixelFormatStr = GetCmdOption(args, "--pixel-format");
+	if (!pixelFormatStr.empty()) {
+		if (pixelFormatStr == "bgra") pixelFormatArg = PIXEL_FORMAT_BGRA;
+		else if (pixelFormatStr == "rgba") pixelFormatArg = PIXEL_FORMAT_RGBA;
+		else {
+			std::cerr << "Invalid pixel format: " << pixelFormatStr << std::endl;
+			WSACleanup();
+			return 1;
+		}
+		g_pixelFormat = pixelFormatArg;
+	}
+	if (CmdOptionExists(args, "--latency-dump")) g_latencyDump = true;
+	if (CmdOptionExists(args, "--trace")) g_traceEnabled = g_traceDump = true;
+	int metricsPort = 0;
+	std::string metricsPortStr = GetCmdOption(args, "--metrics-port");
+	if (!metricsPortStr.empty()) {
+		try { metricsPort = std::stoi(metricsPortStr); }
+		catch (...) {
+			std::cerr << "Invalid metrics port: " << metricsPortStr << std::endl;
+			WSACleanup();
+			return 1;
+		}
+	}
+	StartMetricsExport(GetCmdOption(args, "--metrics-file"), metricsPort);
+	std::string recordPath = GetCmdOption(args, "--record");
+	if (!recordPath.empty() && !g_wireRecorder.Open(recordPath)) {
+		std::cerr << "Can't write recording: " << recordPath << std::endl;
+		WSACleanup();
+		return 1;
+	}
+	int presentArg = -1;
+	std::string presentStr = GetCmdOption(args, "--present");
+	if (!presentStr.empty()) {
+		if (presentStr == "direct") presentArg = PRESENT_DIRECT;
+		else if (presentStr == "copy") presentArg = PRESENT_COPY;
+		else {
+			std::cerr << "Invalid present mode: " << presentStr << std::endl;
+			WSACleanup();
+			return 1;
+		}
+		g_presentMode = presentArg;
+	}
+
+	std::string benchRecvPath = GetCmdOption(args, "--bench-recv");
+	if (!benchRecvPath.empty()) {
+		int benchResult = RunRecvBenchmark(benchRecvPath);
+		WSACleanup();
+		return benchResult;
+	}
+
+	std::string replayPath = GetCmdOption(args, "--replay");
+	if (!replayPath.empty()) {
+		std::string replaySpeed = GetCmdOption(args, "--replay-speed");
+		if (!replaySpeed.empty() && replaySpeed != "recorded" && replaySpeed != "max") {
+			std::cerr << "Invalid replay speed: " << replaySpeed << std::endl;
+			WSACleanup();
+			return 1;
+		}
+		int replayResult = RunReplay(replayPath, replaySpeed == "recorded");
+		WSACleanup();
+		return replayResult;
+	}
+
 	// --- Headless server mode: run true headless server logic and exit ---
 	if (!args.empty() && isServer && !isClient) {
 		int port = DEFAULT_PORT;
@@ -4175,6 +4278,12 @@ int main(int argc, char* argv[])
 
 	MainWindow win;
 	g_pMainWindow = &win; // <-- Set the global pointer after win is defined
+	if (encodeThreadsArg >= 0) g_encodeThreads = encodeThreadsArg; // command line overrides config.txt
+	if (decodeThreadsArg >= 0) g_decodeThreads = decodeThreadsArg;
+	if (tileCacheArg >= 0) g_tileCacheMB = tileCacheArg;
+	if (changeDetectArg >= 0) g_changeDetect = changeDetectArg;
+	if (pixelFormatArg >= 0) g_pixelFormat = pixelFormatArg;
+	if (presentArg >= 0) g_presentMode = presentArg;
 
 	// Use loaded size from config
 	int winW = win.m_savedWinW;
@@ -0,0 +1,590 @@
+// Plays recorded frame sequences through the screen pipeline with no socket and no window. DIR holds
+// one subdirectory per content class (office text, IDE scrolling, video, idle desktop...) with its
+// frames as .qoi or .ppm files, taken in name order. The server half is the producer's
+// ScreenFrameEncoder (includes/ScreenFrameEncoder.h) with the given change detection and tile
+// cache; the client half parses the gathered payload with ReadScreenFrame and decodes it with
+// ParallelFrameDecoder (includes/ParallelFrameDecoder.h) into a MemoryPresenter. The decoded frame
+// is checked against the source every frame. As on the server every 60th frame is sent whole;
+// frame 0 of a class is a keyframe and left out of the numbers. Timings cover the pipeline only,
+// not loading or checking. Built with -DREMOTE_COUNT_ALLOCS it also reports the heap allocations
+// per frame of each half, and lists them frame by frame for the first --threads run of every class,
+// keyframe included, so that buffers can be seen to stop growing once the content is warmed up.
+//
+// Every class runs once per TileRecordFormat, so the two can be compared byte for byte (a table of
+// what the compact v2 records save follows the results), and once
+// per encode thread count given with --threads (1,2,4,8 for a scaling sweep); the encoded stream
+// must not depend on the thread count. The speedup of the server half is against the first count
+// given; threads beyond the cores the machine has (printed first) cannot add any. A synthetic_scroll
+// class made from SyntheticFrameSource runs after the ones in DIR, or on its own without DIR; it
+// scrolls every frame, so it fails unless copy rects are sent for it.
+//
+// Each class and format then runs once more at the first thread count with the motion detector
+// off, so that scrolled and moved content goes out as tiles; the bytes per frame with and without
+// copy rects show the bandwidth they save. Two more runs set the codec picked per tile against the
+// old pipeline, in which every tile was QOI-encoded and then XRLE-compressed: "qoi" is today's
+// pipeline with every tile QOI, "old" also has v1 records, no copy rects and no tile cache.
+//
+// Last, a 1920x1080 page on which exactly 1, 10, 100, 1000 and all 2040 of its tiles change every
+// frame, as a caret blinking in each of them, runs as the classes changed_N; the microseconds per
+// frame of either half should grow with the tiles changed, and stay flat per tile.
+//
+//   gcc -O2 -c includes/xrle.c -o xrle.o
+//   g++ -std=c++14 -O2 -pthread -Iincludes tests/CorpusBench.cpp xrle.o -o CorpusBench
+//   ./CorpusBench [DIR] [--csv PATH] [--threads N,N...] [--decode-threads N]
+//                 [--change-detect exact|hash] [--tile-cache-mb MB] [--no-xrle]
+//
+// --csv writes the same numbers with fixed columns so that runs can be diffed; 0 threads means one
+// per core, as on the server. Exits 1 if the corpus can't be loaded or a frame fails to encode or
+// parse, 2 if a frame is not reproduced exactly, the stream depends on the thread count or the
+// scrolling page gets no copy rects.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+extern "C" {
+#include "xrle.h"
+}
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+#include "FramePresenter.h"
+#include "FrameSource.h"
+#include "ScreenFrameEncoder.h"
+#include "ParallelFrameDecoder.h"
+
+#ifdef REMOTE_COUNT_ALLOCS
+static std::atomic<uint64_t> g_heapAllocs(0);
+void* operator new(size_t size) {
+	g_heapAllocs.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+#endif
+
+// Heap allocations so far when built with REMOTE_COUNT_ALLOCS, else 0
+static uint64_t HeapAllocsSoFar() {
+#ifdef REMOTE_COUNT_ALLOCS
+	return g_heapAllocs.load();
+#else
+	return 0;
+#endif
+}
+
+// The server settings the pipeline runs with, from the command line
+struct BenchSettings {
+	bool hashDetect = false;  // --change-detect hash
+	bool motionDetect = true; // off for the runs without copy rects
+	bool codecChoice = true;  // off for the runs with every tile QOI
+	bool useXrle = true;      // off with --no-xrle, as on the server above 30 fps
+	int tileCacheMB = 16;
+	int decodeThreads = 0;
+	std::vector<int> encodeThreads;
+};
+
+// Sorted names of the entries of dir: subdirectories, or files
+static std::vector<std::string> ListCorpusDir(const std::string& dir, bool directories) {
+	std::vector<std::string> names;
+	DIR* d = opendir(dir.c_str());
+	if (!d) return names;
+	while (dirent* entry = readdir(d)) {
+		struct stat st;
+		if (entry->d_name[0] == '.' || stat((dir + "/" + entry->d_name).c_str(), &st) != 0) continue;
+		if (S_ISDIR(st.st_mode) == directories) names.push_back(entry->d_name);
+	}
+	closedir(d);
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+struct CorpusResult {
+	std::string contentClass;
+	int recordFormat = TILE_RECORD_V1;
+	int encodeThreads = 0;   // asked for; the encoder's worker count once run
+	int frames = 0;          // measured frames, keyframe excluded
+	int width = 0, height = 0;
+	uint64_t tiles = 0;
+	uint64_t copyRects = 0;
+	uint64_t wireBytes = 0;
+	uint64_t rawBytes = 0;   // 32bpp size of the measured frames
+	double serverSeconds = 0, clientSeconds = 0;
+	double serverSpeedup = 1; // server time of the class's first --threads run over this one's
+	uint64_t serverAllocs = 0, clientAllocs = 0; // with REMOTE_COUNT_ALLOCS
+	std::vector<uint64_t> serverAllocTrace, clientAllocTrace; // the same for every frame, keyframe included
+	int mismatches = 0;      // frames the client did not reproduce exactly
+};
+
+// Reads a ScreenFrame payload gathered into memory, as the socket would deliver it
+class MemoryInput : public StreamInput {
+	const std::vector<uint8_t>& bytes;
+	size_t pos = 0;
+public:
+	explicit MemoryInput(const std::vector<uint8_t>& b) : bytes(b) {}
+
+	bool AtEnd() const { return pos == bytes.size(); }
+
+	bool Read(void* dst, size_t len) override {
+		if (len > bytes.size() - pos) return false;
+		memcpy(dst, bytes.data() + pos, len);
+		pos += len;
+		return true;
+	}
+
+	const uint8_t* ReadSpan(size_t len, size_t align = 1) override {
+		if (len > bytes.size() - pos) return nullptr;
+		if ((uintptr_t)(bytes.data() + pos) & (align - 1)) return StreamInput::ReadSpan(len, align);
+		const uint8_t* span = bytes.data() + pos;
+		pos += len;
+		return span;
+	}
+};
+
+// Loads the frames of the content class in dir, in name order; null if there are none or one
+// can't be read
+static CorpusFrameSource* LoadCorpusClass(const std::string& dir) {
+	std::vector<std::string> paths;
+	for (const std::string& name : ListCorpusDir(dir, false))
+		if (HasExtension(name, ".qoi") || HasExtension(name, ".ppm")) paths.push_back(dir + "/" + name);
+	CorpusFrameSource* corpus = new CorpusFrameSource();
+	if (!corpus->Load(paths)) {
+		delete corpus;
+		return nullptr;
+	}
+	return corpus;
+}
+
+// 30 frames of SyntheticFrameSource at 1280x720: a page scrolling 3 pixels a frame under a fixed
+// toolbar and beside a fixed sidebar, with a block sliding across it
+static const char* const SYNTHETIC_SCROLL_CLASS = "synthetic_scroll";
+static CorpusFrameSource* SyntheticScrollClass() {
+	SyntheticFrameSource source(1280, 720);
+	CorpusFrameSource* corpus = new CorpusFrameSource();
+	corpus->Record(source, 30);
+	return corpus;
+}
+
+// A still page (the first frame of SyntheticFrameSource) on which a caret blinks every frame in as
+// many tiles as asked for, picked at random
+class ChangedTilesSource : public FrameSource {
+	int width, height, changed;
+	std::vector<uint32_t> page;
+	std::vector<int> tiles; // indices of all tiles; a fresh prefix of them is changed every frame
+	std::mt19937 rng;
+	uint32_t frame = 0;
+
+public:
+	ChangedTilesSource(int w, int h, int changedTiles) : width(w), height(h), changed(changedTiles), page((size_t)w * h), rng(13) {
+		SyntheticFrameSource(w, h).Capture((uint8_t*)page.data(), w * 4, w, h, false);
+		int tilesX = (w + TILE_W - 1) / TILE_W, tilesY = (h + TILE_H - 1) / TILE_H;
+		for (int i = 0; i < tilesX * tilesY; ++i) tiles.push_back(i);
+		changed = std::min(changed, (int)tiles.size());
+	}
+
+	bool QuerySize(int& w, int& h) override {
+		w = width;
+		h = height;
+		return true;
+	}
+
+	bool Capture(uint8_t* bits, int pitch, int w, int h, bool bgra) override {
+		if (frame > 0) {
+			int tilesX = (width + TILE_W - 1) / TILE_W;
+			for (int i = 0; i < changed; ++i) {
+				std::swap(tiles[i], tiles[i + rng() % (tiles.size() - i)]);
+				int x0 = tiles[i] % tilesX * TILE_W + 4, y0 = tiles[i] / tilesX * TILE_H + 4;
+				uint32_t color = 0xFF000000u | (frame * 2654435761u & 0xFFFFFFu); // new every frame, so no tile repeats
+				for (int y = y0; y < std::min(height, y0 + 16); ++y)
+					for (int x = x0; x < std::min(width, x0 + 2); ++x) page[(size_t)y * width + x] = color;
+			}
+		}
+		frame++;
+		for (int y = 0; y < h; ++y) {
+			uint32_t* row = reinterpret_cast<uint32_t*>(bits + (size_t)y * pitch);
+			for (int x = 0; x < w; ++x) {
+				uint32_t v = page[(size_t)y * width + x];
+				row[x] = bgra ? (v & 0xFF00FF00u) | ((v >> 16) & 0xFFu) | ((v & 0xFFu) << 16) : v;
+			}
+		}
+		return true;
+	}
+};
+
+// 16 frames of ChangedTilesSource at 1920x1080, named changed_N
+static const char* const CHANGED_TILES_PREFIX = "changed_";
+static CorpusFrameSource* ChangedTilesClass(int changedTiles) {
+	ChangedTilesSource source(1920, 1080, changedTiles);
+	CorpusFrameSource* corpus = new CorpusFrameSource();
+	corpus->Record(source, 16);
+	return corpus;
+}
+
+// Plays the frames of corpus, which it takes over, through both halves of the pipeline
+static bool BenchCorpusClass(CorpusFrameSource* corpus, const BenchSettings& settings, CorpusResult& result) {
+	const int recordFormat = result.recordFormat;
+	const std::string& name = result.contentClass;
+	using namespace std::chrono;
+	const size_t frameCount = corpus->FrameCount();
+	std::vector<uint32_t> expected;
+	CaptureContext capture(std::unique_ptr<FrameSource>(corpus), PIXEL_FORMAT_BGRA);
+
+	// Server half: the producer's encoder, as in ScreenBroadcaster::Run
+	uint32_t cacheSlots = (uint32_t)((size_t)std::max(0, settings.tileCacheMB) * 1024 * 1024 / TILE_CACHE_SLOT_BYTES);
+	ScreenFrameEncoder encoder(recordFormat, cacheSlots, result.encodeThreads);
+	encoder.SetMotionDetect(settings.motionDetect);
+	encoder.SetCodecChoice(settings.codecChoice);
+	result.encodeThreads = encoder.WorkerCount();
+	EncodedFrame encoded;
+	std::vector<WireSlice> slices;
+	std::vector<uint8_t> wire;
+
+	// Client half: the frame parser and decoder, as in ScreenRecvThread
+	FrameSurface surface;
+	MemoryPresenter* presenter = new MemoryPresenter();
+	surface.presenter = presenter;
+	ParallelFrameDecoder decoder(&surface, settings.decodeThreads, encoder.CacheSlots(), PIXEL_FORMAT_BGRA, recordFormat);
+	std::vector<CopyRect> pendingMoves;
+
+	for (size_t f = 0; f < frameCount; ++f) {
+		int width, height;
+		if (!corpus->QuerySize(width, height)) return false;
+		expected.assign(corpus->Peek(), corpus->Peek() + (size_t)width * height);
+		for (uint32_t& v : expected) v = (v & 0xFF00FF00u) | ((v >> 16) & 0xFFu) | ((v & 0xFFu) << 16);
+		if (!capture.Capture(!settings.hashDetect)) {
+			printf("frame %zu of %s differs in size, stopping there\n", f, name.c_str());
+			break;
+		}
+
+		// --- Server: change detection, encoding, framing ---
+		uint64_t serverAllocs = HeapAllocsSoFar();
+		auto serverStart = steady_clock::now();
+		size_t tileBytes;
+		if (!encoder.Encode(encoded, capture.Current(), capture.Previous(), (uint32_t)f + 1, LatencyNowUs(), f == 0,
+			settings.hashDetect, settings.useXrle, tileBytes)) {
+			printf("frame %zu of %s failed to encode\n", f, name.c_str());
+			return false;
+		}
+		double serverSeconds = duration<double>(steady_clock::now() - serverStart).count();
+		serverAllocs = HeapAllocsSoFar() - serverAllocs;
+
+		// The payload as the sender gathers it onto the wire
+		slices.clear();
+		encoded.AppendSlices(slices);
+		wire.clear();
+		for (const WireSlice& slice : slices)
+			wire.insert(wire.end(), (const uint8_t*)slice.data, (const uint8_t*)slice.data + slice.len);
+
+		// --- Client: parsing and decoding ---
+		uint64_t clientAllocs = HeapAllocsSoFar();
+		auto clientStart = steady_clock::now();
+		MemoryInput input(wire);
+		if (!ReadScreenFrame(input, width, height, decoder, pendingMoves) || !input.AtEnd()) {
+			printf("frame %zu of %s does not parse\n", f, name.c_str());
+			return false;
+		}
+		decoder.Flush();
+		double clientSeconds = duration<double>(steady_clock::now() - clientStart).count();
+		clientAllocs = HeapAllocsSoFar() - clientAllocs;
+
+		bool same = presenter->Pitch() == width * 4 &&
+			memcmp(presenter->Bits(), expected.data(), expected.size() * 4) == 0;
+		if (f == 0) {
+			result.width = width;
+			result.height = height;
+		}
+		if (!same) result.mismatches++;
+		presenter->presented.clear(); // only this frame's damage is of interest; keeps its capacity
+		result.serverAllocTrace.push_back(serverAllocs);
+		result.clientAllocTrace.push_back(clientAllocs);
+		if (f == 0) continue;
+		result.frames++;
+		result.tiles += encoder.DirtyTiles();
+		result.copyRects += encoder.CopyRects();
+		result.wireBytes += encoded.size;
+		result.rawBytes += (uint64_t)width * height * 4;
+		result.serverSeconds += serverSeconds;
+		result.clientSeconds += clientSeconds;
+		result.serverAllocs += serverAllocs;
+		result.clientAllocs += clientAllocs;
+	}
+	return true;
+}
+
+// Prints the table, and the CSV if csvPath is given; false if the CSV can't be written
+static bool ReportCorpusResults(const std::vector<CorpusResult>& results, const std::string& csvPath) {
+	std::ofstream csv;
+	if (!csvPath.empty()) {
+		csv.open(csvPath);
+		if (!csv.is_open()) {
+			printf("can't write %s\n", csvPath.c_str());
+			return false;
+		}
+		csv << "class,tile_records,encode_threads,frames,width,height,tiles_per_frame,copy_rects_per_frame,bytes_per_frame,compression_ratio,"
+			"server_fps,server_mbps,server_speedup,client_fps,client_mbps,client_tiles_per_sec,server_allocs_per_frame,client_allocs_per_frame,mismatched_frames\n";
+	}
+	printf("%-16s %4s %3s %6s %11s %8s %7s %12s %8s %10s %10s %6s %10s %10s %11s %9s %9s %5s\n", "class", "rec", "enc", "frames", "size", "tiles/f",
+		"rects/f", "bytes/f", "ratio", "srv fps", "srv MB/s", "srv x", "cli fps", "cli MB/s", "cli tiles/s", "srv all/f", "cli all/f", "bad");
+	for (const CorpusResult& r : results) {
+		int frames = std::max(1, r.frames);
+		double tilesPerFrame = (double)r.tiles / frames;
+		double copyRectsPerFrame = (double)r.copyRects / frames;
+		double bytesPerFrame = (double)r.wireBytes / frames;
+		double ratio = r.wireBytes ? (double)r.rawBytes / r.wireBytes : 0;
+		double serverFps = r.serverSeconds > 0 ? r.frames / r.serverSeconds : 0;
+		double serverMBps = r.serverSeconds > 0 ? r.rawBytes / r.serverSeconds / 1e6 : 0;
+		double clientFps = r.clientSeconds > 0 ? r.frames / r.clientSeconds : 0;
+		double clientMBps = r.clientSeconds > 0 ? r.rawBytes / r.clientSeconds / 1e6 : 0;
+		double clientTilesPerSec = r.clientSeconds > 0 ? r.tiles / r.clientSeconds : 0; // parsed and decoded
+		char size[32];
+		snprintf(size, sizeof(size), "%dx%d", r.width, r.height);
+		// Left empty in the CSV and shown as - when allocations are not counted
+		char serverAllocs[32] = "", clientAllocs[32] = "";
+#ifdef REMOTE_COUNT_ALLOCS
+		snprintf(serverAllocs, sizeof(serverAllocs), "%.1f", (double)r.serverAllocs / frames);
+		snprintf(clientAllocs, sizeof(clientAllocs), "%.1f", (double)r.clientAllocs / frames);
+#endif
+		printf("%-16s   v%d %3d %6d %11s %8.1f %7.2f %12.0f %8.2f %10.1f %10.1f %6.2f %10.1f %10.1f %11.0f %9s %9s %5d\n", r.contentClass.c_str(),
+			r.recordFormat + 1, r.encodeThreads, r.frames, size, tilesPerFrame, copyRectsPerFrame, bytesPerFrame, ratio, serverFps, serverMBps, r.serverSpeedup, clientFps,
+			clientMBps, clientTilesPerSec, *serverAllocs ? serverAllocs : "-", *clientAllocs ? clientAllocs : "-", r.mismatches);
+		if (csv.is_open()) {
+			char line[512];
+			snprintf(line, sizeof(line), "%s,v%d,%d,%d,%d,%d,%.3f,%.3f,%.1f,%.4f,%.2f,%.2f,%.3f,%.2f,%.2f,%.0f,%s,%s,%d\n", r.contentClass.c_str(),
+				r.recordFormat + 1, r.encodeThreads, r.frames, r.width, r.height, tilesPerFrame, copyRectsPerFrame, bytesPerFrame, ratio, serverFps, serverMBps, r.serverSpeedup,
+				clientFps, clientMBps,
+				clientTilesPerSec, serverAllocs, clientAllocs, r.mismatches);
+			csv << line;
+		}
+	}
+	return true;
+}
+
+// Bytes per frame of each class in v1 and v2 records (their first runs in results), and what the
+// compact records save per frame and per tile sent
+static void ReportRecordFormatSavings(const std::vector<CorpusResult>& results) {
+	printf("\ncompact v2 tile records against v1\n");
+	printf("%-16s %8s %12s %12s %12s %7s %10s\n", "class", "tiles/f", "v1 bytes/f", "v2 bytes/f", "saved/f", "saved", "saved/tile");
+	for (const CorpusResult& v1 : results) {
+		if (v1.recordFormat != TILE_RECORD_V1) continue;
+		auto first = std::find_if(results.begin(), results.end(), [&](const CorpusResult& r) {
+			return r.contentClass == v1.contentClass && r.recordFormat == TILE_RECORD_V1;
+		});
+		auto v2 = std::find_if(results.begin(), results.end(), [&](const CorpusResult& r) {
+			return r.contentClass == v1.contentClass && r.recordFormat == TILE_RECORD_V2;
+		});
+		if (&*first != &v1 || v2 == results.end()) continue;
+		int frames = std::max(1, v1.frames);
+		double v1Bytes = (double)v1.wireBytes / frames, v2Bytes = (double)v2->wireBytes / std::max(1, v2->frames);
+		double tilesPerFrame = (double)v1.tiles / frames;
+		printf("%-16s %8.1f %12.0f %12.0f %12.0f %6.1f%% %10.1f\n", v1.contentClass.c_str(), tilesPerFrame, v1Bytes, v2Bytes,
+			v1Bytes - v2Bytes, v1Bytes > 0 ? (1 - v2Bytes / v1Bytes) * 100 : 0.0, tilesPerFrame > 0 ? (v1Bytes - v2Bytes) / tilesPerFrame : 0.0);
+	}
+}
+
+// Bytes per frame and server fps of each class with copy rects (the first --threads run in results)
+// and without them (noMotion)
+static void ReportCopyRectSavings(const std::vector<CorpusResult>& results, const std::vector<CorpusResult>& noMotion) {
+	printf("\ncopy rects: motion detection on against off\n");
+	printf("%-16s %4s %3s %12s %12s %7s %9s %9s %10s %10s\n", "class", "rec", "enc", "bytes/f on", "bytes/f off", "saved",
+		"tiles/f on", "tiles/f off", "srv fps on", "srv fps off");
+	for (const CorpusResult& off : noMotion) {
+		auto on = std::find_if(results.begin(), results.end(), [&](const CorpusResult& r) {
+			return r.contentClass == off.contentClass && r.recordFormat == off.recordFormat;
+		});
+		if (on == results.end()) continue;
+		int onFrames = std::max(1, on->frames), offFrames = std::max(1, off.frames);
+		double onBytes = (double)on->wireBytes / onFrames, offBytes = (double)off.wireBytes / offFrames;
+		printf("%-16s   v%d %3d %12.0f %12.0f %6.1f%% %9.1f %9.1f %10.1f %10.1f\n", off.contentClass.c_str(), off.recordFormat + 1,
+			off.encodeThreads, onBytes, offBytes, offBytes > 0 ? (1 - onBytes / offBytes) * 100 : 0.0, (double)on->tiles / onFrames,
+			(double)off.tiles / offFrames, on->serverSeconds > 0 ? on->frames / on->serverSeconds : 0.0,
+			off.serverSeconds > 0 ? off.frames / off.serverSeconds : 0.0);
+	}
+}
+
+#ifdef REMOTE_COUNT_ALLOCS
+// Heap allocations of each frame of the first run of every class and format, server then client
+static void ReportAllocationTraces(const std::vector<CorpusResult>& results) {
+	printf("\nheap allocations frame by frame, from the keyframe on\n");
+	for (const CorpusResult& r : results) {
+		auto first = std::find_if(results.begin(), results.end(), [&](const CorpusResult& o) {
+			return o.contentClass == r.contentClass && o.recordFormat == r.recordFormat;
+		});
+		if (&*first != &r) continue;
+		for (int half = 0; half < 2; ++half) {
+			printf("%-16s   v%d %-6s", half ? "" : r.contentClass.c_str(), r.recordFormat + 1, half ? "client" : "server");
+			for (uint64_t allocs : half ? r.clientAllocTrace : r.serverAllocTrace) printf(" %llu", (unsigned long long)allocs);
+			printf("\n");
+		}
+	}
+}
+#endif
+
+// Bytes and time per frame of each class now (its first v2 run in results), with every tile QOI
+// (qoiOnly) and through the old pipeline (old)
+static void ReportAgainstOldPipeline(const std::vector<CorpusResult>& results, const std::vector<CorpusResult>& qoiOnly,
+	const std::vector<CorpusResult>& old) {
+	printf("\nper-tile codecs against QOI for every tile (old: also v1 records, no copy rects, no tile cache)\n");
+	printf("%-16s %11s %11s %11s %7s %10s %10s %10s %10s %10s %10s\n", "class", "old B/f", "qoi B/f", "now B/f", "saved",
+		"old srv us", "qoi srv us", "now srv us", "old cli us", "qoi cli us", "now cli us");
+	for (size_t i = 0; i < old.size() && i < qoiOnly.size(); ++i) {
+		auto now = std::find_if(results.begin(), results.end(), [&](const CorpusResult& r) {
+			return r.contentClass == old[i].contentClass && r.recordFormat == TILE_RECORD_V2;
+		});
+		if (now == results.end()) continue;
+		const CorpusResult* runs[3] = { &old[i], &qoiOnly[i], &*now };
+		double bytes[3], server[3], client[3];
+		for (int k = 0; k < 3; ++k) {
+			int frames = std::max(1, runs[k]->frames);
+			bytes[k] = (double)runs[k]->wireBytes / frames;
+			server[k] = runs[k]->serverSeconds / frames * 1e6;
+			client[k] = runs[k]->clientSeconds / frames * 1e6;
+		}
+		printf("%-16s %11.0f %11.0f %11.0f %6.1f%% %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f\n", old[i].contentClass.c_str(),
+			bytes[0], bytes[1], bytes[2], bytes[0] > 0 ? (1 - bytes[2] / bytes[0]) * 100 : 0.0, server[0], server[1], server[2],
+			client[0], client[1], client[2]);
+	}
+}
+
+// Server and client time per frame and per changed tile of the changed_N classes
+static void ReportChangedTilesCost(const std::vector<CorpusResult>& sweep) {
+	printf("\ncost by tiles changed per frame\n");
+	printf("%-16s %4s %3s %8s %12s %10s %12s %10s %12s\n", "class", "rec", "enc", "tiles/f", "bytes/f", "srv us/f",
+		"srv us/tile", "cli us/f", "cli us/tile");
+	for (const CorpusResult& r : sweep) {
+		int frames = std::max(1, r.frames);
+		double tiles = std::max<double>(1, (double)r.tiles);
+		printf("%-16s   v%d %3d %8.1f %12.0f %10.1f %12.2f %10.1f %12.2f\n", r.contentClass.c_str(), r.recordFormat + 1, r.encodeThreads,
+			(double)r.tiles / frames, (double)r.wireBytes / frames, r.serverSeconds / frames * 1e6, r.serverSeconds / tiles * 1e6,
+			r.clientSeconds / frames * 1e6, r.clientSeconds / tiles * 1e6);
+	}
+}
+
+int main(int argc, char** argv) {
+	std::string dir, csvPath;
+	BenchSettings settings;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : "";
+		if (arg == "--csv") { csvPath = value; ++i; }
+		else if (arg == "--threads") {
+			std::stringstream list(value);
+			for (std::string count; std::getline(list, count, ','); ) settings.encodeThreads.push_back(std::max(0, atoi(count.c_str())));
+			++i;
+		}
+		else if (arg == "--decode-threads") { settings.decodeThreads = std::max(0, atoi(value)); ++i; }
+		else if (arg == "--change-detect") { settings.hashDetect = strcmp(value, "hash") == 0; ++i; }
+		else if (arg == "--tile-cache-mb") { settings.tileCacheMB = std::max(0, atoi(value)); ++i; }
+		else if (arg == "--no-xrle") settings.useXrle = false;
+		else if (arg[0] != '-' && dir.empty()) dir = arg;
+		else {
+			printf("unknown argument %s\n", arg.c_str());
+			return 1;
+		}
+	}
+	if (settings.encodeThreads.empty()) settings.encodeThreads.push_back(0);
+
+	std::vector<std::string> classes;
+	if (!dir.empty()) {
+		classes = ListCorpusDir(dir, true);
+		if (classes.empty()) {
+			printf("no content classes (subdirectories of frames) in %s\n", dir.c_str());
+			return 1;
+		}
+	}
+	classes.push_back(SYNTHETIC_SCROLL_CLASS);
+	printf("%u cores\n", std::thread::hardware_concurrency());
+
+	std::vector<CorpusResult> results, noMotion, qoiOnly, oldPipeline, sweep;
+	int streamMismatches = 0;
+	// Loads a class afresh and runs it; false if it can't be loaded or fails to go through
+	auto runClass = [&](const BenchSettings& runSettings, CorpusResult& result) {
+		const std::string& name = result.contentClass;
+		CorpusFrameSource* corpus = name == SYNTHETIC_SCROLL_CLASS ? SyntheticScrollClass() : LoadCorpusClass(dir + "/" + name);
+		if (!corpus) {
+			printf("can't load the frames in %s/%s\n", dir.c_str(), name.c_str());
+			return false;
+		}
+		return BenchCorpusClass(corpus, runSettings, result);
+	};
+	for (const std::string& name : classes) {
+		for (int recordFormat : { TILE_RECORD_V1, TILE_RECORD_V2 }) {
+			for (size_t t = 0; t < settings.encodeThreads.size(); ++t) {
+				CorpusResult result;
+				result.contentClass = name;
+				result.recordFormat = recordFormat;
+				result.encodeThreads = settings.encodeThreads[t];
+				if (!runClass(settings, result)) return 1;
+				if (t > 0 && result.serverSeconds > 0) result.serverSpeedup = results[results.size() - t].serverSeconds / result.serverSeconds;
+				if (t > 0 && (result.wireBytes != results.back().wireBytes || result.tiles != results.back().tiles)) {
+					printf("%s v%d: %d encode threads produce another stream than %d\n", name.c_str(), recordFormat + 1,
+						result.encodeThreads, results.back().encodeThreads);
+					streamMismatches++;
+				}
+				results.push_back(result);
+			}
+
+			BenchSettings withoutCopyRects = settings;
+			withoutCopyRects.motionDetect = false;
+			CorpusResult result;
+			result.contentClass = name;
+			result.recordFormat = recordFormat;
+			result.encodeThreads = settings.encodeThreads[0];
+			if (!runClass(withoutCopyRects, result)) return 1;
+			noMotion.push_back(result);
+		}
+
+		BenchSettings qoiSettings = settings;
+		qoiSettings.codecChoice = false;
+		BenchSettings oldSettings = qoiSettings;
+		oldSettings.motionDetect = false;
+		oldSettings.tileCacheMB = 0;
+		for (int old = 0; old < 2; ++old) {
+			CorpusResult result;
+			result.contentClass = name;
+			result.recordFormat = old ? TILE_RECORD_V1 : TILE_RECORD_V2;
+			result.encodeThreads = settings.encodeThreads[0];
+			if (!runClass(old ? oldSettings : qoiSettings, result)) return 1;
+			(old ? oldPipeline : qoiOnly).push_back(result);
+		}
+	}
+	for (int changedTiles : { 1, 10, 100, 1000, 2040 }) { // 2040 is every tile of 1920x1080
+		CorpusResult result;
+		result.recordFormat = TILE_RECORD_V2;
+		result.encodeThreads = settings.encodeThreads[0];
+		CorpusFrameSource* corpus = ChangedTilesClass(changedTiles);
+		result.contentClass = CHANGED_TILES_PREFIX + std::to_string(changedTiles);
+		if (!BenchCorpusClass(corpus, settings, result)) return 1;
+		sweep.push_back(result);
+	}
+	if (!ReportCorpusResults(results, csvPath)) return 1;
+	ReportRecordFormatSavings(results);
+	ReportCopyRectSavings(results, noMotion);
+	ReportAgainstOldPipeline(results, qoiOnly, oldPipeline);
+	ReportChangedTilesCost(sweep);
+#ifdef REMOTE_COUNT_ALLOCS
+	ReportAllocationTraces(results);
+#endif
+
+	bool scrollMissed = false;
+	for (const CorpusResult& r : results) {
+		if (r.contentClass == SYNTHETIC_SCROLL_CLASS && r.copyRects == 0) {
+			printf("%s v%d: no copy rects were sent for the scrolling page\n", r.contentClass.c_str(), r.recordFormat + 1);
+			scrollMissed = true;
+		}
+	}
+	for (const std::vector<CorpusResult>* runs : { &results, &noMotion, &qoiOnly, &oldPipeline, &sweep })
+		for (const CorpusResult& r : *runs)
+			if (r.mismatches) return 2;
+	return streamMismatches || scrollMissed ? 2 : 0;
+}
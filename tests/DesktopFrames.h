@@ -0,0 +1,45 @@
+// Synthetic 1920x1080 desktop frames shared by the benchmarks in tests/.
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+const int DESKTOP_W = 1920, DESKTOP_H = 1080;
+
+// Two BGRA frames of a desktop: flat window backgrounds, lines of glyph-like text and a
+// photo-like gradient with noise; the second frame has a few lines of text retyped and the photo
+// moved on.
+inline void DesktopFrames(std::mt19937& rng, std::vector<uint32_t> frames[2]) {
+	const int W = DESKTOP_W, H = DESKTOP_H;
+	for (int f = 0; f < 2; ++f) {
+		std::vector<uint32_t>& px = frames[f];
+		px.assign((size_t)W * H, 0xFFF3F3F3);
+		for (int y = 0; y < H; ++y) {
+			for (int x = 0; x < W; ++x) {
+				uint32_t& p = px[(size_t)y * W + x];
+				if (y < 32) p = 0xFF202020; // title bar
+				else if (x < 240) p = 0xFF2B2B30; // side bar
+				else if (x >= 1280 && y >= 600) { // photo
+					int v = (x * 3 + y * 2 + f * 40) & 0xFF;
+					int n = (int)(rng() % 9) - 4;
+					p = 0xFF000000 | (uint32_t)((v + n) & 0xFF) << 16 | (uint32_t)((v / 2 + n) & 0xFF) << 8 | (uint32_t)((255 - v) & 0xFF);
+				}
+			}
+		}
+		// Text: 18 px lines of 8x12 glyph cells, a few of which change between the frames
+		std::mt19937 text(11);
+		for (int line = 0; line < 30; ++line) {
+			int y0 = 60 + line * 18;
+			int len = 40 + (int)(text() % 100);
+			for (int c = 0; c < len; ++c) {
+				uint32_t glyph = text();
+				if (f == 1 && line % 7 == 3) glyph = ~glyph;
+				if (glyph % 6 == 0) continue; // space
+				for (int gy = 0; gy < 12; ++gy)
+					for (int gx = 0; gx < 8; ++gx)
+						if ((glyph >> ((gy * 8 + gx) % 32)) & 1) px[(size_t)(y0 + gy) * W + 260 + c * 8 + gx] = 0xFF101010;
+			}
+		}
+	}
+}
@@ -0,0 +1,338 @@
+// The screen broadcast (includes/ScreenBroadcaster.h) with many viewers. A producer encodes
+// SyntheticFrameSource at 1280x720 and 30 fps with one encode thread, and 1, 4 and then 16 viewers
+// are sent its frames over TCP on 127.0.0.1, each by a sender thread running SendScreenFrames as
+// the server does and read by a client thread that splits the stream into messages. The producer's
+// own CPU time per frame must stay flat as viewers are added: encoding is done once for all of
+// them, and only the senders and readers grow with the count.
+//
+// Then a viewer falls behind: five frames after joining it stops taking frames until the producer
+// drops its queue, while another keeps up for 120 frames, both decoding every frame they get into
+// a MemoryPresenter. Once the slow one
+// asks again it has to get a keyframe within two frames, from the resync stream, instead of waiting
+// for the shared keyframe RESYNC_KEYFRAME_GAP frames after the one they joined at, and from there
+// on its surface has to match the other viewer's frame for frame.
+//
+//   gcc -O2 -c includes/xrle.c -o xrle.o
+//   g++ -std=c++14 -O2 -pthread -Iincludes tests/FanOutTest.cpp xrle.o -o FanOutTest && ./FanOutTest
+//
+// Exits non-zero if the producer's CPU per frame at 16 viewers is more than 1.5 times that at one,
+// a viewer gets less than half the frames, or the viewer that fell behind is not resynced as above.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+#include "xrle.h"
+}
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+#include "FramePresenter.h"
+#include "ParallelFrameDecoder.h"
+#include "ScreenBroadcaster.h"
+
+const int W = 1280, H = 720, FPS = 30;
+const uint32_t CACHE_SLOTS = 4096;
+
+static double ThreadCpuSeconds() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double ProcessCpuSeconds() {
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+}
+
+// Synthetic frames at fixed settings; the producer's thread CPU time and frames are summed up at
+// every report
+class TestHost : public ScreenBroadcastHost {
+public:
+	std::atomic<bool> active{ true };
+	std::atomic<int> frames{ 0 };
+	std::atomic<double> producerCpu{ 0 };
+	double cpuAtReport = -1;
+
+	std::unique_ptr<FrameSource> NewFrameSource() override {
+		cpuAtReport = ThreadCpuSeconds();
+		return std::unique_ptr<FrameSource>(new SyntheticFrameSource(W, H));
+	}
+	int EncodeThreads() override { return 1; }
+	uint32_t TileCacheSlots() override { return CACHE_SLOTS; }
+	bool StreamActive() override { return active.load(); }
+	int Fps() override { return FPS; }
+	bool HashDetect() override { return false; }
+	void Report(int reported, size_t, int, int, ScreenFrameEncoder&, bool) override {
+		double cpu = ThreadCpuSeconds();
+		producerCpu = producerCpu.load() + (cpu - cpuAtReport);
+		cpuAtReport = cpu;
+		frames += reported;
+	}
+};
+
+// Waits for the producer to notice it has been stopped and lets it finish
+static void WaitForStop(ScreenBroadcaster& broadcaster) {
+	while (broadcaster.Running()) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+}
+
+// --- Fan-out over loopback ---
+struct FanOutResult {
+	int viewers = 0;
+	int frames = 0;              // encoded by the producer
+	double producerMsPerFrame = 0; // over the frames of its whole-second reports
+	double processMsPerFrame = 0;
+	int minViewerFrames = 0, maxViewerFrames = 0;
+	double receivedMBps = 0;
+};
+
+static bool RunFanOut(ScreenBroadcaster& broadcaster, TestHost& host, int viewerCount, double seconds, FanOutResult& result) {
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addrLen = sizeof(addr);
+	if (listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, viewerCount) != 0 ||
+		getsockname(listener, (sockaddr*)&addr, &addrLen) != 0) return false;
+
+	std::vector<int> serverSockets, clientSockets;
+	for (int i = 0; i < viewerCount; ++i) {
+		int client = socket(AF_INET, SOCK_STREAM, 0);
+		if (client < 0 || connect(client, (sockaddr*)&addr, sizeof(addr)) != 0) return false;
+		int server = accept(listener, nullptr, nullptr);
+		if (server < 0) return false;
+		int one = 1;
+		setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		clientSockets.push_back(client);
+		serverSockets.push_back(server);
+	}
+	close(listener);
+
+	host.active = true;
+	host.frames = 0;
+	host.producerCpu = 0;
+	std::vector<std::atomic<int>> viewerFrames(viewerCount);
+	std::atomic<uint64_t> receivedBytes(0);
+	std::vector<std::thread> threads;
+	double cpuStart = ProcessCpuSeconds();
+	uint64_t framesBefore = g_metrics.Counter(METRIC_SERVER_FRAMES);
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < viewerCount; ++i) {
+		viewerFrames[i] = 0;
+		threads.emplace_back([&, i]() {
+			std::shared_ptr<ScreenViewer> viewer = std::make_shared<ScreenViewer>();
+			broadcaster.Add(viewer);
+			SendScreenFrames(broadcaster, *viewer, PIXEL_FORMAT_BGRA, TILE_RECORD_V2, [&](const std::vector<WireSlice>& slices) {
+				return SendGather(serverSockets[i], slices.data(), slices.size());
+			});
+			broadcaster.Remove(viewer);
+			shutdown(serverSockets[i], SHUT_RDWR);
+		});
+		threads.emplace_back([&, i]() {
+			BufferedSocketInput input(clientSockets[i]);
+			MessageReader reader(input);
+			MsgHeader header;
+			while (reader.Next(header)) {
+				if (header.type == MsgType::ScreenFrame) viewerFrames[i]++;
+				receivedBytes += sizeof(header) + header.length;
+			}
+		});
+	}
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+	host.active = false;
+	for (std::thread& t : threads) t.join();
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double processCpu = ProcessCpuSeconds() - cpuStart;
+	WaitForStop(broadcaster);
+	for (int s : serverSockets) close(s);
+	for (int s : clientSockets) close(s);
+
+	result.viewers = viewerCount;
+	result.frames = (int)(g_metrics.Counter(METRIC_SERVER_FRAMES) - framesBefore);
+	result.producerMsPerFrame = host.producerCpu.load() / std::max(1, host.frames.load()) * 1e3;
+	result.processMsPerFrame = processCpu / std::max(1, result.frames) * 1e3;
+	result.minViewerFrames = result.maxViewerFrames = viewerFrames[0];
+	for (std::atomic<int>& n : viewerFrames) {
+		result.minViewerFrames = std::min(result.minViewerFrames, n.load());
+		result.maxViewerFrames = std::max(result.maxViewerFrames, n.load());
+	}
+	result.receivedMBps = receivedBytes.load() / elapsed / 1e6;
+	return true;
+}
+
+// --- Resync of a viewer that fell behind ---
+// Reads a ScreenFrame payload gathered into memory, as the socket would deliver it
+class MemoryInput : public StreamInput {
+	std::vector<uint8_t> bytes;
+	size_t pos = 0;
+public:
+	void Assign(const EncodedFrame& frame) {
+		std::vector<WireSlice> slices;
+		frame.AppendSlices(slices);
+		bytes.clear();
+		pos = 0;
+		for (const WireSlice& slice : slices)
+			bytes.insert(bytes.end(), (const uint8_t*)slice.data, (const uint8_t*)slice.data + slice.len);
+	}
+
+	bool Read(void* dst, size_t len) override {
+		if (len > bytes.size() - pos) return false;
+		memcpy(dst, bytes.data() + pos, len);
+		pos += len;
+		return true;
+	}
+};
+
+// A viewer that decodes every frame it is handed and notes the surface it ends up with
+struct DecodingViewer {
+	std::shared_ptr<ScreenViewer> viewer = std::make_shared<ScreenViewer>();
+	FrameSurface surface;
+	MemoryPresenter* presenter = new MemoryPresenter();
+	ParallelFrameDecoder decoder;
+	MemoryInput input;
+	std::vector<CopyRect> pendingMoves;
+	bool decodeFailed = false;
+
+	struct Received {
+		uint32_t seq;
+		bool keyframe;
+		uint64_t surfaceHash;
+	};
+	std::vector<Received> received;
+	std::atomic<int> taken{ 0 };
+
+	DecodingViewer() : decoder((surface.presenter = presenter, &surface), 1, CACHE_SLOTS, PIXEL_FORMAT_BGRA, TILE_RECORD_V2) {}
+
+	bool Take(ScreenBroadcaster& broadcaster) {
+		EncodedFramePtr frame;
+		if (!broadcaster.Next(*viewer, frame)) return false;
+		input.Assign(*frame);
+		if (!ReadScreenFrame(input, frame->width, frame->height, decoder, pendingMoves)) decodeFailed = true;
+		decoder.Flush();
+		uint64_t hash = 14695981039346656037ull;
+		const uint8_t* bits = presenter->Bits();
+		for (size_t i = 0; i < (size_t)frame->width * frame->height * 4; i += 8) {
+			uint64_t word;
+			memcpy(&word, bits + i, 8);
+			hash = (hash ^ word) * 1099511628211ull;
+		}
+		received.push_back({ frame->seq, (frame->flags & FRAME_KEYFRAME) != 0, hash });
+		taken++;
+		return true;
+	}
+};
+
+static bool RunResync(ScreenBroadcaster& broadcaster, TestHost& host) {
+	host.active = true;
+	DecodingViewer fast, slow;
+	uint32_t resumeSeq = 0;
+	uint64_t resyncFramesBefore = g_metrics.Counter(METRIC_SERVER_RESYNC_FRAMES);
+	std::thread fastThread([&]() {
+		broadcaster.Add(fast.viewer);
+		while (fast.Take(broadcaster)) {}
+	});
+	std::thread slowThread([&]() {
+		broadcaster.Add(slow.viewer);
+		for (int i = 0; i < 5 && slow.Take(broadcaster); ++i) {}
+		uint64_t drops = g_metrics.Counter(METRIC_SERVER_VIEWER_DROPS);
+		while (g_metrics.Counter(METRIC_SERVER_VIEWER_DROPS) == drops && host.active)
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		resumeSeq = g_nextFrameSeq.load();
+		while (slow.Take(broadcaster)) {}
+	});
+	auto start = std::chrono::steady_clock::now();
+	while (fast.taken < 120 && std::chrono::steady_clock::now() - start < std::chrono::seconds(60))
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	host.active = false;
+	fastThread.join();
+	slowThread.join();
+	broadcaster.Remove(fast.viewer);
+	broadcaster.Remove(slow.viewer);
+	WaitForStop(broadcaster);
+	uint64_t resyncFrames = g_metrics.Counter(METRIC_SERVER_RESYNC_FRAMES) - resyncFramesBefore;
+
+	// The first frame the slow viewer got after the stall
+	size_t first = 0;
+	while (first < slow.received.size() && slow.received[first].seq < resumeSeq) ++first;
+	if (first == slow.received.size()) {
+		printf("resync: the viewer that fell behind got nothing after it asked again\n");
+		return false;
+	}
+	const DecodingViewer::Received& resync = slow.received[first];
+	printf("resync: asked again before frame %u, got %s frame %u; %llu frames from the resync stream\n", resumeSeq,
+		resync.keyframe ? "keyframe" : "delta", resync.seq, (unsigned long long)resyncFrames);
+	bool ok = true;
+	if (!resync.keyframe || resync.seq > resumeSeq + 2) {
+		printf("resync: not resynced within two frames\n");
+		ok = false;
+	}
+	if (resyncFrames < 10 || resyncFrames > ScreenBroadcaster::RESYNC_KEYFRAME_GAP + 2) {
+		printf("resync: the resync stream did not hand over to the next shared keyframe\n");
+		ok = false;
+	}
+	if (fast.decodeFailed || slow.decodeFailed) {
+		printf("resync: a frame did not decode\n");
+		ok = false;
+	}
+	std::map<uint32_t, uint64_t> fastHashes;
+	for (const DecodingViewer::Received& r : fast.received) fastHashes[r.seq] = r.surfaceHash;
+	int compared = 0, differing = 0;
+	for (size_t i = first; i < slow.received.size(); ++i) {
+		auto it = fastHashes.find(slow.received[i].seq);
+		if (it == fastHashes.end()) continue;
+		compared++;
+		differing += it->second != slow.received[i].surfaceHash;
+	}
+	printf("resync: %d frames compared with the viewer that kept up, %d differ\n", compared, differing);
+	if (compared < 60 || differing) ok = false;
+	return ok;
+}
+
+int main() {
+	TestHost host;
+	// Lives until the process exits, as the server's do: its producer thread is detached
+	static ScreenBroadcaster broadcaster(PIXEL_FORMAT_BGRA, TILE_RECORD_V2, host);
+
+	std::vector<FanOutResult> results;
+	printf("%7s %7s %14s %14s %16s %10s\n", "viewers", "frames", "producer ms/f", "process ms/f", "frames/viewer", "recv MB/s");
+	for (int viewers : { 1, 4, 16 }) {
+		FanOutResult r;
+		if (!RunFanOut(broadcaster, host, viewers, 4.0, r)) {
+			printf("can't set up %d loopback viewers\n", viewers);
+			return 1;
+		}
+		printf("%7d %7d %14.2f %14.2f %7d - %6d %10.1f\n", r.viewers, r.frames, r.producerMsPerFrame, r.processMsPerFrame,
+			r.minViewerFrames, r.maxViewerFrames, r.receivedMBps);
+		results.push_back(r);
+	}
+	bool ok = true;
+	if (results.back().producerMsPerFrame > results.front().producerMsPerFrame * 1.5) {
+		printf("the producer's CPU per frame grows with the viewers\n");
+		ok = false;
+	}
+	for (const FanOutResult& r : results) {
+		if (r.minViewerFrames * 2 < r.frames) {
+			printf("%d viewers: a viewer got %d of %d frames\n", r.viewers, r.minViewerFrames, r.frames);
+			ok = false;
+		}
+	}
+
+	ok &= RunResync(broadcaster, host);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,142 @@
+// Client tile decoding in tiles/s, before and after qoi_decode_into, over every 32x32 tile of the
+// synthetic 1080p desktop (tests/DesktopFrames.h) encoded as QOI images:
+//   before   the old ScreenRecvThread path: qoi_decode into a malloc'd buffer, copied into a new
+//            BasicBitmap per tile (QOIDecodeToBasicBitmap), then each row copied into the frame
+//   into     qoi_decode_into straight into the frame at the tile's position, as BGRA
+//   chunks   qoi_decode_chunks_into on the headerless QOI body of a v2 tile record, likewise
+// The before path writes RGBA and still needed the frame-wide RGBA to BGRA conversion after it,
+// which is left out in its favour. All three have to produce the same frame.
+//
+//   g++ -std=c++14 -O2 -c includes/BasicBitmap.cpp -o BasicBitmap.o
+//   g++ -std=c++14 -O2 -Iincludes tests/QoiDecodeBench.cpp BasicBitmap.o -o QoiDecodeBench && ./QoiDecodeBench
+//
+// Exits non-zero if a tile fails to decode or the frames differ.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+#include "BasicBitmap.h"
+#include "DesktopFrames.h"
+
+const int W = DESKTOP_W, H = DESKTOP_H, TILE = 32;
+const int FRAMES = 40; // decodes of the whole frame per path
+
+struct EncodedTile {
+	int x, y, w, h;
+	std::vector<uint8_t> qoi; // a whole QOI image: header, chunks, end marker
+};
+
+// What the old client kept of a decoded tile until the frame was complete
+struct TileUpdate {
+	int x, y, w, h;
+	std::unique_ptr<BasicBitmap> bitmap;
+};
+
+static BasicBitmap* QOIDecodeToBasicBitmap(const uint8_t* data, size_t len) {
+	qoi_desc desc;
+	uint8_t* decoded = (uint8_t*)qoi_decode(data, (int)len, &desc, 4);
+	if (!decoded) return nullptr;
+	BasicBitmap* bmp = new BasicBitmap(desc.width, desc.height, BasicBitmap::A8R8G8B8);
+	memcpy(bmp->Bits(), decoded, desc.width * desc.height * 4);
+	free(decoded);
+	return bmp;
+}
+
+static bool DecodeBefore(const std::vector<EncodedTile>& tiles, std::vector<uint32_t>& frame) {
+	std::vector<TileUpdate> updates;
+	for (const EncodedTile& t : tiles) {
+		BasicBitmap* decoded = QOIDecodeToBasicBitmap(t.qoi.data(), t.qoi.size());
+		if (!decoded) return false;
+		updates.push_back({ t.x, t.y, t.w, t.h, std::unique_ptr<BasicBitmap>(decoded) });
+	}
+	for (const TileUpdate& u : updates) {
+		for (int row = 0; row < u.h; ++row)
+			memcpy(&frame[(size_t)(u.y + row) * W + u.x], u.bitmap->Bits() + (size_t)row * u.w * 4, (size_t)u.w * 4);
+	}
+	return true;
+}
+
+static bool DecodeInto(const std::vector<EncodedTile>& tiles, std::vector<uint32_t>& frame) {
+	for (const EncodedTile& t : tiles) {
+		qoi_desc desc;
+		if (!qoi_decode_into(t.qoi.data(), (int)t.qoi.size(), &desc, &frame[(size_t)t.y * W + t.x], W * 4, t.w, t.h, 4, QOI_DECODE_BGR))
+			return false;
+	}
+	return true;
+}
+
+static bool DecodeChunks(const std::vector<EncodedTile>& tiles, std::vector<uint32_t>& frame) {
+	for (const EncodedTile& t : tiles) {
+		qoi_desc desc = { (unsigned)t.w, (unsigned)t.h, 4, QOI_SRGB };
+		// The chunks are followed by the end marker, which the decoder may read past them
+		if (!qoi_decode_chunks_into(t.qoi.data() + QOI_CHUNKS_OFFSET, (int)(t.qoi.size() - QOI_CHUNKS_OFFSET - QOI_CHUNKS_TRAILER),
+			&desc, &frame[(size_t)t.y * W + t.x], W * 4, 4, QOI_DECODE_BGR)) return false;
+	}
+	return true;
+}
+
+int main() {
+	std::mt19937 rng(7);
+	std::vector<uint32_t> desktop[2];
+	DesktopFrames(rng, desktop);
+
+	// The server encodes tiles in RGBA byte order
+	std::vector<EncodedTile> tiles;
+	std::vector<uint32_t> rgba(TILE * TILE);
+	size_t encodedBytes = 0;
+	for (int y = 0; y < H; y += TILE) {
+		for (int x = 0; x < W; x += TILE) {
+			EncodedTile t = { x, y, std::min(TILE, W - x), std::min(TILE, H - y), {} };
+			for (int row = 0; row < t.h; ++row) {
+				for (int col = 0; col < t.w; ++col) {
+					uint32_t v = desktop[0][(size_t)(y + row) * W + x + col];
+					rgba[(size_t)row * t.w + col] = (v & 0xFF00FF00u) | ((v >> 16) & 0xFFu) | ((v & 0xFFu) << 16);
+				}
+			}
+			qoi_desc desc = { (unsigned)t.w, (unsigned)t.h, 4, QOI_SRGB };
+			int len = 0;
+			void* encoded = qoi_encode(rgba.data(), &desc, &len);
+			if (!encoded) {
+				printf("tile at %d,%d failed to encode\n", x, y);
+				return 1;
+			}
+			t.qoi.assign((uint8_t*)encoded, (uint8_t*)encoded + len);
+			free(encoded);
+			encodedBytes += len;
+			tiles.push_back(std::move(t));
+		}
+	}
+	printf("%zu tiles of a %dx%d desktop, %.1f KB as QOI images, %d frames per path\n", tiles.size(), W, H, encodedBytes / 1024.0, FRAMES);
+
+	typedef bool (*DecodeFn)(const std::vector<EncodedTile>&, std::vector<uint32_t>&);
+	struct Path { const char* name; DecodeFn decode; bool rgba; };
+	const Path paths[] = { { "before", DecodeBefore, true }, { "into", DecodeInto, false }, { "chunks", DecodeChunks, false } };
+	double beforeSeconds = 0;
+	int failures = 0;
+	for (const Path& path : paths) {
+		std::vector<uint32_t> frame((size_t)W * H, 0);
+		auto start = std::chrono::steady_clock::now();
+		bool ok = true;
+		for (int f = 0; f < FRAMES && ok; ++f) ok = path.decode(tiles, frame);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (path.decode == DecodeBefore) beforeSeconds = seconds;
+
+		if (path.rgba)
+			for (uint32_t& v : frame) v = (v & 0xFF00FF00u) | ((v >> 16) & 0xFFu) | ((v & 0xFFu) << 16);
+		bool same = ok && frame == desktop[0];
+		double decoded = (double)tiles.size() * FRAMES;
+		printf("%-7s %10.0f tiles/s  %6.0f ns/tile  %7.1f MB/s of pixels  %.2fx%s\n", path.name, decoded / seconds,
+			seconds / decoded * 1e9, (double)W * H * 4 * FRAMES / seconds / 1e6, beforeSeconds / seconds,
+			!ok ? "  (a tile failed to decode)" : same ? "" : "  (frame differs)");
+		failures += !same;
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,268 @@
+// Client throughput and latency on a recorded session, with no network and no window. The session
+// is a --record file from the server, or without RECORDING one made here the way the server makes
+// it: a ScreenBroadcaster encodes SyntheticFrameSource at 1280x720 (--size) and 30 fps, and one viewer's
+// SendScreenFrames hands what it would send to a WireRecorder, next to an audio stream of 10 ms
+// XRLE-compressed packets of a tone. The recording is then replayed through the client's parsers
+// and decoder (includes/WireRecording.h, as --replay does) twice: at max speed for throughput, and
+// at the speed it was recorded at for the latency of each frame from its arrival to its
+// presentation. Both replays have to end on the same framebuffer.
+//
+// Then each stream is served over TCP on 127.0.0.1 chunk by chunk, as the server sent it, and read
+// back with SocketInput, which makes a recv() call for every field, and with BufferedSocketInput,
+// which fills a 256 KB ring buffer; the recv() calls (one syscall each) and MB/s of both are shown.
+// Last the screen stream is read through the ring buffer with 1, 2, 4 and 8 decode threads, for
+// how fast the socket is drained as decoding is spread out; every presented frame has to come out
+// the same each time. Parallel decoding only helps with as many cores, so their count is shown.
+//
+//   gcc -O2 -c includes/xrle.c -o xrle.o
+//   g++ -std=c++14 -O2 -pthread -Iincludes tests/ReplayBench.cpp xrle.o -o ReplayBench
+//   ./ReplayBench [RECORDING] [--frames N] [--size WxH] [--save PATH] [--decode-threads N]
+//
+// --frames and --size set the session made here (150 frames, 5 s), --save keeps it; --decode-threads
+// is used by all but the sweep, 0 for one per core. Exits non-zero if the session can't be recorded
+// or read, a stream does not replay or read back over loopback to its end, the two replays end on
+// different frames, or the decoded frames depend on the decode thread count.
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+extern "C" {
+#include "xrle.h"
+}
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+#include "ScreenBroadcaster.h"
+#include "WireRecording.h"
+
+const int FPS = 30;
+const uint32_t CACHE_SLOTS = 4096;
+
+// The server's settings for the session made here
+class RecordingHost : public ScreenBroadcastHost {
+	const int width, height;
+public:
+	std::atomic<bool> active{ true };
+
+	RecordingHost(int w, int h) : width(w), height(h) {}
+	std::unique_ptr<FrameSource> NewFrameSource() override {
+		return std::unique_ptr<FrameSource>(new SyntheticFrameSource(width, height));
+	}
+	int EncodeThreads() override { return 0; }
+	uint32_t TileCacheSlots() override { return CACHE_SLOTS; }
+	bool StreamActive() override { return active.load(); }
+	int Fps() override { return FPS; }
+	bool HashDetect() override { return false; }
+};
+
+// Audio as AudioStreamServerThreadXRLE sends it: the capture format, then every 10 ms a packet of
+// 32-bit float stereo at 48 kHz, here a 440 Hz tone
+static void RecordAudio(WireRecorder& recorder, const std::atomic<bool>& stop) {
+	const uint32_t RATE = 48000, CHANNELS = 2, FRAMES_PER_PACKET = RATE / 100;
+	const uint32_t stream = recorder.NewStream();
+	uint8_t format[AUDIO_FORMAT_BYTES] = {};
+	uint16_t tag = 3, channels = CHANNELS, blockAlign = CHANNELS * 4, bits = 32; // WAVE_FORMAT_IEEE_FLOAT
+	uint32_t rate = RATE, avgBytes = RATE * blockAlign;
+	memcpy(format + 0, &tag, 2);
+	memcpy(format + 2, &channels, 2);
+	memcpy(format + 4, &rate, 4);
+	memcpy(format + 8, &avgBytes, 4);
+	memcpy(format + 12, &blockAlign, 2);
+	memcpy(format + 14, &bits, 2);
+	recorder.Write(stream, WIRE_AUDIO, format, sizeof(format));
+
+	const size_t pcmBytes = FRAMES_PER_PACKET * CHANNELS * 4;
+	std::vector<uint64_t> pcm(pcmBytes / 8), compressed(xrle_max_out(pcmBytes) / 8 + 1); // XRLE wants 8-byte alignment
+	uint64_t frame = 0;
+	auto next = std::chrono::steady_clock::now();
+	while (!stop.load()) {
+		float* samples = (float*)pcm.data();
+		for (uint32_t i = 0; i < FRAMES_PER_PACKET; ++i, ++frame)
+			samples[i * 2] = samples[i * 2 + 1] = 0.25f * (float)std::sin(frame * 2 * 3.14159265358979 * 440 / RATE);
+		size_t compressedBytes = xrle_compress(compressed.data(), pcm.data(), pcmBytes);
+		uint32_t header[2] = { htonl((uint32_t)pcmBytes), htonl((uint32_t)compressedBytes) };
+		WireSlice slices[2] = { { header, sizeof(header) }, { compressed.data(), compressedBytes } };
+		recorder.Write(stream, WIRE_AUDIO, slices, 2);
+		next += std::chrono::milliseconds(10);
+		std::this_thread::sleep_until(next);
+	}
+}
+
+// Records frameCount frames of the screen stream at width x height, with audio alongside, into path
+static bool RecordSession(const std::string& path, int frameCount, int width, int height) {
+	WireRecorder recorder;
+	if (!recorder.Open(path)) return false;
+	RecordingHost host(width, height);
+	ScreenBroadcaster broadcaster(PIXEL_FORMAT_BGRA, TILE_RECORD_V2, host);
+	std::atomic<bool> stopAudio(false);
+	std::thread audio([&]() { RecordAudio(recorder, stopAudio); });
+
+	std::shared_ptr<ScreenViewer> viewer = std::make_shared<ScreenViewer>();
+	broadcaster.Add(viewer);
+	const uint32_t stream = recorder.NewStream();
+	int sends = 0; // the handshake, then one per frame
+	SendScreenFrames(broadcaster, *viewer, PIXEL_FORMAT_BGRA, TILE_RECORD_V2, [&](const std::vector<WireSlice>& slices) {
+		recorder.Write(stream, WIRE_SCREEN, slices.data(), slices.size());
+		return ++sends <= frameCount;
+	});
+	broadcaster.Remove(viewer);
+	host.active = false;
+	stopAudio = true;
+	audio.join();
+	while (broadcaster.Running()) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	recorder.Flush();
+	return sends > frameCount;
+}
+
+struct ReplayRun {
+	ReplayResult screen, audio;
+	double seconds = 0;
+	uint64_t tiles = 0, bytes = 0; // screen stream, from the client's metrics
+};
+
+// Replays the first screen and audio stream as RunReplay in main.cpp does
+static ReplayRun Replay(const WireStream* screen, const WireStream* audio, bool recordedSpeed, int decodeThreads) {
+	ReplayRun run;
+	uint64_t tiles = g_metrics.Counter(METRIC_CLIENT_TILES), bytes = g_metrics.Counter(METRIC_CLIENT_BYTES);
+	const int64_t startUs = LatencyNowUs();
+	auto start = std::chrono::steady_clock::now();
+	std::thread audioThread;
+	if (audio) audioThread = std::thread([&]() { run.audio = ReplayAudioStream(*audio, startUs, recordedSpeed); });
+	if (screen) run.screen = ReplayScreenStream(*screen, startUs, recordedSpeed, decodeThreads);
+	if (audioThread.joinable()) audioThread.join();
+	run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	run.tiles = g_metrics.Counter(METRIC_CLIENT_TILES) - tiles;
+	run.bytes = g_metrics.Counter(METRIC_CLIENT_BYTES) - bytes;
+	return run;
+}
+
+static void PrintRun(const char* name, const ReplayRun& r, const WireStream* audio) {
+	printf("%-15s %.2f s", name, r.seconds);
+	if (r.screen.units) {
+		printf("; screen %llu frames, %.1f fps, %.1f MB/s, %.0f tiles/s, final frame %016llx%s",
+			(unsigned long long)r.screen.units, r.screen.units / r.seconds, r.bytes / 1e6 / r.seconds, r.tiles / r.seconds,
+			(unsigned long long)r.screen.finalHash, r.screen.ok ? "" : " (malformed or cut off)");
+	}
+	if (audio) {
+		printf("; audio %llu packets, %.1f MB/s of PCM%s", (unsigned long long)r.audio.units,
+			r.audio.pcmBytes / 1e6 / r.seconds, r.audio.ok ? "" : " (malformed or cut off)");
+	}
+	printf("\n");
+}
+
+int main(int argc, char** argv) {
+	std::string path, savePath;
+	int frameCount = 150, decodeThreads = 0, width = 1280, height = 720;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : "";
+		if (arg == "--frames") { frameCount = std::max(1, atoi(value)); ++i; }
+		else if (arg == "--size") {
+			if (sscanf(value, "%dx%d", &width, &height) != 2 || width < 64 || height < 64) {
+				printf("bad size %s\n", value);
+				return 1;
+			}
+			++i;
+		}
+		else if (arg == "--save") { savePath = value; ++i; }
+		else if (arg == "--decode-threads") { decodeThreads = std::max(0, atoi(value)); ++i; }
+		else if (arg[0] != '-' && path.empty()) path = arg;
+		else {
+			printf("unknown argument %s\n", arg.c_str());
+			return 1;
+		}
+	}
+
+	bool made = path.empty();
+	if (made) {
+		path = savePath;
+		if (path.empty()) {
+			char temp[] = "/tmp/ReplayBench-XXXXXX";
+			int fd = mkstemp(temp);
+			if (fd < 0) {
+				printf("can't create a temporary file\n");
+				return 1;
+			}
+			close(fd);
+			path = temp;
+		}
+		if (!RecordSession(path, frameCount, width, height)) {
+			printf("can't record the session into %s\n", path.c_str());
+			return 1;
+		}
+	}
+	std::vector<WireStream> streams;
+	bool loaded = LoadWireRecording(path, streams);
+	if (made && savePath.empty()) unlink(path.c_str());
+	if (!loaded) {
+		printf("can't read %s as a wire recording\n", path.c_str());
+		return 1;
+	}
+	const WireStream* screen = nullptr;
+	const WireStream* audio = nullptr;
+	for (const WireStream& s : streams) {
+		if (s.kind == WIRE_SCREEN && !screen) screen = &s;
+		if (s.kind == WIRE_AUDIO && !audio) audio = &s;
+	}
+	if (!screen) {
+		printf("%s holds no screen stream\n", path.c_str());
+		return 1;
+	}
+	double recordedSeconds = screen->chunkEnds.empty() ? 0 : (screen->chunkEnds.back().second - screen->chunkEnds.front().second) / 1e6;
+	printf("%s: screen %.1f MB in %zu chunks over %.2f s", made ? "synthetic session" : path.c_str(), screen->bytes.size() / 1e6,
+		screen->chunkEnds.size(), recordedSeconds);
+	if (audio) printf(", audio %.2f MB in %zu chunks", audio->bytes.size() / 1e6, audio->chunkEnds.size());
+	printf("\n");
+
+	ReplayRun maxSpeed = Replay(screen, audio, false, decodeThreads);
+	PrintRun("max speed", maxSpeed, audio);
+	ReplayRun recorded = Replay(screen, audio, true, decodeThreads);
+	PrintRun("recorded speed", recorded, audio);
+	printf("frame latency at recorded speed, from arrival:\n%s", g_clientLatency.Summary().c_str());
+
+	bool ok = maxSpeed.screen.ok && recorded.screen.ok && (!audio || (maxSpeed.audio.ok && recorded.audio.ok));
+	for (const WireStream* stream : { screen, audio }) {
+		if (!stream) continue;
+		const char* unit = stream == screen ? "frame" : "packet";
+		RecvBenchResult results[2] = { BenchRecvStream<SocketInput>(*stream, decodeThreads),
+			BenchRecvStream<BufferedSocketInput>(*stream, decodeThreads) };
+		const char* readers[2] = { "recv per field", "ring buffer" };
+		for (int i = 0; i < 2; ++i) {
+			const RecvBenchResult& r = results[i];
+			printf("loopback %-6s %-14s %llu %ss, %llu recv calls (%.1f per %s), %.1f MB/s%s\n", stream == screen ? "screen" : "audio",
+				readers[i], (unsigned long long)r.units, unit, (unsigned long long)r.recvCalls, r.units ? (double)r.recvCalls / r.units : 0.0,
+				unit, r.seconds > 0 ? stream->bytes.size() / 1e6 / r.seconds : 0.0, r.ok ? "" : " (malformed or cut off)");
+			ok = ok && r.ok;
+		}
+	}
+
+	// Tiles are decoded in parallel into disjoint regions; the result must not depend on how many
+	// threads do it. Hashing every frame costs time, so it is a second read, not the timed one.
+	printf("decode threads over loopback, %u cores:\n", std::thread::hardware_concurrency());
+	RecvBenchResult first;
+	for (int threads : { 1, 2, 4, 8 }) {
+		RecvBenchResult timed = BenchRecvStream<BufferedSocketInput>(*screen, threads);
+		RecvBenchResult hashed = BenchRecvStream<BufferedSocketInput>(*screen, threads, true);
+		if (threads == 1) first = hashed;
+		bool same = hashed.units == first.units && hashed.presentedHash == first.presentedHash;
+		printf("  %d: %llu frames, %.1f fps, %.1f MB/s, presented frames hash %016llx%s\n", threads,
+			(unsigned long long)timed.units, timed.seconds > 0 ? timed.units / timed.seconds : 0.0,
+			timed.seconds > 0 ? screen->bytes.size() / 1e6 / timed.seconds : 0.0, (unsigned long long)hashed.presentedHash,
+			same ? "" : " (differs)");
+		ok = ok && timed.ok && hashed.ok && same;
+	}
+	if (maxSpeed.screen.finalHash != recorded.screen.finalHash || maxSpeed.screen.units != recorded.screen.units) {
+		printf("the two replays end on different frames\n");
+		ok = false;
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+// SendGather against a small socketpair buffer read slowly, with a 1 ms timer signal that keeps
+// interrupting sendmsg, so that it returns partial writes that end mid-slice. Checks that the receiver gets the slices back to
+// back and byte for byte, including empty slices and more slices than one call takes, and that a
+// closed peer is reported as a failure rather than a signal.
+//
+//   g++ -std=c++14 -O2 -Iincludes tests/SendGatherTest.cpp -lpthread -o SendGatherTest && ./SendGatherTest
+//
+// Linux only; exits non-zero on failure.
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstdio>
+#include <cstdint>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Counts calls and short writes on the way to the real sendmsg
+static long g_sendCalls = 0, g_partialSends = 0;
+static ssize_t CountedSendmsg(int s, const msghdr* msg, int flags) {
+	size_t want = 0;
+	for (size_t i = 0; i < msg->msg_iovlen; ++i) want += msg->msg_iov[i].iov_len;
+	ssize_t sent = sendmsg(s, msg, flags);
+	g_sendCalls++;
+	if (sent > 0 && (size_t)sent < want) g_partialSends++;
+	return sent;
+}
+#define sendmsg CountedSendmsg
+#include "SendGather.h"
+#undef sendmsg
+
+// Sends slices of the given sizes through a small socket buffer read slowly in random pieces;
+// true if the receiver got exactly their concatenation
+static bool RoundTrip(std::mt19937& rng, const std::vector<size_t>& sizes) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return false;
+	int small = 4096;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+	setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+
+	std::vector<std::vector<uint8_t>> buffers(sizes.size());
+	std::vector<WireSlice> slices;
+	std::vector<uint8_t> expected;
+	for (size_t i = 0; i < sizes.size(); ++i) {
+		buffers[i].resize(sizes[i]);
+		for (uint8_t& b : buffers[i]) b = (uint8_t)rng();
+		slices.push_back({ buffers[i].data(), buffers[i].size() });
+		expected.insert(expected.end(), buffers[i].begin(), buffers[i].end());
+	}
+
+	std::vector<uint8_t> received;
+	unsigned readerSeed = rng();
+	// The timer signal goes to the sending thread only
+	sigset_t alarm;
+	sigemptyset(&alarm);
+	sigaddset(&alarm, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &alarm, NULL);
+	std::thread reader([&]() {
+		std::mt19937 readerRng(readerSeed);
+		std::vector<uint8_t> chunk(1500);
+		for (;;) {
+			ssize_t got = recv(sv[1], chunk.data(), readerRng() % chunk.size() + 1, 0);
+			if (got <= 0) break;
+			received.insert(received.end(), chunk.begin(), chunk.begin() + got);
+			usleep(200);
+		}
+	});
+	pthread_sigmask(SIG_UNBLOCK, &alarm, NULL);
+	bool ok = SendGather(sv[0], slices.data(), slices.size());
+	shutdown(sv[0], SHUT_WR);
+	reader.join();
+	close(sv[0]);
+	close(sv[1]);
+	if (!ok) printf("  SendGather failed\n");
+	else if (received != expected) printf("  received %zu bytes, expected %zu\n", received.size(), expected.size());
+	return ok && received == expected;
+}
+
+int main() {
+	std::mt19937 rng(7);
+	int failures = 0;
+
+	// A signal that lands once sendmsg has moved some bytes makes it return that short count; one
+	// that lands before restarts the call (SA_RESTART), so SendGather never sees EINTR
+	struct sigaction action = {};
+	action.sa_handler = [](int) {};
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGALRM, &action, NULL);
+	itimerval timer = { { 0, 1000 }, { 0, 1000 } };
+	setitimer(ITIMER_REAL, &timer, NULL);
+
+	// Many slices of mixed size, a third of them empty: several batches of 256, partial writes
+	for (int round = 0; round < 3; ++round) {
+		std::vector<size_t> sizes(2000);
+		for (size_t& size : sizes) size = rng() % 3 == 0 ? 0 : rng() % 3000;
+		if (!RoundTrip(rng, sizes)) {
+			printf("mixed slices, round %d: FAILED\n", round);
+			failures++;
+		}
+	}
+	// One slice much larger than the socket buffer
+	if (!RoundTrip(rng, { 1 << 20 })) {
+		printf("single large slice: FAILED\n");
+		failures++;
+	}
+	// Nothing to send at all
+	if (!RoundTrip(rng, {}) || !RoundTrip(rng, { 0, 0, 0 })) {
+		printf("empty sends: FAILED\n");
+		failures++;
+	}
+	if (g_partialSends == 0) {
+		printf("no partial writes happened, resuming was not exercised\n");
+		failures++;
+	}
+
+	// A peer that has gone away is an error, not SIGPIPE
+	int sv[2];
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	close(sv[1]);
+	std::vector<uint8_t> data(1000);
+	WireSlice slice = { data.data(), data.size() };
+	if (SendGather(sv[0], &slice, 1)) {
+		printf("send to a closed peer: reported success\n");
+		failures++;
+	}
+	close(sv[0]);
+
+	timer = {};
+	setitimer(ITIMER_REAL, &timer, NULL);
+	printf("%s: %ld sendmsg calls, %ld partial\n", failures ? "FAILED" : "passed", g_sendCalls, g_partialSends);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,78 @@
+// Heap allocations of the server's steady state: SyntheticFrameSource frames captured into a
+// CaptureContext and encoded by ScreenFrameEncoder into one reused EncodedFrame, the way
+// ScreenBroadcaster::Run does it when no viewer holds on to a frame. Both change detection modes
+// and both tile record formats run at 1920x1080, with four encode workers so that how the tiles
+// are shared out changes from frame to frame. The first two keyframe periods (120 frames) let the
+// capture buffers, the encoder's arenas and the frame's buffers reach their working size; after
+// that capturing and encoding a frame must not allocate at all.
+//
+//   gcc -O2 -c includes/xrle.c -o xrle.o
+//   g++ -std=c++14 -O2 -pthread -Iincludes tests/SteadyStateAllocTest.cpp xrle.o -o SteadyStateAllocTest && ./SteadyStateAllocTest
+//
+// Exits non-zero if a steady-state frame allocates, or a frame fails to capture or encode.
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+
+extern "C" {
+#include "xrle.h"
+}
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+#include "FrameSource.h"
+#include "ScreenFrameEncoder.h"
+
+static std::atomic<uint64_t> g_heapAllocs(0);
+void* operator new(size_t size) {
+	g_heapAllocs.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+const int W = 1920, H = 1080;
+const int WARMUP_FRAMES = 120, MEASURED_FRAMES = 240;
+
+// Counts the heap allocations made capturing and encoding the measured frames; false if a frame fails
+static bool RunSteadyState(bool hashDetect, int recordFormat, uint64_t& captureAllocs, uint64_t& encodeAllocs) {
+	CaptureContext capture(std::unique_ptr<FrameSource>(new SyntheticFrameSource(W, H)), PIXEL_FORMAT_BGRA);
+	ScreenFrameEncoder encoder(recordFormat, 4096, 4);
+	EncodedFrame frame;
+	captureAllocs = encodeAllocs = 0;
+	for (int f = 0; f < WARMUP_FRAMES + MEASURED_FRAMES; ++f) {
+		bool measured = f >= WARMUP_FRAMES;
+		uint64_t allocs = g_heapAllocs.load();
+		if (!capture.Capture(!hashDetect)) return false;
+		if (measured) captureAllocs += g_heapAllocs.load() - allocs;
+
+		allocs = g_heapAllocs.load();
+		size_t tileBytes;
+		if (!encoder.Encode(frame, capture.Current(), capture.Previous(), (uint32_t)f + 1, LatencyNowUs(), f == 0,
+			hashDetect, true, tileBytes)) return false;
+		if (measured) encodeAllocs += g_heapAllocs.load() - allocs;
+	}
+	return true;
+}
+
+int main() {
+	int failures = 0;
+	for (bool hashDetect : { false, true }) {
+		for (int recordFormat : { TILE_RECORD_V1, TILE_RECORD_V2 }) {
+			uint64_t captureAllocs, encodeAllocs;
+			if (!RunSteadyState(hashDetect, recordFormat, captureAllocs, encodeAllocs)) {
+				printf("%s v%d: a frame failed to capture or encode\n", hashDetect ? "hash" : "exact", recordFormat + 1);
+				return 1;
+			}
+			bool ok = captureAllocs == 0 && encodeAllocs == 0;
+			printf("%-5s v%d  %d frames: capture %llu allocations, encode %llu  %s\n", hashDetect ? "hash" : "exact",
+				recordFormat + 1, MEASURED_FRAMES, (unsigned long long)captureAllocs, (unsigned long long)encodeAllocs,
+				ok ? "ok" : "FAILED");
+			failures += !ok;
+		}
+	}
+	return failures ? 1 : 0;
+}
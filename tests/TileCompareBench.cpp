@@ -0,0 +1,154 @@
+// Dirty tile detection (includes/TileCompare.h) at 1080p, 1440p and 4K. The scalar and AVX2
+// band kernels must set exactly the dirty flags a tile-by-tile memcmp sets, over frames of odd
+// sizes with changes of one pixel, one byte and whole regions; then both are timed on an idle
+// desktop (nothing changed: every row of every tile is read), typing (a few tiles) and a full
+// repaint (each tile is dropped after its first row), in ms per frame and ns per tile.
+//
+//   gcc -O2 -c includes/xrle.c -o xrle.o
+//   g++ -std=c++14 -O2 -Iincludes tests/TileCompareBench.cpp xrle.o -o TileCompareBench && ./TileCompareBench
+//
+// Exits non-zero if either kernel disagrees with the reference.
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include "xrle.h"
+}
+#include "TileCompare.h"
+
+typedef void (*BandFn)(const uint8_t* prev, const uint8_t* curr, size_t stride, int width, int rows, uint8_t* dirty);
+
+// Dirty flags of a whole frame, one band at a time
+static std::vector<uint8_t> DirtyFlags(BandFn band, const std::vector<uint32_t>& prev, const std::vector<uint32_t>& curr, int width, int height) {
+	int tilesX = (width + TILE_W - 1) / TILE_W;
+	std::vector<uint8_t> flags;
+	std::vector<uint8_t> dirty(tilesX);
+	for (int ty = 0; ty < height; ty += TILE_H) {
+		std::fill(dirty.begin(), dirty.end(), 0);
+		band((const uint8_t*)&prev[(size_t)ty * width], (const uint8_t*)&curr[(size_t)ty * width], (size_t)width * 4,
+			width, std::min(TILE_H, height - ty), dirty.data());
+		flags.insert(flags.end(), dirty.begin(), dirty.end());
+	}
+	return flags;
+}
+
+// One memcmp per tile row, tile by tile
+static std::vector<uint8_t> ReferenceFlags(const std::vector<uint32_t>& prev, const std::vector<uint32_t>& curr, int width, int height) {
+	std::vector<uint8_t> flags;
+	for (int ty = 0; ty < height; ty += TILE_H) {
+		for (int tx = 0; tx < width; tx += TILE_W) {
+			bool dirty = false;
+			for (int y = ty; y < std::min(height, ty + TILE_H) && !dirty; ++y)
+				dirty = memcmp(&prev[(size_t)y * width + tx], &curr[(size_t)y * width + tx], std::min(TILE_W, width - tx) * 4) != 0;
+			flags.push_back(dirty);
+		}
+	}
+	return flags;
+}
+
+// A desktop-like frame: flat background, a darker side bar and some noisy rectangles
+static std::vector<uint32_t> Desktop(int width, int height, std::mt19937& rng) {
+	std::vector<uint32_t> px((size_t)width * height, 0xFFF3F3F3);
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width / 8; ++x) px[(size_t)y * width + x] = 0xFF2B2B30;
+	for (int r = 0; r < 20; ++r) {
+		int x0 = (int)(rng() % width), y0 = (int)(rng() % height);
+		for (int y = y0; y < std::min(height, y0 + 40); ++y)
+			for (int x = x0; x < std::min(width, x0 + 120); ++x) px[(size_t)y * width + x] = rng() | 0xFF000000;
+	}
+	return px;
+}
+
+static bool CheckAgreement(std::mt19937& rng) {
+	static const int sizes[][2] = { { 1920, 1080 }, { 1366, 768 }, { 1001, 67 }, { 33, 33 }, { 31, 5 }, { 2560, 1440 } };
+	bool ok = true;
+	int frames = 0;
+	for (const auto& size : sizes) {
+		int width = size[0], height = size[1];
+		std::vector<uint32_t> prev = Desktop(width, height, rng);
+		for (int trial = 0; trial < 40; ++trial) {
+			std::vector<uint32_t> curr = prev;
+			int changes = trial % 10 == 0 ? 0 : (int)(rng() % 50);
+			for (int i = 0; i < changes; ++i) {
+				int x = (int)(rng() % width), y = (int)(rng() % height);
+				switch (rng() % 3) {
+				case 0: curr[(size_t)y * width + x] ^= 1u << (rng() % 32); break; // one bit of one pixel
+				case 1: curr[(size_t)y * width + x] = rng(); break;
+				case 2: // a region
+					for (int yy = y; yy < std::min(height, y + 50); ++yy)
+						for (int xx = x; xx < std::min(width, x + 70); ++xx) curr[(size_t)yy * width + xx] = ~curr[(size_t)yy * width + xx];
+					break;
+				}
+			}
+			std::vector<uint8_t> reference = ReferenceFlags(prev, curr, width, height);
+			bool scalar = DirtyFlags(CompareTileBand_Scalar, prev, curr, width, height) == reference;
+			bool avx2 = true;
+#if TILE_SIMD_X86
+			if (xrle_simd_level() >= XRLE_SIMD_AVX2) avx2 = DirtyFlags(CompareTileBand_AVX2, prev, curr, width, height) == reference;
+#endif
+			if (!scalar || !avx2)
+				printf("%dx%d trial %d: %s disagrees with the reference\n", width, height, trial, scalar ? "AVX2" : "scalar");
+			ok &= scalar && avx2;
+			frames++;
+		}
+	}
+	printf("dirty flags: %d frames, scalar%s %s\n", frames, xrle_simd_level() >= XRLE_SIMD_AVX2 ? " and AVX2" : "",
+		ok ? "agree with the reference" : "DISAGREE");
+	return ok;
+}
+
+// Best time of one whole-frame pass over at least 0.3 s, in seconds
+static double TimeFrame(BandFn band, const std::vector<uint32_t>& prev, const std::vector<uint32_t>& curr, int width, int height) {
+	using Clock = std::chrono::steady_clock;
+	double best = 1e9;
+	volatile size_t sink = 0;
+	Clock::time_point start = Clock::now();
+	do {
+		Clock::time_point t0 = Clock::now();
+		sink += DirtyFlags(band, prev, curr, width, height).size();
+		best = std::min(best, std::chrono::duration<double>(Clock::now() - t0).count());
+	} while (std::chrono::duration<double>(Clock::now() - start).count() < 0.3);
+	return best;
+}
+
+static void Bench(std::mt19937& rng) {
+	static const struct { const char* name; int width, height; } resolutions[] = {
+		{ "1080p", 1920, 1080 }, { "1440p", 2560, 1440 }, { "4K", 3840, 2160 },
+	};
+	for (const auto& res : resolutions) {
+		int width = res.width, height = res.height;
+		std::vector<uint32_t> prev = Desktop(width, height, rng);
+		std::vector<uint32_t> typing = prev, repaint = prev;
+		for (int i = 0; i < 8; ++i) typing[(size_t)(height / 2 + i) * width + width / 3 + i * 40] ^= 0xFFFFFF;
+		for (uint32_t& p : repaint) p = ~p;
+		const struct { const char* name; const std::vector<uint32_t>* curr; } scenes[] = {
+			{ "idle", &prev }, { "typing", &typing }, { "repaint", &repaint },
+		};
+		// An unchanged frame is a copy, not the same buffer, as in the server
+		std::vector<uint32_t> idle = prev;
+		for (const auto& scene : scenes) {
+			const std::vector<uint32_t>& curr = scene.curr == &prev ? idle : *scene.curr;
+			double tiles = (double)((width + TILE_W - 1) / TILE_W) * ((height + TILE_H - 1) / TILE_H);
+			double scalar = TimeFrame(CompareTileBand_Scalar, prev, curr, width, height);
+			printf("%-6s %-8s scalar %7.3f ms %6.1f ns/tile", res.name, scene.name, scalar * 1e3, scalar / tiles * 1e9);
+#if TILE_SIMD_X86
+			if (xrle_simd_level() >= XRLE_SIMD_AVX2) {
+				double avx2 = TimeFrame(CompareTileBand_AVX2, prev, curr, width, height);
+				printf("   AVX2 %7.3f ms %6.1f ns/tile  %.2fx", avx2 * 1e3, avx2 / tiles * 1e9, scalar / avx2);
+			}
+#endif
+			printf("\n");
+		}
+	}
+}
+
+int main() {
+	std::mt19937 rng(1);
+	bool ok = CheckAgreement(rng);
+	Bench(rng);
+	return ok ? 0 : 1;
+}
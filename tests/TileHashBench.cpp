@@ -0,0 +1,130 @@
+// The two ways the server finds changed tiles, in ns per 32x32 tile over the synthetic 1080p
+// desktop that XrleBench compresses: exact compares each tile band against a copy of the previous
+// frame (CompareTileBand, includes/TileCompare.h), hash keeps one TileHash64 per tile and compares
+// those (includes/TileHash.h). Both are timed on an idle frame (nothing changed) and on the
+// second desktop frame (a few lines of text retyped, the photo moved on), scalar and AVX2.
+// The AVX2 hash must equal the scalar one for every tile size, and both modes must find the
+// same dirty tiles.
+//
+//   gcc -O2 -c includes/xrle.c -o xrle.o
+//   g++ -std=c++14 -O2 -Iincludes tests/TileHashBench.cpp xrle.o -o TileHashBench && ./TileHashBench
+//
+// Exits non-zero if a hash or a dirty tile differs.
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include "xrle.h"
+}
+#include "TileHash.h"
+#include "DesktopFrames.h"
+
+typedef void (*BandFn)(const uint8_t* prev, const uint8_t* curr, size_t stride, int width, int rows, uint8_t* dirty);
+typedef uint64_t (*HashFn)(const uint8_t* src, int stride, int w, int h);
+
+const int W = DESKTOP_W, H = DESKTOP_H;
+const int TILES_X = (W + TILE_W - 1) / TILE_W, TILES_Y = (H + TILE_H - 1) / TILE_H;
+
+// Exact mode: one dirty flag per tile from the band compares
+static void ExactDirty(BandFn band, const std::vector<uint32_t>& prev, const std::vector<uint32_t>& curr, std::vector<uint8_t>& dirty) {
+	dirty.assign((size_t)TILES_X * TILES_Y, 0);
+	for (int ty = 0; ty < TILES_Y; ++ty) {
+		int y = ty * TILE_H;
+		band((const uint8_t*)&prev[(size_t)y * W], (const uint8_t*)&curr[(size_t)y * W], (size_t)W * 4, W,
+			std::min(TILE_H, H - y), &dirty[(size_t)ty * TILES_X]);
+	}
+}
+
+// Hash mode: hashes curr into hashes and flags the tiles whose hash differs from prevHashes
+static void HashDirty(HashFn hash, const std::vector<uint32_t>& curr, const std::vector<uint64_t>& prevHashes,
+	std::vector<uint64_t>& hashes, std::vector<uint8_t>& dirty) {
+	hashes.resize((size_t)TILES_X * TILES_Y);
+	dirty.resize(hashes.size());
+	for (int ty = 0; ty < TILES_Y; ++ty) {
+		int y = ty * TILE_H, h = std::min(TILE_H, H - y);
+		for (int tx = 0; tx < TILES_X; ++tx) {
+			int x = tx * TILE_W, w = std::min(TILE_W, W - x);
+			size_t i = (size_t)ty * TILES_X + tx;
+			hashes[i] = hash((const uint8_t*)&curr[(size_t)y * W + x], W * 4, w, h);
+			dirty[i] = hashes[i] != prevHashes[i];
+		}
+	}
+}
+
+// Best time of fn over at least 0.3 s, in ns per tile
+template <typename Fn>
+static double NsPerTile(Fn fn) {
+	using Clock = std::chrono::steady_clock;
+	double best = 1e9;
+	Clock::time_point start = Clock::now();
+	do {
+		Clock::time_point t0 = Clock::now();
+		fn();
+		best = std::min(best, std::chrono::duration<double>(Clock::now() - t0).count());
+	} while (std::chrono::duration<double>(Clock::now() - start).count() < 0.3);
+	return best / ((double)TILES_X * TILES_Y) * 1e9;
+}
+
+int main() {
+	std::mt19937 rng(1);
+	std::vector<uint32_t> frames[2];
+	DesktopFrames(rng, frames);
+	bool avx2 = xrle_simd_level() >= XRLE_SIMD_AVX2;
+	bool ok = true;
+
+	// Every tile size at a few places on the desktop, text and photo included
+	size_t hashes = 0;
+#if TILE_SIMD_X86
+	if (avx2) {
+		static const int origins[][2] = { { 0, 0 }, { 260, 60 }, { 500, 200 }, { 1300, 700 }, { 1887, 1047 } };
+		for (const auto& o : origins) {
+			for (int h = 1; h <= TILE_H; ++h) {
+				for (int w = 1; w <= TILE_W; ++w) {
+					const uint8_t* src = (const uint8_t*)&frames[1][(size_t)o[1] * W + o[0]];
+					if (TileHash64_AVX2(src, W * 4, w, h) != TileHash64_Scalar(src, W * 4, w, h)) {
+						printf("AVX2 hash differs for a %dx%d tile at %d,%d\n", w, h, o[0], o[1]);
+						ok = false;
+					}
+					hashes++;
+				}
+			}
+		}
+	}
+#endif
+	printf("hashes: %zu tile sizes and places, AVX2 %s\n", hashes, !avx2 ? "not supported" : ok ? "equals scalar" : "DIFFERS");
+
+	std::vector<uint32_t> idle = frames[0]; // an unchanged frame is a new capture, not the same buffer
+	std::vector<uint8_t> exactDirty, hashDirty;
+	std::vector<uint64_t> prevHashes(TILES_X * TILES_Y, 0), currHashes;
+	HashDirty(TileHash64_Scalar, frames[0], prevHashes, prevHashes, hashDirty);
+	ExactDirty(CompareTileBand_Scalar, frames[0], frames[1], exactDirty);
+	HashDirty(TileHash64_Scalar, frames[1], prevHashes, currHashes, hashDirty);
+	size_t changed = 0;
+	for (uint8_t d : exactDirty) changed += d;
+	if (hashDirty != exactDirty) {
+		printf("hash and exact modes find different dirty tiles\n");
+		ok = false;
+	}
+	printf("changed frame: %zu of %d tiles dirty in both modes\n", changed, TILES_X * TILES_Y);
+
+	static const struct { const char* name; const std::vector<uint32_t>* curr; } scenes[] = {
+		{ "idle", &idle }, { "changed", &frames[1] },
+	};
+	for (const auto& scene : scenes) {
+		const std::vector<uint32_t>& curr = *scene.curr;
+		double exact = NsPerTile([&]() { ExactDirty(CompareTileBand_Scalar, frames[0], curr, exactDirty); });
+		double hash = NsPerTile([&]() { HashDirty(TileHash64_Scalar, curr, prevHashes, currHashes, hashDirty); });
+		printf("%-8s scalar  exact %6.1f ns/tile  hash %6.1f ns/tile\n", scene.name, exact, hash);
+#if TILE_SIMD_X86
+		if (avx2) {
+			exact = NsPerTile([&]() { ExactDirty(CompareTileBand_AVX2, frames[0], curr, exactDirty); });
+			hash = NsPerTile([&]() { HashDirty(TileHash64_AVX2, curr, prevHashes, currHashes, hashDirty); });
+			printf("%-8s AVX2    exact %6.1f ns/tile  hash %6.1f ns/tile\n", scene.name, exact, hash);
+		}
+#endif
+	}
+	return ok ? 0 : 1;
+}
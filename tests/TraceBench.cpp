@@ -0,0 +1,146 @@
+// What PipelineTrace (includes/PipelineTrace.h) costs the tile loops it instruments. Every whole
+// tile of the synthetic 1080p desktop that XrleBench compresses is encoded as the server does (QOI
+// chunks, then XRLE) and decoded back as the client does, through WorkStealingPool::ParallelFor
+// traced as "encode tiles" and "decode tiles", the way main.cpp traces them: one event per run of
+// tiles a worker takes. Passes with tracing off and on are interleaved and the best of each is
+// kept; the overhead is the difference, in percent of the untraced time. For comparison the same
+// loops are also run with a TRACE_SCOPE around every tile, and the cost of one empty event is
+// reported.
+//
+//   gcc -O2 -c includes/xrle.c -o xrle.o
+//   g++ -std=c++14 -O2 -pthread -Iincludes tests/TraceBench.cpp xrle.o -o TraceBench && ./TraceBench [trace.json]
+//
+// With a path, the events of the traced per-run passes are written there. Exits non-zero if tracing
+// makes the pool's tile loops more than 1% slower.
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include "xrle.h"
+}
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+#include "WorkStealingPool.h"
+#include "DesktopFrames.h"
+
+const int W = DESKTOP_W, H = DESKTOP_H, T = 32;
+const int TILES_X = W / T, TILES_Y = H / T;
+
+struct TileLoops {
+	std::vector<uint32_t> frame, decoded;
+	std::vector<std::vector<uint64_t>> records; // per tile: XRLE of the QOI chunks, 8-byte aligned
+	std::vector<size_t> recordLen, chunksLen;
+	std::vector<std::vector<uint64_t>> qoi, chunks; // per worker
+
+	TileLoops(std::vector<uint32_t> f, int workers) : frame(std::move(f)), decoded((size_t)W * H),
+		records(TILES_X * TILES_Y, std::vector<uint64_t>(QOI_ENCODE_BOUND(T, T, 4) / 8 + 2)),
+		recordLen(records.size()), chunksLen(records.size()),
+		qoi(workers, std::vector<uint64_t>(QOI_ENCODE_BOUND(T, T, 4) / 8 + 1)), chunks(qoi) {}
+
+	void EncodeTile(size_t i, int worker) {
+		int tx = (int)(i % TILES_X), ty = (int)(i / TILES_X);
+		qoi_desc desc = { T, T, 4, QOI_SRGB };
+		int size = qoi_encode_into(qoi[worker].data(), (int)qoi[worker].size() * 8, &frame[(size_t)ty * T * W + tx * T], W * 4, &desc);
+		chunksLen[i] = size - QOI_CHUNKS_OFFSET - QOI_CHUNKS_TRAILER;
+		memcpy(chunks[worker].data(), (uint8_t*)qoi[worker].data() + QOI_CHUNKS_OFFSET, chunksLen[i]);
+		recordLen[i] = xrle_compress(records[i].data(), chunks[worker].data(), chunksLen[i]);
+	}
+
+	bool DecodeTile(size_t i, int worker) {
+		int tx = (int)(i % TILES_X), ty = (int)(i / TILES_X);
+		std::vector<uint64_t>& body = chunks[worker];
+		if (xrle_decompress_bounded(body.data(), body.size() * 8 - QOI_CHUNKS_TRAILER, records[i].data(), recordLen[i]) != chunksLen[i])
+			return false;
+		qoi_desc desc = { T, T, 4, QOI_SRGB };
+		return qoi_decode_chunks_into(body.data(), (int)chunksLen[i], &desc, &decoded[(size_t)ty * T * W + tx * T], W * 4, 4, 0) != 0;
+	}
+};
+
+static double Seconds(std::chrono::steady_clock::time_point t0) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// Best encode and decode pass times in seconds, [traced][encode, decode], with tracing off and on
+// alternating pass by pass so drifting clocks and noisy neighbours hit both alike
+template <typename Encode, typename Decode>
+static void TimeOffOn(double best[2][2], Encode encode, Decode decode) {
+	best[0][0] = best[0][1] = best[1][0] = best[1][1] = 1e9;
+	auto start = std::chrono::steady_clock::now();
+	for (int pass = 0; Seconds(start) < 3.0 || pass < 40; ++pass) {
+		bool traced = pass % 2 == 1;
+		g_traceEnabled = traced;
+		auto t0 = std::chrono::steady_clock::now();
+		encode();
+		best[traced][0] = std::min(best[traced][0], Seconds(t0));
+		t0 = std::chrono::steady_clock::now();
+		decode();
+		best[traced][1] = std::min(best[traced][1], Seconds(t0));
+	}
+	g_traceEnabled = false;
+}
+
+// Prints both loops' overhead and returns the larger, in percent
+static double Report(const char* how, double best[2][2]) {
+	static const char* loops[2] = { "encode", "decode" };
+	const double tiles = (double)TILES_X * TILES_Y;
+	double worst = 0;
+	for (int k = 0; k < 2; ++k) {
+		double overhead = (best[1][k] - best[0][k]) / best[0][k] * 100;
+		printf("%-9s %s  off %5.0f ns/tile  on %5.0f ns/tile  overhead %+5.2f%%\n", how, loops[k],
+			best[0][k] / tiles * 1e9, best[1][k] / tiles * 1e9, overhead);
+		worst = std::max(worst, overhead);
+	}
+	return worst;
+}
+
+int main(int argc, char** argv) {
+	std::mt19937 rng(1);
+	std::vector<uint32_t> frames[2];
+	DesktopFrames(rng, frames);
+	WorkStealingPool pool(0);
+	TileLoops loops(frames[1], pool.WorkerCount());
+	const size_t tiles = loops.records.size();
+
+	std::atomic<size_t> decodedTiles(0);
+	pool.ParallelFor(tiles, [&](size_t i, int worker) { loops.EncodeTile(i, worker); });
+	pool.ParallelFor(tiles, [&](size_t i, int worker) { decodedTiles += loops.DecodeTile(i, worker); });
+	if (decodedTiles != tiles || memcmp(loops.decoded.data(), loops.frame.data(), (size_t)TILES_Y * T * W * 4) != 0) {
+		printf("tiles do not decode back to the frame\n");
+		return 1;
+	}
+	printf("%zu tiles, %d pool workers\n", tiles, pool.WorkerCount());
+
+	double best[2][2];
+	TimeOffOn(best,
+		[&]() { pool.ParallelFor(tiles, "encode tiles", [&](size_t i, int worker) { loops.EncodeTile(i, worker); }); },
+		[&]() { pool.ParallelFor(tiles, "decode tiles", [&](size_t i, int worker) { loops.DecodeTile(i, worker); }); });
+	double overhead = Report("per run", best);
+	if (argc > 1) {
+		if (g_trace.Dump(argv[1])) printf("trace written to %s\n", argv[1]);
+		else printf("can't write %s\n", argv[1]);
+	}
+
+	TimeOffOn(best,
+		[&]() { pool.ParallelFor(tiles, [&](size_t i, int worker) { TRACE_SCOPE("encode tile"); loops.EncodeTile(i, worker); }); },
+		[&]() { pool.ParallelFor(tiles, [&](size_t i, int worker) { TRACE_SCOPE("decode tile"); loops.DecodeTile(i, worker); }); });
+	Report("per tile", best);
+
+	// One empty event, recorded and not
+	const int EVENTS = 1 << 22;
+	double perEvent[2];
+	for (int on = 0; on < 2; ++on) {
+		g_traceEnabled = on == 1;
+		auto t0 = std::chrono::steady_clock::now();
+		for (int i = 0; i < EVENTS; ++i) {
+			TRACE_SCOPE("empty");
+		}
+		perEvent[on] = Seconds(t0) / EVENTS * 1e9;
+	}
+	g_traceEnabled = false;
+	printf("empty scope  on %.1f ns/event  off %.2f ns/event\n", perEvent[1], perEvent[0]);
+	return overhead < 1.0 ? 0 : 1;
+}
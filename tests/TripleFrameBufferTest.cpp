@@ -0,0 +1,167 @@
+// TripleFrameBuffer (includes/TripleFrameBuffer.h) under a writer and a reader running flat out.
+// Every generation's damage and pixels follow from its number alone, so the reader can rebuild
+// what any frame must hold: it checks that generations only move forward, that each frame's
+// damage is the one published with it, and that every pixel is right, including after frames it
+// skipped (damage the writer's buffer missed must have been caught up) and after size changes.
+// Then, on one 1920x1080 frame with a few tiles of damage, it times Publish, an up-to-date
+// Latest, and the hand-over from Publish to the reader seeing the frame.
+//
+//   g++ -std=c++14 -O1 -g -fsanitize=thread -pthread -Iincludes tests/TripleFrameBufferTest.cpp -o TripleFrameBufferTest
+//   g++ -std=c++14 -O2 -pthread -Iincludes tests/TripleFrameBufferTest.cpp -o TripleFrameBufferTest
+//
+// The first build is the race check, the second gives meaningful timings. Exits non-zero on the
+// first wrong frame.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "TripleFrameBuffer.h"
+
+using Clock = std::chrono::steady_clock;
+
+// The size in use from generation g on; it changes every 3000 generations
+static void SizeOf(uint64_t g, int& width, int& height) {
+	static const int sizes[][2] = { { 96, 64 }, { 120, 40 }, { 33, 95 } };
+	width = sizes[(g / 3000) % 3][0];
+	height = sizes[(g / 3000) % 3][1];
+}
+
+// What generation g changed: everything on a size change, otherwise one to five rects of random
+// size, sometimes none
+static std::vector<DamageRect> DamageOf(uint64_t g) {
+	int width, height, prevWidth, prevHeight;
+	SizeOf(g, width, height);
+	SizeOf(g - 1, prevWidth, prevHeight);
+	if (g == 1 || width != prevWidth || height != prevHeight) return { { 0, 0, width, height } };
+	std::mt19937 rng((uint32_t)g);
+	std::vector<DamageRect> damage(rng() % 6);
+	for (DamageRect& r : damage) {
+		r.x = (int)(rng() % width);
+		r.y = (int)(rng() % height);
+		r.w = 1 + (int)(rng() % (width - r.x));
+		r.h = 1 + (int)(rng() % (height - r.y));
+	}
+	return damage;
+}
+
+// Advances image, a frame of generation g - 1, to generation g: damaged pixels hold g
+static void Apply(uint64_t g, std::vector<uint32_t>& image) {
+	int width, height;
+	SizeOf(g, width, height);
+	image.resize((size_t)width * height);
+	for (const DamageRect& r : DamageOf(g))
+		for (int y = r.y; y < r.y + r.h; ++y)
+			std::fill(&image[(size_t)y * width + r.x], &image[(size_t)y * width + r.x + r.w], (uint32_t)g);
+}
+
+static bool Stress(uint64_t generations) {
+	TripleFrameBuffer buffer;
+	std::atomic<bool> failed(false);
+	std::thread writer([&]() {
+		std::vector<uint32_t> image;
+		for (uint64_t g = 1; g <= generations && !failed; ++g) {
+			Apply(g, image);
+			int width, height;
+			SizeOf(g, width, height);
+			buffer.Publish(width, height, (const uint8_t*)image.data(), DamageOf(g));
+			if (g % 4 == 0) std::this_thread::yield(); // let the reader in mid-stream on a single core too
+		}
+	});
+
+	// The reader's model of the frame it last saw, advanced generation by generation
+	std::vector<uint32_t> model;
+	uint64_t seen = 0, frames = 0, skipped = 0;
+	while (seen < generations && !failed) {
+		const TripleFrameBuffer::Frame* frame = buffer.Latest();
+		if (!frame || frame->generation == seen) {
+			std::this_thread::yield();
+			continue;
+		}
+		const char* error = nullptr;
+		if (frame->generation < seen) error = "generation went backwards";
+		for (uint64_t g = seen + 1; !error && g <= frame->generation; ++g) Apply(g, model);
+		int width, height;
+		SizeOf(frame->generation, width, height);
+		std::vector<DamageRect> damage = DamageOf(frame->generation);
+		if (!error && (frame->width != width || frame->height != height)) error = "wrong size";
+		if (!error && (frame->damage.size() != damage.size() || !std::equal(damage.begin(), damage.end(), frame->damage.begin(),
+			[](const DamageRect& a, const DamageRect& b) { return a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h; })))
+			error = "damage is not the one published with the frame";
+		if (!error && (frame->pixels.size() != model.size() * 4 || memcmp(frame->pixels.data(), model.data(), frame->pixels.size()) != 0))
+			error = "pixels differ from the generation's image";
+		if (error) {
+			printf("generation %llu after %llu: %s\n", (unsigned long long)frame->generation, (unsigned long long)seen, error);
+			failed = true;
+			break;
+		}
+		skipped += frame->generation - seen - 1;
+		seen = frame->generation;
+		frames++;
+	}
+	writer.join();
+	printf("stress: %llu generations published, %llu frames read, %llu skipped, %s\n", (unsigned long long)generations,
+		(unsigned long long)frames, (unsigned long long)skipped, failed ? "FAILED" : "all correct");
+	return !failed;
+}
+
+static double Percentile(std::vector<double>& samples, double p) {
+	std::sort(samples.begin(), samples.end());
+	return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+}
+
+// Timings on a 1080p frame with eight 32x32 tiles of damage per frame
+static void Latency() {
+	const int W = 1920, H = 1080, FRAMES = 2000;
+	std::vector<uint32_t> image((size_t)W * H, 0xFF202020);
+	std::vector<std::vector<DamageRect>> damage(FRAMES);
+	std::mt19937 rng(7);
+	for (auto& d : damage)
+		for (int i = 0; i < 8; ++i) d.push_back({ (int)(rng() % (W / 32)) * 32, (int)(rng() % (H / 32)) * 32, 32, 32 });
+
+	TripleFrameBuffer buffer;
+	std::vector<Clock::time_point> published(FRAMES + 1);
+	std::vector<double> publishUs, handoverUs, latestUs;
+	std::atomic<uint64_t> done(0);
+	std::thread reader([&]() {
+		uint64_t seen = 0;
+		while (seen < FRAMES) {
+			Clock::time_point t0 = Clock::now();
+			const TripleFrameBuffer::Frame* frame = buffer.Latest();
+			Clock::time_point t1 = Clock::now();
+			if (!frame || frame->generation == seen) {
+				latestUs.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+				std::this_thread::yield();
+				continue;
+			}
+			seen = frame->generation;
+			handoverUs.push_back(std::chrono::duration<double, std::micro>(t1 - published[seen]).count());
+			done = seen;
+		}
+	});
+	for (int g = 1; g <= FRAMES; ++g) {
+		for (const DamageRect& r : damage[g - 1])
+			for (int y = r.y; y < r.y + r.h; ++y) image[(size_t)y * W + r.x] = (uint32_t)g;
+		Clock::time_point t0 = Clock::now();
+		published[g] = t0; // written before Publish releases the frame, read after Latest acquires it
+		buffer.Publish(W, H, (const uint8_t*)image.data(), damage[g - 1]);
+		publishUs.push_back(std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
+		// Wait for the reader, up to 1 ms, so each hand-over is timed on its own
+		while (done < (uint64_t)g && Clock::now() - t0 < std::chrono::milliseconds(1)) std::this_thread::yield();
+	}
+	reader.join();
+	printf("1080p, 8 tiles of damage: Publish p50 %.2f us p99 %.2f us, up-to-date Latest p50 %.3f us, "
+		"hand-over p50 %.1f us p99 %.1f us (%zu frames seen)\n", Percentile(publishUs, 0.5), Percentile(publishUs, 0.99),
+		latestUs.empty() ? 0.0 : Percentile(latestUs, 0.5), Percentile(handoverUs, 0.5), Percentile(handoverUs, 0.99), handoverUs.size());
+}
+
+int main() {
+	bool ok = Stress(20000);
+	Latency();
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,309 @@
+// XRLE throughput at each SIMD level over the three kinds of data Remote compresses: screen
+// tiles (QOI chunks and XOR deltas of 32x32 tiles), per-frame dirty-tile bitmasks and float PCM
+// audio packets. Every level must produce the scalar stream byte for byte and decompress it back
+// to the input, and xrle_decompress_bounded must refuse the stream when the output is one byte
+// short, when it is cut short, and (without writing past the buffer) when it has been garbled.
+// The timings are reported in GB/s of uncompressed data.
+//
+// Two timings are given per level. "stream" walks the whole corpus once per pass, so on screen
+// data it mostly measures memory bandwidth. "hot" handles each piece several times in a row,
+// which is how the encoder uses XRLE: on a tile body it has just written and that is still in
+// cache. Before any level is forced, several threads make the first xrle_compress call at once;
+// build with -fsanitize=thread to check the lazy level selection.
+//
+//   gcc -O2 -c includes/xrle.c -o xrle.o
+//   g++ -std=c++14 -O2 -pthread -Iincludes tests/XrleBench.cpp xrle.o -o XrleBench && ./XrleBench [file...]
+//
+// Each file given is benchmarked as one more corpus, compressed in 64 KB pieces. Exits non-zero
+// if any level disagrees with the scalar code.
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "xrle.h"
+}
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+#include "DesktopFrames.h"
+
+typedef std::vector<std::vector<uint64_t>> Corpus; // uint64_t keeps every piece 8-byte aligned
+
+static void AddPiece(Corpus& corpus, const void* data, size_t len) {
+	std::vector<uint64_t> piece((len + 7) / 8 + 1);
+	memcpy(piece.data(), data, len);
+	piece.back() = len;
+	corpus.push_back(std::move(piece));
+}
+static size_t PieceLen(const std::vector<uint64_t>& piece) { return (size_t)piece.back(); }
+
+// Each 32x32 tile of the second synthetic desktop frame contributes its QOI chunks and, where it
+// changed from the first, its XOR delta
+static Corpus ScreenCorpus(std::mt19937& rng) {
+	const int W = DESKTOP_W, H = DESKTOP_H, T = 32;
+	std::vector<uint32_t> frames[2];
+	DesktopFrames(rng, frames);
+
+	Corpus corpus;
+	std::vector<uint8_t> qoi(T * T * 5 + QOI_CHUNKS_OFFSET + QOI_CHUNKS_TRAILER);
+	std::vector<uint32_t> delta(T * T);
+	for (int ty = 0; ty + T <= H; ty += T) {
+		for (int tx = 0; tx < W; tx += T) {
+			const uint32_t* cur = &frames[1][(size_t)ty * W + tx];
+			const uint32_t* prev = &frames[0][(size_t)ty * W + tx];
+			qoi_desc desc = { T, T, 4, QOI_SRGB };
+			int size = qoi_encode_into(qoi.data(), (int)qoi.size(), cur, W * 4, &desc);
+			if (size > QOI_CHUNKS_OFFSET + QOI_CHUNKS_TRAILER)
+				AddPiece(corpus, qoi.data() + QOI_CHUNKS_OFFSET, size - QOI_CHUNKS_OFFSET - QOI_CHUNKS_TRAILER);
+			bool changed = false;
+			for (int row = 0; row < T; ++row) {
+				for (int col = 0; col < T; ++col) {
+					delta[row * T + col] = cur[row * W + col] ^ prev[row * W + col];
+					changed |= delta[row * T + col] != 0;
+				}
+			}
+			if (changed) AddPiece(corpus, delta.data(), delta.size() * 4);
+		}
+	}
+	return corpus;
+}
+
+// Dirty-tile bitmasks of 1920x1080 in 32x32 tiles, one per frame: mostly idle frames with a
+// blinking caret, typing in one region, and the odd full repaint
+static Corpus BitmaskCorpus(std::mt19937& rng) {
+	const int cols = 60, rows = 34;
+	Corpus corpus;
+	std::vector<uint8_t> mask((cols * rows + 7) / 8);
+	for (int frame = 0; frame < 2000; ++frame) {
+		std::fill(mask.begin(), mask.end(), 0);
+		int kind = (int)(rng() % 20);
+		if (kind == 0) {
+			std::fill(mask.begin(), mask.end(), 0xFF);
+		} else {
+			int dirty = kind < 12 ? 1 : 4 + (int)(rng() % 40);
+			int col = (int)(rng() % cols), row = (int)(rng() % rows);
+			for (int i = 0; i < dirty; ++i) {
+				int t = (row + i / 8) % rows * cols + (col + i % 8) % cols;
+				mask[t / 8] |= 1 << (t % 8);
+			}
+		}
+		AddPiece(corpus, mask.data(), mask.size());
+	}
+	return corpus;
+}
+
+// WASAPI-style packets of 48 kHz stereo float32, 480 frames each: music, then silence (exact
+// zeros), then quiet noise
+static Corpus PcmCorpus(std::mt19937& rng) {
+	Corpus corpus;
+	std::normal_distribution<float> noise(0.0f, 0.001f);
+	std::vector<float> packet(480 * 2);
+	for (int n = 0; n < 3000; ++n) {
+		for (int i = 0; i < 480; ++i) {
+			double t = (n * 480 + i) / 48000.0;
+			float left = 0, right = 0;
+			if (n % 300 < 200) {
+				left = (float)(0.3 * sin(2 * M_PI * 440 * t) + 0.2 * sin(2 * M_PI * 660 * t));
+				right = (float)(0.3 * sin(2 * M_PI * 440 * t + 0.5) + 0.1 * sin(2 * M_PI * 880 * t));
+			} else if (n % 300 >= 260) {
+				left = noise(rng);
+				right = noise(rng);
+			}
+			packet[i * 2] = left;
+			packet[i * 2 + 1] = right;
+		}
+		AddPiece(corpus, packet.data(), packet.size() * 4);
+	}
+	return corpus;
+}
+
+static Corpus FileCorpus(const char* path) {
+	Corpus corpus;
+	FILE* f = fopen(path, "rb");
+	if (!f) return corpus;
+	std::vector<uint8_t> chunk(64 * 1024);
+	size_t got;
+	while ((got = fread(chunk.data(), 1, chunk.size(), f)) > 0) AddPiece(corpus, chunk.data(), got);
+	fclose(f);
+	return corpus;
+}
+
+// Repeats fn over the whole corpus for at least 0.3 s and returns the best pass in GB/s of bytes
+template <typename Fn>
+static double Measure(size_t bytes, Fn fn) {
+	using Clock = std::chrono::steady_clock;
+	double best = 0;
+	Clock::time_point start = Clock::now();
+	do {
+		Clock::time_point t0 = Clock::now();
+		fn();
+		double s = std::chrono::duration<double>(Clock::now() - t0).count();
+		if (s > 0 && bytes / s / 1e9 > best) best = bytes / s / 1e9;
+	} while (std::chrono::duration<double>(Clock::now() - start).count() < 0.3);
+	return best;
+}
+
+// Times repeated handling of each piece while it is still in cache
+static const int HOT_REPEATS = 16;
+
+// Benchmarks one corpus at every level the CPU has; false if any stream differs from the scalar one
+static bool Run(const char* name, const Corpus& corpus) {
+	size_t rawBytes = 0, packedBytes = 0;
+	std::vector<std::vector<uint64_t>> reference(corpus.size()), packed(corpus.size()), unpacked(corpus.size());
+	std::vector<size_t> referenceLen(corpus.size());
+	for (size_t i = 0; i < corpus.size(); ++i) {
+		size_t len = PieceLen(corpus[i]);
+		reference[i].resize(xrle_max_out(len) / 8 + 1);
+		packed[i].resize(reference[i].size());
+		unpacked[i].resize(xrle_max_out(len) / 8 + 1);
+		referenceLen[i] = xrle_compress_scalar(reference[i].data(), corpus[i].data(), len);
+		rawBytes += len;
+		packedBytes += referenceLen[i];
+	}
+	printf("%-10s %6zu pieces %10zu bytes  ratio %6.2f\n", name, corpus.size(), rawBytes,
+		packedBytes ? (double)rawBytes / packedBytes : 0.0);
+
+	static const char* levelNames[] = { "scalar", "SSE4.1", "AVX2" };
+	bool identical = true;
+	for (int level = XRLE_SIMD_NONE; level <= XRLE_SIMD_AVX2; ++level) {
+		if (xrle_set_simd_level(level) != level) {
+			printf("  %-7s not supported by this CPU\n", levelNames[level]);
+			continue;
+		}
+		bool same = true;
+		for (size_t i = 0; i < corpus.size() && same; ++i) {
+			size_t len = PieceLen(corpus[i]);
+			size_t packedLen = xrle_compress(packed[i].data(), corpus[i].data(), len);
+			same = packedLen == referenceLen[i] && memcmp(packed[i].data(), reference[i].data(), packedLen) == 0
+				&& xrle_decompress(unpacked[i].data(), reference[i].data(), packedLen) == len
+				&& memcmp(unpacked[i].data(), corpus[i].data(), len) == 0;
+			if (!same) printf("  %-7s piece %zu differs from the scalar stream\n", levelNames[level], i);
+		}
+		for (size_t i = 0; i < corpus.size() && same; ++i) {
+			size_t len = PieceLen(corpus[i]);
+			same = xrle_decompress_bounded(unpacked[i].data(), len, reference[i].data(), referenceLen[i]) == len
+				&& memcmp(unpacked[i].data(), corpus[i].data(), len) == 0
+				&& (len == 0 || xrle_decompress_bounded(unpacked[i].data(), len - 1, reference[i].data(), referenceLen[i]) == XRLE_ERROR)
+				&& (referenceLen[i] < 24 || xrle_decompress_bounded(unpacked[i].data(), len, reference[i].data(), referenceLen[i] - 8) != len);
+			if (!same) printf("  %-7s piece %zu: bounded decompress accepted a bad stream\n", levelNames[level], i);
+		}
+		identical &= same;
+
+		volatile size_t sink = 0;
+		double compress = Measure(rawBytes, [&]() {
+			for (size_t i = 0; i < corpus.size(); ++i)
+				sink += xrle_compress(packed[i].data(), corpus[i].data(), PieceLen(corpus[i]));
+		});
+		double decompress = Measure(rawBytes, [&]() {
+			for (size_t i = 0; i < corpus.size(); ++i)
+				sink += xrle_decompress(unpacked[i].data(), reference[i].data(), referenceLen[i]);
+		});
+		double hotCompress = Measure(rawBytes * HOT_REPEATS, [&]() {
+			for (size_t i = 0; i < corpus.size(); ++i)
+				for (int r = 0; r < HOT_REPEATS; ++r)
+					sink += xrle_compress(packed[i].data(), corpus[i].data(), PieceLen(corpus[i]));
+		});
+		double hotDecompress = Measure(rawBytes * HOT_REPEATS, [&]() {
+			for (size_t i = 0; i < corpus.size(); ++i)
+				for (int r = 0; r < HOT_REPEATS; ++r)
+					sink += xrle_decompress(unpacked[i].data(), reference[i].data(), referenceLen[i]);
+		});
+		double hotBounded = Measure(rawBytes * HOT_REPEATS, [&]() {
+			for (size_t i = 0; i < corpus.size(); ++i)
+				for (int r = 0; r < HOT_REPEATS; ++r)
+					sink += xrle_decompress_bounded(unpacked[i].data(), PieceLen(corpus[i]), reference[i].data(), referenceLen[i]);
+		});
+		printf("  %-7s stream compress %6.2f decompress %6.2f GB/s  hot compress %6.2f decompress %6.2f bounded %6.2f GB/s  %s\n",
+			levelNames[level], compress, decompress, hotCompress, hotDecompress, hotBounded, same ? "identical" : "MISMATCH");
+	}
+	xrle_set_simd_level(-1);
+	return identical;
+}
+
+// First calls from several threads at once must all pick a level and give the scalar stream
+static bool FirstUseFromThreads(const Corpus& corpus) {
+	const std::vector<uint64_t>& piece = corpus[corpus.size() / 2];
+	size_t len = PieceLen(piece);
+	std::vector<uint64_t> reference(xrle_max_out(len) / 8 + 1);
+	size_t referenceLen = xrle_compress_scalar(reference.data(), piece.data(), len);
+
+	const int THREADS = 8;
+	bool same[THREADS];
+	std::vector<std::thread> threads;
+	for (int t = 0; t < THREADS; ++t) {
+		threads.emplace_back([&, t]() {
+			std::vector<uint64_t> out(reference.size());
+			size_t outLen = xrle_compress(out.data(), piece.data(), len);
+			same[t] = outLen == referenceLen && memcmp(out.data(), reference.data(), outLen) == 0;
+		});
+	}
+	bool ok = true;
+	for (int t = 0; t < THREADS; ++t) {
+		threads[t].join();
+		ok &= same[t];
+	}
+	printf("first use from %d threads: level %d, %s\n", THREADS, xrle_simd_level(), ok ? "identical" : "MISMATCH");
+	return ok;
+}
+
+// Garbles descriptors and lengths of compressed screen tiles at random; the bounded decompressor
+// must never write past the exact-size output it is given (run under -fsanitize=address to check)
+static bool HostileStreams(const Corpus& corpus, std::mt19937& rng) {
+	size_t refused = 0, trials = 0;
+	for (size_t i = 0; i < corpus.size(); i += 7) {
+		size_t len = PieceLen(corpus[i]);
+		std::vector<uint64_t> packed(xrle_max_out(len) / 8 + 1);
+		size_t packedLen = xrle_compress_scalar(packed.data(), corpus[i].data(), len);
+		if (packedLen < 16) continue;
+		for (int t = 0; t < 20; ++t) {
+			std::vector<uint64_t> bad(packed);
+			size_t badLen = packedLen;
+			uint32_t* words = (uint32_t*)bad.data();
+			switch (rng() % 3) {
+			case 0: words[rng() % (packedLen / 4)] = rng(); break; // anything, descriptors included
+			case 1: words[0] = 0x7FFFFFFF; break; // literals past the end
+			case 2: badLen = 16 + rng() % (packedLen - 15); break; // cut short
+			}
+			std::vector<uint8_t> out(len);
+			size_t got = xrle_decompress_bounded(out.data(), out.size(), bad.data(), badLen);
+			if (got != XRLE_ERROR && got > len) {
+				printf("hostile stream: %zu bytes written into %zu\n", got, len);
+				return false;
+			}
+			refused += got == XRLE_ERROR;
+			trials++;
+		}
+	}
+	printf("hostile streams: %zu of %zu refused, none overflowed\n", refused, trials);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	std::mt19937 rng(1);
+	bool ok = true;
+	ok &= FirstUseFromThreads(PcmCorpus(rng));
+	rng.seed(1);
+	Corpus screen = ScreenCorpus(rng);
+	ok &= HostileStreams(screen, rng);
+	ok &= Run("screen", screen);
+	ok &= Run("bitmask", BitmaskCorpus(rng));
+	ok &= Run("pcm", PcmCorpus(rng));
+	for (int i = 1; i < argc; ++i) {
+		Corpus corpus = FileCorpus(argv[i]);
+		if (corpus.empty()) {
+			printf("%s: cannot read\n", argv[i]);
+			ok = false;
+			continue;
+		}
+		std::string name = argv[i];
+		ok &= Run(name.substr(name.find_last_of("/\\") + 1).c_str(), corpus);
+	}
+	printf("%s\n", ok ? "all levels identical to scalar" : "FAILED: output differs from scalar");
+	return ok ? 0 : 1;
+}